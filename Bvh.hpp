@@ -0,0 +1,618 @@
+// Bounding volume hierarchy over the triangles of a level mesh, for
+// raycasts and swept-sphere queries. The tree is built with the surface
+// area heuristic over binned centroids, the top levels on separate
+// threads, then flattened depth first into 32-byte nodes: the first child
+// of an inner node is the next node in the array, so traversal mostly
+// walks memory forward. Triangles are double sided.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+struct RayHit {
+	float t;				// distance along the (normalized) direction
+	uint32_t triangle;		// in the order of the input indices
+	glm::vec3 normal;		// facing the ray origin
+};
+
+struct SweepHit {
+	float t;				// fraction of the motion before contact
+	glm::vec3 point;		// contact point on the triangle
+	glm::vec3 normal;		// from the contact point towards the sphere
+};
+
+class TriangleBvh {
+public:
+	struct Node {
+		glm::vec3 min;
+		uint32_t offset;	// first triangle of a leaf, second child of an inner node
+		glm::vec3 max;
+		uint16_t count;		// triangles of a leaf, 0 for an inner node
+		uint16_t axis;		// split axis of an inner node
+	};
+	static_assert(sizeof(Node) == 32, "BVH nodes should stay 32 bytes");
+
+	static const int BINS = 12;
+	static const int MAX_LEAF = 4;
+	static const int STACK_SIZE = 64;	// of the traversals, deeper trees use the heap
+
+	// threads = 0 uses every hardware thread
+	void build(const std::vector<glm::vec3> &positions, const std::vector<uint32_t> &indices,
+			   unsigned threads = 0) {
+		size_t n = indices.size() / 3;
+		std::vector<Triangle> input(n);
+		std::vector<Primitive> prims(n);
+		for (size_t i = 0; i < n; i++) {
+			Triangle &T = input[i];
+			T.v0 = positions[indices[3 * i]];
+			T.v1 = positions[indices[3 * i + 1]];
+			T.v2 = positions[indices[3 * i + 2]];
+			T.index = (uint32_t) i;
+			prims[i].min = glm::min(T.v0, glm::min(T.v1, T.v2));
+			prims[i].max = glm::max(T.v0, glm::max(T.v1, T.v2));
+			prims[i].centroid = (prims[i].min + prims[i].max) * 0.5f;
+			prims[i].index = (uint32_t) i;
+		}
+
+		if (threads == 0) {
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		}
+		int parallelDepth = 0;
+		while ((1u << parallelDepth) < threads) {
+			parallelDepth++;
+		}
+
+		nodes.clear();
+		triangles.clear();
+		if (n == 0) {
+			return;
+		}
+		std::unique_ptr<BuildNode> root = buildRecursive(prims, 0, (uint32_t) n, 0, parallelDepth);
+
+		// triangles in leaf order, so that a leaf reads them contiguously
+		triangles.resize(n);
+		for (size_t i = 0; i < n; i++) {
+			triangles[i] = input[prims[i].index];
+		}
+		nodes.reserve(2 * n);
+		depth = 0;
+		flatten(root.get(), 1);
+	}
+
+	bool empty() const {
+		return nodes.empty();
+	}
+
+	size_t nodeCount() const {
+		return nodes.size();
+	}
+
+	size_t triangleCount() const {
+		return triangles.size();
+	}
+
+	int treeDepth() const {
+		return depth;
+	}
+
+	// Closest hit along direction (normalized) within maxT
+	bool raycast(glm::vec3 origin, glm::vec3 direction, float maxT, RayHit &hit) const {
+		return traverseRay(origin, direction, maxT, &hit);
+	}
+
+	// Any hit within maxT: cheaper, for visibility
+	bool occluded(glm::vec3 origin, glm::vec3 direction, float maxT) const {
+		return traverseRay(origin, direction, maxT, nullptr);
+	}
+
+	// Every triangle, for checking raycast()
+	bool raycastBruteForce(glm::vec3 origin, glm::vec3 direction, float maxT, RayHit &hit) const {
+		bool found = false;
+		hit.t = maxT;
+		for (const Triangle &T : triangles) {
+			float t;
+			if (intersectTriangle(T, origin, direction, hit.t, t)) {
+				hit.t = t;
+				hit.triangle = T.index;
+				hit.normal = facingNormal(T, direction);
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	// Earliest contact of a sphere moving by motion, if any
+	bool sweepSphere(glm::vec3 center, float radius, glm::vec3 motion, SweepHit &hit) const {
+		hit.t = 1.0f;
+		bool found = false;
+		if (nodes.empty()) {
+			return false;
+		}
+		glm::vec3 boxMin = glm::min(center, center + motion) - glm::vec3(radius);
+		glm::vec3 boxMax = glm::max(center, center + motion) + glm::vec3(radius);
+		uint32_t fixedStack[STACK_SIZE];
+		std::vector<uint32_t> deepStack;
+		uint32_t *stack = traversalStack(fixedStack, deepStack);
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0) {
+			const Node &N = nodes[stack[--top]];
+			if (glm::any(glm::greaterThan(N.min, boxMax)) || glm::any(glm::lessThan(N.max, boxMin))) {
+				continue;
+			}
+			if (N.count > 0) {
+				for (uint32_t i = N.offset; i < N.offset + N.count; i++) {
+					found |= sweepTriangle(triangles[i], center, radius, motion, hit);
+				}
+			} else {
+				uint32_t self = (uint32_t) (&N - nodes.data());
+				stack[top++] = N.offset;
+				stack[top++] = self + 1;
+			}
+		}
+		return found;
+	}
+
+	// A capsule from a to b, swept as spheres along its axis no more than
+	// a radius apart: exact at the spheres, and anything thinner than a
+	// radius could slip between them
+	bool sweepCapsule(glm::vec3 a, glm::vec3 b, float radius, glm::vec3 motion, SweepHit &hit) const {
+		int spheres = std::max(1, (int) std::ceil(glm::length(b - a) / radius)) + 1;
+		bool found = false;
+		hit.t = 1.0f;
+		for (int i = 0; i < spheres; i++) {
+			glm::vec3 center = a + (b - a) * ((float) i / (spheres - 1));
+			SweepHit sphereHit;
+			if (sweepSphere(center, radius, motion, sphereHit) && sphereHit.t < hit.t) {
+				hit = sphereHit;
+				found = true;
+			}
+		}
+		return found;
+	}
+
+	// Character controller: moves the capsule (a, b relative to position)
+	// by motion, sliding along what it touches instead of stopping
+	glm::vec3 moveAndSlide(glm::vec3 position, glm::vec3 a, glm::vec3 b, float radius,
+						   glm::vec3 motion, int iterations = 4) const {
+		const float SKIN = 1e-3f;
+		for (int i = 0; i < iterations; i++) {
+			float length = glm::length(motion);
+			if (length < 1e-6f) {
+				break;
+			}
+			SweepHit hit{};
+			if (!sweepCapsule(position + a, position + b, radius, motion, hit)) {
+				position += motion;
+				break;
+			}
+			position += motion * (std::max(0.0f, hit.t * length - SKIN) / length);
+			glm::vec3 remaining = motion * (1.0f - hit.t);
+			motion = remaining - hit.normal * glm::dot(remaining, hit.normal);
+		}
+		return position;
+	}
+
+	// Height of the first surface below from, at most maxDrop down
+	bool groundHeight(glm::vec3 from, float maxDrop, float &height) const {
+		RayHit hit;
+		if (!raycast(from, glm::vec3(0.0f, -1.0f, 0.0f), maxDrop, hit)) {
+			return false;
+		}
+		height = from.y - hit.t;
+		return true;
+	}
+
+private:
+	struct Triangle {
+		glm::vec3 v0, v1, v2;
+		uint32_t index;
+	};
+
+	struct Primitive {
+		glm::vec3 min, max, centroid;
+		uint32_t index;
+	};
+
+	struct BuildNode {
+		glm::vec3 min, max;
+		std::unique_ptr<BuildNode> children[2];
+		uint32_t first, count;
+		int axis;
+	};
+
+	std::vector<Node> nodes;
+	std::vector<Triangle> triangles;
+	int depth = 0;
+
+	static float area(glm::vec3 min, glm::vec3 max) {
+		glm::vec3 d = glm::max(max - min, glm::vec3(0.0f));
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+
+	// prims[first, first + count) is partitioned in place; the two halves
+	// of a split are disjoint, so they can be built on different threads
+	std::unique_ptr<BuildNode> buildRecursive(std::vector<Primitive> &prims, uint32_t first,
+											  uint32_t count, int level, int parallelDepth) {
+		std::unique_ptr<BuildNode> node(new BuildNode);
+		node->first = first;
+		node->count = count;
+		node->axis = 0;
+		node->min = glm::vec3(INFINITY);
+		node->max = glm::vec3(-INFINITY);
+		glm::vec3 cmin(INFINITY), cmax(-INFINITY);
+		for (uint32_t i = first; i < first + count; i++) {
+			node->min = glm::min(node->min, prims[i].min);
+			node->max = glm::max(node->max, prims[i].max);
+			cmin = glm::min(cmin, prims[i].centroid);
+			cmax = glm::max(cmax, prims[i].centroid);
+		}
+		if (count <= 1) {
+			return node;
+		}
+
+		// binned SAH over the three axes
+		float bestCost = INFINITY;
+		int bestAxis = -1, bestSplit = 0;
+		for (int axis = 0; axis < 3; axis++) {
+			float extent = cmax[axis] - cmin[axis];
+			// a denormal extent would make the scale of the bins infinite
+			if (extent <= 0.0f || std::isinf(BINS / extent)) {
+				continue;
+			}
+			struct Bin {
+				glm::vec3 min = glm::vec3(INFINITY), max = glm::vec3(-INFINITY);
+				uint32_t count = 0;
+			} bins[BINS];
+			float scale = BINS / extent;
+			for (uint32_t i = first; i < first + count; i++) {
+				int b = std::min(BINS - 1, (int) ((prims[i].centroid[axis] - cmin[axis]) * scale));
+				bins[b].count++;
+				bins[b].min = glm::min(bins[b].min, prims[i].min);
+				bins[b].max = glm::max(bins[b].max, prims[i].max);
+			}
+			// costs of the splits after bin s, sweeping from both sides
+			float rightArea[BINS];
+			uint32_t rightCount[BINS];
+			glm::vec3 rmin(INFINITY), rmax(-INFINITY);
+			uint32_t rc = 0;
+			for (int s = BINS - 1; s > 0; s--) {
+				rmin = glm::min(rmin, bins[s].min);
+				rmax = glm::max(rmax, bins[s].max);
+				rc += bins[s].count;
+				rightArea[s] = area(rmin, rmax);
+				rightCount[s] = rc;
+			}
+			glm::vec3 lmin(INFINITY), lmax(-INFINITY);
+			uint32_t lc = 0;
+			for (int s = 0; s < BINS - 1; s++) {
+				lmin = glm::min(lmin, bins[s].min);
+				lmax = glm::max(lmax, bins[s].max);
+				lc += bins[s].count;
+				if (lc == 0 || rightCount[s + 1] == 0) {
+					continue;
+				}
+				float cost = lc * area(lmin, lmax) + rightCount[s + 1] * rightArea[s + 1];
+				if (cost < bestCost) {
+					bestCost = cost;
+					bestAxis = axis;
+					bestSplit = s;
+				}
+			}
+		}
+
+		// a leaf costs one intersection per triangle, an inner node one
+		// traversal step plus the expected intersections of its children
+		float leafCost = (float) count;
+		float splitCost = 1.0f + bestCost / std::max(area(node->min, node->max), 1e-12f);
+		if (bestAxis < 0 || (count <= MAX_LEAF && splitCost >= leafCost)) {
+			if (count <= UINT16_MAX) {
+				return node;
+			}
+			// too many coincident centroids for one leaf: split in the middle
+			bestAxis = -1;
+		}
+
+		uint32_t middle;
+		if (bestAxis >= 0) {
+			float scale = BINS / (cmax[bestAxis] - cmin[bestAxis]);
+			float low = cmin[bestAxis];
+			int axis = bestAxis, split = bestSplit;
+			auto it = std::partition(prims.begin() + first, prims.begin() + first + count,
+				[&](const Primitive &P) {
+					return std::min(BINS - 1, (int) ((P.centroid[axis] - low) * scale)) <= split;
+				});
+			middle = (uint32_t) (it - prims.begin());
+			node->axis = bestAxis;
+		} else {
+			middle = first + count / 2;
+		}
+
+		if (level < parallelDepth && count > 1024) {
+			std::thread left([&]() {
+				node->children[0] = buildRecursive(prims, first, middle - first, level + 1, parallelDepth);
+			});
+			node->children[1] = buildRecursive(prims, middle, first + count - middle, level + 1, parallelDepth);
+			left.join();
+		} else {
+			node->children[0] = buildRecursive(prims, first, middle - first, level + 1, parallelDepth);
+			node->children[1] = buildRecursive(prims, middle, first + count - middle, level + 1, parallelDepth);
+		}
+		node->count = 0;
+		return node;
+	}
+
+	uint32_t flatten(const BuildNode *B, int level) {
+		depth = std::max(depth, level);
+		uint32_t index = (uint32_t) nodes.size();
+		nodes.push_back(Node());
+		nodes[index].min = B->min;
+		nodes[index].max = B->max;
+		nodes[index].axis = (uint16_t) B->axis;
+		if (B->count > 0) {
+			nodes[index].offset = B->first;
+			nodes[index].count = (uint16_t) B->count;
+		} else {
+			flatten(B->children[0].get(), level + 1);
+			uint32_t second = flatten(B->children[1].get(), level + 1);
+			nodes[index].offset = second;
+			nodes[index].count = 0;
+		}
+		return index;
+	}
+
+	static bool rayBox(const Node &N, glm::vec3 origin, glm::vec3 invDirection, float maxT) {
+		glm::vec3 t0 = (N.min - origin) * invDirection;
+		glm::vec3 t1 = (N.max - origin) * invDirection;
+		glm::vec3 tmin = glm::min(t0, t1), tmax = glm::max(t0, t1);
+		float enter = std::max(std::max(tmin.x, tmin.y), std::max(tmin.z, 0.0f));
+		float exit = std::min(std::min(tmax.x, tmax.y), std::min(tmax.z, maxT));
+		return enter <= exit;
+	}
+
+	// Moller-Trumbore, both faces
+	static bool intersectTriangle(const Triangle &T, glm::vec3 origin, glm::vec3 direction,
+								  float maxT, float &t) {
+		const float EPSILON = 1e-8f;
+		glm::vec3 e1 = T.v1 - T.v0, e2 = T.v2 - T.v0;
+		glm::vec3 p = glm::cross(direction, e2);
+		float det = glm::dot(e1, p);
+		if (std::fabs(det) < EPSILON) {
+			return false;
+		}
+		float inv = 1.0f / det;
+		glm::vec3 s = origin - T.v0;
+		float u = glm::dot(s, p) * inv;
+		if (u < 0.0f || u > 1.0f) {
+			return false;
+		}
+		glm::vec3 q = glm::cross(s, e1);
+		float v = glm::dot(direction, q) * inv;
+		if (v < 0.0f || u + v > 1.0f) {
+			return false;
+		}
+		t = glm::dot(e2, q) * inv;
+		return t > 0.0f && t < maxT;
+	}
+
+	// A traversal pops a node and pushes its two children, so it holds at
+	// most one node per level of the tree: a degenerate mesh can make it
+	// deeper than the fixed stack
+	uint32_t *traversalStack(uint32_t (&fixedStack)[STACK_SIZE], std::vector<uint32_t> &deepStack) const {
+		if (depth < STACK_SIZE) {
+			return fixedStack;
+		}
+		deepStack.resize(depth + 1);
+		return deepStack.data();
+	}
+
+	static glm::vec3 facingNormal(const Triangle &T, glm::vec3 direction) {
+		glm::vec3 normal = glm::normalize(glm::cross(T.v1 - T.v0, T.v2 - T.v0));
+		return glm::dot(normal, direction) > 0.0f ? -normal : normal;
+	}
+
+	bool traverseRay(glm::vec3 origin, glm::vec3 direction, float maxT, RayHit *hit) const {
+		if (nodes.empty()) {
+			return false;
+		}
+		glm::vec3 invDirection = 1.0f / direction;
+		bool found = false;
+		float closest = maxT;
+		uint32_t fixedStack[STACK_SIZE];
+		std::vector<uint32_t> deepStack;
+		uint32_t *stack = traversalStack(fixedStack, deepStack);
+		int top = 0;
+		stack[top++] = 0;
+		while (top > 0) {
+			uint32_t index = stack[--top];
+			const Node &N = nodes[index];
+			if (!rayBox(N, origin, invDirection, closest)) {
+				continue;
+			}
+			if (N.count > 0) {
+				for (uint32_t i = N.offset; i < N.offset + N.count; i++) {
+					float t;
+					if (intersectTriangle(triangles[i], origin, direction, closest, t)) {
+						if (hit == nullptr) {
+							return true;
+						}
+						closest = t;
+						hit->t = t;
+						hit->triangle = triangles[i].index;
+						hit->normal = facingNormal(triangles[i], direction);
+						found = true;
+					}
+				}
+			} else if (direction[N.axis] < 0.0f) {
+				// near child first: it is popped next
+				stack[top++] = index + 1;
+				stack[top++] = N.offset;
+			} else {
+				stack[top++] = N.offset;
+				stack[top++] = index + 1;
+			}
+		}
+		return found;
+	}
+
+	// when the sphere starts touching: the lower root of a t^2 + b t + c,
+	// if it lies in [0, maxRoot). A negative one means it already touches,
+	// which sweepTriangle() has handled before.
+	static bool lowestRoot(float a, float b, float c, float maxRoot, float &root) {
+		float determinant = b * b - 4.0f * a * c;
+		if (determinant < 0.0f || a == 0.0f) {
+			return false;
+		}
+		float sqrtD = std::sqrt(determinant);
+		float r1 = std::min((-b - sqrtD) / (2.0f * a), (-b + sqrtD) / (2.0f * a));
+		if (r1 >= 0.0f && r1 < maxRoot) {
+			root = r1;
+			return true;
+		}
+		return false;
+	}
+	
+	// Closest point of triangle p to point c (Ericson, Real-Time Collision
+	// Detection, 5.1.5)
+	static glm::vec3 closestPoint(glm::vec3 c, const glm::vec3 *p) {
+		glm::vec3 ab = p[1] - p[0], ac = p[2] - p[0], ap = c - p[0];
+		float d1 = glm::dot(ab, ap), d2 = glm::dot(ac, ap);
+		if (d1 <= 0.0f && d2 <= 0.0f) {
+			return p[0];
+		}
+		glm::vec3 bp = c - p[1];
+		float d3 = glm::dot(ab, bp), d4 = glm::dot(ac, bp);
+		if (d3 >= 0.0f && d4 <= d3) {
+			return p[1];
+		}
+		float vc = d1 * d4 - d3 * d2;
+		if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+			return p[0] + ab * (d1 / (d1 - d3));
+		}
+		glm::vec3 cp = c - p[2];
+		float d5 = glm::dot(ab, cp), d6 = glm::dot(ac, cp);
+		if (d6 >= 0.0f && d5 <= d6) {
+			return p[2];
+		}
+		float vb = d5 * d2 - d1 * d6;
+		if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+			return p[0] + ac * (d2 / (d2 - d6));
+		}
+		float va = d3 * d6 - d5 * d4;
+		if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+			return p[1] + (p[2] - p[1]) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+		}
+		float denominator = 1.0f / (va + vb + vc);
+		return p[0] + ab * (vb * denominator) + ac * (vc * denominator);
+	}
+
+	// Sphere against the face, then the vertices and edges of a triangle,
+	// after Fauerby, "Improved Collision detection and Response". Only
+	// triangles the sphere moves towards count, so that a sphere resting
+	// against a wall can still slide along it or move away.
+	static bool sweepTriangle(const Triangle &T, glm::vec3 center, float radius,
+							  glm::vec3 motion, SweepHit &hit) {
+		// unit sphere space
+		float inv = 1.0f / radius;
+		glm::vec3 c = center * inv, v = motion * inv;
+		glm::vec3 p[3] = {T.v0 * inv, T.v1 * inv, T.v2 * inv};
+		glm::vec3 normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+		float length = glm::length(normal);
+		if (length == 0.0f) {
+			return false;
+		}
+		normal /= length;
+		float distance = glm::dot(normal, c - p[0]);
+		if (distance < 0.0f) {
+			normal = -normal;
+			distance = -distance;
+		}
+		float normalSpeed = glm::dot(normal, v);
+		if (normalSpeed >= 0.0f) {
+			return false;
+		}
+
+		float best = hit.t;
+		bool found = false;
+		glm::vec3 contact;
+		if (distance < 1.0f) {
+			// already touching: stop at once if moving further in
+			glm::vec3 closest = closestPoint(c, p);
+			glm::vec3 away = c - closest;
+			float distance2 = glm::dot(away, away);
+			if (distance2 < 1.0f) {
+				away = distance2 > 0.0f ? away / std::sqrt(distance2) : normal;
+				if (glm::dot(away, v) >= 0.0f || best <= 0.0f) {
+					return false;
+				}
+				hit.t = 0.0f;
+				hit.point = closest * radius;
+				hit.normal = away;
+				return true;
+			}
+		} else {
+			float t0 = (1.0f - distance) / normalSpeed;
+			if (t0 > best) {
+				return false;
+			}
+			glm::vec3 planePoint = c - normal + v * t0;
+			// inside the triangle: the face is hit first
+			glm::vec3 e0 = p[1] - p[0], e1 = p[2] - p[0], w = planePoint - p[0];
+			float d00 = glm::dot(e0, e0), d01 = glm::dot(e0, e1), d11 = glm::dot(e1, e1);
+			float d20 = glm::dot(w, e0), d21 = glm::dot(w, e1);
+			float denominator = d00 * d11 - d01 * d01;
+			float bv = (d11 * d20 - d01 * d21) / denominator;
+			float bw = (d00 * d21 - d01 * d20) / denominator;
+			if (bv >= 0.0f && bw >= 0.0f && bv + bw <= 1.0f) {
+				hit.t = t0;
+				hit.point = planePoint * radius;
+				hit.normal = normal;
+				return true;
+			}
+		}
+
+		float speed2 = glm::dot(v, v);
+		for (int k = 0; k < 3; k++) {
+			float t;
+			if (lowestRoot(speed2, 2.0f * glm::dot(v, c - p[k]),
+						   glm::dot(p[k] - c, p[k] - c) - 1.0f, best, t)) {
+				best = t;
+				contact = p[k];
+				found = true;
+			}
+		}
+		for (int k = 0; k < 3; k++) {
+			glm::vec3 edge = p[(k + 1) % 3] - p[k];
+			glm::vec3 toVertex = p[k] - c;
+			float edge2 = glm::dot(edge, edge);
+			float edgeDotV = glm::dot(edge, v);
+			float edgeDotToVertex = glm::dot(edge, toVertex);
+			float t;
+			if (lowestRoot(edge2 * -speed2 + edgeDotV * edgeDotV,
+						   edge2 * (2.0f * glm::dot(v, toVertex)) - 2.0f * edgeDotV * edgeDotToVertex,
+						   edge2 * (1.0f - glm::dot(toVertex, toVertex)) + edgeDotToVertex * edgeDotToVertex,
+						   best, t)) {
+				float f = (edgeDotV * t - edgeDotToVertex) / edge2;
+				if (f >= 0.0f && f <= 1.0f) {
+					best = t;
+					contact = p[k] + edge * f;
+					found = true;
+				}
+			}
+		}
+		if (!found) {
+			return false;
+		}
+		hit.t = best;
+		hit.point = contact * radius;
+		hit.normal = glm::normalize(c + v * best - contact);
+		return true;
+	}
+};
@@ -0,0 +1,668 @@
+// Walkable-area collision. A PolygonGrid preprocesses a polygon once into
+// a uniform grid: every cell keeps a copy of the edges that cross it and a
+// reference point whose inside/outside state is known. contains() only
+// looks at the edges of the cell the point falls in, so a query costs
+// about the same however many vertices the polygon has, and most cells
+// have no edges at all.
+//
+// The orientation test is exact for float coordinates, so the answers do
+// not depend on rounding. Points on the boundary count as inside, as with
+// isInside(). Only the standard library is used, so that the module can
+// be tested and benchmarked without a Vulkan device.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct Point
+{
+    float x;
+    float y;
+};
+
+// Exact sign of the sum of n <= 4 doubles. The terms are accumulated into
+// a nonoverlapping expansion (Shewchuk's Grow-Expansion), whose largest
+// nonzero component has the sign of the sum.
+inline int exactSumSign(const double *terms, int n) {
+	double expansion[4];
+	int m = 0;
+	for (int i = 0; i < n; i++) {
+		double q = terms[i];
+		int k = 0;
+		for (int j = 0; j < m; j++) {
+			double s = q + expansion[j];
+			double bv = s - q;
+			double err = (q - (s - bv)) + (expansion[j] - bv);
+			if (err != 0.0) {
+				expansion[k++] = err;
+			}
+			q = s;
+		}
+		if (q != 0.0) {
+			expansion[k++] = q;
+		}
+		m = k;
+	}
+	if (m == 0) {
+		return 0;
+	}
+	return expansion[m - 1] > 0.0 ? 1 : -1;
+}
+
+// Orientation of the triplet (p, q, r): 1 counterclockwise, -1 clockwise,
+// 0 collinear. The coordinate differences are exact in double for floats
+// within 2^28 of each other in magnitude (any level geometry); the two
+// products are split into value and rounding error with fma when the
+// quick estimate is too close to zero to trust.
+inline int orient2d(Point p, Point q, Point r) {
+	double ax = (double) q.x - p.x, ay = (double) q.y - p.y;
+	double bx = (double) r.x - p.x, by = (double) r.y - p.y;
+	double left = ax * by;
+	double right = ay * bx;
+	double det = left - right;
+	double bound = 1e-15 * (std::fabs(left) + std::fabs(right));
+	if (det > bound) {
+		return 1;
+	}
+	if (det < -bound) {
+		return -1;
+	}
+	double terms[4] = {left, std::fma(ax, by, -left),
+					   -right, -std::fma(ay, bx, -right)};
+	return exactSumSign(terms, 4);
+}
+
+// The tutorial's tests, whose orientation truncates to int: the game's
+// platforms still use them, and the benchmarks compare against them.
+
+// Define Infinite (Using INT_MAX caused overflow problems)
+#define INF 10000
+
+// Given three collinear points p, q, r, the function checks if
+// point q lies on line segment 'pr'
+inline bool onSegment(Point p, Point q, Point r)
+{
+    if (q.x <= std::max(p.x, r.x) && q.x >= std::min(p.x, r.x) &&
+            q.y <= std::max(p.y, r.y) && q.y >= std::min(p.y, r.y))
+        return true;
+    return false;
+}
+
+// To find orientation of ordered triplet (p, q, r).
+// The function returns following values
+// 0 --> p, q and r are collinear
+// 1 --> Clockwise
+// 2 --> Counterclockwise
+inline int orientation(Point p, Point q, Point r)
+{
+    int val = (q.y - p.y) * (r.x - q.x) -
+            (q.x - p.x) * (r.y - q.y);
+
+    if (val == 0) return 0; // collinear
+    return (val > 0)? 1: 2; // clock or counterclock wise
+}
+
+// The function that returns true if line segment 'p1q1'
+// and 'p2q2' intersect.
+inline bool doIntersect(Point p1, Point q1, Point p2, Point q2)
+{
+    // Find the four orientations needed for general and
+    // special cases
+    int o1 = orientation(p1, q1, p2);
+    int o2 = orientation(p1, q1, q2);
+    int o3 = orientation(p2, q2, p1);
+    int o4 = orientation(p2, q2, q1);
+
+    // General case
+    if (o1 != o2 && o3 != o4)
+        return true;
+
+    // Special Cases
+    // p1, q1 and p2 are collinear and p2 lies on segment p1q1
+    if (o1 == 0 && onSegment(p1, p2, q1)) return true;
+
+    // p1, q1 and p2 are collinear and q2 lies on segment p1q1
+    if (o2 == 0 && onSegment(p1, q2, q1)) return true;
+
+    // p2, q2 and p1 are collinear and p1 lies on segment p2q2
+    if (o3 == 0 && onSegment(p2, p1, q2)) return true;
+
+    // p2, q2 and q1 are collinear and q1 lies on segment p2q2
+    if (o4 == 0 && onSegment(p2, q1, q2)) return true;
+
+    return false; // Doesn't fall in any of the above cases
+}
+
+// Returns true if the point p lies inside the polygon[] with n vertices
+inline bool isInside(Point polygon[], int n, Point p)
+{
+    // There must be at least 3 vertices in polygon[]
+    if (n < 3) return false;
+
+    // Create a point for line segment from p to infinite
+    Point extreme = {INF, p.y};
+
+    // Count intersections of the above line with sides of polygon
+    int count = 0, i = 0;
+    do
+    {
+        int next = (i+1)%n;
+
+        // Check if the line segment from 'p' to 'extreme' intersects
+        // with the line segment from 'polygon[i]' to 'polygon[next]'
+        if (doIntersect(polygon[i], polygon[next], p, extreme))
+        {
+            // If the point 'p' is collinear with line segment 'i-next',
+            // then check if it lies on segment. If it lies, return true,
+            // otherwise false
+            if (orientation(polygon[i], p, polygon[next]) == 0)
+            return onSegment(polygon[i], p, polygon[next]);
+
+            count++;
+        }
+        i = next;
+    } while (i != 0);
+
+    // Return true if count is odd, false otherwise
+    return count&1; // Same as (count%2 == 1)
+}
+
+class PolygonGrid {
+public:
+	struct Edge {
+		Point a, b;
+	};
+
+	PolygonGrid() {}
+
+	PolygonGrid(const Point *polygon, size_t n, float cellsPerEdge = 4.0f) {
+		build(polygon, n, cellsPerEdge);
+	}
+
+	// cellsPerEdge sets the resolution: more cells means fewer edges per
+	// occupied cell and more empty ones, at the cost of memory
+	void build(const Point *polygon, size_t n, float cellsPerEdge = 4.0f) {
+		vertices.assign(polygon, polygon + n);
+		cells.clear();
+		cellEdges.clear();
+		cols = rows = 0;
+		if (n < 3) {
+			return;
+		}
+
+		minCorner = maxCorner = polygon[0];
+		for (size_t i = 1; i < n; i++) {
+			minCorner.x = std::min(minCorner.x, polygon[i].x);
+			minCorner.y = std::min(minCorner.y, polygon[i].y);
+			maxCorner.x = std::max(maxCorner.x, polygon[i].x);
+			maxCorner.y = std::max(maxCorner.y, polygon[i].y);
+		}
+		float width = std::max(maxCorner.x - minCorner.x, 1e-6f);
+		float height = std::max(maxCorner.y - minCorner.y, 1e-6f);
+		float cellCount = std::max(1.0f, cellsPerEdge * n);
+		cols = std::max(1, (int) std::ceil(std::sqrt(cellCount * width / height)));
+		rows = std::max(1, (int) std::ceil(cellCount / cols));
+		cellWidth = width / cols;
+		cellHeight = height / rows;
+		invCellWidth = 1.0f / cellWidth;
+		invCellHeight = 1.0f / cellHeight;
+
+		// the cell a point is assigned to is computed in float, so a point
+		// may sit just outside it: the edge lists cover a slightly larger box
+		float marginX = cellWidth * 1e-3f;
+		float marginY = cellHeight * 1e-3f;
+		cells.resize((size_t) cols * rows);
+		for (int cy = 0; cy < rows; cy++) {
+			for (int cx = 0; cx < cols; cx++) {
+				Cell &C = cells[(size_t) cy * cols + cx];
+				float x0 = minCorner.x + cx * cellWidth - marginX;
+				float y0 = minCorner.y + cy * cellHeight - marginY;
+				float x1 = minCorner.x + (cx + 1) * cellWidth + marginX;
+				float y1 = minCorner.y + (cy + 1) * cellHeight + marginY;
+
+				C.firstEdge = (uint32_t) cellEdges.size();
+				for (size_t i = 0; i < n; i++) {
+					Edge E = {polygon[i], polygon[(i + 1) % n]};
+					if (edgeOverlapsBox(E, x0, y0, x1, y1)) {
+						cellEdges.push_back(E);
+					}
+				}
+				C.edgeCount = (uint32_t) cellEdges.size() - C.firstEdge;
+				C.reference = {minCorner.x + (cx + 0.5f) * cellWidth,
+							   minCorner.y + (cy + 0.5f) * cellHeight};
+				C.referenceInside = containsBruteForce(C.reference);
+			}
+		}
+	}
+
+	bool empty() const {
+		return cells.empty();
+	}
+
+	// Parity of the crossings between the edges of p's cell and the
+	// segment from the cell's reference point to p. When the segment
+	// touches a vertex or p lies on an edge the exact answer needs all the
+	// edges, and the query falls back to containsBruteForce().
+	bool contains(Point p) const {
+		if (!(p.x >= minCorner.x && p.x <= maxCorner.x &&
+			  p.y >= minCorner.y && p.y <= maxCorner.y) || cells.empty()) {
+			return false;
+		}
+		int cx = std::min((int) ((p.x - minCorner.x) * invCellWidth), cols - 1);
+		int cy = std::min((int) ((p.y - minCorner.y) * invCellHeight), rows - 1);
+		const Cell &C = cells[(size_t) cy * cols + cx];
+
+		bool inside = C.referenceInside;
+		const Edge *E = cellEdges.data() + C.firstEdge;
+		for (uint32_t i = 0; i < C.edgeCount; i++) {
+			int o1 = orient2d(C.reference, p, E[i].a);
+			int o2 = orient2d(C.reference, p, E[i].b);
+			if (o1 * o2 > 0) {
+				continue;
+			}
+			int o3 = orient2d(E[i].a, E[i].b, C.reference);
+			int o4 = orient2d(E[i].a, E[i].b, p);
+			if (o3 * o4 > 0) {
+				continue;
+			}
+			if (o1 == 0 || o2 == 0 || o3 == 0 || o4 == 0) {
+				return containsBruteForce(p);
+			}
+			inside = !inside;
+		}
+		return inside;
+	}
+
+	// inside[i] = contains(points[i])
+	void containsBatch(const Point *points, size_t n, uint8_t *inside) const {
+		for (size_t i = 0; i < n; i++) {
+			inside[i] = contains(points[i]) ? 1 : 0;
+		}
+	}
+
+	// Crossing test against every edge, with the same exact predicates
+	bool containsBruteForce(Point p) const {
+		size_t n = vertices.size();
+		if (n < 3) {
+			return false;
+		}
+		bool inside = false;
+		for (size_t i = 0; i < n; i++) {
+			Point a = vertices[i];
+			Point b = vertices[(i + 1) % n];
+			int o = orient2d(a, b, p);
+			if (o == 0 &&
+					p.x >= std::min(a.x, b.x) && p.x <= std::max(a.x, b.x) &&
+					p.y >= std::min(a.y, b.y) && p.y <= std::max(a.y, b.y)) {
+				return true;
+			}
+			// half-open rule: a horizontal ray to the right of p crosses
+			// the edge if p is on its left (upward) or right (downward)
+			if ((a.y > p.y) != (b.y > p.y) && (b.y > a.y ? o > 0 : o < 0)) {
+				inside = !inside;
+			}
+		}
+		return inside;
+	}
+
+	const std::vector<Point> &polygon() const {
+		return vertices;
+	}
+
+	int gridColumns() const {
+		return cols;
+	}
+
+	int gridRows() const {
+		return rows;
+	}
+
+	// edges stored over all the cells
+	size_t storedEdges() const {
+		return cellEdges.size();
+	}
+
+private:
+	struct Cell {
+		uint32_t firstEdge;
+		uint32_t edgeCount;
+		Point reference;
+		bool referenceInside;
+	};
+
+	std::vector<Point> vertices;
+	std::vector<Cell> cells;
+	std::vector<Edge> cellEdges;
+	Point minCorner = {0.0f, 0.0f};
+	Point maxCorner = {0.0f, 0.0f};
+	int cols = 0, rows = 0;
+	float cellWidth = 0.0f, cellHeight = 0.0f;
+	float invCellWidth = 0.0f, invCellHeight = 0.0f;
+
+	// conservative: may keep an edge that only passes near the box
+	static bool edgeOverlapsBox(const Edge &E, float x0, float y0, float x1, float y1) {
+		if (std::max(E.a.x, E.b.x) < x0 || std::min(E.a.x, E.b.x) > x1 ||
+			std::max(E.a.y, E.b.y) < y0 || std::min(E.a.y, E.b.y) > y1) {
+			return false;
+		}
+		double dx = (double) E.b.x - E.a.x;
+		double dy = (double) E.b.y - E.a.y;
+		double corners[4][2] = {{x0, y0}, {x1, y0}, {x1, y1}, {x0, y1}};
+		int positive = 0, negative = 0;
+		for (auto &c : corners) {
+			double side = dx * (c[1] - E.a.y) - dy * (c[0] - E.a.x);
+			positive += side >= 0.0;
+			negative += side <= 0.0;
+		}
+		return positive > 0 && negative > 0;
+	}
+};
+
+// Batch kernels for many queries per frame (NPCs, particles). The edges of
+// a polygon are kept as a structure of arrays so that a SIMD register
+// holds the same field of 4 (SSE2) or 8 (AVX2) edges; each query runs
+// through all the edges without branches. The arithmetic is plain float,
+// the same at every SIMD level, so a point within rounding distance of an
+// edge may go either way: use PolygonGrid where that matters.
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define COLLISION_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define COLLISION_TARGET_AVX2
+#else
+#define COLLISION_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#else
+#define COLLISION_X86 0
+#endif
+
+enum SimdLevel {
+	SIMD_SCALAR,
+	SIMD_SSE2,
+	SIMD_AVX2
+};
+
+inline const char *simdLevelName(SimdLevel level) {
+	static const char *names[] = {"scalar", "SSE2", "AVX2"};
+	return names[level];
+}
+
+inline SimdLevel detectSimdLevel() {
+#if COLLISION_X86
+#if defined(_MSC_VER) && !defined(__clang__)
+	int info[4];
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	if (osxsave && avx && (_xgetbv(0) & 6) == 6) {
+		__cpuidex(info, 7, 0);
+		if (info[1] & (1 << 5)) {
+			return SIMD_AVX2;
+		}
+	}
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return SIMD_AVX2;
+	}
+#endif
+	return SIMD_SSE2;
+#else
+	return SIMD_SCALAR;
+#endif
+}
+
+// What the batch kernels use unless told otherwise
+inline SimdLevel bestSimdLevel() {
+	static SimdLevel level = detectSimdLevel();
+	return level;
+}
+
+struct PolygonEdgesSoA {
+	// the arrays are padded to a multiple of the widest register with
+	// edges that never cross a ray nor hit a segment
+	static const size_t WIDTH = 8;
+
+	std::vector<float> ax, ay, bx, by;
+	std::vector<float> dx, dy;			// b - a
+	std::vector<float> slope;			// dx / dy, 0 for horizontal edges
+	std::vector<float> minX, maxX, minY, maxY;
+	size_t count = 0;
+
+	void build(const Point *polygon, size_t n) {
+		count = n < 3 ? 0 : n;
+		size_t padded = (count + WIDTH - 1) / WIDTH * WIDTH;
+		for (auto *v : {&ax, &ay, &bx, &by, &dx, &dy, &slope}) {
+			v->assign(padded, 0.0f);
+		}
+		minX.assign(padded, INFINITY);
+		minY.assign(padded, INFINITY);
+		maxX.assign(padded, -INFINITY);
+		maxY.assign(padded, -INFINITY);
+		for (size_t i = 0; i < count; i++) {
+			Point a = polygon[i];
+			Point b = polygon[(i + 1) % n];
+			ax[i] = a.x;
+			ay[i] = a.y;
+			bx[i] = b.x;
+			by[i] = b.y;
+			dx[i] = b.x - a.x;
+			dy[i] = b.y - a.y;
+			slope[i] = dy[i] != 0.0f ? dx[i] / dy[i] : 0.0f;
+			minX[i] = std::min(a.x, b.x);
+			maxX[i] = std::max(a.x, b.x);
+			minY[i] = std::min(a.y, b.y);
+			maxY[i] = std::max(a.y, b.y);
+		}
+	}
+
+	size_t paddedSize() const {
+		return ax.size();
+	}
+};
+
+inline int parityOfMask(int mask) {
+	mask ^= mask >> 4;
+	mask ^= mask >> 2;
+	mask ^= mask >> 1;
+	return mask & 1;
+}
+
+// Crossing number of a horizontal ray to the right of each point
+inline void pointsInPolygonScalar(const PolygonEdgesSoA &E, const float *px, const float *py,
+								  size_t n, uint8_t *inside) {
+	for (size_t i = 0; i < n; i++) {
+		float x = px[i], y = py[i];
+		int parity = 0;
+		for (size_t e = 0; e < E.count; e++) {
+			bool straddle = (E.ay[e] > y) != (E.by[e] > y);
+			float crossX = E.ax[e] + (y - E.ay[e]) * E.slope[e];
+			parity ^= (straddle && x < crossX);
+		}
+		inside[i] = (uint8_t) parity;
+	}
+}
+
+// True when the segment from (x0, y0) to (x1, y1) touches an edge
+inline void segmentsHitPolygonScalar(const PolygonEdgesSoA &E,
+									 const float *x0, const float *y0,
+									 const float *x1, const float *y1,
+									 size_t n, uint8_t *hit) {
+	for (size_t i = 0; i < n; i++) {
+		float sx = x1[i] - x0[i], sy = y1[i] - y0[i];
+		float sMinX = std::min(x0[i], x1[i]), sMaxX = std::max(x0[i], x1[i]);
+		float sMinY = std::min(y0[i], y1[i]), sMaxY = std::max(y0[i], y1[i]);
+		bool any = false;
+		for (size_t e = 0; e < E.count && !any; e++) {
+			float d1 = E.dx[e] * (y0[i] - E.ay[e]) - E.dy[e] * (x0[i] - E.ax[e]);
+			float d2 = E.dx[e] * (y1[i] - E.ay[e]) - E.dy[e] * (x1[i] - E.ax[e]);
+			float d3 = sx * (E.ay[e] - y0[i]) - sy * (E.ax[e] - x0[i]);
+			float d4 = sx * (E.by[e] - y0[i]) - sy * (E.bx[e] - x0[i]);
+			// the box test settles the collinear case
+			any = d1 * d2 <= 0.0f && d3 * d4 <= 0.0f &&
+				  E.minX[e] <= sMaxX && E.maxX[e] >= sMinX &&
+				  E.minY[e] <= sMaxY && E.maxY[e] >= sMinY;
+		}
+		hit[i] = any;
+	}
+}
+
+#if COLLISION_X86
+inline void pointsInPolygonSSE2(const PolygonEdgesSoA &E, const float *px, const float *py,
+								size_t n, uint8_t *inside) {
+	size_t edges = (E.count + 3) & ~(size_t) 3;
+	for (size_t i = 0; i < n; i++) {
+		__m128 x = _mm_set1_ps(px[i]), y = _mm_set1_ps(py[i]);
+		__m128 parity = _mm_setzero_ps();
+		for (size_t e = 0; e < edges; e += 4) {
+			__m128 ay = _mm_loadu_ps(&E.ay[e]);
+			__m128 straddle = _mm_xor_ps(_mm_cmpgt_ps(ay, y),
+										 _mm_cmpgt_ps(_mm_loadu_ps(&E.by[e]), y));
+			__m128 crossX = _mm_add_ps(_mm_loadu_ps(&E.ax[e]),
+									   _mm_mul_ps(_mm_sub_ps(y, ay), _mm_loadu_ps(&E.slope[e])));
+			parity = _mm_xor_ps(parity, _mm_and_ps(straddle, _mm_cmplt_ps(x, crossX)));
+		}
+		inside[i] = (uint8_t) parityOfMask(_mm_movemask_ps(parity));
+	}
+}
+
+inline void segmentsHitPolygonSSE2(const PolygonEdgesSoA &E,
+								   const float *x0, const float *y0,
+								   const float *x1, const float *y1,
+								   size_t n, uint8_t *hit) {
+	size_t edges = (E.count + 3) & ~(size_t) 3;
+	__m128 zero = _mm_setzero_ps();
+	for (size_t i = 0; i < n; i++) {
+		__m128 px0 = _mm_set1_ps(x0[i]), py0 = _mm_set1_ps(y0[i]);
+		__m128 px1 = _mm_set1_ps(x1[i]), py1 = _mm_set1_ps(y1[i]);
+		__m128 sx = _mm_set1_ps(x1[i] - x0[i]), sy = _mm_set1_ps(y1[i] - y0[i]);
+		__m128 sMinX = _mm_set1_ps(std::min(x0[i], x1[i]));
+		__m128 sMaxX = _mm_set1_ps(std::max(x0[i], x1[i]));
+		__m128 sMinY = _mm_set1_ps(std::min(y0[i], y1[i]));
+		__m128 sMaxY = _mm_set1_ps(std::max(y0[i], y1[i]));
+		int any = 0;
+		for (size_t e = 0; e < edges && !any; e += 4) {
+			__m128 ax = _mm_loadu_ps(&E.ax[e]), ay = _mm_loadu_ps(&E.ay[e]);
+			__m128 dx = _mm_loadu_ps(&E.dx[e]), dy = _mm_loadu_ps(&E.dy[e]);
+			__m128 d1 = _mm_sub_ps(_mm_mul_ps(dx, _mm_sub_ps(py0, ay)),
+								   _mm_mul_ps(dy, _mm_sub_ps(px0, ax)));
+			__m128 d2 = _mm_sub_ps(_mm_mul_ps(dx, _mm_sub_ps(py1, ay)),
+								   _mm_mul_ps(dy, _mm_sub_ps(px1, ax)));
+			__m128 d3 = _mm_sub_ps(_mm_mul_ps(sx, _mm_sub_ps(ay, py0)),
+								   _mm_mul_ps(sy, _mm_sub_ps(ax, px0)));
+			__m128 d4 = _mm_sub_ps(_mm_mul_ps(sx, _mm_sub_ps(_mm_loadu_ps(&E.by[e]), py0)),
+								   _mm_mul_ps(sy, _mm_sub_ps(_mm_loadu_ps(&E.bx[e]), px0)));
+			__m128 mask = _mm_and_ps(_mm_cmple_ps(_mm_mul_ps(d1, d2), zero),
+									 _mm_cmple_ps(_mm_mul_ps(d3, d4), zero));
+			mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_loadu_ps(&E.minX[e]), sMaxX));
+			mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_loadu_ps(&E.maxX[e]), sMinX));
+			mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_loadu_ps(&E.minY[e]), sMaxY));
+			mask = _mm_and_ps(mask, _mm_cmpge_ps(_mm_loadu_ps(&E.maxY[e]), sMinY));
+			any = _mm_movemask_ps(mask);
+		}
+		hit[i] = any != 0;
+	}
+}
+
+COLLISION_TARGET_AVX2
+inline void pointsInPolygonAVX2(const PolygonEdgesSoA &E, const float *px, const float *py,
+								size_t n, uint8_t *inside) {
+	size_t edges = (E.count + 7) & ~(size_t) 7;
+	for (size_t i = 0; i < n; i++) {
+		__m256 x = _mm256_set1_ps(px[i]), y = _mm256_set1_ps(py[i]);
+		__m256 parity = _mm256_setzero_ps();
+		for (size_t e = 0; e < edges; e += 8) {
+			__m256 ay = _mm256_loadu_ps(&E.ay[e]);
+			__m256 straddle = _mm256_xor_ps(_mm256_cmp_ps(ay, y, _CMP_GT_OQ),
+											_mm256_cmp_ps(_mm256_loadu_ps(&E.by[e]), y, _CMP_GT_OQ));
+			__m256 crossX = _mm256_add_ps(_mm256_loadu_ps(&E.ax[e]),
+										  _mm256_mul_ps(_mm256_sub_ps(y, ay),
+														_mm256_loadu_ps(&E.slope[e])));
+			parity = _mm256_xor_ps(parity,
+								   _mm256_and_ps(straddle, _mm256_cmp_ps(x, crossX, _CMP_LT_OQ)));
+		}
+		inside[i] = (uint8_t) parityOfMask(_mm256_movemask_ps(parity));
+	}
+}
+
+COLLISION_TARGET_AVX2
+inline void segmentsHitPolygonAVX2(const PolygonEdgesSoA &E,
+								   const float *x0, const float *y0,
+								   const float *x1, const float *y1,
+								   size_t n, uint8_t *hit) {
+	size_t edges = (E.count + 7) & ~(size_t) 7;
+	__m256 zero = _mm256_setzero_ps();
+	for (size_t i = 0; i < n; i++) {
+		__m256 px0 = _mm256_set1_ps(x0[i]), py0 = _mm256_set1_ps(y0[i]);
+		__m256 px1 = _mm256_set1_ps(x1[i]), py1 = _mm256_set1_ps(y1[i]);
+		__m256 sx = _mm256_set1_ps(x1[i] - x0[i]), sy = _mm256_set1_ps(y1[i] - y0[i]);
+		__m256 sMinX = _mm256_set1_ps(std::min(x0[i], x1[i]));
+		__m256 sMaxX = _mm256_set1_ps(std::max(x0[i], x1[i]));
+		__m256 sMinY = _mm256_set1_ps(std::min(y0[i], y1[i]));
+		__m256 sMaxY = _mm256_set1_ps(std::max(y0[i], y1[i]));
+		int any = 0;
+		for (size_t e = 0; e < edges && !any; e += 8) {
+			__m256 ax = _mm256_loadu_ps(&E.ax[e]), ay = _mm256_loadu_ps(&E.ay[e]);
+			__m256 dx = _mm256_loadu_ps(&E.dx[e]), dy = _mm256_loadu_ps(&E.dy[e]);
+			__m256 d1 = _mm256_sub_ps(_mm256_mul_ps(dx, _mm256_sub_ps(py0, ay)),
+									  _mm256_mul_ps(dy, _mm256_sub_ps(px0, ax)));
+			__m256 d2 = _mm256_sub_ps(_mm256_mul_ps(dx, _mm256_sub_ps(py1, ay)),
+									  _mm256_mul_ps(dy, _mm256_sub_ps(px1, ax)));
+			__m256 d3 = _mm256_sub_ps(_mm256_mul_ps(sx, _mm256_sub_ps(ay, py0)),
+									  _mm256_mul_ps(sy, _mm256_sub_ps(ax, px0)));
+			__m256 d4 = _mm256_sub_ps(_mm256_mul_ps(sx, _mm256_sub_ps(_mm256_loadu_ps(&E.by[e]), py0)),
+									  _mm256_mul_ps(sy, _mm256_sub_ps(_mm256_loadu_ps(&E.bx[e]), px0)));
+			__m256 mask = _mm256_and_ps(_mm256_cmp_ps(_mm256_mul_ps(d1, d2), zero, _CMP_LE_OQ),
+										_mm256_cmp_ps(_mm256_mul_ps(d3, d4), zero, _CMP_LE_OQ));
+			mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_loadu_ps(&E.minX[e]), sMaxX, _CMP_LE_OQ));
+			mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_loadu_ps(&E.maxX[e]), sMinX, _CMP_GE_OQ));
+			mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_loadu_ps(&E.minY[e]), sMaxY, _CMP_LE_OQ));
+			mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_loadu_ps(&E.maxY[e]), sMinY, _CMP_GE_OQ));
+			any = _mm256_movemask_ps(mask);
+		}
+		hit[i] = any != 0;
+	}
+}
+#endif
+
+// Runtime dispatch: level defaults to the best the CPU supports and is
+// lowered to it if higher
+inline void pointsInPolygon(const PolygonEdgesSoA &E, const float *px, const float *py,
+							size_t n, uint8_t *inside, SimdLevel level = bestSimdLevel()) {
+	level = std::min(level, bestSimdLevel());
+#if COLLISION_X86
+	if (level == SIMD_AVX2) {
+		pointsInPolygonAVX2(E, px, py, n, inside);
+		return;
+	}
+	if (level == SIMD_SSE2) {
+		pointsInPolygonSSE2(E, px, py, n, inside);
+		return;
+	}
+#endif
+	pointsInPolygonScalar(E, px, py, n, inside);
+}
+
+inline void segmentsHitPolygon(const PolygonEdgesSoA &E,
+							   const float *x0, const float *y0,
+							   const float *x1, const float *y1,
+							   size_t n, uint8_t *hit, SimdLevel level = bestSimdLevel()) {
+	level = std::min(level, bestSimdLevel());
+#if COLLISION_X86
+	if (level == SIMD_AVX2) {
+		segmentsHitPolygonAVX2(E, x0, y0, x1, y1, n, hit);
+		return;
+	}
+	if (level == SIMD_SSE2) {
+		segmentsHitPolygonSSE2(E, x0, y0, x1, y1, n, hit);
+		return;
+	}
+#endif
+	segmentsHitPolygonScalar(E, x0, y0, x1, y1, n, hit);
+}
@@ -0,0 +1,69 @@
+// Picks the resolution the scene is rendered at from the GPU time of the
+// frames, to keep it within a budget: the scene is drawn into part of an
+// offscreen target, scale times the window on each side, and upscaled to
+// the window. The GPU time of a frame is taken to grow with the pixels,
+// so with the square of the scale.
+//
+// shaders/upscale.frag does the upscale, sharpening what the bilinear
+// filter blurs; UpscaleUniforms must match its block.
+//
+// The scale moves in steps of STEP, since every change records the
+// command buffers again, and waits for the frames rendered at the last
+// one to be measured before it moves again: quickly down when over the
+// budget, slowly up once there is room, so that it does not oscillate.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+#include <glm/glm.hpp>
+
+// std140, binding 1 of the upscale set
+struct UpscaleUniforms {
+	alignas(16) glm::vec4 uvScaleTexel;		// the part of the target drawn, and one texel
+	alignas(16) float sharpness;			// 0 for none
+};
+
+class ResolutionScaler {
+public:
+	static constexpr float STEP = 0.05f;
+	static constexpr float HEADROOM = 0.9f;		// of the budget, to aim at
+	static constexpr int LAG_FRAMES = 4;		// still rendered at the old scale
+	static constexpr int DOWN_FRAMES = 8;		// measured before a change
+	static constexpr int UP_FRAMES = 60;
+
+	ResolutionScaler(float budgetMs = 16.0f, float minScale = 0.5f) :
+		budgetMs(budgetMs), minScale(minScale) {}
+
+	// once per frame measured; returns the scale for the next frames
+	float update(double gpuMs) {
+		if (++samples <= 0) {
+			return current;
+		}
+		average = samples == 1 ? gpuMs : average + 0.2 * (gpuMs - average);
+		if (samples < DOWN_FRAMES) {
+			return current;
+		}
+
+		float wanted = current * (float) std::sqrt(budgetMs * HEADROOM / std::max(average, 1e-3));
+		wanted = std::clamp(std::floor(wanted / STEP + 1e-3f) * STEP, minScale, 1.0f);
+		if (wanted < current || (wanted > current && samples >= UP_FRAMES)) {
+			// up one step at a time, down as far as needed
+			current = wanted < current ? wanted : std::min(current + STEP, 1.0f);
+			samples = -LAG_FRAMES;
+		}
+		return current;
+	}
+
+	float scale() const {
+		return current;
+	}
+
+private:
+	float budgetMs;
+	float minScale;
+	float current = 1.0f;
+	double average = 0.0;		// of the GPU time at the current scale
+	int samples = 0;
+};
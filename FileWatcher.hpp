@@ -0,0 +1,144 @@
+// Reports files that changed on disk, from a background thread. On Linux
+// inotify watches the directories of the files, so that an editor that
+// saves by writing a new file and renaming it over the old one is seen
+// too; elsewhere the modification times are polled. A file is reported
+// once it has been left alone for SETTLE_MS, rather than after every
+// write of a save in progress.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#else
+#include <filesystem>
+#endif
+
+class FileWatcher {
+public:
+	static constexpr int SETTLE_MS = 100;
+
+	~FileWatcher() {
+		stop();
+	}
+
+	// before start()
+	void watch(const std::string &file) {
+		files.insert(file);
+	}
+
+	void start() {
+		if (running || files.empty()) {
+			return;
+		}
+		running = true;
+		thread = std::thread([this]() { run(); });
+	}
+
+	void stop() {
+		if (!running) {
+			return;
+		}
+		running = false;
+		thread.join();
+	}
+
+	// the files that changed and settled since the last call
+	std::vector<std::string> changed() {
+		std::vector<std::string> settled;
+		auto now = std::chrono::steady_clock::now();
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto it = pending.begin(); it != pending.end();) {
+			if (now - it->second >= std::chrono::milliseconds(SETTLE_MS)) {
+				settled.push_back(it->first);
+				it = pending.erase(it);
+			} else {
+				++it;
+			}
+		}
+		return settled;
+	}
+
+private:
+	std::set<std::string> files;
+	std::map<std::string, std::chrono::steady_clock::time_point> pending;	// last change
+	std::mutex mutex;
+	std::atomic<bool> running{false};
+	std::thread thread;
+
+	void touched(const std::string &file) {
+		std::lock_guard<std::mutex> lock(mutex);
+		pending[file] = std::chrono::steady_clock::now();
+	}
+
+#ifdef __linux__
+	void run() {
+		int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd < 0) {
+			return;
+		}
+		std::map<int, std::string> directories;		// watch descriptor -> path prefix
+		for (const std::string &file : files) {
+			size_t slash = file.find_last_of('/');
+			std::string directory = slash == std::string::npos ? "." : file.substr(0, slash);
+			std::string prefix = slash == std::string::npos ? "" : file.substr(0, slash + 1);
+			int wd = inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+			if (wd >= 0) {
+				directories[wd] = prefix;
+			}
+		}
+
+		alignas(inotify_event) char buffer[4096];
+		while (running) {
+			pollfd P = {fd, POLLIN, 0};
+			if (poll(&P, 1, 100) <= 0) {
+				continue;
+			}
+			ssize_t length;
+			while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+				for (char *p = buffer; p < buffer + length;) {
+					const inotify_event *event = (const inotify_event *) p;
+					p += sizeof(inotify_event) + event->len;
+					auto directory = directories.find(event->wd);
+					if (event->len == 0 || directory == directories.end()) {
+						continue;
+					}
+					std::string file = directory->second + event->name;
+					if (files.count(file)) {
+						touched(file);
+					}
+				}
+			}
+		}
+		close(fd);
+	}
+#else
+	void run() {
+		std::map<std::string, std::filesystem::file_time_type> times;
+		std::error_code error;
+		for (const std::string &file : files) {
+			times[file] = std::filesystem::last_write_time(file, error);
+		}
+		while (running) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(250));
+			for (auto &T : times) {
+				auto time = std::filesystem::last_write_time(T.first, error);
+				if (!error && time != T.second) {
+					T.second = time;
+					touched(T.first);
+				}
+			}
+		}
+	}
+#endif
+};
@@ -0,0 +1,114 @@
+// The hand-authored walkable areas of the cave, on the xz plane, shared
+// by the game, the micro-benchmarks and the tests, random points around
+// them to query, how the game extracts the floor of the cave model, and
+// scenes generated over them.
+
+#pragma once
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Collision.hpp"
+#include "NavMesh.hpp"
+#include "Scene.hpp"
+
+// Camera height over the floor, and how far from the walls the
+// navigation mesh keeps it (--navmesh-collision)
+const float EYE_HEIGHT = 2.94f;
+const float NAVMESH_RADIUS = 0.25f;
+
+// The camera's collision capsule with --bvh-collision: it starts a step
+// above the floor, so that small steps do not stop it
+const float CAPSULE_RADIUS = 0.25f;
+const float STEP_HEIGHT = 0.5f;
+
+const Point polygonFirstLevel[] = {
+    {1.977f, -0.12f},{-8.0f, -0.29f},{-8.1f, 4.9f},{-17.977f, 4.95f},{-18.40947f, 15.119062f},{-13.2749f, 15.286366f}, {-13.08979f, -0.321581},{-2.94981f, 32.661884f},{-2.756874f, 30.245684},{7.059189f, 30.348223f},{7.351864f, 27.670744f},{17.165037f, 27.727234f},{17.309513f, 25.223669f},{27.082043f, 25.309875f},{27.167667f, 15.291109f},{32.010273f, 15.222846f},{32.212494f, 5.442165f},{37.041645f, 5.490769f},{37.258324f, -4.548279f},{42.106056f, -4.725879f},{42.303799f, -24.741739f},{51.765488f, -24.710552f},{51.789332f, 4.637737f},{46.881699f, 4.821360f},{46.808151f, 14.725124f},{41.870975f, 14.739830f},{41.740196f, 24.785589f},{36.900578f, 24.698938f},{36.700233f, 34.750481f},{16.906641f, 34.621841f},{16.750671f, 39.685867f},{6.838522f, 39.544998f},{6.710043f, 44.605782f},{-2.701247f, 44.647972f},{-3.126298f, 42.389423f},{-13.196265f, 42.362267f},{-13.263083f, 44.729404f},{-22.239576f, 44.574398f},{-22.488251f, 39.968781f},{-32.621956f,39.646076f},{-32.610435f, 34.810993f},{-37.548759f, 34.689541f},{-37.506943,24.909031f},{-47.633053f, 24.743914f},{-47.550144f, 20.606758f},{-42.709469f, 20.590010f},{-42.595543f, 12.155780f},{-37.737270f, 12.345304f},{-37.563602f, -5.191618f},{-47.347424f, -5.375168f},{-47.347515f, -14.043010f},{-19.012642f, -14.177714f},{-18.594564f, -9.578016f},{2.382220f, -9.686684f},{2.396673f, -19.569105f},{7.026602f, -19.527569f},{7.362133f, -30.314966f},{-3.171566f, -30.144741f},{-3.237250, -27.667923f},{-7.742736f, -27.791506f},{-7.834392f, -30.270039f},{-17.734526f, -30.351521f},{-17.885273f, -39.995483f},{-28.120893f, -40.382954f},{-28.367798f, -30.411938f},{-37.807617f, -30.382368f},{-37.922546f, -40.062504f},{-57.161739f, -40.423023f},{-57.090649f, -49.525463f},{-42.896645f, -49.734165f},{-42.822685f, -54.563705f},{-33.178314f, -54.498180f},{-33.264153f, -49.681889f},{-22.716454f, -49.681530f},{-22.596651f, -59.278316f},{-18.229576f, -59.338959f},{-18.274920f, -49.866566f},{-8.358553f, -49.806484f},{-8.410365f, -39.771515f},{2.154401f, -39.859848f},{2.274107f, -44.014206f},{11.837919f, -43.865822f},{11.794569f, -39.835190f},{16.274645f, -39.648861f},{16.734129f, -19.699081f},{21.426973f, -19.577007f},{21.458563f, -15.080132f},{11.877460f, -15.121017f},{11.906350f, -5.096962f},{6.868548f, -5.122917f},{6.713150f, 4.113907f},{2.215148f, 4.033896f}
+};
+
+const Point polygonSecondLevel[] = {
+    {12.195593f, 4.260537f},{1.732248f, 4.486275f},{1.605743f, 7.818107f},{-11.123894f, 8.001146f},{-10.993432f, 20.290096f},{-0.542608f, 20.20587f},{-0.713717f, 29.559076f},{-12.631978f, 29.501474f},{-13.009111f, 21.811964f},{-17.388380f, 21.739685f},{-17.589445f, 5.879795f},{-7.972856f, 5.238356f},{-7.965707f, 0.072984f},{12.422435f, 0.125029f}
+};
+
+const Point doorVertices[] = {{-4.93, 32.13}, {-2.79, 32.56}, {-2.75, 42.54}, {-5.17, 42.39}};
+
+// uniform in the bounding box of the polygon grown by 10%
+inline std::vector<Point> randomPointsAround(const std::vector<Point> &polygon, int count, unsigned seed)
+{
+	float minX = polygon[0].x, maxX = minX, minY = polygon[0].y, maxY = minY;
+	for (const Point &p : polygon) {
+		minX = std::min(minX, p.x);
+		maxX = std::max(maxX, p.x);
+		minY = std::min(minY, p.y);
+		maxY = std::max(maxY, p.y);
+	}
+	float marginX = (maxX - minX) * 0.1f, marginY = (maxY - minY) * 0.1f;
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<float> x(minX - marginX, maxX + marginX);
+	std::uniform_real_distribution<float> y(minY - marginY, maxY + marginY);
+	std::vector<Point> points(count);
+	for (Point &p : points) {
+		p = {x(random), y(random)};
+	}
+	return points;
+}
+
+// the walkable floor of newcave.obj
+inline NavMeshConfig caveNavMeshConfig()
+{
+	NavMeshConfig config;
+	config.maxSlopeDegrees = 30.0f;
+	config.minHeight = -3.0f;
+	config.maxHeight = 9.0f;
+	return config;
+}
+
+// --generate-scene N: the scene of baseFile with N more blocks scattered
+// over the first level, for scaling tests. Returns the file it was
+// written to.
+inline std::string generateScene(const std::string &baseFile, int count)
+{
+	Scene S;
+	S.parse(Scene::readFile(baseFile), baseFile);
+	int block = (int) (std::find(S.meshNames.begin(), S.meshNames.end(), "block") - S.meshNames.begin());
+	if (block == (int) S.meshNames.size()) {
+		S.meshNames.push_back("block");
+		S.meshFiles.push_back("models/block.obj");
+	}
+
+	PolygonGrid firstLevelArea(polygonFirstLevel, sizeof(polygonFirstLevel) / sizeof(polygonFirstLevel[0]));
+	std::mt19937 random(count);
+	std::uniform_real_distribution<float> scale(0.1f, 0.4f), angle(0.0f, 360.0f);
+	int added = 0;
+	for (unsigned seed = 0; added < count; seed++) {
+		for (const Point &p : randomPointsAround(firstLevelArea.polygon(), count, seed)) {
+			if (added == count || !firstLevelArea.contains(p)) {
+				continue;
+			}
+			SceneEntity E;
+			E.name = "block" + std::to_string(added++);
+			E.mesh = block;
+			E.material = random() % S.materialNames.size();
+			E.scale = glm::vec3(scale(random));
+			E.position = glm::vec3(p.x, -1.94f, p.y);
+			E.rotation = glm::vec3(0.0f, angle(random), 0.0f);
+			E.region = "Generated";
+			S.entities.push_back(E);
+			if (added % 4 == 0) {
+				SceneLight torch;
+				torch.position = E.position + glm::vec3(0.0f, 1.5f, 0.0f);
+				torch.color = glm::vec3(0.964f, 0.603f, 0.329f);
+				torch.radius = 6.0f;
+				S.lights.push_back(torch);
+			}
+		}
+	}
+
+	std::string file = "scenes/generated_" + std::to_string(count) + ".json";
+	S.saveJson(file);
+	LOG_INFO("Generated %s with %zu entities and %zu lights", file.c_str(),
+			 S.entities.size(), S.lights.size());
+	return file;
+}
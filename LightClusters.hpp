@@ -0,0 +1,126 @@
+// Clustered forward lighting: the view frustum is cut into a grid of
+// CLUSTERS_X x CLUSTERS_Y screen tiles and CLUSTERS_Z depth slices
+// (exponentially spaced, so clusters are about as deep as they are wide),
+// and every cluster lists the point lights whose sphere of influence
+// touches it. A fragment then only shades the lights of its own cluster.
+//
+// shaders/clusters.comp builds the lists on the GPU, one invocation per
+// cluster, and shaders/clustered.frag reads them; the layouts below and
+// the constants must match theirs. binLights() is the same algorithm on
+// the CPU, for testing and for the clusters micro-benchmark.
+//
+// A cluster lists at most MAX_LIGHTS_PER_CLUSTER lights, the first ones:
+// those beyond do not light its fragments. Both count them, clusters.comp
+// into the overflow buffer that updateUniformBuffer() reports.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+const uint32_t CLUSTERS_X = 16;
+const uint32_t CLUSTERS_Y = 9;
+const uint32_t CLUSTERS_Z = 24;
+const uint32_t CLUSTER_COUNT = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+const uint32_t MAX_LIGHTS_PER_CLUSTER = 31;
+const uint32_t MAX_LIGHTS = 1024;
+
+// std430, in world space; no light reaches beyond the radius
+struct PointLight {
+	glm::vec4 positionRadius;
+	glm::vec4 colorIntensity;
+};
+
+// std430: the light indices of a cluster
+struct LightCluster {
+	uint32_t count;
+	uint32_t lights[MAX_LIGHTS_PER_CLUSTER];
+};
+
+// std430, binding 3 of the lights set: the lights left out of full
+// clusters, added up over the clusters; zeroed by the host once read
+struct ClusterOverflow {
+	uint32_t droppedLights;
+};
+
+// std140, binding 0 of the lights set
+struct ClusterUniforms {
+	alignas(16) glm::mat4 view;
+	alignas(16) glm::mat4 invProj;
+	alignas(16) glm::vec4 screenNearFar;	// width, height, near, far
+	alignas(16) uint32_t lightCount;
+};
+
+// view-space depth (positive) of the near side of slice z
+inline float clusterSliceDepth(uint32_t z, float nearPlane, float farPlane) {
+	return nearPlane * std::pow(farPlane / nearPlane, z / (float) CLUSTERS_Z);
+}
+
+// view-space bounding box of a cluster
+inline void clusterBounds(uint32_t x, uint32_t y, uint32_t z, const glm::mat4 &invProj,
+						  float nearPlane, float farPlane, glm::vec3 &minCorner, glm::vec3 &maxCorner) {
+	float depth0 = clusterSliceDepth(z, nearPlane, farPlane);
+	float depth1 = clusterSliceDepth(z + 1, nearPlane, farPlane);
+	minCorner = glm::vec3(1e30f);
+	maxCorner = glm::vec3(-1e30f);
+	for (uint32_t corner = 0; corner < 4; corner++) {
+		glm::vec2 ndc((x + (corner & 1)) / (float) CLUSTERS_X * 2.0f - 1.0f,
+					  (y + (corner >> 1)) / (float) CLUSTERS_Y * 2.0f - 1.0f);
+		glm::vec4 p = invProj * glm::vec4(ndc, 1.0f, 1.0f);
+		glm::vec3 ray = glm::vec3(p) / p.w;		// on some plane in front of the camera
+		for (float depth : {depth0, depth1}) {
+			glm::vec3 q = ray * (depth / -ray.z);
+			minCorner = glm::min(minCorner, q);
+			maxCorner = glm::max(maxCorner, q);
+		}
+	}
+}
+
+// clusters[CLUSTER_COUNT], indexed x + CLUSTERS_X * (y + CLUSTERS_Y * z);
+// returns how many lights were left out of full clusters, over all of them
+inline size_t binLights(const std::vector<PointLight> &lights, const glm::mat4 &view,
+						const glm::mat4 &invProj, float nearPlane, float farPlane,
+						std::vector<LightCluster> &clusters) {
+	size_t dropped = 0;
+	clusters.resize(CLUSTER_COUNT);
+	std::vector<glm::vec3> centers(lights.size());
+	for (size_t i = 0; i < lights.size(); i++) {
+		centers[i] = glm::vec3(view * glm::vec4(glm::vec3(lights[i].positionRadius), 1.0f));
+	}
+	for (uint32_t index = 0; index < CLUSTER_COUNT; index++) {
+		uint32_t x = index % CLUSTERS_X;
+		uint32_t y = index / CLUSTERS_X % CLUSTERS_Y;
+		uint32_t z = index / (CLUSTERS_X * CLUSTERS_Y);
+		glm::vec3 minCorner, maxCorner;
+		clusterBounds(x, y, z, invProj, nearPlane, farPlane, minCorner, maxCorner);
+		LightCluster &C = clusters[index];
+		C.count = 0;
+		for (size_t i = 0; i < lights.size(); i++) {
+			glm::vec3 d = glm::clamp(centers[i], minCorner, maxCorner) - centers[i];
+			float radius = lights[i].positionRadius.w;
+			if (glm::dot(d, d) > radius * radius) {
+				continue;
+			}
+			if (C.count < MAX_LIGHTS_PER_CLUSTER) {
+				C.lights[C.count++] = (uint32_t) i;
+			} else {
+				dropped++;
+			}
+		}
+	}
+	return dropped;
+}
+
+// the cluster of a fragment, from its window coordinates and view-space depth
+inline uint32_t clusterOf(glm::vec2 fragCoord, glm::vec2 screen, float depth,
+						  float nearPlane, float farPlane) {
+	uint32_t x = std::min((uint32_t) (fragCoord.x / screen.x * CLUSTERS_X), CLUSTERS_X - 1);
+	uint32_t y = std::min((uint32_t) (fragCoord.y / screen.y * CLUSTERS_Y), CLUSTERS_Y - 1);
+	float slice = std::log(std::max(depth, nearPlane) / nearPlane) / std::log(farPlane / nearPlane);
+	uint32_t z = std::min((uint32_t) (slice * CLUSTERS_Z), CLUSTERS_Z - 1);
+	return x + CLUSTERS_X * (y + CLUSTERS_Y * z);
+}
@@ -0,0 +1,257 @@
+// Asynchronous logging. LOG_INFO("fmt", ...) formats the message straight
+// into a ring buffer owned by the calling thread (a single producer, so
+// no lock and no allocation) and returns; a background thread drains all
+// the buffers in timestamp order to stdout and, optionally, a file.
+//
+// Levels below LOG_COMPILE_LEVEL are compiled out, arguments included;
+// the others are filtered at run time by Logger::get().setLevel().
+// LOG_EVERY_MS() rate-limits a message that would otherwise be printed
+// every frame. A full buffer drops messages rather than blocking.
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <algorithm>
+#include <vector>
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_WARN 3
+#define LOG_LEVEL_ERROR 4
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+struct LogMessage {
+	uint64_t time;		// ns since the logger started
+	int level;
+	char text[244];
+};
+
+// Written by its own thread only, read by the drain thread
+struct LogRing {
+	static const size_t CAPACITY = 1024;	// power of two
+
+	LogMessage slots[CAPACITY];
+	std::atomic<uint64_t> head{0};		// next slot to write
+	std::atomic<uint64_t> tail{0};		// next slot to read
+	std::atomic<uint64_t> dropped{0};
+};
+
+// Per call site state of LOG_EVERY_MS
+struct LogRateLimit {
+	std::atomic<uint64_t> next{0};
+	std::atomic<uint32_t> suppressed{0};
+
+	// true when the message can go out; skipped is how many were
+	// suppressed since the last one
+	bool allow(uint64_t now, uint64_t intervalNs, uint32_t &skipped) {
+		uint64_t due = next.load(std::memory_order_relaxed);
+		if (now < due ||
+				!next.compare_exchange_strong(due, now + intervalNs,
+											  std::memory_order_relaxed)) {
+			suppressed.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		skipped = suppressed.exchange(0, std::memory_order_relaxed);
+		return true;
+	}
+};
+
+class Logger {
+public:
+	static Logger &get() {
+		static Logger instance;
+		return instance;
+	}
+
+	bool enabled(int level) const {
+		return level >= minLevel.load(std::memory_order_relaxed);
+	}
+
+	void setLevel(int level) {
+		minLevel.store(level, std::memory_order_relaxed);
+	}
+
+	// "trace", "debug", "info", "warn" or "error"
+	static int parseLevel(const std::string &name) {
+		static const char *names[] = {"trace", "debug", "info", "warn", "error"};
+		for (int i = 0; i < 5; i++) {
+			if (name == names[i]) {
+				return i;
+			}
+		}
+		throw std::runtime_error("unknown log level " + name);
+	}
+
+	void setFile(const std::string &file) {
+		std::lock_guard<std::mutex> lock(outputMutex);
+		out.open(file);
+		if (!out) {
+			throw std::runtime_error("failed to open log file " + file + "!");
+		}
+	}
+
+	uint64_t now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	void log(int level, const char *format, ...) {
+		va_list args;
+		va_start(args, format);
+		vlog(level, 0, format, args);
+		va_end(args);
+	}
+
+	void logSuppressed(int level, uint32_t suppressed, const char *format, ...) {
+		va_list args;
+		va_start(args, format);
+		vlog(level, suppressed, format, args);
+		va_end(args);
+	}
+
+	// Writes out everything logged so far, from the calling thread
+	void flush() {
+		drain();
+	}
+
+	~Logger() {
+		running = false;
+		if (drainThread.joinable()) {
+			drainThread.join();
+		}
+		drain();
+	}
+
+private:
+	std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+	std::atomic<int> minLevel{LOG_LEVEL_INFO};
+	std::atomic<bool> running{true};
+	std::mutex ringsMutex;
+	std::vector<std::unique_ptr<LogRing>> rings;
+	std::mutex outputMutex;
+	std::ofstream out;
+	std::vector<LogMessage> pending;
+	std::thread drainThread;
+
+	Logger() {
+		drainThread = std::thread([this]() {
+			while (running) {
+				if (drain() == 0) {
+					std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				}
+			}
+		});
+	}
+
+	LogRing *threadRing() {
+		thread_local LogRing *ring = nullptr;
+		if (ring == nullptr) {
+			std::lock_guard<std::mutex> lock(ringsMutex);
+			rings.push_back(std::make_unique<LogRing>());
+			ring = rings.back().get();
+		}
+		return ring;
+	}
+
+	void vlog(int level, uint32_t suppressed, const char *format, va_list args) {
+		LogRing *R = threadRing();
+		uint64_t head = R->head.load(std::memory_order_relaxed);
+		if (head - R->tail.load(std::memory_order_acquire) >= LogRing::CAPACITY) {
+			R->dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		LogMessage &M = R->slots[head & (LogRing::CAPACITY - 1)];
+		M.time = now();
+		M.level = level;
+		int n = vsnprintf(M.text, sizeof(M.text), format, args);
+		if (suppressed > 0 && n >= 0 && (size_t) n < sizeof(M.text)) {
+			snprintf(M.text + n, sizeof(M.text) - n, " (%u similar suppressed)", suppressed);
+		}
+		R->head.store(head + 1, std::memory_order_release);
+	}
+
+	// Returns the number of messages written
+	size_t drain() {
+		std::lock_guard<std::mutex> lock(outputMutex);
+		pending.clear();
+		uint64_t dropped = 0;
+		{
+			std::lock_guard<std::mutex> ringsLock(ringsMutex);
+			for (auto &R : rings) {
+				uint64_t tail = R->tail.load(std::memory_order_relaxed);
+				uint64_t head = R->head.load(std::memory_order_acquire);
+				for (; tail < head; tail++) {
+					pending.push_back(R->slots[tail & (LogRing::CAPACITY - 1)]);
+				}
+				R->tail.store(tail, std::memory_order_release);
+				dropped += R->dropped.exchange(0, std::memory_order_relaxed);
+			}
+		}
+		if (pending.empty() && dropped == 0) {
+			return 0;
+		}
+
+		std::stable_sort(pending.begin(), pending.end(),
+			[](const LogMessage &a, const LogMessage &b) { return a.time < b.time; });
+		static const char *labels[] = {"TRACE", "DEBUG", "INFO ", "WARN ", "ERROR"};
+		char prefix[32];
+		for (const LogMessage &M : pending) {
+			snprintf(prefix, sizeof(prefix), "[%10.3f] %s ", M.time * 1e-9,
+					 labels[std::min(std::max(M.level, 0), 4)]);
+			std::cout << prefix << M.text << "\n";
+			if (out.is_open()) {
+				out << prefix << M.text << "\n";
+			}
+		}
+		if (dropped > 0) {
+			std::cout << "[logger] " << dropped << " messages dropped, buffer full\n";
+		}
+		std::cout.flush();
+		if (out.is_open()) {
+			out.flush();
+		}
+		return pending.size() + dropped;
+	}
+};
+
+#define LOG_AT(level, ...) \
+	do { \
+		if ((level) >= LOG_COMPILE_LEVEL && Logger::get().enabled(level)) { \
+			Logger::get().log(level, __VA_ARGS__); \
+		} \
+	} while (0)
+
+// At most one message every ms milliseconds from this call site
+#define LOG_EVERY_MS(level, ms, ...) \
+	do { \
+		if ((level) >= LOG_COMPILE_LEVEL && Logger::get().enabled(level)) { \
+			static LogRateLimit logRateLimit_; \
+			uint32_t logSuppressed_; \
+			if (logRateLimit_.allow(Logger::get().now(), (ms) * 1000000ull, \
+									logSuppressed_)) { \
+				Logger::get().logSuppressed(level, logSuppressed_, __VA_ARGS__); \
+			} \
+		} \
+	} while (0)
+
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
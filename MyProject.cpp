@@ -1,6 +1,7 @@
 // This has been adapted from the Vulkan tutorial
 
 #include "MyProject.hpp"
+#include "Level.hpp"
 
 const std::string MODEL_PATH = "models/";
 const std::string TEXTURE_PATH = "textures/";
@@ -24,8 +25,20 @@ struct globalUniformBufferObject
 struct UniformBufferObject
 {
 	alignas(16) glm::mat4 model;
-    alignas(16) int isFlowingColor;
+    alignas(16) int isFlowingColor;		// unused, keeps the offsets of the compiled shaders
     alignas(16) glm::vec3 highlightColor;
+    alignas(16) glm::vec3 materialColor;
+};
+
+// What a variant of the lighting shaders computes, one specialization
+// constant each (constant_id the bit index): an entity is drawn with the
+// variant of the features its material and its role need.
+enum ShaderFeature : uint32_t {
+	FEATURE_TEXTURE = 1,
+	FEATURE_LIGHTING = 2,
+	FEATURE_SPECULAR = 4,
+	FEATURE_HIGHLIGHT = 8,
+	FEATURE_COUNT = 4
 };
 
 // MAIN !
@@ -41,6 +54,51 @@ protected:
     int colorSelectorToUnlock = 0;
     int colorSelFreezed = -1;
     bool doorUnlocked = false;
+    
+    // platform and door animations, owned by the simulation step
+    float animationDuration = 2; // seconds of animation
+    Timeline timeline;
+    uint32_t platformTrack;
+    uint32_t doorTrack;
+    glm::vec3 handlePos;
+    glm::vec3 doorPos;
+    int selColor = 0;
+    int blockColorFlowing = 1;
+    
+    // collision, preprocessed once from the walkable area tables
+    PolygonGrid firstLevelArea;
+    PolygonGrid secondLevelArea;
+    PolygonGrid platformArea[2];
+    PolygonGrid doorArea;
+    
+    // floor of the cave, extracted from its mesh; with --navmesh-collision
+    // it replaces the two level polygons
+    NavMesh navMesh;
+    bool navMeshCollision = false;
+    
+    // every triangle of the cave; with --bvh-collision the camera slides
+    // along the walls and needs floor under it
+    TriangleBvh levelBvh;
+    bool bvhCollision = false;
+    
+    // What the rendering needs from the simulation. Each step publishes
+    // its state with the previous one, so that frames can interpolate.
+    struct SimulationState {
+        glm::vec3 RobotPos;
+        float lookYaw, lookPitch, lookRoll;
+        glm::vec3 handlePos;
+        glm::vec3 doorPos;
+        int selColor;
+        int colorSelFreezed;
+        bool doorUnlocked;
+        int blockColorFlowing;
+    };
+    struct SimulationSnapshot {
+        SimulationState prev, curr;
+        double time = 0.0;    // of curr
+    };
+    TripleBuffer<SimulationSnapshot> snapshots;
+    SimulationState publishedState;
 
 	// Descriptor Layouts [what will be passed to the shaders]
 	// which variable will be passed in a shader of which type and defines the bindings
@@ -48,34 +106,60 @@ protected:
 	DescriptorSetLayout DSLobj;
 
 	// Pipelines [Shader couples]
-	Pipeline P1;
+	// P_lit holds a variant of the lighting shaders per combination of
+	// features some entity uses, and sceneLayout is the layout they share
+	std::map<uint32_t, Pipeline> P_lit;
+	VkPipelineLayout sceneLayout;
+	std::vector<uint32_t> entityFeatures;
 
-	// Models, textures and Descriptors (values assigned to the uniforms)
-    // (CAVE)
-	Model M_Cave;
-	Texture T_Cave;
-    DescriptorSet DS_Cave; // instances of DSLobj, are elments that are passed to shaders
-    
-    // for each model (PLATFORM)
-	Model M_Platform;
-	Texture T_Platform;
-	DescriptorSet DS_Platform1; // instances of DSLobj
-    DescriptorSet DS_Platform2; // instances of DSLobj
-    // ---------
-    
-    Model M_Door;
-    Texture T_Door;
-    DescriptorSet DS_Door; // instances of DSLobj
-    
-    Model M_IntBlock;
-    Texture T_IntBlock;
-    DescriptorSet DS_IntBlock; // instances of DSLobj
-    
-    Model M_Hint;
-    Texture T_Hint;
-    DescriptorSet DS_Hint; // instances of DSLobj
-    
-    
+	// The level: models, textures and one descriptor set per entity, from
+	// scenes/cave.json or the file given with --scene
+	std::string sceneFile = "scenes/cave.json";
+	int generateSceneEntities = 0;
+	Scene scene;
+	std::vector<Model> sceneMeshes;
+	std::vector<Texture> sceneTextures;		// those of the color-only materials unused
+	Texture whiteTexture;					// bound in their place
+	std::vector<DescriptorSet> entitySets;
+	std::vector<glm::vec3 SimulationState::*> entityTracks;	// nullptr when still
+
+	// Clustered lighting: the torch and the lights of the scene, binned
+	// into clusters by P_clusters every frame. Off with --single-light,
+	// or when its shaders have not been compiled.
+	bool clusteredLighting = true;
+	DescriptorSetLayout DSLlights;
+	DescriptorSet DS_lights;
+	ComputePipeline P_clusters;
+	std::vector<PointLight> pointLights;	// the torch first
+	uint32_t droppedLightsReported = 0;		// the most left out of full clusters in a frame
+
+	// Shadows of the torch and of the lights nearest to the camera, cached
+	// in the atlas: P_shadow renders the faces it picks, in the frame
+	// commands. Off with --no-shadows, or when shadow.vert is not compiled.
+	bool shadows = true;
+	ShadowAtlas shadowAtlas;
+	DepthTarget shadowTarget;
+	DescriptorSetLayout DSLshadow;
+	DescriptorSet DS_shadow;
+	Pipeline P_shadow;
+	std::vector<glm::vec4> entityBounds;	// bounding spheres, center and radius
+	std::vector<glm::vec4> meshBounds;		// of the models, before the entity transforms
+
+	// Depth pre-pass: P_depth lays down the depth of the level from the
+	// positions alone, then P_litEqual shades only the fragments that match
+	// it, once per pixel. The overdraw view draws with P_overdraw instead,
+	// adding up the fragments shaded, and fragmentCounter reports them.
+	// --depth-prepass and --overdraw, P and O to switch; neither without
+	// depth.vert and overdraw.frag compiled.
+	bool depthPrePass = false;
+	bool overdrawView = false;
+	bool prePassShaders = false;
+	Pipeline P_depth;
+	std::map<uint32_t, Pipeline> P_litEqual;
+	Pipeline P_overdraw;
+	Pipeline P_overdrawEqual;
+	bool prePassKeyDown = false;
+	bool overdrawKeyDown = false;
     
     DescriptorSet DS_global;
 
@@ -88,15 +172,211 @@ protected:
 		windowTitle = "My Project";
 		initialBackgroundColor = {0.0f, 0.0f, 0.0f, 1.0f};
 
-		// Descriptor pool sizes
-		uniformBlocksInPool = 7; // how many descriptor set you're going to use
-		texturesInPool = 6;
-		setsInPool = 7; //handle, body, global for now + 3 wheels
+		// keys read in updateUniformBuffer: only these are recorded and replayed
+		inputKeys = {GLFW_KEY_LEFT, GLFW_KEY_RIGHT, GLFW_KEY_UP, GLFW_KEY_DOWN,
+					 GLFW_KEY_Q, GLFW_KEY_E, GLFW_KEY_A, GLFW_KEY_D,
+					 GLFW_KEY_W, GLFW_KEY_S, GLFW_KEY_F, GLFW_KEY_G,
+					 GLFW_KEY_SPACE, GLFW_KEY_P, GLFW_KEY_O};
+	}
+	
+	bool parseOption(int argc, char **argv, int &i)
+	{
+		if (std::string(argv[i]) == "--navmesh-collision") {
+			navMeshCollision = true;
+			return true;
+		}
+		if (std::string(argv[i]) == "--bvh-collision") {
+			bvhCollision = true;
+			return true;
+		}
+		if (std::string(argv[i]) == "--single-light") {
+			clusteredLighting = false;
+			return true;
+		}
+		if (std::string(argv[i]) == "--no-shadows") {
+			shadows = false;
+			return true;
+		}
+		if (std::string(argv[i]) == "--depth-prepass") {
+			depthPrePass = true;
+			return true;
+		}
+		if (std::string(argv[i]) == "--overdraw") {
+			overdrawView = true;
+			return true;
+		}
+		if (std::string(argv[i]) == "--scene" || std::string(argv[i]) == "--generate-scene") {
+			if (i + 1 >= argc) {
+				throw std::runtime_error(std::string("missing value for ") + argv[i]);
+			}
+			if (std::string(argv[i]) == "--scene") {
+				sceneFile = argv[++i];
+			} else {
+				generateSceneEntities = std::max(0, std::stoi(argv[++i]));
+			}
+			return true;
+		}
+		return false;
+	}
+	
+	// their SPIR-V is compiled by hand, see the top of the shaders
+	bool clusteredShadersBuilt()
+	{
+		for (const char *file : {"shaders/clusters_comp.spv", "shaders/clustered_frag.spv"}) {
+			if (!std::ifstream(file)) {
+				LOG_WARN("%s is missing: only the torch lights the level", file);
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	bool shadowShaderBuilt()
+	{
+		if (!std::ifstream("shaders/shadow_vert.spv")) {
+			LOG_WARN("shaders/shadow_vert.spv is missing: lights cast no shadows");
+			return false;
+		}
+		return true;
+	}
+	
+	// the features an entity is drawn with: those of its material, and the
+	// highlight for the entities that show the color of the lock
+	uint32_t shaderFeatures(const SceneEntity &E) const
+	{
+		const SceneMaterial &M = scene.materials[E.material];
+		uint32_t features = 0;
+		if (!scene.textureFiles[E.material].empty()) {
+			features |= FEATURE_TEXTURE;
+		}
+		if (M.lit) {
+			features |= FEATURE_LIGHTING;
+			if (M.specular) {
+				features |= FEATURE_SPECULAR;
+			}
+		}
+		if (E.highlight) {
+			features |= FEATURE_HIGHLIGHT;
+		}
+		return features;
+	}
+
+	// the specialization constants of a variant, a VkBool32 per feature
+	static std::vector<uint32_t> featureConstants(uint32_t features)
+	{
+		std::vector<uint32_t> constants(FEATURE_COUNT);
+		for (uint32_t i = 0; i < FEATURE_COUNT; i++) {
+			constants[i] = (features >> i) & 1;
+		}
+		return constants;
+	}
+
+	bool prePassShadersBuilt()
+	{
+		for (const char *file : {"shaders/depth_vert.spv", "shaders/overdraw_frag.spv"}) {
+			if (!std::ifstream(file)) {
+				LOG_WARN("%s is missing: no depth pre-pass nor overdraw view", file);
+				return false;
+			}
+		}
+		return true;
+	}
+	
+	// of every entity, where it rests; updateUniformBuffer() moves those
+	// of the animated ones
+	void buildEntityBounds()
+	{
+		meshBounds.clear();
+		for (const Model &M : sceneMeshes) {
+			glm::vec3 lo(1e30f), hi(-1e30f);
+			for (const Vertex &V : M.vertices) {
+				lo = glm::min(lo, V.pos);
+				hi = glm::max(hi, V.pos);
+			}
+			glm::vec3 center = M.vertices.empty() ? glm::vec3(0.0f) : (lo + hi) * 0.5f;
+			float radius = 0.0f;
+			for (const Vertex &V : M.vertices) {
+				radius = std::max(radius, glm::distance(center, V.pos));
+			}
+			meshBounds.push_back(glm::vec4(center, radius));
+		}
+		entityBounds.resize(scene.entities.size());
+		for (size_t i = 0; i < entityBounds.size(); i++) {
+			entityBounds[i] = entityBound(i, glm::vec3(0.0f));
+		}
+	}
+	
+	glm::vec4 entityBound(size_t i, glm::vec3 offset)
+	{
+		const SceneEntity &E = scene.entities[i];
+		glm::vec4 meshBound = meshBounds[E.mesh];
+		glm::vec3 center = glm::vec3(E.transform(offset) * glm::vec4(glm::vec3(meshBound), 1.0f));
+		float scale = std::max(std::abs(E.scale.x), std::max(std::abs(E.scale.y), std::abs(E.scale.z)));
+		return glm::vec4(center, meshBound.w * scale);
+	}
+	
+	// the torch, which updateUniformBuffer() moves with the camera, then
+	// the lights of the scene
+	void buildPointLights()
+	{
+		pointLights.clear();
+		pointLights.push_back({glm::vec4(0.0f, 0.0f, 0.0f, 40.0f),
+							   glm::vec4(0.964f, 0.603f, 0.329f, 1.0f)});
+		for (const SceneLight &L : scene.lights) {
+			pointLights.push_back({glm::vec4(L.position, L.radius), glm::vec4(L.color, L.intensity)});
+		}
+		if (pointLights.size() > MAX_LIGHTS) {
+			LOG_WARN("%zu lights, only the first %u are drawn", pointLights.size(), MAX_LIGHTS);
+			pointLights.resize(MAX_LIGHTS);
+		}
+	}
+	
+	void loadScene()
+	{
+		PROFILE_ZONE("loadScene");
+		if (generateSceneEntities > 0) {
+			sceneFile = generateScene(sceneFile, generateSceneEntities);
+		}
+		std::string name = sceneFile.substr(sceneFile.find_last_of("/\\") + 1);
+		name = name.substr(0, name.find('.'));
+		bool cached = scene.loadOrCompile(sceneFile, "scene_" + name + ".bin");
+		LOG_INFO("Scene %s %s: %zu meshes, %zu materials, %zu entities", sceneFile.c_str(),
+				 cached ? "loaded from cache" : "compiled", scene.meshFiles.size(),
+				 scene.materialNames.size(), scene.entities.size());
+	}
+	
+	// what moves an entity, by the name of its track in the scene
+	glm::vec3 SimulationState::*trackOffset(const SceneEntity &E)
+	{
+		if (E.track.empty()) {
+			return nullptr;
+		} else if (E.track == "platform") {
+			return &SimulationState::handlePos;
+		} else if (E.track == "door") {
+			return &SimulationState::doorPos;
+		}
+		throw std::runtime_error("entity " + E.name + " has an unknown track " + E.track);
+	}
+	
+	// what --replay-input compares with the recording
+	uint64_t hashSimulationState()
+	{
+		// glm vectors may be padded: hash the components only
+		uint64_t hash = hashBytes(&RobotPos[0], 3 * sizeof(float));
+		hash = hashBytes(&lookYaw, sizeof(lookYaw), hash);
+		hash = hashBytes(&lookPitch, sizeof(lookPitch), hash);
+		hash = hashBytes(&lookRoll, sizeof(lookRoll), hash);
+		hash = hashBytes(&colorSelFreezed, sizeof(colorSelFreezed), hash);
+		hash = hashBytes(&doorUnlocked, sizeof(doorUnlocked), hash);
+		return hash;
 	}
 
 	// Here you load and setup all your Vulkan objects
 	void localInit()
 	{
+		loadScene();
+		clusteredLighting = clusteredLighting && clusteredShadersBuilt();
+
 		// Descriptor Layouts [what will be passed to the shaders]
 		DSLobj.init(this, {// this array contains the binding:
 							  // first  element : the binding number
@@ -109,331 +389,540 @@ protected:
         // the gblobal does not have textures, this is why we deleted the second element
 		DSLglobal.init(this, {{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS}});
 
+		// the clusters are built by the compute shader and read by the fragment one
+		if (clusteredLighting) {
+			VkShaderStageFlags stages = VK_SHADER_STAGE_COMPUTE_BIT | VK_SHADER_STAGE_FRAGMENT_BIT;
+			DSLlights.init(this, {{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, stages},
+								  {1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, stages},
+								  {2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, stages},
+								  {3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT}});
+		}
+
+		// the shadow atlas is sampled by the lighting shaders, even when
+		// nothing is rendered into it; shadow.vert only reads binding 0
+		DSLshadow.init(this, {{0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+							   VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT},
+							  {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}});
+		shadowTarget.init(this, SHADOW_ATLAS_SIZE, SHADOW_ATLAS_SIZE);
+		shadows = shadows && shadowShaderBuilt();
+
 		// Pipelines [Shader couples]
 		// The last array, is a vector of pointer to the layouts of the sets that will
 		// be used in this pipeline. The first element will be set 0, and so on..
-		P1.init(this, "shaders/vert.spv", "shaders/frag.spv", {&DSLglobal, &DSLobj}); //the first changes less freq while the last more frequently.
-
-		// Models, textures and Descriptors (values assigned to the uniforms)
-		M_Cave.init(this, MODEL_PATH + "newcave.obj");
-		T_Cave.init(this, TEXTURE_PATH + "block.png");
-		DS_Cave.init(this, &DSLobj, {// the second parameter, is a pointer to the Uniform Set Layout of this set
-										  // the last parameter is an array, with one element per binding of the set.
-										  // first  elmenet : the binding number
-										  // second element : UNIFORM or TEXTURE (an enum) depending on the type
-										  // third  element : only for UNIFORMs, the size of the corresponding C++ object
-										  // fourth element : only for TEXTUREs, the pointer to the corresponding texture object
-										  {0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-										  {1, TEXTURE, 0, &T_Cave}});
-        // (HANDLE) for each model
-		M_Platform.init(this, MODEL_PATH + "block.obj");
-		T_Platform.init(this, TEXTURE_PATH + "redBrick.png");
-		DS_Platform1.init(this, &DSLobj, {// it uses same layout but we set a different instance of it
-											{0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-											{1, TEXTURE, 0, &T_Platform}});
-        DS_Platform2.init(this, &DSLobj, {// it uses same layout but we set a different instance of it
-                                            {0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-                                            {1, TEXTURE, 0, &T_Platform}});
+		// request() only registers the pipeline: all of them are compiled together,
+		// in parallel, right after localInit() returns.
+		PipelineDescription litDesc;
+		litDesc.vertShader = "shaders/vert.spv";
+		if (clusteredLighting) {
+			litDesc.fragShader = "shaders/clustered_frag.spv";
+			litDesc.setLayouts = {&DSLglobal, &DSLobj, &DSLlights, &DSLshadow};
+			P_clusters.init(this, "shaders/clusters_comp.spv", {&DSLlights});
+		} else {
+			litDesc.fragShader = "shaders/frag.spv";
+			litDesc.setLayouts = {&DSLglobal, &DSLobj, &DSLshadow}; //the first changes less freq while the last more frequently.
+		}
+		entityFeatures.resize(scene.entities.size());
+		for (size_t i = 0; i < entityFeatures.size(); i++) {
+			entityFeatures[i] = shaderFeatures(scene.entities[i]);
+			if (!P_lit.count(entityFeatures[i])) {
+				PipelineDescription variantDesc = litDesc;
+				variantDesc.specialization = featureConstants(entityFeatures[i]);
+				P_lit[entityFeatures[i]].request(this, variantDesc);
+			}
+		}
+		sceneLayout = pipelineRegistry.getPipelineLayout(litDesc.setLayouts);
+		prePassShaders = prePassShadersBuilt();
+		depthPrePass = depthPrePass && prePassShaders;
+		overdrawView = overdrawView && prePassShaders;
+		if (prePassShaders) {
+			// all with the layout of P_lit, so that the sets it binds stay bound
+			PipelineDescription depthDesc;
+			depthDesc.vertShader = "shaders/depth_vert.spv";
+			depthDesc.setLayouts = litDesc.setLayouts;
+			depthDesc.positionOnly = true;
+			depthDesc.colorWrite = false;
+			P_depth.request(this, depthDesc);
+			
+			for (auto &V : P_lit) {
+				PipelineDescription equalDesc = litDesc;
+				equalDesc.specialization = featureConstants(V.first);
+				equalDesc.depthCompareOp = VK_COMPARE_OP_EQUAL;
+				equalDesc.depthWrite = false;
+				P_litEqual[V.first].request(this, equalDesc);
+			}
+			
+			PipelineDescription overdrawDesc = litDesc;
+			overdrawDesc.fragShader = "shaders/overdraw_frag.spv";
+			overdrawDesc.blendEnable = true;
+			overdrawDesc.srcBlendFactor = VK_BLEND_FACTOR_ONE;
+			overdrawDesc.dstBlendFactor = VK_BLEND_FACTOR_ONE;
+			P_overdraw.request(this, overdrawDesc);
+			overdrawDesc.depthCompareOp = VK_COMPARE_OP_EQUAL;
+			overdrawDesc.depthWrite = false;
+			P_overdrawEqual.request(this, overdrawDesc);
+		}
+		if (shadows) {
+			PipelineDescription shadowDesc;
+			shadowDesc.vertShader = "shaders/shadow_vert.spv";
+			shadowDesc.setLayouts = {&DSLshadow, &DSLobj};
+			shadowDesc.positionOnly = true;
+			shadowDesc.cullMode = VK_CULL_MODE_NONE;	// the cave is seen from inside
+			shadowDesc.renderPass = shadowTarget.renderPass;
+			shadowDesc.colorAttachments = 0;
+			P_shadow.request(this, shadowDesc);
+		}
+
+		// Models, textures and Descriptors (values assigned to the uniforms):
+		// each entity has its own set, with its transform and its material
+		sceneMeshes.resize(scene.meshFiles.size());
+		for (size_t i = 0; i < sceneMeshes.size(); i++) {
+			sceneMeshes[i].init(this, scene.meshFiles[i]);
+		}
+		sceneTextures.resize(scene.textureFiles.size());
+		for (size_t i = 0; i < sceneTextures.size(); i++) {
+			if (!scene.textureFiles[i].empty()) {
+				sceneTextures[i].init(this, scene.textureFiles[i]);
+			}
+		}
+		const stbi_uc white[4] = {255, 255, 255, 255};
+		whiteTexture.BP = this;
+		whiteTexture.createTextureImage(white, 1, 1);
+		whiteTexture.createTextureImageView();
+		whiteTexture.createTextureSampler();
+		entitySets.resize(scene.entities.size());
+		entityTracks.resize(scene.entities.size());
+		for (size_t i = 0; i < entitySets.size(); i++) {
+			const SceneEntity &E = scene.entities[i];
+			entitySets[i].init(this, &DSLobj, {// the second parameter, is a pointer to the Uniform Set Layout of this set
+											   // the last parameter is an array, with one element per binding of the set.
+											   // first  elmenet : the binding number
+											   // second element : UNIFORM or TEXTURE (an enum) depending on the type
+											   // third  element : only for UNIFORMs, the size of the corresponding C++ object
+											   // fourth element : only for TEXTUREs, the pointer to the corresponding texture object
+											   {0, UNIFORM, sizeof(UniformBufferObject), nullptr},
+											   {1, TEXTURE, 0, scene.textureFiles[E.material].empty() ?
+													&whiteTexture : &sceneTextures[E.material]}});
+			entityTracks[i] = trackOffset(E);
+		}
         
+        // add a new init for the global DS
+        DS_global.init(this, &DSLglobal, {{0, UNIFORM, sizeof(globalUniformBufferObject), nullptr}});
         // ---------------
         
-        M_IntBlock.init(this, MODEL_PATH + "block.obj");
-        T_IntBlock.init(this, TEXTURE_PATH + "block.png");
-        DS_IntBlock.init(this, &DSLobj, {// it uses same layout but we set a different instance of it
-                                            {0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-                                            {1, TEXTURE, 0, &T_IntBlock}});
-        
-        M_Door.init(this, MODEL_PATH + "door.obj");
-        T_Door.init(this, TEXTURE_PATH + "block.png");
-        DS_Door.init(this, &DSLobj, {// it uses same layout but we set a different instance of it
-                                            {0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-                                            {1, TEXTURE, 0, &T_Door}});
-        
-        M_Hint.init(this, MODEL_PATH + "hint.obj");
-        T_Hint.init(this, TEXTURE_PATH + "hint.png");
-        DS_Hint.init(this, &DSLobj, {// it uses same layout but we set a different instance of it
-                                            {0, UNIFORM, sizeof(UniformBufferObject), nullptr},
-                                            {1, TEXTURE, 0, &T_Hint}});
+        DS_shadow.init(this, &DSLshadow, {{0, UNIFORM, sizeof(ShadowUniforms), nullptr},
+        								  {1, TEXTURE, 0, &shadowTarget.texture}});
+        if (clusteredLighting) {
+        	DS_lights.init(this, &DSLlights, {{0, UNIFORM, sizeof(ClusterUniforms), nullptr},
+        									  {1, STORAGE, MAX_LIGHTS * sizeof(PointLight), nullptr},
+        									  {2, STORAGE, CLUSTER_COUNT * sizeof(LightCluster), nullptr},
+        									  {3, STORAGE, sizeof(ClusterOverflow), nullptr}});
+        }
+        buildPointLights();
+        buildEntityBounds();
         
+        buildWalkableAreas();
+        buildNavMesh();
+        buildLevelBvh();
+        buildAnimations();
         
-        // add a new init for the global DS
-        DS_global.init(this, &DSLglobal, {{0, UNIFORM, sizeof(globalUniformBufferObject), nullptr}});
-        // ---------------
+        // the first frames render the initial state
+        publishedState = captureState();
+        publishSnapshot(0.0);
 	}
 
+	void buildWalkableAreas()
+	{
+		firstLevelArea.build(polygonFirstLevel, sizeof(polygonFirstLevel)/sizeof(polygonFirstLevel[0]));
+		secondLevelArea.build(polygonSecondLevel, sizeof(polygonSecondLevel)/sizeof(polygonSecondLevel[0]));
+		for (int i = 0; i < 2; i++) {
+			VerticesOfPlatform plat = getVerticesOfPlatform(i);
+			Point platform[] = {{plat.v1[0], plat.v1[1]}, {plat.v2[0], plat.v2[1]}, {plat.v3[0], plat.v3[1]}, {plat.v4[0], plat.v4[1]}};
+			platformArea[i].build(platform, 4);
+		}
+		doorArea.build(doorVertices, sizeof(doorVertices)/sizeof(doorVertices[0]));
+	}
+	
+	// the platforms rise to the second level and back with SPACE, the door
+	// sinks into the floor once unlocked
+	void buildAnimations()
+	{
+		platformTrack = timeline.addTrack({{0.0f, glm::vec3(0.0f, -1.90f, 0.1f)},
+										   {animationDuration, glm::vec3(0.0f, 8.0f, 0.1f)}});
+		doorTrack = timeline.addTrack({{0.0f, glm::vec3(0.0f, 0.0f, 0.0f)},
+									   {animationDuration, glm::vec3(0.0f, -8.0f, 0.0f)}});
+		handlePos = timeline.value(platformTrack);
+		doorPos = timeline.value(doorTrack);
+	}
+	
+	void buildNavMesh()
+	{
+		PROFILE_ZONE("buildNavMesh");
+		// cached between runs
+		bool cached = navMesh.loadOrBuild(MODEL_PATH + "newcave.obj", "navmesh_newcave.bin",
+										  caveNavMeshConfig());
+		LOG_INFO("Navigation mesh %s: %zu triangles, %u regions, %zu boundary edges",
+				 cached ? "loaded from cache" : "built", navMesh.triangles.size(),
+				 navMesh.regionCount, navMesh.boundaryEdgeCount());
+	}
+	
+	void buildLevelBvh()
+	{
+		PROFILE_ZONE("buildLevelBvh");
+		std::vector<glm::vec3> positions;
+		std::vector<uint32_t> indices;
+		NavMesh::loadObj(MODEL_PATH + "newcave.obj", positions, indices);
+		levelBvh.build(positions, indices);
+		LOG_INFO("Level BVH: %zu triangles, %zu nodes, depth %d", levelBvh.triangleCount(),
+				 levelBvh.nodeCount(), levelBvh.treeDepth());
+	}
+	
+	// --bvh-collision: where the camera ends up trying to move from oldPos
+	// to newPos. It keeps oldPos if there is no floor under the new one.
+	glm::vec3 moveCamera(glm::vec3 oldPos, glm::vec3 newPos)
+	{
+		glm::vec3 bottom(0.0f, STEP_HEIGHT + CAPSULE_RADIUS - EYE_HEIGHT, 0.0f);
+		glm::vec3 moved = levelBvh.moveAndSlide(oldPos, bottom, glm::vec3(0.0f), CAPSULE_RADIUS,
+												newPos - oldPos);
+		float ground;
+		if (!levelBvh.groundHeight(moved, EYE_HEIGHT + STEP_HEIGHT, ground)) {
+			return oldPos;
+		}
+		return moved;
+	}
+	
+	// Can the camera move from oldPos to RobotPos on this level? With the
+	// navigation mesh the floor under the new position must be far enough
+	// from the walls and connected to the floor under the old one, so that
+	// the camera cannot step onto the top of a wall.
+	bool canMoveOn(const PolygonGrid &area, glm::vec3 oldPos)
+	{
+		if (!navMeshCollision) {
+			return area.contains({RobotPos[0], RobotPos[2]});
+		}
+		float floorY = RobotPos[1] - EYE_HEIGHT;
+		int to = navMesh.locate(RobotPos[0], RobotPos[2], floorY, 1.5f);
+		if (to < 0 || navMesh.boundaryDistance(RobotPos[0], RobotPos[2], navMesh.regionOf(to),
+											   NAVMESH_RADIUS) < NAVMESH_RADIUS) {
+			return false;
+		}
+		int from = navMesh.locate(oldPos[0], oldPos[2], oldPos[1] - EYE_HEIGHT, 1.5f);
+		return from < 0 || navMesh.connected(from, to);
+	}
+	
 	// Here you destroy all the objects you created!
 	void localCleanup()
 	{
-		// model 1 cleanup
-		DS_Cave.cleanup();
-		T_Cave.cleanup();
-		M_Cave.cleanup();
-		// model 2 cleanup
-		DS_Platform1.cleanup();
-        DS_Platform2.cleanup();
-		T_Platform.cleanup();
-		M_Platform.cleanup();
-        // interactive block cleanup
-        DS_IntBlock.cleanup();
-        T_IntBlock.cleanup();
-        M_IntBlock.cleanup();
-        // door cleanup
-        DS_Door.cleanup();
-        T_Door.cleanup();
-        M_Door.cleanup();
-        // hint cleanup
-        DS_Hint.cleanup();
-        T_Hint.cleanup();
-        M_Hint.cleanup();
+		for (DescriptorSet &DS : entitySets) {
+			DS.cleanup();
+		}
+		for (size_t i = 0; i < sceneTextures.size(); i++) {
+			if (!scene.textureFiles[i].empty()) {
+				sceneTextures[i].cleanup();
+			}
+		}
+		whiteTexture.cleanup();
+		for (Model &M : sceneMeshes) {
+			M.cleanup();
+		}
         
         DS_global.cleanup();
+        DS_shadow.cleanup();
+        if (shadows) {
+        	P_shadow.cleanup();
+        }
+        shadowTarget.cleanup();
+        DSLshadow.cleanup();
+        if (clusteredLighting) {
+        	DS_lights.cleanup();
+        	P_clusters.cleanup();
+        	DSLlights.cleanup();
+        }
 
-		P1.cleanup();
+		if (prePassShaders) {
+			P_depth.cleanup();
+			for (auto &V : P_litEqual) {
+				V.second.cleanup();
+			}
+			P_overdraw.cleanup();
+			P_overdrawEqual.cleanup();
+		}
+		for (auto &V : P_lit) {
+			V.second.cleanup();
+		}
 		DSLglobal.cleanup();
         DSLobj.cleanup();
 	}
 
+	// the shadow faces updateUniformBuffer() picked for this frame, drawn
+	// with what reaches into them
+	bool populateFrameCommands(VkCommandBuffer commandBuffer, int currentImage)
+	{
+		const std::vector<ShadowFace> &faces = shadowAtlas.faces();
+		if (faces.empty()) {
+			return false;
+		}
+		// recorded every frame, so its set lasts the frame: it points at the
+		// face matrices only, not at the atlas that the faces render into
+		VkDescriptorSet facesSet = DS_shadow.transientSet(currentImage, 1);
+		shadowTarget.begin(commandBuffer);
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, P_shadow.graphicsPipeline);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+								P_shadow.pipelineLayout, 0, 1, &facesSet, 0, nullptr);
+		uint32_t boundMesh = UINT32_MAX;
+		for (const ShadowFace &F : faces) {
+			glm::uvec2 origin = ShadowAtlas::tileOrigin(F.slot, F.face);
+			shadowTarget.clearRegion(commandBuffer, {{(int32_t) origin.x, (int32_t) origin.y},
+													 {SHADOW_TILE_SIZE, SHADOW_TILE_SIZE}});
+			glm::vec4 light = shadowAtlas.slotSphere(F.slot);
+			for (size_t i = 0; i < scene.entities.size(); i++) {
+				glm::vec3 center = glm::vec3(entityBounds[i]) - glm::vec3(light);
+				float radius = entityBounds[i].w;
+				if (glm::length(center) > radius + light.w ||
+					!ShadowAtlas::sphereInFace(center, radius, F.face)) {
+					continue;
+				}
+				const Model &M = sceneMeshes[scene.entities[i].mesh];
+				if (scene.entities[i].mesh != boundMesh) {
+					VkBuffer vertexBuffers[] = {M.positionBuffer};
+					VkDeviceSize offsets[] = {0};
+					vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+					vkCmdBindIndexBuffer(commandBuffer, M.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+					boundMesh = scene.entities[i].mesh;
+				}
+				vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+										P_shadow.pipelineLayout, 1, 1, &entitySets[i].descriptorSets[currentImage],
+										0, nullptr);
+				// the instance picks the face matrix in shadow.vert
+				vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(M.indices.size()), 1, 0, 0,
+								 6 * F.slot + F.face);
+			}
+		}
+		shadowTarget.end(commandBuffer);
+		return true;
+	}
+
+	// the light lists of this frame's clusters, before the main pass reads them
+	void populateComputeCommands(VkCommandBuffer commandBuffer, int currentImage)
+	{
+		if (!clusteredLighting) {
+			return;
+		}
+		gpuProfiler.beginRegion(commandBuffer, "LightClusters");
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, P_clusters.computePipeline);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+								P_clusters.pipelineLayout, 0, 1, &DS_lights.descriptorSets[currentImage],
+								0, nullptr);
+		vkCmdDispatch(commandBuffer, (CLUSTER_COUNT + 63) / 64, 1, 1);
+		
+		// the overflow count is read back by the host
+		VkMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+		barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_HOST_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+							 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0,
+							 1, &barrier, 0, nullptr, 0, nullptr);
+		gpuProfiler.endRegion(commandBuffer);
+	}
+
 	// Here it is the creation of the command buffer:
 	// You send to the GPU all the objects you want to draw,
 	// with their buffers and textures
 	void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage)
 	{
-
-		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-						  P1.graphicsPipeline);
+		// P_lit, P_litEqual, P_depth and the overdraw ones share sceneLayout
         // GLOBAL DS
         vkCmdBindDescriptorSets(commandBuffer,
                                 VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                P1.pipelineLayout, 0, 1, &DS_global.descriptorSets[currentImage], //the first integer parameter is the set, global has set=0 objects will have set=1 then
+                                sceneLayout, 0, 1, &DS_global.descriptorSets[currentImage], //the first integer parameter is the set, global has set=0 objects will have set=1 then
                                 0, nullptr);
+		if (clusteredLighting) {
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+									sceneLayout, 2, 1, &DS_lights.descriptorSets[currentImage],
+									0, nullptr);
+		}
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+								sceneLayout, clusteredLighting ? 3 : 2, 1,
+								&DS_shadow.descriptorSets[currentImage], 0, nullptr);
 
-		// MODEL OF BODY
-		VkBuffer vertexBuffers[] = {M_Cave.vertexBuffer};
-		// property .vertexBuffer of models, contains the VkBuffer handle to its vertex buffer
-		VkDeviceSize offsets[] = {0};
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-		// property .indexBuffer of models, contains the VkBuffer handle to its index buffer
-		vkCmdBindIndexBuffer(commandBuffer, M_Cave.indexBuffer, 0,
-							 VK_INDEX_TYPE_UINT32);
-
-		// property .pipelineLayout of a pipeline contains its layout.
-		// property .descriptorSets of a descriptor set contains its elements.
-		vkCmdBindDescriptorSets(commandBuffer,
-								VK_PIPELINE_BIND_POINT_GRAPHICS,
-								P1.pipelineLayout, 1, 1, &DS_Cave.descriptorSets[currentImage],
-								0, nullptr);
+		if (depthPrePass) {
+			gpuProfiler.beginRegion(commandBuffer, "DepthPrePass");
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+							  P_depth.graphicsPipeline);
+			drawEntities(commandBuffer, currentImage, true, nullptr);
+			gpuProfiler.endRegion(commandBuffer);
+		}
 
-		// property .indices.size() of models, contains the number of triangles * 3 of the mesh.
-		vkCmdDrawIndexed(commandBuffer,
-						 static_cast<uint32_t>(M_Cave.indices.size()), 1, 0, 0, 0);
-        //----------------
-
-		// MODEL OF Handle
-		VkBuffer vertexBuffersHandle[] = {M_Platform.vertexBuffer};
-		VkDeviceSize offsetsHandle[] = {0};
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffersHandle, offsetsHandle);
-		vkCmdBindIndexBuffer(commandBuffer, M_Platform.indexBuffer, 0,
-							 VK_INDEX_TYPE_UINT32);
-		vkCmdBindDescriptorSets(commandBuffer,
-								VK_PIPELINE_BIND_POINT_GRAPHICS,
-								P1.pipelineLayout, 1, 1, &DS_Platform1.descriptorSets[currentImage], //particular objects DS (descriptors) will have set=1 (it's the first integer parameter)
-								0, nullptr);
-		vkCmdDrawIndexed(commandBuffer,
-						 static_cast<uint32_t>(M_Platform.indices.size()), 1, 0, 0, 0);
-        vkCmdBindDescriptorSets(commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                P1.pipelineLayout, 1, 1, &DS_Platform2.descriptorSets[currentImage], //particular objects DS (descriptors) will have set=1 (it's the first integer parameter)
-                                0, nullptr);
-        vkCmdDrawIndexed(commandBuffer,
-                         static_cast<uint32_t>(M_Platform.indices.size()), 1, 0, 0, 0);
-        //----------------
-        
-        // MODEL OF Interactive Block
-        VkBuffer vertexBuffersIntBlock[] = {M_IntBlock.vertexBuffer};
-        VkDeviceSize offsetsIntBlock[] = {0};
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffersIntBlock, offsetsIntBlock);
-        vkCmdBindIndexBuffer(commandBuffer, M_IntBlock.indexBuffer, 0,
-                             VK_INDEX_TYPE_UINT32);
-        vkCmdBindDescriptorSets(commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                P1.pipelineLayout, 1, 1, &DS_IntBlock.descriptorSets[currentImage], //particular objects DS (descriptors) will have set=1 (it's the first integer parameter)
-                                0, nullptr);
-        vkCmdDrawIndexed(commandBuffer,
-                         static_cast<uint32_t>(M_IntBlock.indices.size()), 1, 0, 0, 0);
-        //----------------
-        
-        // MODEL OF Door
-        VkBuffer vertexBuffersDoor[] = {M_Door.vertexBuffer};
-        VkDeviceSize offsetsDoor[] = {0};
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffersDoor, offsetsDoor);
-        vkCmdBindIndexBuffer(commandBuffer, M_Door.indexBuffer, 0,
-                             VK_INDEX_TYPE_UINT32);
-        vkCmdBindDescriptorSets(commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                P1.pipelineLayout, 1, 1, &DS_Door.descriptorSets[currentImage], //particular objects DS (descriptors) will have set=1 (it's the first integer parameter)
-                                0, nullptr);
-        vkCmdDrawIndexed(commandBuffer,
-                         static_cast<uint32_t>(M_Door.indices.size()), 1, 0, 0, 0);
-        //----------------
-        
-        // MODEL OF Hint
-        VkBuffer vertexBuffersHint[] = {M_Hint.vertexBuffer};
-        VkDeviceSize offsetsHint[] = {0};
-        vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffersHint, offsetsHint);
-        vkCmdBindIndexBuffer(commandBuffer, M_Hint.indexBuffer, 0,
-                             VK_INDEX_TYPE_UINT32);
-        vkCmdBindDescriptorSets(commandBuffer,
-                                VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                P1.pipelineLayout, 1, 1, &DS_Hint.descriptorSets[currentImage], //particular objects DS (descriptors) will have set=1 (it's the first integer parameter)
-                                0, nullptr);
-        vkCmdDrawIndexed(commandBuffer,
-                         static_cast<uint32_t>(M_Hint.indices.size()), 1, 0, 0, 0);
-        //----------------
+		if (overdrawView) {
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+							  (depthPrePass ? P_overdrawEqual : P_overdraw).graphicsPipeline);
+			fragmentCounter.begin(commandBuffer, currentImage);
+			drawEntities(commandBuffer, currentImage, false, nullptr);
+		} else {
+			drawEntities(commandBuffer, currentImage, false, depthPrePass ? &P_litEqual : &P_lit);
+		}
+		if (overdrawView) {
+			fragmentCounter.end(commandBuffer, currentImage);
+		}
 	}
 
-	// Here is where you update the uniforms.
-	// Very likely this will be where you will be writing the logic of your application.
-	void updateUniformBuffer(uint32_t currentImage)
+	// every entity of the scene, with the pipeline bound, or the variant of
+	// its features when given them; the depth-only draws read the positions
+	// alone
+	void drawEntities(VkCommandBuffer commandBuffer, int currentImage, bool positionsOnly,
+					  const std::map<uint32_t, Pipeline> *variants)
+	{
+		// consecutive entities of the same mesh bind its buffers once, and
+		// of the same features their variant
+		const std::string *region = nullptr;
+		uint32_t boundMesh = UINT32_MAX;
+		uint32_t boundFeatures = UINT32_MAX;
+		for (size_t i = 0; i < scene.entities.size(); i++) {
+			const SceneEntity &E = scene.entities[i];
+			if (!positionsOnly && (!region || E.region != *region)) {
+				if (region && !region->empty()) {
+					gpuProfiler.endRegion(commandBuffer);
+				}
+				region = &E.region;
+				if (!region->empty()) {
+					gpuProfiler.beginRegion(commandBuffer, *region);
+				}
+			}
+			
+			const Model &M = sceneMeshes[E.mesh];
+			if (E.mesh != boundMesh) {
+				// property .vertexBuffer of models, contains the VkBuffer handle to its vertex buffer
+				VkBuffer vertexBuffers[] = {positionsOnly ? M.positionBuffer : M.vertexBuffer};
+				VkDeviceSize offsets[] = {0};
+				vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+				// property .indexBuffer of models, contains the VkBuffer handle to its index buffer
+				vkCmdBindIndexBuffer(commandBuffer, M.indexBuffer, 0,
+									 VK_INDEX_TYPE_UINT32);
+				boundMesh = E.mesh;
+			}
+			if (variants && entityFeatures[i] != boundFeatures) {
+				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+								  variants->at(entityFeatures[i]).graphicsPipeline);
+				boundFeatures = entityFeatures[i];
+			}
+			
+			// property .pipelineLayout of a pipeline contains its layout.
+			// property .descriptorSets of a descriptor set contains its elements.
+			vkCmdBindDescriptorSets(commandBuffer,
+									VK_PIPELINE_BIND_POINT_GRAPHICS,
+									sceneLayout, 1, 1, &entitySets[i].descriptorSets[currentImage], //particular objects DS (descriptors) will have set=1 (it's the first integer parameter)
+									0, nullptr);
+			
+			// property .indices.size() of models, contains the number of triangles * 3 of the mesh.
+			vkCmdDrawIndexed(commandBuffer,
+							 static_cast<uint32_t>(M.indices.size()), 1, 0, 0, 0);
+		}
+		if (region && !region->empty()) {
+			gpuProfiler.endRegion(commandBuffer);
+		}
+	}
+
+	// Here is where you write the logic of your application: movement,
+	// collisions and animations. Called every 1/simulationRate seconds of
+	// simulated time, on the simulation thread when there is one.
+	void simulationStep(double simTime, float deltaT)
 	{
-		static auto startTime = std::chrono::high_resolution_clock::now();
-        static float lastTime = 0.0f;
-		auto currentTime = std::chrono::high_resolution_clock::now();
-		float time = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - startTime).count();
-        float deltaT = time - lastTime;
-        lastTime = time;
+		float time = (float) simTime;
         const float ROT_SPEED = glm::radians(90.0f);
         const float MOVE_SPEED = 6.75f;
         
         //double m_dx = xpos - old_xpos;
         //double m_dy = ypos - old_ypos;
         
-        Point polygonFirstLevel[]={
-            {1.977f, -0.12f},{-8.0f, -0.29f},{-8.1f, 4.9f},{-17.977f, 4.95f},{-18.40947f, 15.119062f},{-13.2749f, 15.286366f}, {-13.08979f, -0.321581},{-2.94981f, 32.661884f},{-2.756874f, 30.245684},{7.059189f, 30.348223f},{7.351864f, 27.670744f},{17.165037f, 27.727234f},{17.309513f, 25.223669f},{27.082043f, 25.309875f},{27.167667f, 15.291109f},{32.010273f, 15.222846f},{32.212494f, 5.442165f},{37.041645f, 5.490769f},{37.258324f, -4.548279f},{42.106056f, -4.725879f},{42.303799f, -24.741739f},{51.765488f, -24.710552f},{51.789332f, 4.637737f},{46.881699f, 4.821360f},{46.808151f, 14.725124f},{41.870975f, 14.739830f},{41.740196f, 24.785589f},{36.900578f, 24.698938f},{36.700233f, 34.750481f},{16.906641f, 34.621841f},{16.750671f, 39.685867f},{6.838522f, 39.544998f},{6.710043f, 44.605782f},{-2.701247f, 44.647972f},{-3.126298f, 42.389423f},{-13.196265f, 42.362267f},{-13.263083f, 44.729404f},{-22.239576f, 44.574398f},{-22.488251f, 39.968781f},{-32.621956f,39.646076f},{-32.610435f, 34.810993f},{-37.548759f, 34.689541f},{-37.506943,24.909031f},{-47.633053f, 24.743914f},{-47.550144f, 20.606758f},{-42.709469f, 20.590010f},{-42.595543f, 12.155780f},{-37.737270f, 12.345304f},{-37.563602f, -5.191618f},{-47.347424f, -5.375168f},{-47.347515f, -14.043010f},{-19.012642f, -14.177714f},{-18.594564f, -9.578016f},{2.382220f, -9.686684f},{2.396673f, -19.569105f},{7.026602f, -19.527569f},{7.362133f, -30.314966f},{-3.171566f, -30.144741f},{-3.237250, -27.667923f},{-7.742736f, -27.791506f},{-7.834392f, -30.270039f},{-17.734526f, -30.351521f},{-17.885273f, -39.995483f},{-28.120893f, -40.382954f},{-28.367798f, -30.411938f},{-37.807617f, -30.382368f},{-37.922546f, -40.062504f},{-57.161739f, -40.423023f},{-57.090649f, -49.525463f},{-42.896645f, -49.734165f},{-42.822685f, -54.563705f},{-33.178314f, -54.498180f},{-33.264153f, -49.681889f},{-22.716454f, -49.681530f},{-22.596651f, -59.278316f},{-18.229576f, -59.338959f},{-18.274920f, -49.866566f},{-8.358553f, -49.806484f},{-8.410365f, -39.771515f},{2.154401f, -39.859848f},{2.274107f, -44.014206f},{11.837919f, -43.865822f},{11.794569f, -39.835190f},{16.274645f, -39.648861f},{16.734129f, -19.699081f},{21.426973f, -19.577007f},{21.458563f, -15.080132f},{11.877460f, -15.121017f},{11.906350f, -5.096962f},{6.868548f, -5.122917f},{6.713150f, 4.113907f},{2.215148f, 4.033896f}
-        };
-        
-        Point polygonSecondLevel[]={
-            {12.195593f, 4.260537f},{1.732248f, 4.486275f},{1.605743f, 7.818107f},{-11.123894f, 8.001146f},{-10.993432f, 20.290096f},{-0.542608f, 20.20587f},{-0.713717f, 29.559076f},{-12.631978f, 29.501474f},{-13.009111f, 21.811964f},{-17.388380f, 21.739685f},{-17.589445f, 5.879795f},{-7.972856f, 5.238356f},{-7.965707f, 0.072984f},{12.422435f, 0.125029f}
-        };
-        
-        VerticesOfPlatform plat = getVerticesOfPlatform(0);
-        Point platform[]={{plat.v1[0], plat.v1[1]}, {plat.v2[0], plat.v2[1]}, {plat.v3[0], plat.v3[1]}, {plat.v4[0], plat.v4[1]}};
-        plat = getVerticesOfPlatform(1);
-        Point platform2[]={{plat.v1[0], plat.v1[1]}, {plat.v2[0], plat.v2[1]}, {plat.v3[0], plat.v3[1]}, {plat.v4[0], plat.v4[1]}};
-        Point doorVertices[] = {{-4.93, 32.13}, {-2.79, 32.56}, {-2.75, 42.54}, {-5.17, 42.39}};
-        
         glm::vec3 oldRobotPos = RobotPos;
-        if(glfwGetKey(window, GLFW_KEY_LEFT)) {
+        if(getKey(GLFW_KEY_LEFT)) {
             lookYaw += deltaT * ROT_SPEED;
         }
-        if(glfwGetKey(window, GLFW_KEY_RIGHT)) {
+        if(getKey(GLFW_KEY_RIGHT)) {
             lookYaw -= deltaT * ROT_SPEED;
         }
-        if(glfwGetKey(window, GLFW_KEY_UP)) {
+        if(getKey(GLFW_KEY_UP)) {
             lookPitch += deltaT * ROT_SPEED;
         }
-        if(glfwGetKey(window, GLFW_KEY_DOWN)) {
+        if(getKey(GLFW_KEY_DOWN)) {
             lookPitch -= deltaT * ROT_SPEED;
         }
-        if(glfwGetKey(window, GLFW_KEY_Q)) {
+        if(getKey(GLFW_KEY_Q)) {
             lookRoll -= deltaT * ROT_SPEED;
         }
-        if(glfwGetKey(window, GLFW_KEY_E)) {
+        if(getKey(GLFW_KEY_E)) {
             lookRoll += deltaT * ROT_SPEED;
         }
-        if(glfwGetKey(window, GLFW_KEY_A)) {
+        if(getKey(GLFW_KEY_A)) {
             RobotPos -= MOVE_SPEED * glm::vec3(glm::rotate(glm::mat4(1.0f), lookYaw,
                                     glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(1,0,0,1)) * deltaT;
         }
-        if(glfwGetKey(window, GLFW_KEY_D)) {
+        if(getKey(GLFW_KEY_D)) {
             RobotPos += MOVE_SPEED * glm::vec3(glm::rotate(glm::mat4(1.0f), lookYaw,
                                     glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(1,0,0,1)) * deltaT;
         }
-        if(glfwGetKey(window, GLFW_KEY_W)) {
+        if(getKey(GLFW_KEY_W)) {
             RobotPos -= MOVE_SPEED * glm::vec3(glm::rotate(glm::mat4(1.0f), lookYaw,
                                     glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(0,0,1,1)) * deltaT;
         }
-        if(glfwGetKey(window, GLFW_KEY_S)) {
+        if(getKey(GLFW_KEY_S)) {
             RobotPos += MOVE_SPEED * glm::vec3(glm::rotate(glm::mat4(1.0f), lookYaw,
                                     glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(0,0,1,1)) * deltaT;
         }
-        if(glfwGetKey(window, GLFW_KEY_F)) {
+        if(getKey(GLFW_KEY_F)) {
             RobotPos += MOVE_SPEED * glm::vec3(0.0f, deltaT, 0.0f);
         }
-        if(glfwGetKey(window, GLFW_KEY_G)) {
+        if(getKey(GLFW_KEY_G)) {
             RobotPos -= MOVE_SPEED * glm::vec3(0.0f, deltaT, 0.0f);
         }
+        if (cameraPath.playing) {
+            // benchmark: the camera path overrides the keyboard
+            cameraPath.sample(time, RobotPos, lookYaw, lookPitch, lookRoll);
+            oldRobotPos = RobotPos;
+        }
         
         if (RobotPos[1]<2.0f) {
-            if (!doorUnlocked && isInside(doorVertices, sizeof(doorVertices)/sizeof(doorVertices[0]), {RobotPos[0], RobotPos[2]})){
+            if (!doorUnlocked && doorArea.contains({RobotPos[0], RobotPos[2]})){
                 RobotPos = oldRobotPos;
             }
-            if (!isInside(polygonFirstLevel, sizeof(polygonFirstLevel)/sizeof(polygonFirstLevel[0]), {RobotPos[0], RobotPos[2]})) {
+            if (bvhCollision) {
+                RobotPos = moveCamera(oldRobotPos, RobotPos);
+            } else if (!canMoveOn(firstLevelArea, oldRobotPos)) {
                 RobotPos = oldRobotPos;
             }
         }else if(RobotPos[1]>10){
-            if (!isInside(polygonSecondLevel, sizeof(polygonSecondLevel)/sizeof(polygonSecondLevel[0]), {RobotPos[0], RobotPos[2]})) {
+            if (bvhCollision) {
+                RobotPos = moveCamera(oldRobotPos, RobotPos);
+            } else if (!canMoveOn(secondLevelArea, oldRobotPos)) {
                 RobotPos = oldRobotPos;
             }
         }else{
-            if ((!isInside(platform, sizeof(platform)/sizeof(platform[0]), {RobotPos[0], RobotPos[2]}))
-                && !isInside(platform2, sizeof(platform2)/sizeof(platform2[0]), {RobotPos[0], RobotPos[2]})) {
+            if (!platformArea[0].contains({RobotPos[0], RobotPos[2]})
+                && !platformArea[1].contains({RobotPos[0], RobotPos[2]})) {
                 RobotPos = oldRobotPos;
             }
         }
-        std::cout << std::to_string(RobotPos[0]) << " " << std::to_string(RobotPos[1])<< " " << std::to_string(RobotPos[2])<< " " << "\n";
+        LOG_EVERY_MS(LOG_LEVEL_DEBUG, 250, "camera %f %f %f", RobotPos[0], RobotPos[1], RobotPos[2]);
         
         
         
         int nearest_plat_index = getNearestPlatform(RobotPos);
-        // possible code to move an object after an interaction (going up and down like a platform)
-        float animationDuration = 2; // seconds of animation
-        static int isMoving = 0;
-        static auto interactionStartTime = std::chrono::high_resolution_clock::now();
-        static glm::vec3 handlePosStart = glm::vec3(0.0f, -1.90f, 0.1f);
-        static glm::vec3 handlePosEnd = glm::vec3(0.0f, 8.0f, 0.1f);
-        static glm::vec3 handlePos = handlePosStart;
-        if (!isMoving && glfwGetKey(window, GLFW_KEY_SPACE)) {
-            std::cout << "nearest plat: " << nearest_plat_index;
-            isMoving = 1;
-            interactionStartTime = std::chrono::high_resolution_clock::now();
-        }
-        if (isMoving){
-            bool cameraNeedToMove = isCameraOnPlatform(getVerticesOfPlatform(nearest_plat_index), RobotPos);
-            std::cout << "camera need to move: " << cameraNeedToMove;
-            float deltaTimeAnimation = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - interactionStartTime).count();
-            if (deltaTimeAnimation >= animationDuration) {
-                
-                handlePos = handlePosEnd;
-                isMoving = 0;
-                glm::vec3 handlePosTemp = handlePosEnd;
-                handlePosEnd = handlePosStart;
-                handlePosStart = handlePosTemp;
-            } else {
-                handlePos = glm::vec3(handlePosStart[0] + ((handlePosEnd[0]-handlePosStart[0])/animationDuration)*deltaTimeAnimation,
-                                      handlePosStart[1] + ((handlePosEnd[1]-handlePosStart[1])/animationDuration)*deltaTimeAnimation,
-                                      handlePosStart[2] + ((handlePosEnd[2]-handlePosStart[2])/animationDuration)*deltaTimeAnimation);
-                if (cameraNeedToMove) {
-                    float height_diff = handlePosEnd[1] - handlePosStart[1];
-                    RobotPos[1] += (height_diff/animationDuration)*deltaT;
-                }
-            }
+        // SPACE moves the platforms to the other level
+        if (!timeline.playing(platformTrack) && getKey(GLFW_KEY_SPACE)) {
+            LOG_DEBUG("nearest plat: %d", nearest_plat_index);
+            timeline.toggle(platformTrack, time);
         }
-        // ------------------- animation code
+        bool cameraNeedToMove = timeline.playing(platformTrack)
+            && platformArea[nearest_plat_index].contains({RobotPos[0], RobotPos[2]});
         
-        // Animation of door
-        // possible code to move an object after an interaction (DOOR)
-        int selColor = (int)std::floor(time) % 5;
-        static int doorIsMoving = 0;
-        static int blockColorFlowing = 1;
-        static glm::vec3 doorPosStart = glm::vec3(0.0f, 0.0f, 0.0f);
-        static glm::vec3 doorPosEnd = glm::vec3(0.0f, -8.0f, 0.0f);
-        static glm::vec3 doorPos = doorPosStart;
+        // the door opens when the camera stands on the block while it
+        // shows the right color
+        selColor = (int)std::floor(time) % 5;
         bool isOnIntBlock = isCameraOnPlatform(getVerticesOfIntBlock(), RobotPos);
         bool isOnRightColor = colorSelectorToUnlock == colorSelFreezed;
-        if (!doorIsMoving && isOnIntBlock && isOnRightColor && !doorUnlocked) {
-            doorIsMoving = 1;
+        if (isOnIntBlock && isOnRightColor && !doorUnlocked) {
             doorUnlocked = true;
-            interactionStartTime = std::chrono::high_resolution_clock::now();
+            timeline.play(doorTrack, time);
         }
         if (isOnIntBlock && blockColorFlowing) {
             colorSelFreezed = selColor;
@@ -442,40 +931,93 @@ protected:
         if (!isOnIntBlock && !doorUnlocked){
             blockColorFlowing = 1;
         }
-        if (doorIsMoving){
-            float deltaTimeAnimation = std::chrono::duration<float, std::chrono::seconds::period>(currentTime - interactionStartTime).count();
-            if (deltaTimeAnimation >= animationDuration) {
-                doorPos = doorPosEnd;
-                doorIsMoving = 0;
-                glm::vec3 doorPosTemp = doorPosEnd;
-                doorPosEnd = doorPosStart;
-                doorPosStart = doorPosTemp;
-            } else {
-                doorPos = glm::vec3(doorPosStart[0] + ((doorPosEnd[0]-doorPosStart[0])/animationDuration)*deltaTimeAnimation,
-                                      doorPosStart[1] + ((doorPosEnd[1]-doorPosStart[1])/animationDuration)*deltaTimeAnimation,
-                                      doorPosStart[2] + ((doorPosEnd[2]-doorPosStart[2])/animationDuration)*deltaTimeAnimation);
+        
+        timeline.update(time);
+        glm::vec3 newHandlePos = timeline.value(platformTrack);
+        if (cameraNeedToMove) {
+            // the camera rides the platform
+            RobotPos[1] += newHandlePos[1] - handlePos[1];
+        }
+        handlePos = newHandlePos;
+        doorPos = timeline.value(doorTrack);
+        for (const TimelineEvent &E : timeline.events()) {
+            if (E.track == doorTrack && E.event == Timeline::FINISHED) {
+                LOG_INFO("door open");
             }
         }
-        // ------------------- animation code
 
-        
-        
+        cameraPath.record(time, RobotPos, lookYaw, lookPitch, lookRoll);
+        publishSnapshot(simTime);
+	}
+	
+	SimulationState captureState()
+	{
+		return {RobotPos, lookYaw, lookPitch, lookRoll, handlePos, doorPos,
+				selColor, colorSelFreezed, doorUnlocked, blockColorFlowing};
+	}
+	
+	void publishSnapshot(double simTime)
+	{
+		SimulationSnapshot &S = snapshots.writeBuffer();
+		S.prev = publishedState;
+		S.curr = captureState();
+		S.time = simTime;
+		publishedState = S.curr;
+		snapshots.publish();
+	}
+
+	// Here is where you update the uniforms, from the latest simulation
+	// state interpolated to the time of this frame.
+	// P and O, on the press: what the command buffers draw changes, so
+	// they are recorded again
+	void switchRenderModes()
+	{
+		bool prePassKey = getKey(GLFW_KEY_P) == GLFW_PRESS;
+		bool overdrawKey = getKey(GLFW_KEY_O) == GLFW_PRESS;
+		if (prePassShaders && prePassKey && !prePassKeyDown) {
+			depthPrePass = !depthPrePass;
+			outdateCommandBuffers();
+			LOG_INFO("Depth pre-pass %s", depthPrePass ? "on" : "off");
+		}
+		if (prePassShaders && overdrawKey && !overdrawKeyDown) {
+			overdrawView = !overdrawView;
+			outdateCommandBuffers();
+			LOG_INFO("Overdraw view %s", overdrawView ? "on" : "off");
+		}
+		prePassKeyDown = prePassKey;
+		overdrawKeyDown = overdrawKey;
+	}
+
+	void updateUniformBuffer(uint32_t currentImage)
+	{
+		snapshots.update();
+		const SimulationSnapshot &S = snapshots.read();
+		float alpha = interpolationAlpha(S.time);
+		SimulationState state = S.curr;
+		state.RobotPos = glm::mix(S.prev.RobotPos, S.curr.RobotPos, alpha);
+		state.lookYaw = glm::mix(S.prev.lookYaw, S.curr.lookYaw, alpha);
+		state.lookPitch = glm::mix(S.prev.lookPitch, S.curr.lookPitch, alpha);
+		state.lookRoll = glm::mix(S.prev.lookRoll, S.curr.lookRoll, alpha);
+		state.handlePos = glm::mix(S.prev.handlePos, S.curr.handlePos, alpha);
+		state.doorPos = glm::mix(S.prev.doorPos, S.curr.doorPos, alpha);
+		float time = (float) getTime();
+		switchRenderModes();
 
         void *data;
         
 		globalUniformBufferObject gubo{};
         UniformBufferObject ubo{};
-        gubo.view = LookInDirMat(RobotPos, glm::vec3(lookYaw, lookPitch, lookRoll));
+        gubo.view = LookInDirMat(state.RobotPos, glm::vec3(state.lookYaw, state.lookPitch, state.lookRoll));
 		gubo.proj = glm::perspective(glm::radians(45.0f),
 									swapChainExtent.width / (float)swapChainExtent.height,
 									0.1f, 150.0f);
 		gubo.proj[1][1] *= -1;
         gubo.time = glm::fract(time);
-        gubo.eyePos = RobotPos;
+        gubo.eyePos = state.RobotPos;
         gubo.coneInOutDecayExp = glm::vec4(0.0f, 0.3f, 2.0f, 2.0f);
-        float direction_x = cos((lookYaw)) * cos((lookPitch));
-        float direction_y = sin((lookPitch));
-        float direction_z = sin((lookYaw)) * cos((lookPitch));
+        float direction_x = cos((state.lookYaw)) * cos((state.lookPitch));
+        float direction_y = sin((state.lookPitch));
+        float direction_z = sin((state.lookYaw)) * cos((state.lookPitch));
         gubo.cameraDir = glm::normalize(glm::vec3(direction_x, direction_y, direction_z));
         //std::cout << gubo.cameraDir[0] << " " << gubo.cameraDir[1] << " " << gubo.cameraDir[2] << "\n";
         
@@ -486,78 +1028,93 @@ protected:
         memcpy(data, &gubo, sizeof(gubo));
         vkUnmapMemory(device, DS_global.uniformBuffersMemory[0][currentImage]);
 
-        ubo.isFlowingColor = 0;
-		// doing for every model or better for every (DS_) -- HERE: SLBody --
-		// Here is where you actually update your uniforms
-		// uniformBuffersMemory[0] -> the 0 is the binding of the uniform you're going to change
-		ubo.model = glm::mat4(1.0f);
-		vkMapMemory(device, DS_Cave.uniformBuffersMemory[0][currentImage], 0,
-					sizeof(ubo), 0, &data);
-		memcpy(data, &ubo, sizeof(ubo));
-		vkUnmapMemory(device, DS_Cave.uniformBuffersMemory[0][currentImage]);
-		// ------------
-
-		// (HANDLE) doing for every model or better for every (DS_)
-		ubo.model = glm::translate(glm::mat4(1), handlePos); // you can modify your ubo for each DS before passing it
-		vkMapMemory(device, DS_Platform1.uniformBuffersMemory[0][currentImage], 0,
-					sizeof(ubo), 0, &data);
-		memcpy(data, &ubo, sizeof(ubo));
-		vkUnmapMemory(device, DS_Platform1.uniformBuffersMemory[0][currentImage]);
-		// ------------
-        // (HANDLE2) doing for every model or better for every (DS_)
-        ubo.model = glm::translate(glm::mat4(1), glm::vec3(-17.9, handlePos[1], 12.0)); // you can modify your ubo for each DS before passing it
-        vkMapMemory(device, DS_Platform2.uniformBuffersMemory[0][currentImage], 0,
-                    sizeof(ubo), 0, &data);
-        memcpy(data, &ubo, sizeof(ubo));
-        vkUnmapMemory(device, DS_Platform2.uniformBuffersMemory[0][currentImage]);
-        // ------------
-        
-        // (INTBLOCK) doing for every model or better for every (DS_)
-        ubo.model = glm::translate(glm::mat4(1), glm::vec3(-26.0, -1.8, 33.0)) *
-                    glm::scale(glm::mat4(1), glm::vec3(0.5, 0.5, 0.5)); // you can modify your ubo for each DS before passing it
-        ubo.isFlowingColor = 0;
-        ubo.highlightColor = highLightColors[selColor];
-        if (doorUnlocked || !blockColorFlowing) {
-            ubo.highlightColor = highLightColors[colorSelFreezed];
+        // Lights: the torch follows the camera as in shader.frag
+        pointLights[0].positionRadius = glm::vec4(state.RobotPos + glm::vec3(0.0f, 0.5f, 0.0f), 40.0f);
+        if (clusteredLighting) {
+        	ClusterUniforms cu{};
+        	cu.view = gubo.view;
+        	cu.invProj = glm::inverse(gubo.proj);
+        	cu.screenNearFar = glm::vec4(renderExtent().width, renderExtent().height, 0.1f, 150.0f);
+        	cu.lightCount = (uint32_t) pointLights.size();
+        	vkMapMemory(device, DS_lights.uniformBuffersMemory[0][currentImage], 0,
+        				sizeof(cu), 0, &data);
+        	memcpy(data, &cu, sizeof(cu));
+        	vkUnmapMemory(device, DS_lights.uniformBuffersMemory[0][currentImage]);
+        	vkMapMemory(device, DS_lights.uniformBuffersMemory[1][currentImage], 0,
+        				pointLights.size() * sizeof(PointLight), 0, &data);
+        	memcpy(data, pointLights.data(), pointLights.size() * sizeof(PointLight));
+        	vkUnmapMemory(device, DS_lights.uniformBuffersMemory[1][currentImage]);
+        	
+        	// what the last frame drawn from this image left out, zeroed
+        	// for the next one
+        	vkMapMemory(device, DS_lights.uniformBuffersMemory[3][currentImage], 0,
+        				sizeof(ClusterOverflow), 0, &data);
+        	ClusterOverflow *overflow = (ClusterOverflow *) data;
+        	if (overflow->droppedLights > droppedLightsReported) {
+        		droppedLightsReported = overflow->droppedLights;
+        		LOG_WARN("%u lights left out of clusters already lighting %u: raise MAX_LIGHTS_PER_CLUSTER",
+        				 droppedLightsReported, MAX_LIGHTS_PER_CLUSTER);
+        	}
+        	overflow->droppedLights = 0;
+        	vkUnmapMemory(device, DS_lights.uniformBuffersMemory[3][currentImage]);
         }
-        vkMapMemory(device, DS_IntBlock.uniformBuffersMemory[0][currentImage], 0,
-                    sizeof(ubo), 0, &data);
-        memcpy(data, &ubo, sizeof(ubo));
-        vkUnmapMemory(device, DS_IntBlock.uniformBuffersMemory[0][currentImage]);
-        // ------------
-        
-        // (DOOR) doing for every model or better for every (DS_)
-        ubo.isFlowingColor = 0;
-        ubo.model = glm::translate(glm::mat4(1), doorPos); // you can modify your ubo for each DS before passing it
-        vkMapMemory(device, DS_Door.uniformBuffersMemory[0][currentImage], 0,
-                    sizeof(ubo), 0, &data);
-        memcpy(data, &ubo, sizeof(ubo));
-        vkUnmapMemory(device, DS_Door.uniformBuffersMemory[0][currentImage]);
-        ubo.highlightColor = glm::vec3(0.0, 0.0, 0.0); //set back to null highlight
-        // ------------
-        
-        // (HINT) doing for every model or better for every (DS_)
-        ubo.model = glm::mat4(1.0);
-        vkMapMemory(device, DS_Hint.uniformBuffersMemory[0][currentImage], 0,
-                    sizeof(ubo), 0, &data);
-        memcpy(data, &ubo, sizeof(ubo));
-        vkUnmapMemory(device, DS_Hint.uniformBuffersMemory[0][currentImage]);
-        // ------------
         
+        // Shadows: the faces that the animated entities moved through are
+        // rendered again, with those of the lights that moved
+        std::vector<glm::vec4> movedCasters;
+        for (size_t i = 0; i < scene.entities.size(); i++) {
+        	if (!entityTracks[i]) {
+        		continue;
+        	}
+        	glm::vec4 bound = entityBound(i, state.*entityTracks[i]);
+        	if (bound != entityBounds[i]) {
+        		glm::vec3 from = glm::vec3(entityBounds[i]), to = glm::vec3(bound);
+        		movedCasters.push_back(glm::vec4((from + to) * 0.5f,
+        										 glm::distance(from, to) * 0.5f + std::max(bound.w, entityBounds[i].w)));
+        		entityBounds[i] = bound;
+        	}
+        }
+        if (shadows) {
+        	shadowAtlas.update(pointLights, shadowedLights(pointLights, state.RobotPos), movedCasters);
+        }
+        ShadowUniforms su;
+        shadowAtlas.fillUniforms(su, pointLights.size());
+        vkMapMemory(device, DS_shadow.uniformBuffersMemory[0][currentImage], 0,
+        			sizeof(su), 0, &data);
+        memcpy(data, &su, sizeof(su));
+        vkUnmapMemory(device, DS_shadow.uniformBuffersMemory[0][currentImage]);
+
+        // the color lock and the door show the color the lock shows
+        glm::vec3 lockColor = highLightColors[state.selColor];
+        if (state.doorUnlocked || !state.blockColorFlowing) {
+            lockColor = highLightColors[state.colorSelFreezed];
+        }
+		// uniformBuffersMemory[0] -> the 0 is the binding of the uniform you're going to change
+		for (size_t i = 0; i < scene.entities.size(); i++) {
+			const SceneEntity &E = scene.entities[i];
+			ubo.model = E.transform(entityTracks[i] ? state.*entityTracks[i] : glm::vec3(0.0f));
+			ubo.highlightColor = E.highlight ? lockColor : glm::vec3(0.0f);
+			ubo.materialColor = scene.materials[E.material].color;
+			vkMapMemory(device, entitySets[i].uniformBuffersMemory[0][currentImage], 0,
+						sizeof(ubo), 0, &data);
+			memcpy(data, &ubo, sizeof(ubo));
+			vkUnmapMemory(device, entitySets[i].uniformBuffersMemory[0][currentImage]);
+		}
 	}
 };
 
 // This is the main: probably you do not need to touch this!
-int main()
+int main(int argc, char **argv)
 {
 	MyProject app;
 
 	try
 	{
-		app.run();
+		app.run(argc, argv);
 	}
 	catch (const std::exception &e)
 	{
+		Logger::get().flush();
 		std::cerr << e.what() << std::endl;
 		return EXIT_FAILURE;
 	}
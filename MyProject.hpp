@@ -14,6 +14,19 @@
 #include <algorithm>
 #include <fstream>
 #include <array>
+#include <cstdio>
+#include <cmath>
+#include <string>
+#include <map>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <random>
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
@@ -30,9 +43,295 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+#include "Profiler.hpp"
+#include "Logger.hpp"
+#include "Collision.hpp"
+#include "NavMesh.hpp"
+#include "Bvh.hpp"
+#include "Timeline.hpp"
+#include "Scene.hpp"
+#include "FileWatcher.hpp"
+#include "LightClusters.hpp"
+#include "ShadowAtlas.hpp"
+#include "DynamicResolution.hpp"
+
 //
 
-const int MAX_FRAMES_IN_FLIGHT = 2;
+// Frame pacing: can be changed in setWindowParameters() or from the
+// command line (--present-mode, --frames-in-flight, --swapchain-images,
+// --fps-limit)
+struct FramePacingConfig {
+	VkPresentModeKHR presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+	int framesInFlight = 2;
+	uint32_t swapChainImages = 0;	// 0: one more than the surface minimum
+	float fpsLimit = 0.0f;			// 0: no CPU frame limiter
+	float spinMicroseconds = 1500.0f;	// busy-wait this close to the deadline
+	float reportInterval = 5.0f;	// seconds between frame statistics reports
+};
+
+// Running mean/variance (Welford) of frame times and latencies
+struct FrameStats {
+	int frames = 0;
+	double meanFrameTime = 0.0, m2FrameTime = 0.0;
+	double minFrameTime = 1e30, maxFrameTime = 0.0;
+	int latencySamples = 0;
+	double meanLatency = 0.0, maxLatency = 0.0;
+	
+	void addFrameTime(double ms) {
+		frames++;
+		double delta = ms - meanFrameTime;
+		meanFrameTime += delta / frames;
+		m2FrameTime += delta * (ms - meanFrameTime);
+		minFrameTime = std::min(minFrameTime, ms);
+		maxFrameTime = std::max(maxFrameTime, ms);
+	}
+	
+	void addLatency(double ms) {
+		latencySamples++;
+		meanLatency += (ms - meanLatency) / latencySamples;
+		maxLatency = std::max(maxLatency, ms);
+	}
+	
+	void print(const char *label) const {
+		if (frames < 2) return;
+		LOG_INFO("%s: %d frames, frame time avg %g ms, stddev %g ms, min %g ms, "
+				 "max %g ms, input-to-GPU-done latency avg %g ms, max %g ms",
+				 label, frames, meanFrameTime, std::sqrt(m2FrameTime / (frames - 1)),
+				 minFrameTime, maxFrameTime, meanLatency, maxLatency);
+	}
+};
+
+// Average, percentiles and maximum of a set of timings in ms, as written
+// to the benchmark report
+struct TimingSummary {
+	size_t count = 0;
+	double avg = 0.0, p50 = 0.0, p95 = 0.0, p99 = 0.0, max = 0.0;
+	
+	static TimingSummary of(std::vector<double> samples) {
+		TimingSummary S;
+		S.count = samples.size();
+		if (samples.empty()) return S;
+		std::sort(samples.begin(), samples.end());
+		double sum = 0.0;
+		for (double v : samples) {
+			sum += v;
+		}
+		auto at = [&](double p) {
+			return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+		};
+		S.avg = sum / samples.size();
+		S.p50 = at(0.50);
+		S.p95 = at(0.95);
+		S.p99 = at(0.99);
+		S.max = samples.back();
+		return S;
+	}
+	
+	nlohmann::json toJson() const {
+		return {{"count", count}, {"avg", avg}, {"p50", p50}, {"p95", p95},
+				{"p99", p99}, {"max", max}};
+	}
+};
+
+// Camera keyframes, one "time x y z yaw pitch roll" line each (seconds,
+// world units, degrees; # starts a comment). Played back with linear
+// interpolation by the benchmark mode, or recorded from the live camera.
+struct CameraPath {
+	struct Key {
+		float time;
+		glm::vec3 pos;
+		glm::vec3 angles;	// yaw, pitch, roll in radians
+	};
+	std::vector<Key> keys;
+	bool playing = false;
+	std::ofstream recording;
+	
+	void load(const std::string &file) {
+		std::ifstream in(file);
+		if (!in) {
+			throw std::runtime_error("failed to open camera path " + file + "!");
+		}
+		std::string line;
+		while (std::getline(in, line)) {
+			line = line.substr(0, line.find('#'));
+			Key K;
+			if (sscanf(line.c_str(), "%f %f %f %f %f %f %f", &K.time,
+					   &K.pos.x, &K.pos.y, &K.pos.z,
+					   &K.angles.x, &K.angles.y, &K.angles.z) == 7) {
+				K.angles = glm::radians(K.angles);
+				if (!keys.empty() && K.time < keys.back().time) {
+					throw std::runtime_error("camera path keys out of order in " + file + "!");
+				}
+				keys.push_back(K);
+			}
+		}
+		if (keys.empty()) {
+			throw std::runtime_error("camera path " + file + " has no keys!");
+		}
+		playing = true;
+	}
+	
+	float duration() const {
+		return keys.empty() ? 0.0f : keys.back().time;
+	}
+	
+	// clamps to the first and last keys
+	void sample(float time, glm::vec3 &pos, float &yaw, float &pitch, float &roll) const {
+		auto next = std::upper_bound(keys.begin(), keys.end(), time,
+						[](float t, const Key &K) { return t < K.time; });
+		glm::vec3 angles;
+		if (next == keys.begin()) {
+			pos = next->pos;
+			angles = next->angles;
+		} else if (next == keys.end()) {
+			pos = keys.back().pos;
+			angles = keys.back().angles;
+		} else {
+			auto prev = next - 1;
+			float a = (time - prev->time) / std::max(next->time - prev->time, 1e-6f);
+			pos = glm::mix(prev->pos, next->pos, a);
+			angles = glm::mix(prev->angles, next->angles, a);
+		}
+		yaw = angles.x;
+		pitch = angles.y;
+		roll = angles.z;
+	}
+	
+	void startRecording(const std::string &file) {
+		recording.open(file);
+		if (!recording) {
+			throw std::runtime_error("failed to open " + file + "!");
+		}
+		recording << "# time x y z yaw pitch roll\n";
+	}
+	
+	void record(float time, const glm::vec3 &pos, float yaw, float pitch, float roll) {
+		if (recording.is_open()) {
+			recording << time << " " << pos.x << " " << pos.y << " " << pos.z << " " <<
+						 glm::degrees(yaw) << " " << glm::degrees(pitch) << " " <<
+						 glm::degrees(roll) << "\n";
+		}
+	}
+};
+
+// Single producer, single consumer triple buffer: the writer never waits
+// and the reader always gets the most recent complete value.
+template <typename T>
+class TripleBuffer {
+public:
+	T &writeBuffer() {
+		return buffers[back];
+	}
+	
+	void publish() {
+		back = middle.exchange(back | DIRTY, std::memory_order_acq_rel) & INDEX;
+	}
+	
+	// true if a newer value has been published since the last call
+	bool update() {
+		if (!(middle.load(std::memory_order_relaxed) & DIRTY)) {
+			return false;
+		}
+		front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+	
+	const T &read() const {
+		return buffers[front];
+	}
+
+private:
+	static const int INDEX = 3;
+	static const int DIRTY = 4;
+	T buffers[3];
+	int back = 0;
+	int front = 1;
+	std::atomic<int> middle{2};
+};
+
+// Per-frame input log (--record-input, --replay-input). Each frame stores
+// the virtual clock and the state of the keys of BaseProject::inputKeys
+// as a bitmask (12 bytes), so a replay goes through exactly the same
+// frames as the recording. The header holds the key codes and a hash of
+// the final simulation state, checked at the end of the replay.
+struct InputLog {
+	static const uint32_t VERSION = 1;
+	struct Frame {
+		double time;
+		uint32_t keys;
+	};
+	
+	std::vector<int> keys;
+	std::vector<Frame> frames;
+	size_t next = 0;
+	uint64_t stateHash = 0;
+	bool replaying = false;
+	std::ofstream out;
+	
+	bool recording() const {
+		return out.is_open();
+	}
+	
+	void startRecording(const std::string &file, const std::vector<int> &K) {
+		keys = K;
+		out.open(file, std::ios::binary);
+		if (!out) {
+			throw std::runtime_error("failed to open " + file + "!");
+		}
+		uint32_t version = VERSION;
+		uint32_t keyCount = keys.size();
+		out.write("INPL", 4);
+		out.write((const char *) &version, sizeof(version));
+		out.write((const char *) &stateHash, sizeof(stateHash));
+		out.write((const char *) &keyCount, sizeof(keyCount));
+		out.write((const char *) keys.data(), keyCount * sizeof(int32_t));
+	}
+	
+	void record(const Frame &F) {
+		if (recording()) {
+			out.write((const char *) &F.time, sizeof(F.time));
+			out.write((const char *) &F.keys, sizeof(F.keys));
+		}
+	}
+	
+	void finishRecording(uint64_t hash) {
+		if (!recording()) return;
+		out.seekp(8);
+		out.write((const char *) &hash, sizeof(hash));
+		out.close();
+	}
+	
+	void load(const std::string &file) {
+		std::ifstream in(file, std::ios::binary);
+		char magic[4];
+		uint32_t version = 0, keyCount = 0;
+		in.read(magic, 4);
+		in.read((char *) &version, sizeof(version));
+		in.read((char *) &stateHash, sizeof(stateHash));
+		in.read((char *) &keyCount, sizeof(keyCount));
+		if (!in || memcmp(magic, "INPL", 4) != 0 || version != VERSION || keyCount > 32) {
+			throw std::runtime_error("not a valid input log: " + file + "!");
+		}
+		keys.resize(keyCount);
+		in.read((char *) keys.data(), keyCount * sizeof(int32_t));
+		
+		Frame F;
+		while (in.read((char *) &F.time, sizeof(F.time)) &&
+			   in.read((char *) &F.keys, sizeof(F.keys))) {
+			frames.push_back(F);
+		}
+		replaying = true;
+	}
+	
+	bool nextFrame(Frame &F) {
+		if (next >= frames.size()) return false;
+		F = frames[next++];
+		return true;
+	}
+};
 
 // Lesson 22.0
 const std::vector<const char*> validationLayers = {
@@ -81,6 +380,27 @@ struct Vertex {
 						
 		return attributeDescriptions;
 	}
+	
+	// the position-only stream of Model::positionBuffer, for depth-only
+	// passes that fetch nothing else
+	static VkVertexInputBindingDescription getPositionBindingDescription() {
+		VkVertexInputBindingDescription bindingDescription{};
+		bindingDescription.binding = 0;
+		bindingDescription.stride = sizeof(glm::vec3);
+		bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+		
+		return bindingDescription;
+	}
+	
+	static VkVertexInputAttributeDescription getPositionAttributeDescription() {
+		VkVertexInputAttributeDescription attributeDescription{};
+		attributeDescription.binding = 0;
+		attributeDescription.location = 0;
+		attributeDescription.format = VK_FORMAT_R32G32B32_SFLOAT;
+		attributeDescription.offset = 0;
+		
+		return attributeDescription;
+	}
 };
 
 
@@ -172,30 +492,40 @@ void PrintVkError( VkResult result ) {
 			break;
 		}
 	}
-	std::cout << "Error: " << result << ", " << meaning << "\n";
+	LOG_ERROR("Error: %d, %s", (int) result, meaning.c_str());
+	// the caller is about to throw, make sure the message gets out
+	Logger::get().flush();
 }
 
 class BaseProject;
 
 struct Model {
 	BaseProject *BP;
+	std::string file;
 	std::vector<Vertex> vertices;
 	std::vector<uint32_t> indices;
 	VkBuffer vertexBuffer;
 	VkDeviceMemory vertexBufferMemory;
+	VkBuffer positionBuffer;		// just the positions, for depth-only passes
+	VkDeviceMemory positionBufferMemory;
 	VkBuffer indexBuffer;
 	VkDeviceMemory indexBufferMemory;
 	
 	void loadModel(std::string file);
 	void createIndexBuffer();
 	void createVertexBuffer();
+	void createPositionBuffer();
 
 	void init(BaseProject *bp, std::string file);
+	// swaps in new geometry, once the GPU is done with the old one
+	void reload(std::vector<Vertex> newVertices, std::vector<uint32_t> newIndices);
+	void destroyBuffers();
 	void cleanup();
 };
 
 struct Texture {
 	BaseProject *BP;
+	std::string file;
 	uint32_t mipLevels;
 	VkImage textureImage;
 	VkDeviceMemory textureImageMemory;
@@ -203,10 +533,15 @@ struct Texture {
 	VkSampler textureSampler;
 	
 	void createTextureImage(std::string file);
+	void createTextureImage(const stbi_uc *pixels, int texWidth, int texHeight);
 	void createTextureImageView();
 	void createTextureSampler();
 
 	void init(BaseProject *bp, std::string file);
+	// swaps in new RGBA pixels, once the GPU is done with the old image;
+	// the descriptor sets using the texture must be written again
+	void reload(const stbi_uc *pixels, int texWidth, int texHeight);
+	void destroyImage();
 	void cleanup();
 };
 
@@ -225,19 +560,119 @@ struct DescriptorSetLayout {
 	void cleanup();
 };
 
+// Everything that identifies a graphics pipeline: two equal descriptions
+// always resolve to the same VkPipeline through the PipelineRegistry.
+struct PipelineDescription {
+	std::string vertShader;
+	std::string fragShader;		// none for depth-only pipelines
+	std::vector<DescriptorSetLayout *> setLayouts;
+	VkRenderPass renderPass = VK_NULL_HANDLE;	// the main one when null
+	uint32_t colorAttachments = 1;
+	bool colorWrite = true;
+	bool positionOnly = false;	// reads Model::positionBuffer instead
+	// the value of specialization constant i of both shaders, as 32 bits:
+	// variants of a shader are descriptions that differ here
+	std::vector<uint32_t> specialization;
+	
+	VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL;
+	VkCullModeFlags cullMode = VK_CULL_MODE_BACK_BIT;
+	VkFrontFace frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	bool depthTest = true;
+	bool depthWrite = true;
+	VkCompareOp depthCompareOp = VK_COMPARE_OP_LESS;
+	bool blendEnable = false;
+	VkBlendFactor srcBlendFactor = VK_BLEND_FACTOR_ONE;
+	VkBlendFactor dstBlendFactor = VK_BLEND_FACTOR_ZERO;
+	uint32_t subpass = 0;
+	
+	size_t hash() const;
+	bool operator==(const PipelineDescription &other) const;
+};
+
 struct Pipeline {
 	BaseProject *BP;
 	VkPipeline graphicsPipeline;
   	VkPipelineLayout pipelineLayout;
   	
+  	// init() creates the pipeline right away, request() defers it to the
+  	// batch compiled in parallel once localInit() has returned.
   	void init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
   			  std::vector<DescriptorSetLayout *> D);
-  	VkShaderModule createShaderModule(const std::vector<char>& code);
+  	void init(BaseProject *bp, const PipelineDescription &desc);
+  	void request(BaseProject *bp, const PipelineDescription &desc);
   	static std::vector<char> readFile(const std::string& filename);  	
 	void cleanup();
 };
 
-enum DescriptorSetElementType {UNIFORM, TEXTURE};
+// A compute shader and its layout. The module and the layout come from
+// the PipelineRegistry, the pipeline itself is owned here.
+struct ComputePipeline {
+	BaseProject *BP;
+	VkPipeline computePipeline;
+	VkPipelineLayout pipelineLayout;
+
+	void init(BaseProject *bp, const std::string &Shader, std::vector<DescriptorSetLayout *> D);
+	void cleanup();
+};
+
+// Owns every VkPipeline, VkPipelineLayout and VkShaderModule of the
+// application. Identical descriptions share one pipeline (reference
+// counted), and shader modules are loaded once per file.
+struct PipelineRegistry {
+	struct Entry {
+		PipelineDescription desc;
+		size_t hash;
+		VkPipeline pipeline = VK_NULL_HANDLE;
+		VkPipelineLayout layout = VK_NULL_HANDLE;
+		int refCount = 0;
+		std::vector<Pipeline *> waiting;
+		std::vector<Pipeline *> users;	// updated when a shader is reloaded
+	};
+
+	BaseProject *BP;
+	std::vector<std::unique_ptr<Entry>> entries;
+	std::vector<Entry *> pending;
+	std::map<std::string, VkShaderModule> shaderModules;
+	std::map<std::vector<VkDescriptorSetLayout>, VkPipelineLayout> layouts;
+	
+	void init(BaseProject *bp);
+	Entry *acquire(const PipelineDescription &desc);
+	void request(Pipeline *P, const PipelineDescription &desc);
+	void createPending();
+	void release(Pipeline *P);
+	bool reloadShader(const std::string &file, const std::vector<char> &code);
+	void cleanup();
+
+	Entry *find(const PipelineDescription &desc, size_t hash);
+	void prepare(Entry *E);
+	VkResult compile(Entry *E);
+	VkShaderModule getShaderModule(const std::string &file);
+	VkResult createShaderModule(const std::vector<char> &code, VkShaderModule &module);
+	VkPipelineLayout getPipelineLayout(const std::vector<DescriptorSetLayout *> &D);
+};
+
+// A depth image kept from frame to frame, which a render pass of its own
+// draws into a region at a time and which shaders then sample, such as
+// the shadow atlas. Between passes it is in the shader read layout.
+struct DepthTarget {
+	BaseProject *BP;
+	uint32_t width;
+	uint32_t height;
+	Texture texture;		// the image, a view and a nearest sampler, for descriptor sets
+	VkRenderPass renderPass;
+	VkFramebuffer framebuffer;
+
+	void init(BaseProject *bp, uint32_t width, uint32_t height);
+	// begins the render pass, keeping what the image holds
+	void begin(VkCommandBuffer commandBuffer);
+	// clears a region and points the viewport and scissor to it
+	void clearRegion(VkCommandBuffer commandBuffer, VkRect2D region);
+	void end(VkCommandBuffer commandBuffer);
+	void cleanup();
+};
+
+enum DescriptorSetElementType {UNIFORM, TEXTURE, STORAGE};
 
 struct DescriptorSetElement {
 	int binding;
@@ -246,18 +681,162 @@ struct DescriptorSetElement {
 	Texture *tex;
 };
 
+// Hands out the descriptor sets from a list of pools, adding a pool, twice
+// as large as the last, whenever the current one runs out, so nothing has
+// to be counted ahead. The sets of a destroyed DescriptorSet are kept per
+// layout and handed out again, once the GPU is done with the frames that
+// may use them. Transient sets, for a single frame, come from pools of
+// their own per frame in flight, all reset at once when the frame comes
+// around again.
+struct DescriptorAllocator {
+	static const uint32_t FIRST_POOL_SETS = 64;
+	static const uint32_t MAX_POOL_SETS = 4096;
+
+	struct FramePools {
+		std::vector<VkDescriptorPool> pools;
+		size_t used = 0;		// allocated from since the reset, the last one current
+	};
+
+	BaseProject *BP;
+	std::vector<VkDescriptorPool> pools;	// the last one current
+	uint32_t nextPoolSets = FIRST_POOL_SETS;
+	std::map<VkDescriptorSetLayout, std::vector<VkDescriptorSet>> freeSets;
+	// bumped by forgetLayout(), so that a set freed before is not handed
+	// out for another layout that got the same handle
+	std::map<VkDescriptorSetLayout, uint32_t> layoutGenerations;
+	std::vector<FramePools> frames;
+
+	void init(BaseProject *bp, size_t framesInFlight);
+	VkDescriptorSet allocate(VkDescriptorSetLayout layout);
+	// recycled through deferDestroy(): the command buffers already
+	// recorded may still use the set
+	void free(VkDescriptorSetLayout layout, VkDescriptorSet set);
+	// when the layout is destroyed: its sets stay in their pool, unused
+	void forgetLayout(VkDescriptorSetLayout layout);
+	// valid until resetFrame() of the same frame
+	VkDescriptorSet allocateTransient(VkDescriptorSetLayout layout, size_t frame);
+	// once the GPU is done with the frame
+	void resetFrame(size_t frame);
+	// after the deletions deferred by free() have run
+	void cleanup();
+
+	VkDescriptorPool createPool(uint32_t sets);
+	VkResult allocateFrom(VkDescriptorPool pool, VkDescriptorSetLayout layout,
+						  VkDescriptorSet &set);
+};
+
 struct DescriptorSet {
 	BaseProject *BP;
+	VkDescriptorSetLayout layout;
 
 	std::vector<std::vector<VkBuffer>> uniformBuffers;
 	std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
 	std::vector<VkDescriptorSet> descriptorSets;
 	
 	std::vector<bool> toFree;
+	std::vector<DescriptorSetElement> elements;
 
 	void init(BaseProject *bp, DescriptorSetLayout *L,
 		std::vector<DescriptorSetElement> E);
+	// points the sets at the current buffers and textures of the elements
+	void writeDescriptors();
+	// a set for the current frame alone, pointing at the buffers of image
+	// i, from the transient pools: for the command buffers recorded every
+	// frame. Only the first elementCount elements are written.
+	VkDescriptorSet transientSet(size_t i, size_t elementCount);
+	void writeSet(VkDescriptorSet set, size_t i, size_t elementCount);
+	// the buffers and sets, one of each per swap chain image: made again
+	// when the number of images changes
+	void createPerImage();
+	void destroyPerImage();
+	void cleanup();
+};
+
+// GPU timings of named regions of the command buffers (--gpu-profile,
+// --gpu-profile-csv). Command buffers are recorded once per swap chain
+// image, so each of them owns a query pool that it resets itself; the
+// results are read without waiting once the image's previous submission
+// is known to be complete.
+struct GpuProfiler {
+	static const uint32_t MAX_QUERIES = 64;
+	static const int HISTORY = 256;
+
+	struct Region {
+		std::string name;
+		std::vector<double> samples;	// ring buffer of the last HISTORY frames, ms
+		int count = 0;
+		double last = 0.0;
+		std::vector<double> all;		// every sample, with keepAllSamples
+	};
+	struct QueryPool {
+		VkQueryPool pool = VK_NULL_HANDLE;
+		uint32_t used = 0;
+		std::vector<int> regionOfPair;	// query pair -> region
+		bool submitted = false;
+	};
+
+	BaseProject *BP;
+	bool enabled = false;
+	bool supported = false;
+	bool keepAllSamples = false;
+	double timestampPeriod = 1.0;	// ns per tick
+	uint64_t timestampMask = ~0ull;
+	std::vector<QueryPool> pools;
+	std::vector<Region> regions;
+	std::vector<std::pair<int, uint32_t>> openRegions;	// region, begin query
+	uint32_t recording = 0;
+	std::string csvFile;
+	std::ofstream csv;
+	uint64_t frame = 0;
+
+	void init(BaseProject *bp, uint32_t commandBufferCount);
+	// a query pool per command buffer, when their number changes
+	void resize(uint32_t commandBufferCount);
 	void cleanup();
+
+	// recording: beginCommandBuffer() must come before any region and
+	// outside a render pass
+	void beginCommandBuffer(VkCommandBuffer commandBuffer, uint32_t index);
+	void beginRegion(VkCommandBuffer commandBuffer, const std::string &name);
+	void endRegion(VkCommandBuffer commandBuffer);
+
+	// frame loop: collect() once the command buffer is idle again,
+	// submitted() right after queueing it
+	void collect(uint32_t index);
+	void submitted(uint32_t index);
+	void clearAllSamples();
+
+	int findRegion(const std::string &name) const;
+	double average(int region) const;
+	double percentile(int region, double p) const;
+	void report() const;
+};
+
+// Fragments that passed the depth test in the draws between begin() and
+// end(), with one occlusion query per command buffer, reset and read back
+// the same way as the timestamps of GpuProfiler. Divided by the pixels of
+// the window, it tells how many times each of them was shaded.
+struct FragmentCounter {
+	BaseProject *BP;
+	VkQueryPool pool = VK_NULL_HANDLE;
+	bool precise = false;		// else only zero or not is guaranteed
+	std::vector<bool> recorded;
+	std::vector<bool> pending;
+	uint64_t fragments = 0;		// since the last report
+	uint64_t pixels = 0;
+	uint64_t last = 0;
+	
+	void init(BaseProject *bp, uint32_t commandBufferCount, bool preciseQueries);
+	void cleanup();
+	
+	// beginCommandBuffer() outside the render pass, the others inside
+	void beginCommandBuffer(VkCommandBuffer commandBuffer, uint32_t index);
+	void begin(VkCommandBuffer commandBuffer, uint32_t index);
+	void end(VkCommandBuffer commandBuffer, uint32_t index);
+	
+	void collect(uint32_t index, VkExtent2D extent);
+	void submitted(uint32_t index);
+	void report();
 };
 
 
@@ -266,16 +845,34 @@ class BaseProject {
 	friend class Model;
 	friend class Texture;
 	friend class Pipeline;
+	friend class ComputePipeline;
+	friend class DepthTarget;
+	friend class PipelineRegistry;
 	friend class DescriptorSetLayout;
 	friend class DescriptorSet;
+	friend class DescriptorAllocator;
+	friend class GpuProfiler;
+	friend class FragmentCounter;
 public:
 	virtual void setWindowParameters() = 0;
-    void run() {
+    void run(int argc = 0, char **argv = nullptr) {
     	setWindowParameters();
-        initWindow();
+    	parseCommandLine(argc, argv);
+        if (!headless) {
+        	initWindow();
+        }
         initVulkan();
-        mainLoop();
+        try {
+        	mainLoop();
+        } catch (...) {
+        	stopHotReload();
+        	stopSimulation();
+        	throw;
+        }
         cleanup();
+        if (!traceFile.empty()) {
+        	Profiler::get().writeChromeTrace(traceFile);
+        }
     }
 
 protected:
@@ -283,9 +880,82 @@ protected:
 	uint32_t windowHeight;
 	std::string windowTitle;
 	VkClearColorValue initialBackgroundColor;
-	int uniformBlocksInPool;
-	int texturesInPool;
-	int setsInPool;
+	FramePacingConfig framePacing;
+	std::string traceFile;
+	
+	// Headless mode (--headless): no window, surface or swap chain; the
+	// frames are rendered into offscreen images standing in for the swap
+	// chain ones, and can be written to PNG files (--png prefix).
+	bool headless = false;
+	int frameLimit = 0;				// --frames, 0: until the window is closed
+	uint64_t frameNumber = 0;
+	std::string pngPrefix;
+	int pngInterval = 1;
+	std::vector<VkDeviceMemory> offscreenImagesMemory;
+	
+	// Virtual clock: with a fixed time step (--fixed-dt, --benchmark)
+	// every frame advances it by exactly that much, so that runs are
+	// reproducible whatever the frame rate. Sampled once per frame, with
+	// the input, by sampleInput().
+	float fixedTimeStep = 0.0f;
+	std::chrono::steady_clock::time_point startTime;
+	double clockTime = 0.0;
+	
+	// Keys read through getKey(), set in setWindowParameters(); at most 32
+	std::vector<int> inputKeys;
+	std::atomic<uint32_t> inputState{0};
+	InputLog inputLog;
+	std::string recordInputFile;
+	
+	// Fixed-rate simulation: simulationStep() runs every 1/simulationRate
+	// seconds on its own thread, reading the input sampled by the frame
+	// loop. Runs that must be reproducible (fixed time step, input
+	// recording or replay, --sim-thread off) execute the steps due before
+	// each frame on the main thread instead.
+	float simulationRate = 60.0f;
+	bool simulationThreaded = true;
+	std::thread simulationThread;
+	std::atomic<bool> simulationRunning{false};
+	std::exception_ptr simulationError;		// rethrown by the frame loop
+	uint64_t simulationTicks = 0;
+	
+	// Benchmark mode (--benchmark camera_path.txt): the camera follows the
+	// path at a fixed time step and the CPU/GPU frame times after the
+	// warm-up are written as JSON (--benchmark-report).
+	CameraPath cameraPath;
+	std::string cameraPathFile;
+	std::string benchmarkReport = "benchmark.json";
+	int benchmarkWarmup = 30;
+	std::vector<double> benchmarkFrameTimes;
+	
+	// Hot reload (--hot-reload): the shaders, models and textures that
+	// change on disk are read and decoded on worker threads, then swapped
+	// in between two frames once the GPU is done with the old ones.
+	struct ReloadedFile {
+		std::string file;
+		bool shader = false;
+		bool model = false;
+		bool texture = false;
+		std::vector<char> code;
+		Model mesh;
+		std::vector<stbi_uc> pixels;
+		int width = 0;
+		int height = 0;
+		std::string error;
+		double loadMs = 0.0;
+	};
+	bool hotReload = false;
+	FileWatcher fileWatcher;
+	// a single loader thread, so that the profiler registers it only once
+	std::thread reloadThread;
+	std::mutex reloadMutex;
+	std::condition_variable reloadWake;
+	std::deque<ReloadedFile> reloadsToLoad;
+	std::vector<ReloadedFile> reloadsLoaded;
+	bool reloadThreadStop = false;
+	std::vector<Model *> loadedModels;
+	std::vector<Texture *> loadedTextures;
+	std::vector<DescriptorSet *> allocatedDescriptorSets;
 
 	// Lesson 12
     GLFWwindow* window;
@@ -299,9 +969,17 @@ protected:
     VkQueue presentQueue;
 	VkCommandPool commandPool;
 	std::vector<VkCommandBuffer> commandBuffers;
+	// bumped by outdateCommandBuffers(); what each buffer was recorded at
+	uint64_t commandBufferGeneration = 0;
+	std::vector<uint64_t> recordedGenerations;
+	// and the extent each renders the scene at, for fragmentCounter
+	std::vector<VkExtent2D> recordedExtents;
+	// recorded again every frame, see populateFrameCommands()
+	VkCommandPool frameCommandPool;
+	std::vector<VkCommandBuffer> frameCommandBuffers;
 
     // Lesson 14
-    VkSwapchainKHR swapChain;
+    VkSwapchainKHR swapChain = VK_NULL_HANDLE;
     std::vector<VkImage> swapChainImages;
 	VkFormat swapChainImageFormat;
 	VkExtent2D swapChainExtent;
@@ -310,7 +988,7 @@ protected:
 	// Lesson 19
 	VkRenderPass renderPass;
 	
- 	VkDescriptorPool descriptorPool;
+ 	DescriptorAllocator descriptorAllocator;
 
 	// Lesson 22
 	// L22.0 --- Debugging
@@ -331,36 +1009,380 @@ protected:
 	std::vector<VkFence> inFlightFences;
 	std::vector<VkFence> imagesInFlight;
 	
+	// Optional VK_KHR_timeline_semaphore backend (--sync timeline).
+	// Every submission to the graphics queue gets the next value of a
+	// monotonic counter; with timeline semaphores the GPU signals exactly
+	// that value, otherwise completion is inferred from the frame fences.
+	// Frames, uploads and deferred deletions are all tracked by value.
+	bool useTimelineSemaphores = false;
+	VkSemaphore timelineSemaphore = VK_NULL_HANDLE;
+	PFN_vkWaitSemaphoresKHR pfnWaitSemaphores = nullptr;
+	PFN_vkGetSemaphoreCounterValueKHR pfnGetSemaphoreCounterValue = nullptr;
+	uint64_t lastSubmittedValue = 0;
+	uint64_t lastCompletedValue = 0;
+	std::vector<uint64_t> frameSubmitValues;
+	std::vector<uint64_t> imageSubmitValues;
+	std::deque<std::pair<uint64_t, std::function<void()>>> deletionQueue;
+	
+	// Set by GLFW when the window changes size
+	bool framebufferResized = false;
+	
+	// Frame pacing and statistics
+	std::chrono::steady_clock::time_point lastFrameStart;
+	std::chrono::steady_clock::time_point nextFrameDeadline;
+	std::chrono::steady_clock::time_point lastReport;
+	std::chrono::steady_clock::time_point lastInputTime;
+	std::vector<std::chrono::steady_clock::time_point> frameInputTimes;
+	FrameStats intervalStats;
+	FrameStats totalStats;
+	
+	// Command line options shared by every project; a project can add
+	// its own by overriding parseOption()
+	void parseCommandLine(int argc, char **argv) {
+		for (int i = 1; i < argc; i++) {
+			std::string arg = argv[i];
+			auto value = [&]() -> std::string {
+				if (i + 1 >= argc) {
+					throw std::runtime_error("missing value for " + arg);
+				}
+				return argv[++i];
+			};
+			
+			if (arg == "--present-mode") {
+				std::string mode = value();
+				if (mode == "fifo") {
+					framePacing.presentMode = VK_PRESENT_MODE_FIFO_KHR;
+				} else if (mode == "mailbox") {
+					framePacing.presentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+				} else if (mode == "immediate") {
+					framePacing.presentMode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+				} else {
+					throw std::runtime_error("unknown present mode " + mode);
+				}
+			} else if (arg == "--frames-in-flight") {
+				framePacing.framesInFlight = std::max(1, std::stoi(value()));
+			} else if (arg == "--swapchain-images") {
+				framePacing.swapChainImages = std::stoi(value());
+			} else if (arg == "--fps-limit") {
+				framePacing.fpsLimit = std::stof(value());
+			} else if (arg == "--sync") {
+				std::string mode = value();
+				if (mode != "binary" && mode != "timeline") {
+					throw std::runtime_error("unknown sync backend " + mode);
+				}
+				useTimelineSemaphores = (mode == "timeline");
+			} else if (arg == "--log-level") {
+				Logger::get().setLevel(Logger::parseLevel(value()));
+			} else if (arg == "--log-file") {
+				Logger::get().setFile(value());
+			} else if (arg == "--trace") {
+				// started right away so that the startup is in the trace
+				traceFile = value();
+				Profiler::get().start();
+			} else if (arg == "--gpu-profile") {
+				gpuProfiler.enabled = true;
+			} else if (arg == "--gpu-profile-csv") {
+				gpuProfiler.enabled = true;
+				gpuProfiler.csvFile = value();
+			} else if (arg == "--headless") {
+				headless = true;
+			} else if (arg == "--frames") {
+				frameLimit = std::stoi(value());
+			} else if (arg == "--png") {
+				pngPrefix = value();
+			} else if (arg == "--png-interval") {
+				pngInterval = std::max(1, std::stoi(value()));
+			} else if (arg == "--fixed-dt") {
+				fixedTimeStep = std::stof(value());
+			} else if (arg == "--benchmark") {
+				cameraPathFile = value();
+				cameraPath.load(cameraPathFile);
+			} else if (arg == "--benchmark-report") {
+				benchmarkReport = value();
+			} else if (arg == "--benchmark-warmup") {
+				benchmarkWarmup = std::max(0, std::stoi(value()));
+			} else if (arg == "--hot-reload") {
+				hotReload = true;
+			} else if (arg == "--dynamic-resolution") {
+				dynamicResolution = true;
+				resolutionScaler = ResolutionScaler(std::stof(value()));
+			} else if (arg == "--sim-rate") {
+				simulationRate = std::stof(value());
+				if (simulationRate <= 0.0f) {
+					throw std::runtime_error("--sim-rate must be positive");
+				}
+			} else if (arg == "--sim-thread") {
+				std::string mode = value();
+				if (mode != "on" && mode != "off") {
+					throw std::runtime_error("--sim-thread takes on or off");
+				}
+				simulationThreaded = (mode == "on");
+			} else if (arg == "--record-input") {
+				recordInputFile = value();
+			} else if (arg == "--replay-input") {
+				inputLog.load(value());
+			} else if (arg == "--record-camera-path") {
+				cameraPath.startRecording(value());
+			} else if (!parseOption(argc, argv, i)) {
+				throw std::runtime_error("unknown option " + arg);
+			}
+		}
+		
+		if (cameraPath.playing) {
+			if (fixedTimeStep <= 0.0f) {
+				fixedTimeStep = 1.0f / 60.0f;
+			}
+			if (frameLimit <= 0) {
+				frameLimit = (int) std::ceil(cameraPath.duration() / fixedTimeStep) + 1;
+			}
+			if (frameLimit <= benchmarkWarmup) {
+				throw std::runtime_error("benchmark has no frames after the warm-up");
+			}
+			gpuProfiler.enabled = true;
+			gpuProfiler.keepAllSamples = true;
+		}
+		if (dynamicResolution) {
+			// their SPIR-V is compiled by hand, see the top of the shaders
+			for (const char *file : {"shaders/upscale_vert.spv", "shaders/upscale_frag.spv"}) {
+				if (dynamicResolution && !std::ifstream(file)) {
+					LOG_WARN("%s is missing: rendering at full resolution", file);
+					dynamicResolution = false;
+				}
+			}
+			// the scale follows the GPU time of the frames
+			if (dynamicResolution && !gpuProfiler.enabled) {
+				LOG_INFO("--dynamic-resolution turns on the GPU profiler");
+				gpuProfiler.enabled = true;
+			}
+		}
+		if (inputKeys.size() > 32) {
+			throw std::runtime_error("at most 32 keys can be listed in inputKeys");
+		}
+		if (!recordInputFile.empty()) {
+			if (inputLog.replaying) {
+				throw std::runtime_error("cannot record and replay the input at once");
+			}
+			inputLog.startRecording(recordInputFile, inputKeys);
+		}
+		if (inputLog.replaying && inputLog.keys != inputKeys) {
+			throw std::runtime_error("input log was recorded with different keys");
+		}
+		if (fixedTimeStep > 0.0f || inputLog.recording() || inputLog.replaying) {
+			simulationThreaded = false;
+		}
+		if (headless && frameLimit <= 0 && !inputLog.replaying) {
+			throw std::runtime_error("--headless needs --frames");
+		}
+		if (!pngPrefix.empty() && !headless) {
+			throw std::runtime_error("--png is only supported with --headless");
+		}
+	}
+	
+	// Seconds since the main loop started, on the virtual clock
+	double getTime() {
+		return clockTime;
+	}
+	
+	// Keyboard state as sampled at the start of the frame. Keys not in
+	// inputKeys are read directly, and cannot be recorded or replayed.
+	int getKey(int key) {
+		for (size_t i = 0; i < inputKeys.size(); i++) {
+			if (inputKeys[i] == key) {
+				return (inputState.load(std::memory_order_relaxed) >> i) & 1 ?
+						GLFW_PRESS : GLFW_RELEASE;
+			}
+		}
+		// GLFW can only be queried from the main thread
+		if (inputLog.recording() || inputLog.replaying || simulationThreaded) {
+			throw std::runtime_error("key " + std::to_string(key) +
+									 " is not listed in inputKeys");
+		}
+		return headless ? GLFW_RELEASE : glfwGetKey(window, key);
+	}
+	
+	// Takes the clock and the keys for this frame, from the window or from
+	// the input log; false once a replay has run out of frames.
+	bool sampleInput() {
+		InputLog::Frame F;
+		if (inputLog.replaying) {
+			if (!inputLog.nextFrame(F)) {
+				return false;
+			}
+		} else {
+			if (fixedTimeStep > 0.0f) {
+				F.time = frameNumber * (double) fixedTimeStep;
+			} else {
+				F.time = std::chrono::duration<double>(
+							std::chrono::steady_clock::now() - startTime).count();
+			}
+			F.keys = 0;
+			for (size_t i = 0; i < inputKeys.size() && !headless; i++) {
+				if (glfwGetKey(window, inputKeys[i]) == GLFW_PRESS) {
+					F.keys |= 1u << i;
+				}
+			}
+			inputLog.record(F);
+		}
+		clockTime = F.time;
+		inputState.store(F.keys, std::memory_order_relaxed);
+		return true;
+	}
+	
+	// Gameplay logic, at a fixed rate; time is the simulated time at the
+	// end of the step.
+	virtual void simulationStep(double time, float dt) {
+	}
+	
+	// How far the frame is between the previous simulation step and the
+	// one that ended at stepTime, for interpolating the published state.
+	float interpolationAlpha(double stepTime) {
+		return (float) glm::clamp((getTime() - stepTime) * simulationRate, 0.0, 1.0);
+	}
+	
+	void startSimulation() {
+		if (!simulationThreaded) {
+			return;
+		}
+		simulationRunning = true;
+		simulationThread = std::thread([this]() {
+			Profiler::get().setThreadName("simulation");
+			double dt = 1.0 / simulationRate;
+			while (simulationRunning) {
+				double stepTime = (simulationTicks + 1) * dt;
+				// a late step does not wait: the simulation catches up
+				std::this_thread::sleep_until(startTime +
+					std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+						std::chrono::duration<double>(stepTime)));
+				PROFILE_ZONE("simulationStep");
+				try {
+					simulationStep(stepTime, (float) dt);
+				} catch (...) {
+					simulationError = std::current_exception();
+					simulationRunning = false;
+				}
+				simulationTicks++;
+			}
+		});
+	}
+	
+	void stopSimulation() {
+		if (simulationThread.joinable()) {
+			simulationRunning = false;
+			simulationThread.join();
+		}
+		if (simulationError) {
+			std::exception_ptr error = simulationError;
+			simulationError = nullptr;
+			std::rethrow_exception(error);
+		}
+	}
+	
+	// Single-threaded mode: runs the steps due by this frame's time
+	void advanceSimulation() {
+		double dt = 1.0 / simulationRate;
+		while ((simulationTicks + 1) * dt <= clockTime) {
+			PROFILE_ZONE("simulationStep");
+			simulationTicks++;
+			simulationStep(simulationTicks * dt, (float) dt);
+		}
+	}
+	
+	// Overridden by projects that want --replay-input to check that the
+	// replay ended in the same state as the recording; 0: no check.
+	virtual uint64_t hashSimulationState() {
+		return 0;
+	}
+	
+	// FNV-1a, for hashSimulationState()
+	static uint64_t hashBytes(const void *data, size_t size,
+							  uint64_t hash = 14695981039346656037ull) {
+		const unsigned char *bytes = (const unsigned char *) data;
+		for (size_t i = 0; i < size; i++) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+	
+	virtual bool parseOption(int argc, char **argv, int &i) {
+		return false;
+	}
+	
+	// Pipeline cache, persisted to disk between runs
+	VkPhysicalDeviceProperties physicalDeviceProperties;
+	VkPipelineCache pipelineCache = VK_NULL_HANDLE;
+	std::string pipelineCacheFile;
+	
+	PipelineRegistry pipelineRegistry;
+	GpuProfiler gpuProfiler;
+	FragmentCounter fragmentCounter;
+	bool occlusionQueryPrecise = false;
+	
+	// Dynamic resolution (--dynamic-resolution <GPU ms>): renderPass draws
+	// the scene into the top left corner of sceneColor, renderScale times
+	// the window on each side, and presentRenderPass upscales it into the
+	// swap chain image. The scale follows the "Frame" GPU timings.
+	bool dynamicResolution = false;
+	ResolutionScaler resolutionScaler;
+	float renderScale = 1.0f;
+	int frameTimings = 0;			// samples of "Frame" already seen
+	Texture sceneColor;
+	VkFramebuffer sceneFramebuffer;
+	VkRenderPass presentRenderPass;
+	DescriptorSetLayout upscaleSetLayout;
+	DescriptorSet upscaleSet;
+	Pipeline upscalePipeline;
+	
 	// Lesson 12
     void initWindow() {
         glfwInit();
 
         glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-        glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+        glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
 
         window = glfwCreateWindow(windowWidth, windowHeight, windowTitle.c_str(), nullptr, nullptr);
+        glfwSetWindowUserPointer(window, this);
+        glfwSetFramebufferSizeCallback(window, framebufferResizeCallback);
+    }
+    
+    static void framebufferResizeCallback(GLFWwindow* window, int width, int height) {
+    	auto app = reinterpret_cast<BaseProject*>(glfwGetWindowUserPointer(window));
+    	app->framebufferResized = true;
     }
 
 	virtual void localInit() = 0;
 
 	// Lesson 12
     void initVulkan() {
+    	PROFILE_ZONE("initVulkan");
 		createInstance();				// L12
 		setupDebugMessenger();			// L22.0
 		createSurface();				// L13
 		pickPhysicalDevice();			// L14
 		createLogicalDevice();			// L14
+		createPipelineCache();
+		createTimelineSemaphore();
 		createSwapChain();				// L15
 		createImageViews();				// L15
 		createRenderPass();				// L19
 		createCommandPool();			// L13
 		createDepthResources();			// L22.1
 		createFramebuffers();			// L22.2
-		createDescriptorPool();			// L21
+		descriptorAllocator.init(this, framePacing.framesInFlight);	// L21
 
-		localInit();
+		pipelineRegistry.init(this);
+		if (dynamicResolution) {
+			createUpscale();
+		}
+		{
+			PROFILE_ZONE("localInit");
+			localInit();
+		}
+		pipelineRegistry.createPending();
 
+		gpuProfiler.init(this, swapChainImages.size());
+		fragmentCounter.init(this, swapChainImages.size(), occlusionQueryPrecise);
 		createCommandBuffers();			// L22.5 (13)
+		createFrameCommandBuffers();
 		createSyncObjects();			// L22.3 
     }
 
@@ -378,13 +1400,6 @@ protected:
 		createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
 		createInfo.pApplicationInfo = &appInfo;
 
-		uint32_t glfwExtensionCount = 0;
-		const char** glfwExtensions;
-		glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
-				
-		createInfo.enabledExtensionCount = glfwExtensionCount;
-		createInfo.ppEnabledExtensionNames = glfwExtensions;
-
 		createInfo.enabledLayerCount = 0;
 
 		auto extensions = getRequiredExtensions();
@@ -418,17 +1433,47 @@ protected:
     // Lesson 12 and L22.0
     std::vector<const char*> getRequiredExtensions() {
 		uint32_t glfwExtensionCount = 0;
-		const char** glfwExtensions;
-		glfwExtensions =
-			glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+		const char** glfwExtensions = nullptr;
+		// no surface extensions without a window
+		if (!headless) {
+			glfwExtensions =
+				glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+		}
 
 		std::vector<const char*> extensions(glfwExtensions,
 			glfwExtensions + glfwExtensionCount);
 			extensions.push_back(VK_EXT_DEBUG_UTILS_EXTENSION_NAME);
 		
+		// needed on Vulkan 1.0 to query the timeline semaphore feature
+		if (useTimelineSemaphores) {
+			if (checkInstanceExtensionSupport(
+					VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME)) {
+				extensions.push_back(
+					VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
+			} else {
+				LOG_WARN("Timeline semaphores not available, using binary sync");
+				useTimelineSemaphores = false;
+			}
+		}
+		
 		return extensions;
 	}
 	
+	bool checkInstanceExtensionSupport(const char *name) {
+		uint32_t extensionCount;
+		vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount, nullptr);
+		std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+		vkEnumerateInstanceExtensionProperties(nullptr, &extensionCount,
+					availableExtensions.data());
+		
+		for (const auto& extension : availableExtensions) {
+			if (strcmp(extension.extensionName, name) == 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+	
 	// Lesson 22.0 - debug support
 	bool checkValidationLayerSupport() {
 		uint32_t layerCount;
@@ -497,6 +1542,9 @@ protected:
 
 	// Lesson 13
     void createSurface() {
+    	if (headless) {
+    		return;
+    	}
     	if (glfwCreateWindowSurface(instance, window, nullptr, &surface)
     			!= VK_SUCCESS) {
 			throw std::runtime_error("failed to create window surface!");
@@ -515,7 +1563,7 @@ protected:
 		std::vector<VkPhysicalDevice> devices(deviceCount);
 		vkEnumeratePhysicalDevices(instance, &deviceCount, devices.data());
 		
-		std::cout << "Physical devices found: " << deviceCount << "\n";
+		LOG_INFO("Physical devices found: %u", deviceCount);
 		
 		for (const auto& device : devices) {
 			if (isDeviceSuitable(device)) {
@@ -527,16 +1575,56 @@ protected:
 		if (physicalDevice == VK_NULL_HANDLE) {
 			throw std::runtime_error("failed to find a suitable GPU!");
 		}
+		
+		vkGetPhysicalDeviceProperties(physicalDevice, &physicalDeviceProperties);
+		
+		if (useTimelineSemaphores && !checkTimelineSemaphoreSupport(physicalDevice)) {
+			LOG_WARN("Timeline semaphores not supported by the device, using binary sync");
+			useTimelineSemaphores = false;
+		}
     }
+    
+    bool checkTimelineSemaphoreSupport(VkPhysicalDevice device) {
+		uint32_t extensionCount;
+		vkEnumerateDeviceExtensionProperties(device, nullptr,
+					&extensionCount, nullptr);
+		std::vector<VkExtensionProperties> availableExtensions(extensionCount);
+		vkEnumerateDeviceExtensionProperties(device, nullptr,
+					&extensionCount, availableExtensions.data());
+		
+		bool found = false;
+		for (const auto& extension : availableExtensions) {
+			if (strcmp(extension.extensionName,
+					   VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME) == 0) {
+				found = true;
+			}
+		}
+		
+		auto getFeatures2 = (PFN_vkGetPhysicalDeviceFeatures2KHR)
+				vkGetInstanceProcAddr(instance, "vkGetPhysicalDeviceFeatures2KHR");
+		if (!found || getFeatures2 == nullptr) {
+			return false;
+		}
+		
+		VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures{};
+		timelineFeatures.sType =
+			VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+		VkPhysicalDeviceFeatures2KHR features2{};
+		features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+		features2.pNext = &timelineFeatures;
+		getFeatures2(device, &features2);
+		
+		return timelineFeatures.timelineSemaphore == VK_TRUE;
+	}
 
 	// Lesson 13
     bool isDeviceSuitable(VkPhysicalDevice device) {
  		QueueFamilyIndices indices = findQueueFamilies(device);
 
-		bool extensionsSupported = checkDeviceExtensionSupport(device);
+		bool extensionsSupported = headless || checkDeviceExtensionSupport(device);
 
-		bool swapChainAdequate = false;
-		if (extensionsSupported) {
+		bool swapChainAdequate = headless;
+		if (extensionsSupported && !headless) {
 			SwapChainSupportDetails swapChainSupport = querySwapChainSupport(device);
 			swapChainAdequate = !swapChainSupport.formats.empty() &&
 								!swapChainSupport.presentModes.empty();
@@ -567,9 +1655,14 @@ protected:
 				indices.graphicsFamily = i;
 			}
 				
+			// headless: nothing is presented, the graphics queue stands in
 			VkBool32 presentSupport = false;
-			vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
-												 &presentSupport);
+			if (headless) {
+				presentSupport = (queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT) != 0;
+			} else {
+				vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface,
+													 &presentSupport);
+			}
 			if (presentSupport) {
 			 	indices.presentFamily = i;
 			}
@@ -651,8 +1744,13 @@ protected:
 			queueCreateInfos.push_back(queueCreateInfo);
 		}
 		
+		VkPhysicalDeviceFeatures supportedFeatures;
+		vkGetPhysicalDeviceFeatures(physicalDevice, &supportedFeatures);
+		occlusionQueryPrecise = supportedFeatures.occlusionQueryPrecise;
+		
 		VkPhysicalDeviceFeatures deviceFeatures{};
 		deviceFeatures.samplerAnisotropy = VK_TRUE;
+		deviceFeatures.occlusionQueryPrecise = occlusionQueryPrecise ? VK_TRUE : VK_FALSE;
 		
 		VkDeviceCreateInfo createInfo{};
 		createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
@@ -662,9 +1760,22 @@ protected:
 			static_cast<uint32_t>(queueCreateInfos.size());
 		
 		createInfo.pEnabledFeatures = &deviceFeatures;
+		
+		std::vector<const char*> enabledExtensions;
+		if (!headless) {
+			enabledExtensions = deviceExtensions;
+		}
+		VkPhysicalDeviceTimelineSemaphoreFeaturesKHR timelineFeatures{};
+		if (useTimelineSemaphores) {
+			enabledExtensions.push_back(VK_KHR_TIMELINE_SEMAPHORE_EXTENSION_NAME);
+			timelineFeatures.sType =
+				VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES_KHR;
+			timelineFeatures.timelineSemaphore = VK_TRUE;
+			createInfo.pNext = &timelineFeatures;
+		}
 		createInfo.enabledExtensionCount =
-				static_cast<uint32_t>(deviceExtensions.size());
-		createInfo.ppEnabledExtensionNames = deviceExtensions.data();
+				static_cast<uint32_t>(enabledExtensions.size());
+		createInfo.ppEnabledExtensionNames = enabledExtensions.data();
 
 			createInfo.enabledLayerCount = 
 					static_cast<uint32_t>(validationLayers.size());
@@ -681,19 +1792,232 @@ protected:
 		vkGetDeviceQueue(device, indices.presentFamily.value(), 0, &presentQueue);
 	}
 	
-	// Lesson 14
-	void createSwapChain() {
-		SwapChainSupportDetails swapChainSupport =
-				querySwapChainSupport(physicalDevice);
-		VkSurfaceFormatKHR surfaceFormat =
-				chooseSwapSurfaceFormat(swapChainSupport.formats);
-		VkPresentModeKHR presentMode =
-				chooseSwapPresentMode(swapChainSupport.presentModes);
-		VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
-		
-		uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+	// The cache file is keyed on the device and driver, so switching GPU
+	// or updating the driver starts from an empty cache instead of
+	// feeding incompatible data to the implementation.
+	void createPipelineCache() {
+		char key[64];
+		snprintf(key, sizeof(key), "%04x_%04x_%08x",
+				 physicalDeviceProperties.vendorID,
+				 physicalDeviceProperties.deviceID,
+				 physicalDeviceProperties.driverVersion);
+		pipelineCacheFile = std::string("pipeline_cache_") + key + ".bin";
 		
-		if (swapChainSupport.capabilities.maxImageCount > 0 &&
+		std::vector<char> initialData;
+		std::ifstream file(pipelineCacheFile, std::ios::ate | std::ios::binary);
+		if (file.is_open()) {
+			initialData.resize((size_t) file.tellg());
+			file.seekg(0);
+			file.read(initialData.data(), initialData.size());
+			file.close();
+			
+			if (!isPipelineCacheDataValid(initialData)) {
+				LOG_INFO("Discarding stale pipeline cache %s", pipelineCacheFile.c_str());
+				initialData.clear();
+			} else {
+				LOG_INFO("Loaded pipeline cache %s (%zu bytes)",
+						 pipelineCacheFile.c_str(), initialData.size());
+			}
+		}
+		
+		VkPipelineCacheCreateInfo cacheInfo{};
+		cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+		cacheInfo.initialDataSize = initialData.size();
+		cacheInfo.pInitialData = initialData.empty() ? nullptr : initialData.data();
+		
+		VkResult result = vkCreatePipelineCache(device, &cacheInfo, nullptr,
+							&pipelineCache);
+		if (result != VK_SUCCESS && !initialData.empty()) {
+			// Some drivers reject data that passes the header check;
+			// retry with an empty cache rather than failing the startup.
+			cacheInfo.initialDataSize = 0;
+			cacheInfo.pInitialData = nullptr;
+			result = vkCreatePipelineCache(device, &cacheInfo, nullptr,
+							&pipelineCache);
+		}
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create pipeline cache!");
+		}
+	}
+	
+	bool isPipelineCacheDataValid(const std::vector<char>& data) {
+		VkPipelineCacheHeaderVersionOne header;
+		if (data.size() < sizeof(header)) {
+			return false;
+		}
+		memcpy(&header, data.data(), sizeof(header));
+		
+		return header.headerSize >= sizeof(header) &&
+			   header.headerSize <= data.size() &&
+			   header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+			   header.vendorID == physicalDeviceProperties.vendorID &&
+			   header.deviceID == physicalDeviceProperties.deviceID &&
+			   memcmp(header.pipelineCacheUUID,
+					  physicalDeviceProperties.pipelineCacheUUID,
+					  VK_UUID_SIZE) == 0;
+	}
+	
+	// Written to a temporary file first, so an interrupted shutdown
+	// never leaves a truncated cache behind.
+	void savePipelineCache() {
+		size_t dataSize = 0;
+		if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr)
+				!= VK_SUCCESS || dataSize == 0) {
+			return;
+		}
+		std::vector<char> data(dataSize);
+		if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, data.data())
+				!= VK_SUCCESS) {
+			return;
+		}
+		
+		std::string tmpFile = pipelineCacheFile + ".tmp";
+		std::ofstream file(tmpFile, std::ios::binary | std::ios::trunc);
+		if (!file.is_open()) {
+			LOG_WARN("Cannot write pipeline cache %s", tmpFile.c_str());
+			return;
+		}
+		file.write(data.data(), dataSize);
+		file.close();
+		if (!file || std::rename(tmpFile.c_str(), pipelineCacheFile.c_str()) != 0) {
+			std::remove(tmpFile.c_str());
+			LOG_WARN("Cannot write pipeline cache %s", pipelineCacheFile.c_str());
+		}
+	}
+
+	void createTimelineSemaphore() {
+		if (!useTimelineSemaphores) {
+			return;
+		}
+		pfnWaitSemaphores = (PFN_vkWaitSemaphoresKHR)
+				vkGetDeviceProcAddr(device, "vkWaitSemaphoresKHR");
+		pfnGetSemaphoreCounterValue = (PFN_vkGetSemaphoreCounterValueKHR)
+				vkGetDeviceProcAddr(device, "vkGetSemaphoreCounterValueKHR");
+		if (pfnWaitSemaphores == nullptr || pfnGetSemaphoreCounterValue == nullptr) {
+			throw std::runtime_error("failed to load timeline semaphore functions!");
+		}
+		
+		VkSemaphoreTypeCreateInfoKHR typeInfo{};
+		typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO_KHR;
+		typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE_KHR;
+		typeInfo.initialValue = 0;
+		
+		VkSemaphoreCreateInfo semaphoreInfo{};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		semaphoreInfo.pNext = &typeInfo;
+		
+		VkResult result = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
+							&timelineSemaphore);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create timeline semaphore!");
+		}
+	}
+	
+	// Submits to the graphics queue and returns the value that marks its
+	// completion (signaled on the timeline semaphore when enabled).
+	uint64_t submitToGraphicsQueue(VkSubmitInfo &submitInfo, VkFence fence) {
+		uint64_t value = ++lastSubmittedValue;
+		
+		std::vector<VkSemaphore> signalSemaphores(submitInfo.pSignalSemaphores,
+				submitInfo.pSignalSemaphores + submitInfo.signalSemaphoreCount);
+		std::vector<uint64_t> signalValues(signalSemaphores.size(), 0);
+		std::vector<uint64_t> waitValues(submitInfo.waitSemaphoreCount, 0);
+		VkTimelineSemaphoreSubmitInfoKHR timelineInfo{};
+		if (useTimelineSemaphores) {
+			signalSemaphores.push_back(timelineSemaphore);
+			signalValues.push_back(value);
+			
+			timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO_KHR;
+			timelineInfo.waitSemaphoreValueCount =
+					static_cast<uint32_t>(waitValues.size());
+			timelineInfo.pWaitSemaphoreValues = waitValues.data();
+			timelineInfo.signalSemaphoreValueCount =
+					static_cast<uint32_t>(signalValues.size());
+			timelineInfo.pSignalSemaphoreValues = signalValues.data();
+			submitInfo.pNext = &timelineInfo;
+			submitInfo.signalSemaphoreCount =
+					static_cast<uint32_t>(signalSemaphores.size());
+			submitInfo.pSignalSemaphores = signalSemaphores.data();
+		}
+		
+		VkResult result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, fence);
+		submitInfo.pNext = nullptr;
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to submit command buffer!");
+		}
+		return value;
+	}
+	
+	uint64_t completedValue() {
+		if (useTimelineSemaphores) {
+			uint64_t value;
+			pfnGetSemaphoreCounterValue(device, timelineSemaphore, &value);
+			lastCompletedValue = std::max(lastCompletedValue, value);
+		}
+		return lastCompletedValue;
+	}
+	
+	// Blocks until the submission that returned this value has finished.
+	// Without timeline semaphores the only way to wait for an arbitrary
+	// submission is to drain the queue.
+	void waitForValue(uint64_t value) {
+		if (value <= lastCompletedValue) {
+			return;
+		}
+		if (useTimelineSemaphores) {
+			VkSemaphoreWaitInfoKHR waitInfo{};
+			waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO_KHR;
+			waitInfo.semaphoreCount = 1;
+			waitInfo.pSemaphores = &timelineSemaphore;
+			waitInfo.pValues = &value;
+			pfnWaitSemaphores(device, &waitInfo, UINT64_MAX);
+			lastCompletedValue = value;
+		} else {
+			vkQueueWaitIdle(graphicsQueue);
+			lastCompletedValue = lastSubmittedValue;
+		}
+	}
+	
+	// Runs fn once the GPU is done with everything submitted so far.
+	// Anything still referenced by the pre-recorded command buffers must
+	// be unlinked (by re-recording them) before being deferred here.
+	void deferDestroy(std::function<void()> fn) {
+		deletionQueue.emplace_back(lastSubmittedValue, std::move(fn));
+	}
+	
+	void collectGarbage() {
+		uint64_t completed = completedValue();
+		while (!deletionQueue.empty() && deletionQueue.front().first <= completed) {
+			deletionQueue.front().second();
+			deletionQueue.pop_front();
+		}
+	}
+
+	// Lesson 14
+	void createSwapChain() {
+		if (headless) {
+			createOffscreenImages();
+			return;
+		}
+		SwapChainSupportDetails swapChainSupport =
+				querySwapChainSupport(physicalDevice);
+		VkSurfaceFormatKHR surfaceFormat =
+				chooseSwapSurfaceFormat(swapChainSupport.formats);
+		VkPresentModeKHR presentMode =
+				chooseSwapPresentMode(swapChainSupport.presentModes);
+		VkExtent2D extent = chooseSwapExtent(swapChainSupport.capabilities);
+		VkSwapchainKHR oldSwapChain = swapChain;
+		
+		uint32_t imageCount = swapChainSupport.capabilities.minImageCount + 1;
+		if (framePacing.swapChainImages > 0) {
+			imageCount = std::max(framePacing.swapChainImages,
+								  swapChainSupport.capabilities.minImageCount);
+		}
+		
+		if (swapChainSupport.capabilities.maxImageCount > 0 &&
 				imageCount > swapChainSupport.capabilities.maxImageCount) {
 			imageCount = swapChainSupport.capabilities.maxImageCount;
 		}
@@ -725,7 +2049,7 @@ protected:
 		 createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 		 createInfo.presentMode = presentMode;
 		 createInfo.clipped = VK_TRUE;
-		 createInfo.oldSwapchain = VK_NULL_HANDLE;
+		 createInfo.oldSwapchain = oldSwapChain;
 		 
 		 VkResult result = vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain);
 		 if (result != VK_SUCCESS) {
@@ -733,6 +2057,12 @@ protected:
 			throw std::runtime_error("failed to create swap chain!");
 		}
 		
+		// The retired swap chain was handed over in oldSwapchain,
+		// so it can go as soon as its replacement exists.
+		if (oldSwapChain != VK_NULL_HANDLE) {
+			vkDestroySwapchainKHR(device, oldSwapChain, nullptr);
+		}
+		
 		vkGetSwapchainImagesKHR(device, swapChain, &imageCount, nullptr);
 		swapChainImages.resize(imageCount);
 		vkGetSwapchainImagesKHR(device, swapChain, &imageCount,
@@ -742,6 +2072,102 @@ protected:
 		swapChainExtent = extent;
 	}
 
+	// Headless replacement for the swap chain images: rendered to like
+	// them, then left in TRANSFER_SRC layout for the PNG readback.
+	void createOffscreenImages() {
+		uint32_t imageCount = framePacing.swapChainImages > 0 ?
+								framePacing.swapChainImages : 3;
+		swapChainImageFormat = VK_FORMAT_R8G8B8A8_SRGB;
+		swapChainExtent = {windowWidth, windowHeight};
+		
+		swapChainImages.resize(imageCount);
+		offscreenImagesMemory.resize(imageCount);
+		for (uint32_t i = 0; i < imageCount; i++) {
+			createImage(swapChainExtent.width, swapChainExtent.height, 1,
+						swapChainImageFormat, VK_IMAGE_TILING_OPTIMAL,
+						VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
+						VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+						VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+						swapChainImages[i], offscreenImagesMemory[i]);
+		}
+	}
+	
+	void destroyOffscreenImages() {
+		for (size_t i = 0; i < swapChainImages.size(); i++) {
+			vkDestroyImage(device, swapChainImages[i], nullptr);
+			vkFreeMemory(device, offscreenImagesMemory[i], nullptr);
+		}
+	}
+	
+	// Copies a rendered offscreen image back to the host and writes it as
+	// <pngPrefix><frame>.png. Blocks until the copy is done.
+	void writeFramePNG(uint32_t imageIndex) {
+		PROFILE_ZONE("writeFramePNG");
+		uint32_t width = swapChainExtent.width;
+		uint32_t height = swapChainExtent.height;
+		VkDeviceSize size = (VkDeviceSize) width * height * 4;
+		
+		VkBuffer readbackBuffer;
+		VkDeviceMemory readbackBufferMemory;
+		createBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+					 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+					 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+					 readbackBuffer, readbackBufferMemory);
+		
+		VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+		
+		// the render pass already left the image in TRANSFER_SRC layout:
+		// only its color writes have to be made visible to the copy
+		VkImageMemoryBarrier barrier{};
+		barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+		barrier.image = swapChainImages[imageIndex];
+		barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		barrier.subresourceRange.baseMipLevel = 0;
+		barrier.subresourceRange.levelCount = 1;
+		barrier.subresourceRange.baseArrayLayer = 0;
+		barrier.subresourceRange.layerCount = 1;
+		barrier.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+		vkCmdPipelineBarrier(commandBuffer,
+							 VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+							 VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+							 0, nullptr, 0, nullptr, 1, &barrier);
+		
+		VkBufferImageCopy region{};
+		region.bufferOffset = 0;
+		region.bufferRowLength = 0;
+		region.bufferImageHeight = 0;
+		region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		region.imageSubresource.mipLevel = 0;
+		region.imageSubresource.baseArrayLayer = 0;
+		region.imageSubresource.layerCount = 1;
+		region.imageOffset = {0, 0, 0};
+		region.imageExtent = {width, height, 1};
+		vkCmdCopyImageToBuffer(commandBuffer, swapChainImages[imageIndex],
+							   VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+							   readbackBuffer, 1, &region);
+		
+		endSingleTimeCommands(commandBuffer);
+		
+		void* data;
+		vkMapMemory(device, readbackBufferMemory, 0, size, 0, &data);
+		char fileName[32];
+		snprintf(fileName, sizeof(fileName), "%05llu.png",
+				 (unsigned long long) frameNumber);
+		std::string file = pngPrefix + fileName;
+		if (!stbi_write_png(file.c_str(), width, height, 4, data, width * 4)) {
+			LOG_ERROR("Failed to write %s", file.c_str());
+		}
+		vkUnmapMemory(device, readbackBufferMemory);
+		
+		vkDestroyBuffer(device, readbackBuffer, nullptr);
+		vkFreeMemory(device, readbackBufferMemory, nullptr);
+	}
+
 	// Lesson 14
 	VkSurfaceFormatKHR chooseSwapSurfaceFormat(
 				const std::vector<VkSurfaceFormatKHR>& availableFormats)
@@ -756,14 +2182,17 @@ protected:
 		return availableFormats[0];
 	}
 
-	// Lesson 14
+	// Lesson 14 - FIFO is the only mode every implementation supports,
+	// so it is the fallback when the configured one is not available
 	VkPresentModeKHR chooseSwapPresentMode(
 			const std::vector<VkPresentModeKHR>& availablePresentModes) {
 		for (const auto& availablePresentMode : availablePresentModes) {
-			if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+			if (availablePresentMode == framePacing.presentMode) {
 				return availablePresentMode;
 			}
 		}
+		LOG_WARN("Present mode %d not supported, using FIFO",
+				 (int) framePacing.presentMode);
 		return VK_PRESENT_MODE_FIFO_KHR;
 	}
 	
@@ -850,7 +2279,13 @@ protected:
 		colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
 		colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
 		colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		colorAttachment.finalLayout = headless ?
+						VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL :
+						VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		if (dynamicResolution) {
+			// sceneColor, for the upscale
+			colorAttachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		}
 		
 		VkAttachmentReference colorAttachmentRef{};
 		colorAttachmentRef.attachment = 0;
@@ -870,6 +2305,17 @@ protected:
 		dependency.srcAccessMask = 0;
 		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		
+		// with dynamic resolution, sceneColor is drawn once the previous
+		// frame's upscale has read it, and read once this frame drew it
+		std::array<VkSubpassDependency, 2> dependencies = {dependency, dependency};
+		dependencies[0].srcStageMask |= VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		dependencies[1].srcSubpass = 0;
+		dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+		dependencies[1].srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		dependencies[1].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+		dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
 
 		std::array<VkAttachmentDescription, 2> attachments =
 								{colorAttachment, depthAttachment};
@@ -880,19 +2326,75 @@ protected:
 		renderPassInfo.pAttachments = attachments.data();
 		renderPassInfo.subpassCount = 1;
 		renderPassInfo.pSubpasses = &subpass;
+		renderPassInfo.dependencyCount = dynamicResolution ? 2 : 1;
+		renderPassInfo.pDependencies = dynamicResolution ? dependencies.data() : &dependency;
+
+		VkResult result = vkCreateRenderPass(device, &renderPassInfo, nullptr,
+					&renderPass);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create render pass!");
+		}
+		
+		if (dynamicResolution) {
+			createPresentRenderPass();
+		}
+	}
+	
+	// The upscale into the swap chain image, which it covers entirely
+	void createPresentRenderPass() {
+    	VkAttachmentDescription colorAttachment{};
+		colorAttachment.format = swapChainImageFormat;
+		colorAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+		colorAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		colorAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		colorAttachment.finalLayout = headless ?
+						VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL :
+						VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		
+		VkAttachmentReference colorAttachmentRef{};
+		colorAttachmentRef.attachment = 0;
+		colorAttachmentRef.layout =
+				VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		
+		VkSubpassDescription subpass{};
+		subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+		subpass.colorAttachmentCount = 1;
+		subpass.pColorAttachments = &colorAttachmentRef;
+		
+		VkSubpassDependency dependency{};
+		dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+		dependency.dstSubpass = 0;
+		dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		dependency.srcAccessMask = 0;
+		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		
+		VkRenderPassCreateInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+		renderPassInfo.attachmentCount = 1;
+		renderPassInfo.pAttachments = &colorAttachment;
+		renderPassInfo.subpassCount = 1;
+		renderPassInfo.pSubpasses = &subpass;
 		renderPassInfo.dependencyCount = 1;
 		renderPassInfo.pDependencies = &dependency;
 
 		VkResult result = vkCreateRenderPass(device, &renderPassInfo, nullptr,
-					&renderPass);
+					&presentRenderPass);
 		if (result != VK_SUCCESS) {
 		 	PrintVkError(result);
 			throw std::runtime_error("failed to create render pass!");
-		}		
+		}
 	}
 
 	// Lesson 22.2 
     void createFramebuffers() {
+		if (dynamicResolution) {
+			createSceneTarget();
+		}
 		swapChainFramebuffers.resize(swapChainImageViews.size());
 		for (size_t i = 0; i < swapChainImageViews.size(); i++) {
 			std::array<VkImageView, 2> attachments = {
@@ -903,8 +2405,9 @@ protected:
 			VkFramebufferCreateInfo framebufferInfo{};
 			framebufferInfo.sType =
 				VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
-			framebufferInfo.renderPass = renderPass;
-			framebufferInfo.attachmentCount =
+			// with dynamic resolution only the upscale draws there
+			framebufferInfo.renderPass = dynamicResolution ? presentRenderPass : renderPass;
+			framebufferInfo.attachmentCount = dynamicResolution ? 1 :
 							static_cast<uint32_t>(attachments.size());;
 			framebufferInfo.pAttachments = attachments.data();
 			framebufferInfo.width = swapChainExtent.width; 
@@ -920,6 +2423,120 @@ protected:
 		}
 	}
 
+	// As large as the window: only the top left corner is drawn when the
+	// scale is lower, so that changing it needs no new images
+	void createSceneTarget() {
+		sceneColor.BP = this;
+		sceneColor.mipLevels = 1;
+		createImage(swapChainExtent.width, swapChainExtent.height, 1, swapChainImageFormat,
+					VK_IMAGE_TILING_OPTIMAL,
+					VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+					sceneColor.textureImage, sceneColor.textureImageMemory);
+		sceneColor.textureImageView = createImageView(sceneColor.textureImage, swapChainImageFormat,
+													  VK_IMAGE_ASPECT_COLOR_BIT, 1);
+		
+		VkSamplerCreateInfo samplerInfo{};
+		samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+		samplerInfo.magFilter = VK_FILTER_LINEAR;
+		samplerInfo.minFilter = VK_FILTER_LINEAR;
+		samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+		samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+		samplerInfo.maxLod = 0.0f;
+		VkResult result = vkCreateSampler(device, &samplerInfo, nullptr,
+										  &sceneColor.textureSampler);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+		 	throw std::runtime_error("failed to create texture sampler!");
+		}
+		
+		std::array<VkImageView, 2> attachments = {sceneColor.textureImageView, depthImageView};
+		VkFramebufferCreateInfo framebufferInfo{};
+		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		framebufferInfo.renderPass = renderPass;
+		framebufferInfo.attachmentCount = static_cast<uint32_t>(attachments.size());
+		framebufferInfo.pAttachments = attachments.data();
+		framebufferInfo.width = swapChainExtent.width; 
+		framebufferInfo.height = swapChainExtent.height;
+		framebufferInfo.layers = 1;
+		result = vkCreateFramebuffer(device, &framebufferInfo, nullptr, &sceneFramebuffer);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create framebuffer!");
+		}
+	}
+	
+	void createUpscale() {
+		upscaleSetLayout.init(this, {{0, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT},
+									 {1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_FRAGMENT_BIT}});
+		upscaleSet.init(this, &upscaleSetLayout, {{0, TEXTURE, 0, &sceneColor},
+												  {1, UNIFORM, sizeof(UpscaleUniforms), nullptr}});
+		
+		PipelineDescription desc;
+		desc.vertShader = "shaders/upscale_vert.spv";	// a triangle over the window
+		desc.fragShader = "shaders/upscale_frag.spv";
+		desc.setLayouts = {&upscaleSetLayout};
+		desc.renderPass = presentRenderPass;
+		desc.cullMode = VK_CULL_MODE_NONE;
+		desc.depthTest = false;
+		desc.depthWrite = false;
+		upscalePipeline.request(this, desc);
+	}
+	
+	void recordUpscale(VkCommandBuffer commandBuffer, size_t i) {
+		VkRenderPassBeginInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = presentRenderPass;
+		renderPassInfo.framebuffer = swapChainFramebuffers[i];
+		renderPassInfo.renderArea.offset = {0, 0};
+		renderPassInfo.renderArea.extent = swapChainExtent;
+		
+		gpuProfiler.beginRegion(commandBuffer, "Upscale");
+		vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+		setViewport(commandBuffer, swapChainExtent);
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+						  upscalePipeline.graphicsPipeline);
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+								upscalePipeline.pipelineLayout, 0, 1,
+								&upscaleSet.descriptorSets[i], 0, nullptr);
+		vkCmdDraw(commandBuffer, 3, 1, 0, 0);
+		vkCmdEndRenderPass(commandBuffer);
+		gpuProfiler.endRegion(commandBuffer);
+	}
+	
+	// Feeds the GPU time of the last frame measured to the scaler
+	void updateRenderScale() {
+		int frame = gpuProfiler.findRegion("Frame");
+		if (frame < 0 || gpuProfiler.regions[frame].count == frameTimings) {
+			return;
+		}
+		frameTimings = gpuProfiler.regions[frame].count;
+		float scale = resolutionScaler.update(gpuProfiler.regions[frame].last);
+		if (scale != renderScale) {
+			LOG_DEBUG("Render scale %.2f, GPU frame %.2f ms", scale,
+					  gpuProfiler.regions[frame].last);
+			renderScale = scale;
+			outdateCommandBuffers();
+		}
+	}
+	
+	void updateUpscaleUniforms(uint32_t currentImage) {
+		VkExtent2D extent = renderExtent();
+		UpscaleUniforms U{};
+		U.uvScaleTexel = glm::vec4(extent.width / (float) swapChainExtent.width,
+								   extent.height / (float) swapChainExtent.height,
+								   1.0f / swapChainExtent.width, 1.0f / swapChainExtent.height);
+		// sharper the lower the scale, none at full resolution
+		U.sharpness = std::min(1.0f - renderScale, 0.5f);
+		void *data;
+		vkMapMemory(device, upscaleSet.uniformBuffersMemory[1][currentImage], 0,
+					sizeof(U), 0, &data);
+		memcpy(data, &U, sizeof(U));
+		vkUnmapMemory(device, upscaleSet.uniformBuffersMemory[1][currentImage]);
+	}
+
 	// Lesson 13
     void createCommandPool() {
     	QueueFamilyIndices queueFamilyIndices = 
@@ -928,7 +2545,8 @@ protected:
 		VkCommandPoolCreateInfo poolInfo{};
 		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
 		poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-		poolInfo.flags = 0; // Optional
+		// command buffers are recorded again one by one, see recordCommandBuffer()
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
 		
 		VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &commandPool);
 		if (result != VK_SUCCESS) {
@@ -1159,16 +2777,28 @@ protected:
 	
 	// New - Lesson 23
 	void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
+		waitForValue(endSingleTimeCommandsAsync(commandBuffer));
+	}
+	
+	// Same as endSingleTimeCommands() without blocking: returns the value
+	// to wait for, and resources used by the upload (staging buffers...)
+	// can simply be handed to deferDestroy().
+	uint64_t endSingleTimeCommandsAsync(VkCommandBuffer commandBuffer) {
 		vkEndCommandBuffer(commandBuffer);
 		
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 		submitInfo.commandBufferCount = 1;
 		submitInfo.pCommandBuffers = &commandBuffer;
-		vkQueueSubmit(graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE);
-		vkQueueWaitIdle(graphicsQueue);
+		uint64_t value = submitToGraphicsQueue(submitInfo, VK_NULL_HANDLE);
 		
-		vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
+		VkDevice dev = device;
+		VkCommandPool pool = commandPool;
+		deferDestroy([dev, pool, commandBuffer]() {
+			VkCommandBuffer cb = commandBuffer;
+			vkFreeCommandBuffers(dev, pool, 1, &cb);
+		});
+		return value;
 	}
 	
 
@@ -1228,38 +2858,19 @@ protected:
 		throw std::runtime_error("failed to find suitable memory type!");
 	}
     
-    // Lesson 21
-	void createDescriptorPool() {
-		std::array<VkDescriptorPoolSize, 2> poolSizes{};
-		poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-		poolSizes[0].descriptorCount = static_cast<uint32_t>(uniformBlocksInPool *
-															 swapChainImages.size());
-		// New - Lesson 23
-		poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-		poolSizes[1].descriptorCount = static_cast<uint32_t>(texturesInPool *
-															 swapChainImages.size());
-		//
-
-		VkDescriptorPoolCreateInfo poolInfo{};
-		poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-		poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());;
-		poolInfo.pPoolSizes = poolSizes.data();
-		poolInfo.maxSets = static_cast<uint32_t>(setsInPool * swapChainImages.size());
-		
-		VkResult result = vkCreateDescriptorPool(device, &poolInfo, nullptr,
-									&descriptorPool);
-		if (result != VK_SUCCESS) {
-		 	PrintVkError(result);
-			throw std::runtime_error("failed to create descriptor pool!");
-		}
-	}
-	
 	virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int i) = 0;
 
+	// Recorded before the render pass begins, for compute work whose
+	// results the pass reads
+	virtual void populateComputeCommands(VkCommandBuffer commandBuffer, int i) {}
+
 	// Lesson 22.5 (and 13)
     void createCommandBuffers() {
+    	PROFILE_ZONE("createCommandBuffers");
     	// Lesson 13
     	commandBuffers.resize(swapChainFramebuffers.size());
+    	recordedGenerations.assign(commandBuffers.size(), 0);
+    	recordedExtents.assign(commandBuffers.size(), VkExtent2D{0, 0});
     	
     	VkCommandBufferAllocateInfo allocInfo{};
 		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
@@ -1274,54 +2885,168 @@ protected:
 			throw std::runtime_error("failed to allocate command buffers!");
 		}
 		
-		// Lesson 22.5 --- Draw calls
-		// This is where the commands that actually draw something on screen are!
 		for (size_t i = 0; i < commandBuffers.size(); i++) {
-			VkCommandBufferBeginInfo beginInfo{};
-			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-			beginInfo.flags = 0; // Optional
-			beginInfo.pInheritanceInfo = nullptr; // Optional
-
-			if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
-						VK_SUCCESS) {
-				throw std::runtime_error("failed to begin recording command buffer!");
-			}
-			
-			VkRenderPassBeginInfo renderPassInfo{};
-			renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-			renderPassInfo.renderPass = renderPass; 
-			renderPassInfo.framebuffer = swapChainFramebuffers[i];
-			renderPassInfo.renderArea.offset = {0, 0};
-			renderPassInfo.renderArea.extent = swapChainExtent;
-	
-			std::array<VkClearValue, 2> clearValues{};
-			clearValues[0].color = initialBackgroundColor;
-			clearValues[1].depthStencil = {1.0f, 0};
-	
-			renderPassInfo.clearValueCount =
-							static_cast<uint32_t>(clearValues.size());
-			renderPassInfo.pClearValues = clearValues.data();
-			
-			vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
-					VK_SUBPASS_CONTENTS_INLINE);			
+			recordCommandBuffer(i);
+		}
+	}
 	
+	// Lesson 22.5 --- Draw calls
+	// This is where the commands that actually draw something on screen are!
+	// Beginning the command buffer resets it: the pool allows it.
+	void recordCommandBuffer(size_t i) {
+		PROFILE_ZONE("recordCommandBuffer");
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = 0; // Optional
+		beginInfo.pInheritanceInfo = nullptr; // Optional
 
-			populateCommandBuffer(commandBuffers[i], i);
-			
+		if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
+					VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
+		recordedGenerations[i] = commandBufferGeneration;
+		gpuProfiler.beginCommandBuffer(commandBuffers[i], i);
+		fragmentCounter.beginCommandBuffer(commandBuffers[i], i);
+		gpuProfiler.beginRegion(commandBuffers[i], "Frame");
+		populateComputeCommands(commandBuffers[i], i);
+		
+		// with dynamic resolution the scene goes to the top left corner
+		// of sceneColor, and is upscaled to the swap chain image after
+		VkExtent2D extent = renderExtent();
+		recordedExtents[i] = extent;
+		VkRenderPassBeginInfo renderPassInfo{};
+		renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+		renderPassInfo.renderPass = renderPass; 
+		renderPassInfo.framebuffer = dynamicResolution ? sceneFramebuffer :
+														 swapChainFramebuffers[i];
+		renderPassInfo.renderArea.offset = {0, 0};
+		renderPassInfo.renderArea.extent = extent;
+
+		std::array<VkClearValue, 2> clearValues{};
+		clearValues[0].color = initialBackgroundColor;
+		clearValues[1].depthStencil = {1.0f, 0};
+
+		renderPassInfo.clearValueCount =
+						static_cast<uint32_t>(clearValues.size());
+		renderPassInfo.pClearValues = clearValues.data();
+		
+		gpuProfiler.beginRegion(commandBuffers[i], "MainPass");
+		vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
+				VK_SUBPASS_CONTENTS_INLINE);			
 
-			vkCmdEndRenderPass(commandBuffers[i]);
+		// Viewport and scissor are dynamic state in every pipeline,
+		// so a resize never requires building pipelines again.
+		setViewport(commandBuffers[i], extent);
 
-			if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-				throw std::runtime_error("failed to record command buffer!");
-			}
+		populateCommandBuffer(commandBuffers[i], i);
+		
+
+		vkCmdEndRenderPass(commandBuffers[i]);
+		gpuProfiler.endRegion(commandBuffers[i]);	// MainPass
+		if (dynamicResolution) {
+			recordUpscale(commandBuffers[i], i);
+		}
+		gpuProfiler.endRegion(commandBuffers[i]);	// Frame
+
+		if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
+		}
+	}
+	
+	void setViewport(VkCommandBuffer commandBuffer, VkExtent2D extent) {
+		VkViewport viewport{};
+		viewport.x = 0.0f;
+		viewport.y = 0.0f;
+		viewport.width = (float) extent.width;
+		viewport.height = (float) extent.height;
+		viewport.minDepth = 0.0f;
+		viewport.maxDepth = 1.0f;
+		vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+		VkRect2D scissor{};
+		scissor.offset = {0, 0};
+		scissor.extent = extent;
+		vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+	}
+	
+	// The size the scene is rendered at
+	VkExtent2D renderExtent() const {
+		if (!dynamicResolution) {
+			return swapChainExtent;
+		}
+		return {std::max(1u, (uint32_t) (swapChainExtent.width * renderScale + 0.5f)),
+				std::max(1u, (uint32_t) (swapChainExtent.height * renderScale + 0.5f))};
+	}
+	
+	// Records every command buffer again, each one the next time its
+	// image comes up: the GPU is done with it by then, so nothing waits
+	void outdateCommandBuffers() {
+		commandBufferGeneration++;
+	}
+    
+	// Commands that change from frame to frame, unlike those recorded once
+	// by createCommandBuffers(): returns true when it recorded any, and the
+	// command buffer is then submitted before the one of the image.
+	virtual bool populateFrameCommands(VkCommandBuffer commandBuffer, int i) {
+		return false;
+	}
+
+	// one per image, since the frame that last used an image is over
+	// before the image is used again
+	void createFrameCommandBuffers() {
+		QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+						 VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+		VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &frameCommandPool);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create command pool!");
+		}
+		allocateFrameCommandBuffers();
+	}
+	
+	void allocateFrameCommandBuffers() {
+		frameCommandBuffers.resize(swapChainImages.size());
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = frameCommandPool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = (uint32_t) frameCommandBuffers.size();
+		VkResult result = vkAllocateCommandBuffers(device, &allocInfo, frameCommandBuffers.data());
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to allocate command buffers!");
+		}
+	}
+	
+	bool recordFrameCommands(uint32_t imageIndex) {
+		VkCommandBuffer commandBuffer = frameCommandBuffers[imageIndex];
+		vkResetCommandBuffer(commandBuffer, 0);
+		VkCommandBufferBeginInfo beginInfo{};
+		beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+			throw std::runtime_error("failed to begin recording command buffer!");
+		}
+		bool recorded = populateFrameCommands(commandBuffer, imageIndex);
+		if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+			throw std::runtime_error("failed to record command buffer!");
 		}
+		return recorded;
 	}
     
     // Lesson 22.5
     void createSyncObjects() {
-    	imageAvailableSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    	renderFinishedSemaphores.resize(MAX_FRAMES_IN_FLIGHT);
-    	inFlightFences.resize(MAX_FRAMES_IN_FLIGHT);
+    	imageAvailableSemaphores.resize(framePacing.framesInFlight);
+    	renderFinishedSemaphores.resize(framePacing.framesInFlight);
+    	frameInputTimes.resize(framePacing.framesInFlight);
+    	frameSubmitValues.resize(framePacing.framesInFlight, 0);
+    	imageSubmitValues.resize(swapChainImages.size(), 0);
+    	// the timeline semaphore replaces the per-frame fences
+    	inFlightFences.resize(useTimelineSemaphores ? 0 : framePacing.framesInFlight);
     	imagesInFlight.resize(swapChainImages.size(), VK_NULL_HANDLE);
     	    	
     	VkSemaphoreCreateInfo semaphoreInfo{};
@@ -1331,12 +3056,13 @@ protected:
 		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
 		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 		
-		for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+		for (size_t i = 0; i < (size_t) framePacing.framesInFlight; i++) {
 			VkResult result1 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
 								&imageAvailableSemaphores[i]);
 			VkResult result2 = vkCreateSemaphore(device, &semaphoreInfo, nullptr,
 								&renderFinishedSemaphores[i]);
-			VkResult result3 = vkCreateFence(device, &fenceInfo, nullptr,
+			VkResult result3 = useTimelineSemaphores ? VK_SUCCESS :
+								vkCreateFence(device, &fenceInfo, nullptr,
 								&inFlightFences[i]);
 			if (result1 != VK_SUCCESS ||
 				result2 != VK_SUCCESS ||
@@ -1351,51 +3077,560 @@ protected:
     
     // Lesson 22.6 --- Main Rendering Loop
     void mainLoop() {
-        while (!glfwWindowShouldClose(window)) {
-            glfwPollEvents();
+    	lastFrameStart = std::chrono::steady_clock::now();
+    	startTime = lastFrameStart;
+    	lastReport = lastFrameStart;
+    	startSimulation();
+    	nextFrameDeadline = lastFrameStart;
+    	if (hotReload) {
+    		startHotReload();
+    	}
+    	
+        while (!shouldClose()) {
+            PROFILE_ZONE("frame");
+            if (!headless) {
+            	PROFILE_ZONE("glfwPollEvents");
+            	glfwPollEvents();
+            }
+            if (!sampleInput()) {
+            	break;
+            }
+            if (simulationThreaded && !simulationRunning) {
+            	break;	// the simulation failed: stopSimulation() rethrows
+            }
+            if (hotReload) {
+            	applyReloads();
+            }
+            lastInputTime = std::chrono::steady_clock::now();
             drawFrame();
+            limitFrameRate();
+            updateFrameStats();
+            frameNumber++;
         }
+        stopSimulation();
+        stopHotReload();
         
         vkDeviceWaitIdle(device);
+        totalStats.print("Frame statistics (total)");
+        gpuProfiler.report();
+        if (cameraPath.playing) {
+        	writeBenchmarkReport();
+        }
+        finishInputLog();
     }
     
-    // Lesson 22.6
-    void drawFrame() {
-		vkWaitForFences(device, 1, &inFlightFences[currentFrame],
-						VK_TRUE, UINT64_MAX);
-		
-		uint32_t imageIndex;
-		
-		VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
-				imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
-
-		if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
-			vkWaitForFences(device, 1, &imagesInFlight[imageIndex],
-							VK_TRUE, UINT64_MAX);
-		}
-		imagesInFlight[imageIndex] = inFlightFences[currentFrame];
-		
-		updateUniformBuffer(imageIndex);
-		
+    void startHotReload() {
+    	std::set<std::string> files;
+    	for (auto &M : pipelineRegistry.shaderModules) {
+    		files.insert(M.first);
+    	}
+    	for (Model *M : loadedModels) {
+    		files.insert(M->file);
+    	}
+    	for (Texture *T : loadedTextures) {
+    		files.insert(T->file);
+    	}
+    	for (const std::string &file : files) {
+    		fileWatcher.watch(file);
+    	}
+    	fileWatcher.start();
+    	LOG_INFO("Hot reload: watching %zu files", files.size());
+    	
+    	reloadThreadStop = false;
+    	reloadThread = std::thread([this]() {
+    		Profiler::get().setThreadName("hot reload");
+    		std::unique_lock<std::mutex> lock(reloadMutex);
+    		while (true) {
+    			reloadWake.wait(lock, [this]() { return reloadThreadStop || !reloadsToLoad.empty(); });
+    			if (reloadThreadStop) {
+    				return;
+    			}
+    			ReloadedFile R = std::move(reloadsToLoad.front());
+    			reloadsToLoad.pop_front();
+    			lock.unlock();
+    			R = loadChangedFile(std::move(R));
+    			lock.lock();
+    			reloadsLoaded.push_back(std::move(R));
+    		}
+    	});
+    }
+    
+    // the files still loading are dropped
+    void stopHotReload() {
+    	fileWatcher.stop();
+    	if (reloadThread.joinable()) {
+    		{
+    			std::lock_guard<std::mutex> lock(reloadMutex);
+    			reloadThreadStop = true;
+    		}
+    		reloadWake.notify_one();
+    		reloadThread.join();
+    	}
+    	reloadsToLoad.clear();
+    	reloadsLoaded.clear();
+    }
+    
+    // Runs on the loader thread: only reads and decodes the file
+    static ReloadedFile loadChangedFile(ReloadedFile R) {
+    	PROFILE_ZONE_DETAIL("loadChangedFile", R.file.c_str());
+    	auto start = std::chrono::steady_clock::now();
+    	try {
+    		if (R.shader) {
+    			R.code = Pipeline::readFile(R.file);
+    			uint32_t magic = 0;
+    			memcpy(&magic, R.code.data(), std::min<size_t>(R.code.size(), 4));
+    			if (R.code.size() % 4 != 0 || magic != 0x07230203) {
+    				throw std::runtime_error("not a SPIR-V module");
+    			}
+    		}
+    		if (R.model) {
+    			R.mesh.loadModel(R.file);
+    		}
+    		if (R.texture) {
+    			int channels;
+    			stbi_uc *pixels = stbi_load(R.file.c_str(), &R.width, &R.height,
+    										&channels, STBI_rgb_alpha);
+    			if (!pixels) {
+    				throw std::runtime_error(stbi_failure_reason());
+    			}
+    			R.pixels.assign(pixels, pixels + (size_t) R.width * R.height * 4);
+    			stbi_image_free(pixels);
+    		}
+    	} catch (const std::exception &e) {
+    		R.error = e.what();
+    	}
+    	R.loadMs = std::chrono::duration<double, std::milli>(
+    				   std::chrono::steady_clock::now() - start).count();
+    	return R;
+    }
+    
+    // Starts loading the files that changed, and swaps in those that are
+    // loaded. The GPU is drained first: the old resources may belong to
+    // frames in flight, and the command buffers recorded with them are
+    // recorded again.
+    void applyReloads() {
+    	std::vector<ReloadedFile> changed;
+    	for (const std::string &file : fileWatcher.changed()) {
+    		ReloadedFile R;
+    		R.file = file;
+    		R.shader = pipelineRegistry.shaderModules.count(file) > 0;
+    		R.model = std::any_of(loadedModels.begin(), loadedModels.end(),
+    							  [&](Model *M) { return M->file == file; });
+    		R.texture = std::any_of(loadedTextures.begin(), loadedTextures.end(),
+    								[&](Texture *T) { return T->file == file; });
+    		changed.push_back(std::move(R));
+    	}
+    	
+    	std::vector<ReloadedFile> ready;
+    	{
+    		std::lock_guard<std::mutex> lock(reloadMutex);
+    		for (ReloadedFile &R : changed) {
+    			reloadsToLoad.push_back(std::move(R));
+    		}
+    		ready.swap(reloadsLoaded);
+    	}
+    	if (!changed.empty()) {
+    		reloadWake.notify_one();
+    	}
+    	if (ready.empty()) {
+    		return;
+    	}
+    	
+    	PROFILE_ZONE("applyReloads");
+    	auto start = std::chrono::steady_clock::now();
+    	waitForValue(lastSubmittedValue);
+    	for (ReloadedFile &R : ready) {
+    		if (!R.error.empty()) {
+    			LOG_WARN("Cannot reload %s: %s", R.file.c_str(), R.error.c_str());
+    			continue;
+    		}
+    		if (R.shader && !pipelineRegistry.reloadShader(R.file, R.code)) {
+    			LOG_WARN("Cannot reload %s: the pipelines using it do not build", R.file.c_str());
+    			continue;
+    		}
+    		if (R.model) {
+    			try {
+    				for (Model *M : loadedModels) {
+    					if (M->file == R.file) {
+    						M->reload(R.mesh.vertices, R.mesh.indices);
+    					}
+    				}
+    			} catch (const std::exception &e) {
+    				LOG_WARN("Cannot reload %s: %s", R.file.c_str(), e.what());
+    				continue;
+    			}
+    		}
+    		if (R.texture) {
+    			for (Texture *T : loadedTextures) {
+    				if (T->file != R.file) {
+    					continue;
+    				}
+    				T->reload(R.pixels.data(), R.width, R.height);
+    				for (DescriptorSet *DS : allocatedDescriptorSets) {
+    					if (std::any_of(DS->elements.begin(), DS->elements.end(),
+    									[&](const DescriptorSetElement &E) { return E.tex == T; })) {
+    						DS->writeDescriptors();
+    					}
+    				}
+    			}
+    		}
+    		LOG_INFO("Reloaded %s, read in %.1f ms", R.file.c_str(), R.loadMs);
+    	}
+    	
+    	for (size_t i = 0; i < commandBuffers.size(); i++) {
+    		recordCommandBuffer(i);
+    	}
+    	LOG_INFO("Swapped in %zu files in %.1f ms", ready.size(),
+    			 std::chrono::duration<double, std::milli>(
+    				 std::chrono::steady_clock::now() - start).count());
+    }
+    
+    // Everything that makes two runs comparable goes in the report along
+    // with the timings, so that a diff shows when they are not.
+    void writeBenchmarkReport() {
+    	// the device is idle: the last frames' timestamps are all there
+    	for (uint32_t i = 0; i < swapChainImages.size(); i++) {
+    		gpuProfiler.collect(i);
+    	}
+    	
+    	nlohmann::json gpu = nlohmann::json::object();
+    	for (const auto &R : gpuProfiler.regions) {
+    		gpu[R.name] = TimingSummary::of(R.all).toJson();
+    	}
+    	nlohmann::json report = {
+    		{"cameraPath", cameraPathFile},
+    		{"frames", benchmarkFrameTimes.size()},
+    		{"warmupFrames", benchmarkWarmup},
+    		{"fixedTimeStep", fixedTimeStep},
+    		{"device", physicalDeviceProperties.deviceName},
+    		{"driverVersion", physicalDeviceProperties.driverVersion},
+    		{"width", swapChainExtent.width},
+    		{"height", swapChainExtent.height},
+    		{"headless", headless},
+    		{"presentMode", headless ? -1 : (int) framePacing.presentMode},
+    		{"fpsLimit", framePacing.fpsLimit},
+    		{"cpu", TimingSummary::of(benchmarkFrameTimes).toJson()},
+    		{"gpu", gpu}
+    	};
+    	
+    	std::ofstream out(benchmarkReport);
+    	if (!out) {
+    		throw std::runtime_error("failed to write " + benchmarkReport + "!");
+    	}
+    	out << report.dump(4) << "\n";
+    	LOG_INFO("Benchmark report written to %s", benchmarkReport.c_str());
+    }
+    
+    void finishInputLog() {
+    	uint64_t hash = hashSimulationState();
+    	if (inputLog.recording()) {
+    		inputLog.finishRecording(hash);
+    		LOG_INFO("Input recorded, simulation state hash %llu",
+    				 (unsigned long long) hash);
+    	} else if (inputLog.replaying) {
+    		if (hash == 0 || inputLog.stateHash == 0) {
+    			LOG_INFO("Input replayed, simulation state hash %llu",
+    					 (unsigned long long) hash);
+    		} else if (hash == inputLog.stateHash) {
+    			LOG_INFO("Input replayed, simulation state hash %llu matches the recording",
+    					 (unsigned long long) hash);
+    		} else {
+    			LOG_ERROR("Input replayed, simulation state hash %llu DIFFERS from "
+    					  "the recording (%llu)", (unsigned long long) hash,
+    					  (unsigned long long) inputLog.stateHash);
+    		}
+    	}
+    }
+    
+    bool shouldClose() {
+    	if (frameLimit > 0 && frameNumber >= (uint64_t) frameLimit) {
+    		return true;
+    	}
+    	return !headless && glfwWindowShouldClose(window);
+    }
+    
+    // Sleeps until shortly before the deadline and spins for the rest:
+    // sleep alone overshoots by the scheduler granularity (up to a few ms).
+    void limitFrameRate() {
+    	if (framePacing.fpsLimit <= 0.0f) {
+    		return;
+    	}
+    	PROFILE_ZONE("limitFrameRate");
+    	auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    					std::chrono::duration<double>(1.0 / framePacing.fpsLimit));
+    	auto spin = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+    					std::chrono::duration<double, std::micro>(framePacing.spinMicroseconds));
+    	
+    	nextFrameDeadline += period;
+    	auto now = std::chrono::steady_clock::now();
+    	if (nextFrameDeadline < now - period) {
+    		// more than a frame late: do not try to catch up with a burst
+    		nextFrameDeadline = now;
+    		return;
+    	}
+    	if (nextFrameDeadline - now > spin) {
+    		std::this_thread::sleep_for(nextFrameDeadline - now - spin);
+    	}
+    	while (std::chrono::steady_clock::now() < nextFrameDeadline) {
+    		std::this_thread::yield();
+    	}
+    }
+    
+    void updateFrameStats() {
+    	auto now = std::chrono::steady_clock::now();
+    	double frameTime = std::chrono::duration<double, std::milli>(
+    							now - lastFrameStart).count();
+    	lastFrameStart = now;
+    	intervalStats.addFrameTime(frameTime);
+    	totalStats.addFrameTime(frameTime);
+    	
+    	if (cameraPath.playing) {
+    		if (frameNumber == (uint64_t) benchmarkWarmup) {
+    			// GPU results lag a few frames behind: close enough
+    			gpuProfiler.clearAllSamples();
+    		}
+    		if (frameNumber >= (uint64_t) benchmarkWarmup) {
+    			benchmarkFrameTimes.push_back(frameTime);
+    		}
+    	}
+    	
+    	if (std::chrono::duration<float>(now - lastReport).count() >=
+    			framePacing.reportInterval) {
+    		intervalStats.print("Frame statistics");
+    		gpuProfiler.report();
+    		fragmentCounter.report();
+    		intervalStats = FrameStats();
+    		lastReport = now;
+    	}
+    }
+    
+    // Rebuilds only what depends on the window size: swap chain, image
+    // views, depth buffer, framebuffers and the command buffers that
+    // reference them. Render pass, pipelines, descriptor sets and all the
+    // assets are kept, and only the frames already in flight are waited for.
+    void recreateSwapChain() {
+    	PROFILE_ZONE("recreateSwapChain");
+    	int width = 0, height = 0;
+    	glfwGetFramebufferSize(window, &width, &height);
+    	while (width == 0 || height == 0) {
+    		// minimized: nothing to present until the window comes back
+    		glfwWaitEvents();
+    		glfwGetFramebufferSize(window, &width, &height);
+    	}
+    	
+    	waitForValue(lastSubmittedValue);
+    	vkQueueWaitIdle(presentQueue);
+    	
+    	cleanupSwapChainResources();
+    	
+    	VkFormat oldFormat = swapChainImageFormat;
+    	size_t oldImageCount = swapChainImages.size();
+    	createSwapChain();
+    	if (swapChainImageFormat != oldFormat) {
+    		// the render passes, and every pipeline made for them, would
+    		// have to be made again
+    		throw std::runtime_error("swap chain format changed during recreation!");
+    	}
+    	createImageViews();
+    	createDepthResources();
+    	createFramebuffers();
+    	if (swapChainImages.size() != oldImageCount) {
+    		resizePerImageResources(oldImageCount);
+    	} else if (dynamicResolution) {
+    		upscaleSet.writeDescriptors();
+    	}
+    	createCommandBuffers();
+    	
+    	std::fill(imagesInFlight.begin(), imagesInFlight.end(), VK_NULL_HANDLE);
+    	std::fill(imageSubmitValues.begin(), imageSubmitValues.end(), 0);
+    }
+    
+    // The descriptor sets with their uniform buffers, the query pools and
+    // the frame command buffers are per image. Everything they hold is
+    // written again every frame, so they are simply made anew.
+    void resizePerImageResources(size_t oldImageCount) {
+    	LOG_INFO("Swap chain images: %zu -> %zu", oldImageCount, swapChainImages.size());
+    	for (DescriptorSet *DS : allocatedDescriptorSets) {
+    		DS->destroyPerImage();
+    		DS->createPerImage();
+    	}
+    	collectGarbage();
+    	gpuProfiler.resize(swapChainImages.size());
+    	fragmentCounter.cleanup();
+    	fragmentCounter.init(this, swapChainImages.size(), occlusionQueryPrecise);
+    	vkFreeCommandBuffers(device, frameCommandPool,
+    			static_cast<uint32_t>(frameCommandBuffers.size()), frameCommandBuffers.data());
+    	allocateFrameCommandBuffers();
+    	imagesInFlight.resize(swapChainImages.size());
+    	imageSubmitValues.resize(swapChainImages.size());
+    }
+    
+    // Closes the input-to-GPU-done latency of the frames seen done since the
+    // last look, without waiting: the time is taken when the fence or the
+    // timeline value of the frame is first found signaled, which is called
+    // once before and once after waiting for a frame slot.
+    void collectLatencies() {
+    	uint64_t completed = completedValue();
+    	auto now = std::chrono::steady_clock::now();
+    	for (size_t slot = 0; slot < frameInputTimes.size(); slot++) {
+    		if (frameInputTimes[slot].time_since_epoch().count() == 0) {
+    			continue;
+    		}
+    		bool done = useTimelineSemaphores ? frameSubmitValues[slot] <= completed :
+    				vkGetFenceStatus(device, inFlightFences[slot]) == VK_SUCCESS;
+    		if (done) {
+    			double latency = std::chrono::duration<double, std::milli>(
+    				now - frameInputTimes[slot]).count();
+    			intervalStats.addLatency(latency);
+    			totalStats.addLatency(latency);
+    			frameInputTimes[slot] = {};
+    		}
+    	}
+    }
+    
+    // Waits until the frame that last used this slot is done on the GPU.
+    // Frames complete in submission order, so everything up to its value
+    // is complete as well.
+    void waitForFrameSlot(size_t slot) {
+    	if (useTimelineSemaphores) {
+    		waitForValue(frameSubmitValues[slot]);
+    	} else {
+			vkWaitForFences(device, 1, &inFlightFences[slot],
+							VK_TRUE, UINT64_MAX);
+			lastCompletedValue = std::max(lastCompletedValue, frameSubmitValues[slot]);
+		}
+    }
+    
+    // Everything recreateSwapChain() rebuilds, except the swap chain itself
+    // which is passed as oldSwapchain to its replacement.
+    void cleanupSwapChainResources() {
+		vkDestroyImageView(device, depthImageView, nullptr);
+		vkDestroyImage(device, depthImage, nullptr);
+		vkFreeMemory(device, depthImageMemory, nullptr);
+
+		for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
+			vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
+		}
+		if (dynamicResolution) {
+			vkDestroyFramebuffer(device, sceneFramebuffer, nullptr);
+			sceneColor.destroyImage();
+		}
+		
+		vkFreeCommandBuffers(device, commandPool,
+				static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+
+		for (size_t i = 0; i < swapChainImageViews.size(); i++){
+			vkDestroyImageView(device, swapChainImageViews[i], nullptr);
+		}
+    }
+    
+    // Lesson 22.6
+    void drawFrame() {
+    	PROFILE_ZONE("drawFrame");
+    	collectLatencies();
+    	{
+    		PROFILE_ZONE("waitForFrameSlot");
+			waitForFrameSlot(currentFrame);
+		}
+		collectLatencies();
+		descriptorAllocator.resetFrame(currentFrame);
+		collectGarbage();
+		
+		uint32_t imageIndex;
+		
+		VkResult result;
+		if (headless) {
+			// offscreen images are simply used in turn
+			imageIndex = frameNumber % swapChainImages.size();
+			result = VK_SUCCESS;
+		} else {
+			PROFILE_ZONE("vkAcquireNextImageKHR");
+			result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
+				imageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+		}
+		
+		if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+			recreateSwapChain();
+			return;
+		} else if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to acquire swap chain image!");
+		}
+
+		{
+			PROFILE_ZONE("waitForImage");
+			if (useTimelineSemaphores) {
+				waitForValue(imageSubmitValues[imageIndex]);
+			} else {
+				if (imagesInFlight[imageIndex] != VK_NULL_HANDLE) {
+					vkWaitForFences(device, 1, &imagesInFlight[imageIndex],
+									VK_TRUE, UINT64_MAX);
+				}
+				imagesInFlight[imageIndex] = inFlightFences[currentFrame];
+			}
+		}
+		gpuProfiler.collect(imageIndex);
+		// counted at the scale the buffer was recorded at, maybe not the current one
+		fragmentCounter.collect(imageIndex, recordedExtents[imageIndex]);
+		if (dynamicResolution) {
+			updateRenderScale();
+			updateUpscaleUniforms(imageIndex);
+		}
+		if (recordedGenerations[imageIndex] != commandBufferGeneration) {
+			recordCommandBuffer(imageIndex);
+		}
+		
+		if (!simulationThreaded) {
+			advanceSimulation();
+		}
+		{
+			PROFILE_ZONE("updateUniformBuffer");
+			updateUniformBuffer(imageIndex);
+		}
+		VkCommandBuffer submitted[] = {frameCommandBuffers[imageIndex], commandBuffers[imageIndex]};
+		bool frameCommands;
+		{
+			PROFILE_ZONE("recordFrameCommands");
+			frameCommands = recordFrameCommands(imageIndex);
+		}
+		
 		VkSubmitInfo submitInfo{};
 		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
 		VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
 		VkPipelineStageFlags waitStages[] =
 			{VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-		submitInfo.waitSemaphoreCount = 1;
+		submitInfo.waitSemaphoreCount = headless ? 0 : 1;
 		submitInfo.pWaitSemaphores = waitSemaphores;
 		submitInfo.pWaitDstStageMask = waitStages;
-		submitInfo.commandBufferCount = 1;
-		submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+		submitInfo.commandBufferCount = frameCommands ? 2 : 1;
+		submitInfo.pCommandBuffers = frameCommands ? submitted : &commandBuffers[imageIndex];
 		VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
-		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.signalSemaphoreCount = headless ? 0 : 1;
 		submitInfo.pSignalSemaphores = signalSemaphores;
 		
-		vkResetFences(device, 1, &inFlightFences[currentFrame]);
+		VkFence frameFence = VK_NULL_HANDLE;
+		if (!useTimelineSemaphores) {
+			frameFence = inFlightFences[currentFrame];
+			vkResetFences(device, 1, &frameFence);
+		}
 
-		if (vkQueueSubmit(graphicsQueue, 1, &submitInfo,
-				inFlightFences[currentFrame]) != VK_SUCCESS) {
-			throw std::runtime_error("failed to submit draw command buffer!");
+		uint64_t submitValue;
+		{
+			PROFILE_ZONE("vkQueueSubmit");
+			submitValue = submitToGraphicsQueue(submitInfo, frameFence);
+		}
+		frameSubmitValues[currentFrame] = submitValue;
+		imageSubmitValues[imageIndex] = submitValue;
+		gpuProfiler.submitted(imageIndex);
+		fragmentCounter.submitted(imageIndex);
+		frameInputTimes[currentFrame] = lastInputTime;
+		
+		if (headless) {
+			if (!pngPrefix.empty() && frameNumber % pngInterval == 0) {
+				writeFramePNG(imageIndex);
+			}
+			currentFrame = (currentFrame + 1) % framePacing.framesInFlight;
+			return;
 		}
 		
 		VkPresentInfoKHR presentInfo{};
@@ -1409,9 +3644,21 @@ protected:
 		presentInfo.pImageIndices = &imageIndex;
 		presentInfo.pResults = nullptr; // Optional
 		
-		result = vkQueuePresentKHR(presentQueue, &presentInfo);
+		{
+			PROFILE_ZONE("vkQueuePresentKHR");
+			result = vkQueuePresentKHR(presentQueue, &presentInfo);
+		}
+		
+		if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR ||
+				framebufferResized) {
+			framebufferResized = false;
+			recreateSwapChain();
+		} else if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to present swap chain image!");
+		}
 
-		currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+		currentFrame = (currentFrame + 1) % framePacing.framesInFlight;
     }
 
 	virtual void updateUniformBuffer(uint32_t currentImage) = 0;
@@ -1421,48 +3668,64 @@ protected:
 	// All lessons
 	
     void cleanup() {
-		vkDestroyImageView(device, depthImageView, nullptr);
-		vkDestroyImage(device, depthImage, nullptr);
-		vkFreeMemory(device, depthImageMemory, nullptr);
-
-		for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
-			vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
-		}
-		
-		vkFreeCommandBuffers(device, commandPool,
-				static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
+    	PROFILE_ZONE("cleanup");
+		cleanupSwapChainResources();
 
 		vkDestroyRenderPass(device, renderPass, nullptr);
-
-		for (size_t i = 0; i < swapChainImageViews.size(); i++){
-			vkDestroyImageView(device, swapChainImageViews[i], nullptr);
+		if (dynamicResolution) {
+			vkDestroyRenderPass(device, presentRenderPass, nullptr);
+			upscaleSet.cleanup();
+			upscalePipeline.cleanup();
+			upscaleSetLayout.cleanup();
 		}
 		
-		vkDestroySwapchainKHR(device, swapChain, nullptr);
+		if (headless) {
+			destroyOffscreenImages();
+		} else {
+			vkDestroySwapchainKHR(device, swapChain, nullptr);
+		}
 		
-		vkDestroyDescriptorPool(device, descriptorPool, nullptr);
-    	
-    	
 		localCleanup();
+		pipelineRegistry.cleanup();
+		gpuProfiler.cleanup();
+		fragmentCounter.cleanup();
+		
+    	// the device is idle: every pending deletion can run now
+    	lastCompletedValue = lastSubmittedValue;
+    	collectGarbage();
+    	// after the sets freed by localCleanup() came back
+    	descriptorAllocator.cleanup();
     	
-    	for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+    	for (size_t i = 0; i < imageAvailableSemaphores.size(); i++) {
 			vkDestroySemaphore(device, renderFinishedSemaphores[i], nullptr);
 			vkDestroySemaphore(device, imageAvailableSemaphores[i], nullptr);
+    	}
+    	for (size_t i = 0; i < inFlightFences.size(); i++) {
 			vkDestroyFence(device, inFlightFences[i], nullptr);
     	}
+    	if (timelineSemaphore != VK_NULL_HANDLE) {
+    		vkDestroySemaphore(device, timelineSemaphore, nullptr);
+    	}
     	
     	vkDestroyCommandPool(device, commandPool, nullptr);
+    	vkDestroyCommandPool(device, frameCommandPool, nullptr);
+    	
+    	savePipelineCache();
+    	vkDestroyPipelineCache(device, pipelineCache, nullptr);
     	
  		vkDestroyDevice(device, nullptr);
 		
 		DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
 		
-		vkDestroySurfaceKHR(instance, surface, nullptr);
+		if (!headless) {
+			vkDestroySurfaceKHR(instance, surface, nullptr);
+		}
     	vkDestroyInstance(instance, nullptr);
 
-        glfwDestroyWindow(window);
-
-        glfwTerminate();
+		if (!headless) {
+			glfwDestroyWindow(window);
+			glfwTerminate();
+		}
     }
 	
 };
@@ -1525,6 +3788,23 @@ void Model::createVertexBuffer() {
 	vkUnmapMemory(BP->device, vertexBufferMemory);			
 }
 
+void Model::createPositionBuffer() {
+	VkDeviceSize bufferSize = sizeof(glm::vec3) * vertices.size();
+	
+	BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, 
+						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+						VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+						positionBuffer, positionBufferMemory);
+
+	void* data;
+	vkMapMemory(BP->device, positionBufferMemory, 0, bufferSize, 0, &data);
+	glm::vec3 *positions = (glm::vec3 *) data;
+	for (size_t i = 0; i < vertices.size(); i++) {
+		positions[i] = vertices[i].pos;
+	}
+	vkUnmapMemory(BP->device, positionBufferMemory);
+}
+
 void Model::createIndexBuffer() {
 	VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
 
@@ -1540,17 +3820,56 @@ void Model::createIndexBuffer() {
 }
 
 void Model::init(BaseProject *bp, std::string file) {
+	PROFILE_ZONE_DETAIL("Model::init", file.c_str());
 	BP = bp;
+	this->file = file;
 	loadModel(file);
 	createVertexBuffer();
+	createPositionBuffer();
 	createIndexBuffer();
+	BP->loadedModels.push_back(this);
 }
 
-void Model::cleanup() {
+// the new buffers are made before the old ones are destroyed: if one of
+// them cannot be, the model keeps the old geometry
+void Model::reload(std::vector<Vertex> newVertices, std::vector<uint32_t> newIndices) {
+	Model next{};
+	next.BP = BP;
+	next.vertices = std::move(newVertices);
+	next.indices = std::move(newIndices);
+	try {
+		next.createVertexBuffer();
+		next.createPositionBuffer();
+		next.createIndexBuffer();
+	} catch (...) {
+		next.destroyBuffers();
+		throw;
+	}
+	
+	destroyBuffers();
+	vertices = std::move(next.vertices);
+	indices = std::move(next.indices);
+	vertexBuffer = next.vertexBuffer;
+	vertexBufferMemory = next.vertexBufferMemory;
+	positionBuffer = next.positionBuffer;
+	positionBufferMemory = next.positionBufferMemory;
+	indexBuffer = next.indexBuffer;
+	indexBufferMemory = next.indexBufferMemory;
+}
+
+void Model::destroyBuffers() {
    	vkDestroyBuffer(BP->device, indexBuffer, nullptr);
    	vkFreeMemory(BP->device, indexBufferMemory, nullptr);
 	vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
    	vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+	vkDestroyBuffer(BP->device, positionBuffer, nullptr);
+   	vkFreeMemory(BP->device, positionBufferMemory, nullptr);
+}
+
+void Model::cleanup() {
+	destroyBuffers();
+	auto &loaded = BP->loadedModels;
+	loaded.erase(std::remove(loaded.begin(), loaded.end(), this), loaded.end());
 }
 
 
@@ -1566,7 +3885,11 @@ void Texture::createTextureImage(std::string file) {
 	if (!pixels) {
 		throw std::runtime_error("failed to load texture image!");
 	}
+	createTextureImage(pixels, texWidth, texHeight);
+	stbi_image_free(pixels);
+}
 
+void Texture::createTextureImage(const stbi_uc *pixels, int texWidth, int texHeight) {
 	VkDeviceSize imageSize = texWidth * texHeight * 4;
 	mipLevels = static_cast<uint32_t>(std::floor(
 					std::log2(std::max(texWidth, texHeight)))) + 1;
@@ -1583,8 +3906,6 @@ void Texture::createTextureImage(std::string file) {
 	memcpy(data, pixels, static_cast<size_t>(imageSize));
 	vkUnmapMemory(BP->device, stagingBufferMemory);
 	
-	stbi_image_free(pixels);
-	
 	BP->createImage(texWidth, texHeight, mipLevels, VK_FORMAT_R8G8B8A8_SRGB,
 				VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
 				VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
@@ -1640,107 +3961,547 @@ void Texture::createTextureSampler() {
 
 
 void Texture::init(BaseProject *bp, std::string file) {
+	PROFILE_ZONE_DETAIL("Texture::init", file.c_str());
 	BP = bp;
+	this->file = file;
 	createTextureImage(file);
 	createTextureImageView();
 	createTextureSampler();
+	BP->loadedTextures.push_back(this);
 }
 
-void Texture::cleanup() {
+void Texture::reload(const stbi_uc *pixels, int texWidth, int texHeight) {
+	destroyImage();
+	createTextureImage(pixels, texWidth, texHeight);
+	createTextureImageView();
+	createTextureSampler();
+}
+
+void Texture::destroyImage() {
    	vkDestroySampler(BP->device, textureSampler, nullptr);
    	vkDestroyImageView(BP->device, textureImageView, nullptr);
 	vkDestroyImage(BP->device, textureImage, nullptr);
 	vkFreeMemory(BP->device, textureImageMemory, nullptr);
 }
 
+void Texture::cleanup() {
+	destroyImage();
+	auto &loaded = BP->loadedTextures;
+	loaded.erase(std::remove(loaded.begin(), loaded.end(), this), loaded.end());
+}
+
+
 
 
 
+static void hashCombine(size_t &seed, size_t value) {
+	seed ^= value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+}
+
+size_t PipelineDescription::hash() const {
+	size_t h = std::hash<std::string>()(vertShader);
+	hashCombine(h, std::hash<std::string>()(fragShader));
+	for(DescriptorSetLayout *D : setLayouts) {
+		hashCombine(h, std::hash<VkDescriptorSetLayout>()(D->descriptorSetLayout));
+	}
+	hashCombine(h, topology);
+	hashCombine(h, polygonMode);
+	hashCombine(h, cullMode);
+	hashCombine(h, frontFace);
+	hashCombine(h, (depthTest ? 1 : 0) | (depthWrite ? 2 : 0) | (blendEnable ? 4 : 0) |
+				   (colorWrite ? 8 : 0) | (positionOnly ? 16 : 0));
+	hashCombine(h, depthCompareOp);
+	hashCombine(h, srcBlendFactor);
+	hashCombine(h, dstBlendFactor);
+	hashCombine(h, subpass);
+	hashCombine(h, std::hash<VkRenderPass>()(renderPass));
+	hashCombine(h, colorAttachments);
+	for (uint32_t value : specialization) {
+		hashCombine(h, value);
+	}
+	return h;
+}
+
+bool PipelineDescription::operator==(const PipelineDescription &other) const {
+	if(setLayouts.size() != other.setLayouts.size()) {
+		return false;
+	}
+	for(size_t i = 0; i < setLayouts.size(); i++) {
+		if(setLayouts[i]->descriptorSetLayout !=
+		   other.setLayouts[i]->descriptorSetLayout) {
+			return false;
+		}
+	}
+	return vertShader == other.vertShader && fragShader == other.fragShader &&
+		   topology == other.topology && polygonMode == other.polygonMode &&
+		   cullMode == other.cullMode && frontFace == other.frontFace &&
+		   depthTest == other.depthTest && depthWrite == other.depthWrite &&
+		   depthCompareOp == other.depthCompareOp &&
+		   blendEnable == other.blendEnable &&
+		   srcBlendFactor == other.srcBlendFactor &&
+		   dstBlendFactor == other.dstBlendFactor && subpass == other.subpass &&
+		   renderPass == other.renderPass && colorAttachments == other.colorAttachments &&
+		   colorWrite == other.colorWrite && positionOnly == other.positionOnly &&
+		   specialization == other.specialization;
+}
 
 void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
 					std::vector<DescriptorSetLayout *> D) {
+	PipelineDescription desc;
+	desc.vertShader = VertShader;
+	desc.fragShader = FragShader;
+	desc.setLayouts = D;
+	init(bp, desc);
+}
+
+void Pipeline::init(BaseProject *bp, const PipelineDescription &desc) {
 	BP = bp;
+	PipelineRegistry::Entry *E = BP->pipelineRegistry.acquire(desc);
+	graphicsPipeline = E->pipeline;
+	pipelineLayout = E->layout;
+	E->users.push_back(this);
+}
+
+void Pipeline::request(BaseProject *bp, const PipelineDescription &desc) {
+	BP = bp;
+	graphicsPipeline = VK_NULL_HANDLE;
+	pipelineLayout = VK_NULL_HANDLE;
+	BP->pipelineRegistry.request(this, desc);
+}
+
+// Lesson 18
+std::vector<char> Pipeline::readFile(const std::string& filename) {
+		std::ifstream file(filename, std::ios::ate | std::ios::binary);
+	if (!file.is_open()) {
+		throw std::runtime_error("failed to open file!");
+	}
 	
-	auto vertShaderCode = readFile(VertShader);
-	auto fragShaderCode = readFile(FragShader);
-	
-	std::cout << "Vertex shader len: " <<
-				vertShaderCode.size() << "\n";
-	std::cout << "Fragment shader len: " <<
-				fragShaderCode.size() << "\n";
-	
-	VkShaderModule vertShaderModule =
-			createShaderModule(vertShaderCode);
-	VkShaderModule fragShaderModule =
-			createShaderModule(fragShaderCode);
+	size_t fileSize = (size_t) file.tellg();
+	std::vector<char> buffer(fileSize);
+	 
+	file.seekg(0);
+	file.read(buffer.data(), fileSize);
+	 
+	file.close();
+	 
+	return buffer;
+}
 
-	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
-    vertShaderStageInfo.sType =
-    		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-    vertShaderStageInfo.module = vertShaderModule;
-    vertShaderStageInfo.pName = "main";
+void Pipeline::cleanup() {
+	BP->pipelineRegistry.release(this);
+}
 
-    VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
-    fragShaderStageInfo.sType =
-    		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-    fragShaderStageInfo.module = fragShaderModule;
-    fragShaderStageInfo.pName = "main";
+void ComputePipeline::init(BaseProject *bp, const std::string &Shader,
+						   std::vector<DescriptorSetLayout *> D) {
+	PROFILE_ZONE("ComputePipeline::init");
+	BP = bp;
+	pipelineLayout = BP->pipelineRegistry.getPipelineLayout(D);
 
-    VkPipelineShaderStageCreateInfo shaderStages[] =
-    		{vertShaderStageInfo, fragShaderStageInfo};
+	VkPipelineShaderStageCreateInfo stageInfo{};
+	stageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	stageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	stageInfo.module = BP->pipelineRegistry.getShaderModule(Shader);
+	stageInfo.pName = "main";
 
-	// Lesson 17
-	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
-	vertexInputInfo.sType =
-			VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-	auto bindingDescription = Vertex::getBindingDescription();
-	auto attributeDescriptions = Vertex::getAttributeDescriptions();
-			
-	vertexInputInfo.vertexBindingDescriptionCount = 1;
-	vertexInputInfo.vertexAttributeDescriptionCount =
-			static_cast<uint32_t>(attributeDescriptions.size());
-	vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-	vertexInputInfo.pVertexAttributeDescriptions =
-			attributeDescriptions.data();		
+	VkComputePipelineCreateInfo pipelineInfo{};
+	pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	pipelineInfo.stage = stageInfo;
+	pipelineInfo.layout = pipelineLayout;
 
-	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
-	inputAssembly.sType =
-		VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-	inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-	inputAssembly.primitiveRestartEnable = VK_FALSE;
+	VkResult result = vkCreateComputePipelines(BP->device, BP->pipelineCache, 1,
+								&pipelineInfo, nullptr, &computePipeline);
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to create compute pipeline!");
+	}
+}
 
-	// Lesson 19
-	VkViewport viewport{};
-	viewport.x = 0.0f;
-	viewport.y = 0.0f;
-	viewport.width = (float) BP->swapChainExtent.width;
-	viewport.height = (float) BP->swapChainExtent.height;
-	viewport.minDepth = 0.0f;
-	viewport.maxDepth = 1.0f;
+void ComputePipeline::cleanup() {
+	vkDestroyPipeline(BP->device, computePipeline, nullptr);
+}
+
+void PipelineRegistry::init(BaseProject *bp) {
+	BP = bp;
+}
+
+PipelineRegistry::Entry *PipelineRegistry::find(const PipelineDescription &desc,
+												size_t hash) {
+	for(auto &E : entries) {
+		if(E->hash == hash && E->desc == desc) {
+			return E.get();
+		}
+	}
+	return nullptr;
+}
+
+PipelineRegistry::Entry *PipelineRegistry::acquire(const PipelineDescription &desc) {
+	size_t hash = desc.hash();
+	Entry *E = find(desc, hash);
 	
-	VkRect2D scissor{};
-	scissor.offset = {0, 0};
-	scissor.extent = BP->swapChainExtent;
+	if(E == nullptr) {
+		entries.push_back(std::make_unique<Entry>());
+		E = entries.back().get();
+		E->desc = desc;
+		E->hash = hash;
+	}
+	E->refCount++;
 	
-	VkPipelineViewportStateCreateInfo viewportState{};
-	viewportState.sType =
-			VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	if(E->pipeline == VK_NULL_HANDLE) {
+		// Either brand new or still pending: build it now, and take it out
+		// of the batch so that createPending() does not build it again
+		auto compileStart = std::chrono::high_resolution_clock::now();
+		prepare(E);
+		VkResult result = compile(E);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create graphics pipeline!");
+		}
+		LOG_DEBUG("Pipeline created in %.2f ms",
+				  std::chrono::duration<float, std::milli>(
+					  std::chrono::high_resolution_clock::now() - compileStart).count());
+		pending.erase(std::remove(pending.begin(), pending.end(), E), pending.end());
+		for(Pipeline *P : E->waiting) {
+			P->graphicsPipeline = E->pipeline;
+			P->pipelineLayout = E->layout;
+			E->users.push_back(P);
+		}
+		E->waiting.clear();
+	}
+	return E;
+}
+
+void PipelineRegistry::request(Pipeline *P, const PipelineDescription &desc) {
+	size_t hash = desc.hash();
+	Entry *E = find(desc, hash);
+	
+	if(E == nullptr) {
+		entries.push_back(std::make_unique<Entry>());
+		E = entries.back().get();
+		E->desc = desc;
+		E->hash = hash;
+	}
+	E->refCount++;
+	
+	if(E->pipeline != VK_NULL_HANDLE) {
+		P->graphicsPipeline = E->pipeline;
+		P->pipelineLayout = E->layout;
+		E->users.push_back(P);
+		return;
+	}
+	if(E->waiting.empty() &&
+	   std::find(pending.begin(), pending.end(), E) == pending.end()) {
+		pending.push_back(E);
+	}
+	E->waiting.push_back(P);
+}
+
+// Shader modules and layouts are resolved on the calling thread, then the
+// pipelines themselves are compiled on worker threads: vkCreateGraphicsPipelines
+// and the (internally synchronized) pipeline cache are safe to use concurrently.
+void PipelineRegistry::createPending() {
+	if(pending.empty()) {
+		return;
+	}
+	PROFILE_ZONE("PipelineRegistry::createPending");
+	auto compileStart = std::chrono::high_resolution_clock::now();
+	
+	for(Entry *E : pending) {
+		prepare(E);
+	}
+	
+	size_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+	threadCount = std::min(threadCount, pending.size());
+	
+	std::vector<VkResult> results(pending.size(), VK_SUCCESS);
+	std::atomic<size_t> next(0);
+	auto worker = [&]() {
+		for(size_t i = next++; i < pending.size(); i = next++) {
+			results[i] = compile(pending[i]);
+		}
+	};
+	
+	std::vector<std::thread> threads;
+	for(size_t t = 1; t < threadCount; t++) {
+		threads.emplace_back([&worker, t]() {
+			Profiler::get().setThreadName("pipeline compile " + std::to_string(t));
+			worker();
+		});
+	}
+	worker();
+	for(auto &T : threads) {
+		T.join();
+	}
+	
+	for(size_t i = 0; i < pending.size(); i++) {
+		if (results[i] != VK_SUCCESS) {
+		 	PrintVkError(results[i]);
+			throw std::runtime_error("failed to create graphics pipeline!");
+		}
+		for(Pipeline *P : pending[i]->waiting) {
+			P->graphicsPipeline = pending[i]->pipeline;
+			P->pipelineLayout = pending[i]->layout;
+			pending[i]->users.push_back(P);
+		}
+		pending[i]->waiting.clear();
+	}
+	
+	LOG_INFO("Created %zu pipelines on %zu threads in %.2f ms", pending.size(),
+			 threadCount, std::chrono::duration<float, std::milli>(
+				 std::chrono::high_resolution_clock::now() - compileStart).count());
+	pending.clear();
+}
+
+void PipelineRegistry::release(Pipeline *P) {
+	for(auto it = entries.begin(); it != entries.end(); ++it) {
+		if((*it)->pipeline == P->graphicsPipeline) {
+			auto &users = (*it)->users;
+			users.erase(std::remove(users.begin(), users.end(), P), users.end());
+			if(--(*it)->refCount == 0) {
+				vkDestroyPipeline(BP->device, P->graphicsPipeline, nullptr);
+				entries.erase(it);
+			}
+			return;
+		}
+	}
+}
+
+// Replaces the module of a shader file and rebuilds every pipeline that
+// uses it. The GPU must be done with the old pipelines, and command
+// buffers must be recorded again. If one of them does not build, the old
+// module and pipelines are kept and false is returned.
+bool PipelineRegistry::reloadShader(const std::string &file, const std::vector<char> &code) {
+	auto module = shaderModules.find(file);
+	if(module == shaderModules.end()) {
+		return false;
+	}
+	VkShaderModule oldModule = module->second;
+	if(createShaderModule(code, module->second) != VK_SUCCESS) {
+		module->second = oldModule;
+		return false;
+	}
+	
+	std::vector<Entry *> rebuilt;
+	std::vector<VkPipeline> oldPipelines;
+	for(auto &E : entries) {
+		if(E->pipeline == VK_NULL_HANDLE ||
+		   (E->desc.vertShader != file && E->desc.fragShader != file)) {
+			continue;
+		}
+		VkPipeline oldPipeline = E->pipeline;
+		VkResult result = compile(E.get());
+		if(result != VK_SUCCESS) {
+			PrintVkError(result);
+			E->pipeline = oldPipeline;
+			for(size_t i = 0; i < rebuilt.size(); i++) {
+				vkDestroyPipeline(BP->device, rebuilt[i]->pipeline, nullptr);
+				rebuilt[i]->pipeline = oldPipelines[i];
+			}
+			vkDestroyShaderModule(BP->device, module->second, nullptr);
+			module->second = oldModule;
+			return false;
+		}
+		rebuilt.push_back(E.get());
+		oldPipelines.push_back(oldPipeline);
+	}
+	
+	for(size_t i = 0; i < rebuilt.size(); i++) {
+		vkDestroyPipeline(BP->device, oldPipelines[i], nullptr);
+		for(Pipeline *P : rebuilt[i]->users) {
+			P->graphicsPipeline = rebuilt[i]->pipeline;
+		}
+	}
+	vkDestroyShaderModule(BP->device, oldModule, nullptr);
+	return true;
+}
+
+void PipelineRegistry::cleanup() {
+	for(auto &E : entries) {
+		if(E->pipeline != VK_NULL_HANDLE) {
+			vkDestroyPipeline(BP->device, E->pipeline, nullptr);
+		}
+	}
+	entries.clear();
+	pending.clear();
+	
+	for(auto &L : layouts) {
+		vkDestroyPipelineLayout(BP->device, L.second, nullptr);
+	}
+	layouts.clear();
+	
+	for(auto &M : shaderModules) {
+		vkDestroyShaderModule(BP->device, M.second, nullptr);
+	}
+	shaderModules.clear();
+}
+
+// Lesson 18
+VkShaderModule PipelineRegistry::getShaderModule(const std::string &file) {
+	auto it = shaderModules.find(file);
+	if(it != shaderModules.end()) {
+		return it->second;
+	}
+	
+	auto code = Pipeline::readFile(file);
+	LOG_DEBUG("Shader %s len: %zu", file.c_str(), code.size());
+	
+	VkShaderModule shaderModule;
+	VkResult result = createShaderModule(code, shaderModule);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create shader module!");
+	}
+	
+	shaderModules[file] = shaderModule;
+	return shaderModule;
+}
+
+VkResult PipelineRegistry::createShaderModule(const std::vector<char> &code,
+											  VkShaderModule &module) {
+	VkShaderModuleCreateInfo createInfo{};
+	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	createInfo.codeSize = code.size();
+	createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
+	
+	return vkCreateShaderModule(BP->device, &createInfo, nullptr, &module);
+}
+
+// Lesson 21
+VkPipelineLayout PipelineRegistry::getPipelineLayout(
+			const std::vector<DescriptorSetLayout *> &D) {
+	std::vector<VkDescriptorSetLayout> DSL(D.size());
+	for(int i = 0; i < D.size(); i++) {
+		DSL[i] = D[i]->descriptorSetLayout;
+	}
+	
+	auto it = layouts.find(DSL);
+	if(it != layouts.end()) {
+		return it->second;
+	}
+	
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = DSL.size();
+	pipelineLayoutInfo.pSetLayouts = DSL.data();
+	pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
+	pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
+	
+	VkPipelineLayout pipelineLayout;
+	VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
+				&pipelineLayout);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create pipeline layout!");
+	}
+	
+	layouts[DSL] = pipelineLayout;
+	return pipelineLayout;
+}
+
+void PipelineRegistry::prepare(Entry *E) {
+	getShaderModule(E->desc.vertShader);
+	if(!E->desc.fragShader.empty()) {
+		getShaderModule(E->desc.fragShader);
+	}
+	E->layout = getPipelineLayout(E->desc.setLayouts);
+}
+
+// Only reads the module and layout maps, so it can run on any thread
+// once prepare() has been called for the entry.
+VkResult PipelineRegistry::compile(Entry *E) {
+	PROFILE_ZONE_DETAIL("PipelineRegistry::compile", E->desc.vertShader.c_str());
+	const PipelineDescription &desc = E->desc;
+	
+	VkPipelineShaderStageCreateInfo vertShaderStageInfo{};
+    vertShaderStageInfo.sType =
+    		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
+    vertShaderStageInfo.module = shaderModules.at(desc.vertShader);
+    vertShaderStageInfo.pName = "main";
+
+    VkPipelineShaderStageCreateInfo fragShaderStageInfo{};
+    fragShaderStageInfo.sType =
+    		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+    fragShaderStageInfo.module = desc.fragShader.empty() ? VK_NULL_HANDLE :
+    		shaderModules.at(desc.fragShader);
+    fragShaderStageInfo.pName = "main";
+
+    std::vector<VkSpecializationMapEntry> specializationEntries(desc.specialization.size());
+    for (uint32_t i = 0; i < specializationEntries.size(); i++) {
+    	specializationEntries[i] = {i, i * (uint32_t) sizeof(uint32_t), sizeof(uint32_t)};
+    }
+    VkSpecializationInfo specializationInfo{};
+    specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+    specializationInfo.pMapEntries = specializationEntries.data();
+    specializationInfo.dataSize = desc.specialization.size() * sizeof(uint32_t);
+    specializationInfo.pData = desc.specialization.data();
+    if (!desc.specialization.empty()) {
+    	// constants a shader does not declare are ignored
+    	vertShaderStageInfo.pSpecializationInfo = &specializationInfo;
+    	fragShaderStageInfo.pSpecializationInfo = &specializationInfo;
+    }
+
+    VkPipelineShaderStageCreateInfo shaderStages[] =
+    		{vertShaderStageInfo, fragShaderStageInfo};
+
+	// Lesson 17
+	VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
+	vertexInputInfo.sType =
+			VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	auto bindingDescription = Vertex::getBindingDescription();
+	auto attributeDescriptions = Vertex::getAttributeDescriptions();
+	auto positionBindingDescription = Vertex::getPositionBindingDescription();
+	auto positionAttributeDescription = Vertex::getPositionAttributeDescription();
+			
+	vertexInputInfo.vertexBindingDescriptionCount = 1;
+	if (desc.positionOnly) {
+		vertexInputInfo.vertexAttributeDescriptionCount = 1;
+		vertexInputInfo.pVertexBindingDescriptions = &positionBindingDescription;
+		vertexInputInfo.pVertexAttributeDescriptions = &positionAttributeDescription;
+	} else {
+		vertexInputInfo.vertexAttributeDescriptionCount =
+				static_cast<uint32_t>(attributeDescriptions.size());
+		vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+		vertexInputInfo.pVertexAttributeDescriptions =
+				attributeDescriptions.data();
+	}
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+	inputAssembly.sType =
+		VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = desc.topology;
+	inputAssembly.primitiveRestartEnable = VK_FALSE;
+
+	// Lesson 19 - viewport and scissor are set when recording the
+	// command buffers, so pipelines do not depend on the window size
+	VkPipelineViewportStateCreateInfo viewportState{};
+	viewportState.sType =
+			VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
 	viewportState.viewportCount = 1;
-	viewportState.pViewports = &viewport;
+	viewportState.pViewports = nullptr;
 	viewportState.scissorCount = 1;
-	viewportState.pScissors = &scissor;
+	viewportState.pScissors = nullptr;
+	
+	VkDynamicState dynamicStates[] = {
+		VK_DYNAMIC_STATE_VIEWPORT,
+		VK_DYNAMIC_STATE_SCISSOR
+	};
+	VkPipelineDynamicStateCreateInfo dynamicState{};
+	dynamicState.sType =
+			VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamicState.dynamicStateCount = 2;
+	dynamicState.pDynamicStates = dynamicStates;
 	
 	VkPipelineRasterizationStateCreateInfo rasterizer{};
 	rasterizer.sType =
 			VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
 	rasterizer.depthClampEnable = VK_FALSE;
 	rasterizer.rasterizerDiscardEnable = VK_FALSE;
-	rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
+	rasterizer.polygonMode = desc.polygonMode;
 	rasterizer.lineWidth = 1.0f;
-	rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-	rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	rasterizer.cullMode = desc.cullMode;
+	rasterizer.frontFace = desc.frontFace;
 	rasterizer.depthBiasEnable = VK_FALSE;
 	rasterizer.depthBiasConstantFactor = 0.0f; // Optional
 	rasterizer.depthBiasClamp = 0.0f; // Optional
@@ -1757,16 +4518,14 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 	multisampling.alphaToOneEnable = VK_FALSE; // Optional
 	
 	VkPipelineColorBlendAttachmentState colorBlendAttachment{};
-	colorBlendAttachment.colorWriteMask =
+	colorBlendAttachment.colorWriteMask = !desc.colorWrite ? 0 :
 			VK_COLOR_COMPONENT_R_BIT |
 			VK_COLOR_COMPONENT_G_BIT |
 			VK_COLOR_COMPONENT_B_BIT |
 			VK_COLOR_COMPONENT_A_BIT;
-	colorBlendAttachment.blendEnable = VK_FALSE;
-	colorBlendAttachment.srcColorBlendFactor =
-			VK_BLEND_FACTOR_ONE; // Optional
-	colorBlendAttachment.dstColorBlendFactor =
-			VK_BLEND_FACTOR_ZERO; // Optional
+	colorBlendAttachment.blendEnable = desc.blendEnable ? VK_TRUE : VK_FALSE;
+	colorBlendAttachment.srcColorBlendFactor = desc.srcBlendFactor;
+	colorBlendAttachment.dstColorBlendFactor = desc.dstBlendFactor;
 	colorBlendAttachment.colorBlendOp =
 			VK_BLEND_OP_ADD; // Optional
 	colorBlendAttachment.srcAlphaBlendFactor =
@@ -1781,41 +4540,20 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 			VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
 	colorBlending.logicOpEnable = VK_FALSE;
 	colorBlending.logicOp = VK_LOGIC_OP_COPY; // Optional
-	colorBlending.attachmentCount = 1;
+	colorBlending.attachmentCount = desc.colorAttachments;
 	colorBlending.pAttachments = &colorBlendAttachment;
 	colorBlending.blendConstants[0] = 0.0f; // Optional
 	colorBlending.blendConstants[1] = 0.0f; // Optional
 	colorBlending.blendConstants[2] = 0.0f; // Optional
 	colorBlending.blendConstants[3] = 0.0f; // Optional
 	
-	// Lesson 21
-	std::vector<VkDescriptorSetLayout> DSL(D.size());
-	for(int i = 0; i < D.size(); i++) {
-		DSL[i] = D[i]->descriptorSetLayout;
-	}
-	
-	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
-	pipelineLayoutInfo.sType =
-		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-	pipelineLayoutInfo.setLayoutCount = DSL.size();
-	pipelineLayoutInfo.pSetLayouts = DSL.data();
-	pipelineLayoutInfo.pushConstantRangeCount = 0; // Optional
-	pipelineLayoutInfo.pPushConstantRanges = nullptr; // Optional
-	
-	VkResult result = vkCreatePipelineLayout(BP->device, &pipelineLayoutInfo, nullptr,
-				&pipelineLayout);
-	if (result != VK_SUCCESS) {
-	 	PrintVkError(result);
-		throw std::runtime_error("failed to create pipeline layout!");
-	}
-	
 	// Lesson 19
 	VkPipelineDepthStencilStateCreateInfo depthStencil{};
 	depthStencil.sType = 
 			VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-	depthStencil.depthTestEnable = VK_TRUE;
-	depthStencil.depthWriteEnable = VK_TRUE;
-	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+	depthStencil.depthTestEnable = desc.depthTest ? VK_TRUE : VK_FALSE;
+	depthStencil.depthWriteEnable = desc.depthWrite ? VK_TRUE : VK_FALSE;
+	depthStencil.depthCompareOp = desc.depthCompareOp;
 	depthStencil.depthBoundsTestEnable = VK_FALSE;
 	depthStencil.minDepthBounds = 0.0f; // Optional
 	depthStencil.maxDepthBounds = 1.0f; // Optional
@@ -1826,7 +4564,7 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 	VkGraphicsPipelineCreateInfo pipelineInfo{};
 	pipelineInfo.sType =
 			VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-	pipelineInfo.stageCount = 2;
+	pipelineInfo.stageCount = desc.fragShader.empty() ? 1 : 2;
 	pipelineInfo.pStages = shaderStages;
 	pipelineInfo.pVertexInputState = &vertexInputInfo;
 	pipelineInfo.pInputAssemblyState = &inputAssembly;
@@ -1835,64 +4573,16 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
 	pipelineInfo.pMultisampleState = &multisampling;
 	pipelineInfo.pDepthStencilState = &depthStencil;
 	pipelineInfo.pColorBlendState = &colorBlending;
-	pipelineInfo.pDynamicState = nullptr; // Optional
-	pipelineInfo.layout = pipelineLayout;
-	pipelineInfo.renderPass = BP->renderPass;
-	pipelineInfo.subpass = 0;
+	pipelineInfo.pDynamicState = &dynamicState;
+	pipelineInfo.layout = E->layout;
+	pipelineInfo.renderPass = desc.renderPass != VK_NULL_HANDLE ? desc.renderPass :
+													  BP->renderPass;
+	pipelineInfo.subpass = desc.subpass;
 	pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
 	pipelineInfo.basePipelineIndex = -1; // Optional
 	
-	result = vkCreateGraphicsPipelines(BP->device, VK_NULL_HANDLE, 1,
-			&pipelineInfo, nullptr, &graphicsPipeline);
-	if (result != VK_SUCCESS) {
-	 	PrintVkError(result);
-		throw std::runtime_error("failed to create graphics pipeline!");
-	}
-	
-	vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
-	vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
-}
-
-// Lesson 18
-std::vector<char> Pipeline::readFile(const std::string& filename) {
-		std::ifstream file(filename, std::ios::ate | std::ios::binary);
-	if (!file.is_open()) {
-		throw std::runtime_error("failed to open file!");
-	}
-	
-	size_t fileSize = (size_t) file.tellg();
-	std::vector<char> buffer(fileSize);
-	 
-	file.seekg(0);
-	file.read(buffer.data(), fileSize);
-	 
-	file.close();
-	 
-	return buffer;
-}
-
-// Lesson 18
-VkShaderModule Pipeline::createShaderModule(const std::vector<char>& code) {
-	VkShaderModuleCreateInfo createInfo{};
-	createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-	createInfo.codeSize = code.size();
-	createInfo.pCode = reinterpret_cast<const uint32_t*>(code.data());
-	
-	VkShaderModule shaderModule;
-
-	VkResult result = vkCreateShaderModule(BP->device, &createInfo, nullptr,
-					&shaderModule);
-	if (result != VK_SUCCESS) {
-	 	PrintVkError(result);
-		throw std::runtime_error("failed to create shader module!");
-	}
-	
-	return shaderModule;
-}
-
-void Pipeline::cleanup() {
-		vkDestroyPipeline(BP->device, graphicsPipeline, nullptr);
-		vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
+	return vkCreateGraphicsPipelines(BP->device, BP->pipelineCache, 1,
+			&pipelineInfo, nullptr, &E->pipeline);
 }
 
 void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutBinding> B) {
@@ -1922,12 +4612,144 @@ void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutB
 }
 
 void DescriptorSetLayout::cleanup() {
+    	BP->descriptorAllocator.forgetLayout(descriptorSetLayout);
     	vkDestroyDescriptorSetLayout(BP->device, descriptorSetLayout, nullptr);	
 }
 
+void DescriptorAllocator::init(BaseProject *bp, size_t framesInFlight) {
+	BP = bp;
+	frames.resize(framesInFlight);
+}
+
+VkDescriptorSet DescriptorAllocator::allocate(VkDescriptorSetLayout layout) {
+	std::vector<VkDescriptorSet> &recycled = freeSets[layout];
+	if (!recycled.empty()) {
+		VkDescriptorSet set = recycled.back();
+		recycled.pop_back();
+		return set;
+	}
+	
+	VkDescriptorSet set;
+	VkResult result = pools.empty() ? VK_ERROR_OUT_OF_POOL_MEMORY_KHR :
+									  allocateFrom(pools.back(), layout, set);
+	if (result == VK_ERROR_OUT_OF_POOL_MEMORY_KHR || result == VK_ERROR_FRAGMENTED_POOL) {
+		pools.push_back(createPool(nextPoolSets));
+		LOG_DEBUG("Descriptor pool %zu: %u sets", pools.size(), nextPoolSets);
+		nextPoolSets = std::min(nextPoolSets * 2, MAX_POOL_SETS);
+		result = allocateFrom(pools.back(), layout, set);
+	}
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate descriptor sets!");
+	}
+	return set;
+}
+
+void DescriptorAllocator::free(VkDescriptorSetLayout layout, VkDescriptorSet set) {
+	uint32_t generation = layoutGenerations[layout];
+	BP->deferDestroy([this, layout, set, generation]() {
+		auto current = layoutGenerations.find(layout);
+		if (current != layoutGenerations.end() && current->second == generation) {
+			freeSets[layout].push_back(set);
+		}
+	});
+}
+
+void DescriptorAllocator::forgetLayout(VkDescriptorSetLayout layout) {
+	freeSets.erase(layout);
+	layoutGenerations[layout]++;
+}
+
+VkDescriptorSet DescriptorAllocator::allocateTransient(VkDescriptorSetLayout layout, size_t frame) {
+	FramePools &F = frames[frame];
+	VkDescriptorSet set;
+	VkResult result = F.used == 0 ? VK_ERROR_OUT_OF_POOL_MEMORY_KHR :
+									allocateFrom(F.pools[F.used - 1], layout, set);
+	if (result == VK_ERROR_OUT_OF_POOL_MEMORY_KHR || result == VK_ERROR_FRAGMENTED_POOL) {
+		// the pools of earlier frames are kept, reset, for the next ones
+		if (F.used == F.pools.size()) {
+			F.pools.push_back(createPool(FIRST_POOL_SETS));
+		}
+		F.used++;
+		result = allocateFrom(F.pools[F.used - 1], layout, set);
+	}
+	if (result != VK_SUCCESS) {
+		PrintVkError(result);
+		throw std::runtime_error("failed to allocate descriptor sets!");
+	}
+	return set;
+}
+
+void DescriptorAllocator::resetFrame(size_t frame) {
+	FramePools &F = frames[frame];
+	for (size_t i = 0; i < F.used; i++) {
+		vkResetDescriptorPool(BP->device, F.pools[i], 0);
+	}
+	F.used = 0;
+}
+
+void DescriptorAllocator::cleanup() {
+	for (VkDescriptorPool pool : pools) {
+		vkDestroyDescriptorPool(BP->device, pool, nullptr);
+	}
+	for (FramePools &F : frames) {
+		for (VkDescriptorPool pool : F.pools) {
+			vkDestroyDescriptorPool(BP->device, pool, nullptr);
+		}
+	}
+	pools.clear();
+	frames.clear();
+	freeSets.clear();
+	layoutGenerations.clear();
+	nextPoolSets = FIRST_POOL_SETS;
+}
+
+// Lesson 21
+// in the proportions of the sets of the application: a uniform block and
+// a texture each on average, and a few storage buffers
+VkDescriptorPool DescriptorAllocator::createPool(uint32_t sets) {
+	std::array<VkDescriptorPoolSize, 3> poolSizes{};
+	poolSizes[0] = {VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 * sets};
+	poolSizes[1] = {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 2 * sets};
+	poolSizes[2] = {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, sets};
+
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+	poolInfo.pPoolSizes = poolSizes.data();
+	poolInfo.maxSets = sets;
+	
+	VkDescriptorPool pool;
+	VkResult result = vkCreateDescriptorPool(BP->device, &poolInfo, nullptr, &pool);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create descriptor pool!");
+	}
+	return pool;
+}
+
+VkResult DescriptorAllocator::allocateFrom(VkDescriptorPool pool, VkDescriptorSetLayout layout,
+										   VkDescriptorSet &set) {
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = pool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &layout;
+	return vkAllocateDescriptorSets(BP->device, &allocInfo, &set);
+}
+
 void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 						 std::vector<DescriptorSetElement> E) {
+	PROFILE_ZONE("DescriptorSet::init");
 	BP = bp;
+	layout = DSL->descriptorSetLayout;
+	elements = E;
+	createPerImage();
+	BP->allocatedDescriptorSets.push_back(this);
+}
+
+void DescriptorSet::createPerImage() {
+	const std::vector<DescriptorSetElement> &E = elements;
 	
 	// Create uniform buffer
 	uniformBuffers.resize(E.size());
@@ -1937,13 +4759,22 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 	for (int j = 0; j < E.size(); j++) {
 		uniformBuffers[j].resize(BP->swapChainImages.size());
 		uniformBuffersMemory[j].resize(BP->swapChainImages.size());
-		if(E[j].type == UNIFORM) {
+		if(E[j].type == UNIFORM || E[j].type == STORAGE) {
+			VkBufferUsageFlags usage = E[j].type == UNIFORM ?
+					VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT : VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
 			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
 				VkDeviceSize bufferSize = E[j].size;
-				BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+				BP->createBuffer(bufferSize, usage,
 									 	 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
 									 	 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
 									 	 uniformBuffers[j][i], uniformBuffersMemory[j][i]);
+				// shaders may add to a storage buffer: it starts at zero
+				if (E[j].type == STORAGE) {
+					void *data;
+					vkMapMemory(BP->device, uniformBuffersMemory[j][i], 0, bufferSize, 0, &data);
+					memset(data, 0, bufferSize);
+					vkUnmapMemory(BP->device, uniformBuffersMemory[j][i]);
+				}
 			}
 			toFree[j] = true;
 		} else {
@@ -1952,71 +4783,535 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 	}
 	
 	// Create Descriptor set
-	std::vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
-											   DSL->descriptorSetLayout);
-	VkDescriptorSetAllocateInfo allocInfo{};
-	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-	allocInfo.descriptorPool = BP->descriptorPool;
-	allocInfo.descriptorSetCount = static_cast<uint32_t>(BP->swapChainImages.size());
-	allocInfo.pSetLayouts = layouts.data();
-	
 	descriptorSets.resize(BP->swapChainImages.size());
-	
-	VkResult result = vkAllocateDescriptorSets(BP->device, &allocInfo,
-										descriptorSets.data());
-	if (result != VK_SUCCESS) {
-		PrintVkError(result);
-		throw std::runtime_error("failed to allocate descriptor sets!");
+	for (size_t i = 0; i < descriptorSets.size(); i++) {
+		descriptorSets[i] = BP->descriptorAllocator.allocate(layout);
 	}
 	
+	writeDescriptors();
+}
+
+void DescriptorSet::writeDescriptors() {
 	for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-		std::vector<VkWriteDescriptorSet> descriptorWrites(E.size());
-		for (int j = 0; j < E.size(); j++) {
-			if(E[j].type == UNIFORM) {
-				VkDescriptorBufferInfo bufferInfo{};
-				bufferInfo.buffer = uniformBuffers[j][i];
-				bufferInfo.offset = 0;
-				bufferInfo.range = E[j].size;
-				
-				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				descriptorWrites[j].dstSet = descriptorSets[i];
-				descriptorWrites[j].dstBinding = E[j].binding;
-				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-				descriptorWrites[j].descriptorCount = 1;
-				descriptorWrites[j].pBufferInfo = &bufferInfo;
-			} else if(E[j].type == TEXTURE) {
-				VkDescriptorImageInfo imageInfo{};
-				imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-				imageInfo.imageView = E[j].tex->textureImageView;
-				imageInfo.sampler = E[j].tex->textureSampler;
-		
-				descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-				descriptorWrites[j].dstSet = descriptorSets[i];
-				descriptorWrites[j].dstBinding = E[j].binding;
-				descriptorWrites[j].dstArrayElement = 0;
-				descriptorWrites[j].descriptorType =
-											VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-				descriptorWrites[j].descriptorCount = 1;
-				descriptorWrites[j].pImageInfo = &imageInfo;
-			}
-		}		
-		vkUpdateDescriptorSets(BP->device,
-						static_cast<uint32_t>(descriptorWrites.size()),
-						descriptorWrites.data(), 0, nullptr);
+		writeSet(descriptorSets[i], i, elements.size());
 	}
+}
 
+VkDescriptorSet DescriptorSet::transientSet(size_t i, size_t elementCount) {
+	VkDescriptorSet set = BP->descriptorAllocator.allocateTransient(layout, BP->currentFrame);
+	writeSet(set, i, elementCount);
+	return set;
+}
+
+void DescriptorSet::writeSet(VkDescriptorSet set, size_t i, size_t elementCount) {
+	const std::vector<DescriptorSetElement> &E = elements;
+	// the infos must outlive the loop: the writes point to them
+	std::vector<VkWriteDescriptorSet> descriptorWrites(elementCount);
+	std::vector<VkDescriptorBufferInfo> bufferInfos(elementCount);
+	std::vector<VkDescriptorImageInfo> imageInfos(elementCount);
+	for (int j = 0; j < elementCount; j++) {
+		if(E[j].type == UNIFORM || E[j].type == STORAGE) {
+			VkDescriptorBufferInfo &bufferInfo = bufferInfos[j];
+			bufferInfo.buffer = uniformBuffers[j][i];
+			bufferInfo.offset = 0;
+			bufferInfo.range = E[j].size;
+			
+			descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			descriptorWrites[j].dstSet = set;
+			descriptorWrites[j].dstBinding = E[j].binding;
+			descriptorWrites[j].dstArrayElement = 0;
+			descriptorWrites[j].descriptorType = E[j].type == UNIFORM ?
+					VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			descriptorWrites[j].descriptorCount = 1;
+			descriptorWrites[j].pBufferInfo = &bufferInfo;
+		} else if(E[j].type == TEXTURE) {
+			VkDescriptorImageInfo &imageInfo = imageInfos[j];
+			imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			imageInfo.imageView = E[j].tex->textureImageView;
+			imageInfo.sampler = E[j].tex->textureSampler;
+	
+			descriptorWrites[j].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			descriptorWrites[j].dstSet = set;
+			descriptorWrites[j].dstBinding = E[j].binding;
+			descriptorWrites[j].dstArrayElement = 0;
+			descriptorWrites[j].descriptorType =
+										VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			descriptorWrites[j].descriptorCount = 1;
+			descriptorWrites[j].pImageInfo = &imageInfo;
+		}
+	}		
+	vkUpdateDescriptorSets(BP->device,
+					static_cast<uint32_t>(descriptorWrites.size()),
+					descriptorWrites.data(), 0, nullptr);
 }
 
 void DescriptorSet::cleanup() {
-	for(int j = 0; j < uniformBuffers.size(); j++) {
+	auto &allocated = BP->allocatedDescriptorSets;
+	allocated.erase(std::remove(allocated.begin(), allocated.end(), this), allocated.end());
+	destroyPerImage();
+}
+
+// as many as were made, which may no longer be the number of images
+void DescriptorSet::destroyPerImage() {
+	for (VkDescriptorSet set : descriptorSets) {
+		BP->descriptorAllocator.free(layout, set);
+	}
+	descriptorSets.clear();
+	for(size_t j = 0; j < uniformBuffers.size(); j++) {
 		if(toFree[j]) {
-			for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+			for (size_t i = 0; i < uniformBuffers[j].size(); i++) {
 				vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
 				vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
 			}
 		}
 	}
+	uniformBuffers.clear();
+	uniformBuffersMemory.clear();
+}
+
+void DepthTarget::init(BaseProject *bp, uint32_t width, uint32_t height) {
+	BP = bp;
+	this->width = width;
+	this->height = height;
+	VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
+	
+	texture.BP = bp;
+	texture.mipLevels = 1;
+	BP->createImage(width, height, 1, depthFormat, VK_IMAGE_TILING_OPTIMAL,
+					VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+					VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+					texture.textureImage, texture.textureImageMemory);
+	texture.textureImageView = BP->createImageView(texture.textureImage, depthFormat,
+												   VK_IMAGE_ASPECT_DEPTH_BIT, 1);
+	
+	// depths are compared in the shaders, not filtered
+	VkSamplerCreateInfo samplerInfo{};
+	samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerInfo.magFilter = VK_FILTER_NEAREST;
+	samplerInfo.minFilter = VK_FILTER_NEAREST;
+	samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+	samplerInfo.maxLod = 0.0f;
+	VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr,
+									  &texture.textureSampler);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+	 	throw std::runtime_error("failed to create texture sampler!");
+	}
+	
+	// what the image holds is undefined until drawn, but its layout is not
+	VkCommandBuffer commandBuffer = BP->beginSingleTimeCommands();
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = texture.textureImage;
+	barrier.subresourceRange = {VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1};
+	barrier.srcAccessMask = 0;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+						 VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, 0, 0, nullptr, 0, nullptr,
+						 1, &barrier);
+	BP->endSingleTimeCommands(commandBuffer);
+	
+	VkAttachmentDescription depthAttachment{};
+	depthAttachment.format = depthFormat;
+	depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
+	depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+	depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depthAttachment.initialLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	depthAttachment.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	
+	VkAttachmentReference depthAttachmentRef{};
+	depthAttachmentRef.attachment = 0;
+	depthAttachmentRef.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+	
+	VkSubpassDescription subpass{};
+	subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+	subpass.colorAttachmentCount = 0;
+	subpass.pDepthStencilAttachment = &depthAttachmentRef;
+	
+	// after the frames submitted before have read the image, and before
+	// the frame that follows reads it
+	std::array<VkSubpassDependency, 2> dependencies{};
+	dependencies[0].srcSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[0].dstSubpass = 0;
+	dependencies[0].srcStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dependencies[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	dependencies[0].dstStageMask = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT |
+								   VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[0].dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT |
+									VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[1].srcSubpass = 0;
+	dependencies[1].dstSubpass = VK_SUBPASS_EXTERNAL;
+	dependencies[1].srcStageMask = VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	dependencies[1].srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	dependencies[1].dstStageMask = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+	dependencies[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	
+	VkRenderPassCreateInfo renderPassInfo{};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+	renderPassInfo.attachmentCount = 1;
+	renderPassInfo.pAttachments = &depthAttachment;
+	renderPassInfo.subpassCount = 1;
+	renderPassInfo.pSubpasses = &subpass;
+	renderPassInfo.dependencyCount = static_cast<uint32_t>(dependencies.size());
+	renderPassInfo.pDependencies = dependencies.data();
+	result = vkCreateRenderPass(BP->device, &renderPassInfo, nullptr, &renderPass);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create render pass!");
+	}
+	
+	VkFramebufferCreateInfo framebufferInfo{};
+	framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+	framebufferInfo.renderPass = renderPass;
+	framebufferInfo.attachmentCount = 1;
+	framebufferInfo.pAttachments = &texture.textureImageView;
+	framebufferInfo.width = width;
+	framebufferInfo.height = height;
+	framebufferInfo.layers = 1;
+	result = vkCreateFramebuffer(BP->device, &framebufferInfo, nullptr, &framebuffer);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create framebuffer!");
+	}
+}
+
+void DepthTarget::begin(VkCommandBuffer commandBuffer) {
+	VkRenderPassBeginInfo renderPassInfo{};
+	renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	renderPassInfo.renderPass = renderPass;
+	renderPassInfo.framebuffer = framebuffer;
+	renderPassInfo.renderArea.offset = {0, 0};
+	renderPassInfo.renderArea.extent = {width, height};
+	vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
+}
+
+void DepthTarget::clearRegion(VkCommandBuffer commandBuffer, VkRect2D region) {
+	VkClearAttachment clear{};
+	clear.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
+	clear.clearValue.depthStencil = {1.0f, 0};
+	VkClearRect rect{region, 0, 1};
+	vkCmdClearAttachments(commandBuffer, 1, &clear, 1, &rect);
+	
+	VkViewport viewport{};
+	viewport.x = (float) region.offset.x;
+	viewport.y = (float) region.offset.y;
+	viewport.width = (float) region.extent.width;
+	viewport.height = (float) region.extent.height;
+	viewport.minDepth = 0.0f;
+	viewport.maxDepth = 1.0f;
+	vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+	vkCmdSetScissor(commandBuffer, 0, 1, &region);
+}
+
+void DepthTarget::end(VkCommandBuffer commandBuffer) {
+	vkCmdEndRenderPass(commandBuffer);
+}
+
+void DepthTarget::cleanup() {
+	vkDestroyFramebuffer(BP->device, framebuffer, nullptr);
+	vkDestroyRenderPass(BP->device, renderPass, nullptr);
+	texture.destroyImage();
+}
+
+void GpuProfiler::init(BaseProject *bp, uint32_t commandBufferCount) {
+	BP = bp;
+	if (!enabled) {
+		return;
+	}
+	
+	uint32_t queueFamilyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(BP->physicalDevice, &queueFamilyCount, nullptr);
+	std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(BP->physicalDevice, &queueFamilyCount,
+											 queueFamilies.data());
+	uint32_t validBits = queueFamilies[BP->findQueueFamilies(BP->physicalDevice).
+									   graphicsFamily.value()].timestampValidBits;
+	if (validBits == 0) {
+		LOG_WARN("GPU profiler: timestamps not supported on the graphics queue");
+		return;
+	}
+	supported = true;
+	timestampMask = validBits >= 64 ? ~0ull : (1ull << validBits) - 1;
+	timestampPeriod = BP->physicalDeviceProperties.limits.timestampPeriod;
+	
+	resize(commandBufferCount);
+	
+	if (!csvFile.empty()) {
+		csv.open(csvFile);
+		if (!csv) {
+			throw std::runtime_error("failed to open " + csvFile + "!");
+		}
+		csv << "frame,region,ms\n";
+	}
+}
+
+void GpuProfiler::resize(uint32_t commandBufferCount) {
+	if (!supported) {
+		return;
+	}
+	for (auto &P : pools) {
+		vkDestroyQueryPool(BP->device, P.pool, nullptr);
+	}
+	pools.clear();
+	
+	VkQueryPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	poolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	poolInfo.queryCount = MAX_QUERIES;
+	
+	pools.resize(commandBufferCount);
+	for (auto &P : pools) {
+		VkResult result = vkCreateQueryPool(BP->device, &poolInfo, nullptr, &P.pool);
+		if (result != VK_SUCCESS) {
+		 	PrintVkError(result);
+			throw std::runtime_error("failed to create timestamp query pool!");
+		}
+	}
+}
+
+void GpuProfiler::cleanup() {
+	for (auto &P : pools) {
+		vkDestroyQueryPool(BP->device, P.pool, nullptr);
+	}
+	pools.clear();
+	if (csv.is_open()) {
+		csv.close();
+	}
+}
+
+void GpuProfiler::beginCommandBuffer(VkCommandBuffer commandBuffer, uint32_t index) {
+	if (!supported) {
+		return;
+	}
+	recording = index;
+	QueryPool &P = pools[index];
+	P.used = 0;
+	P.regionOfPair.clear();
+	// results still in the pool belong to the previous recording
+	P.submitted = false;
+	openRegions.clear();
+	vkCmdResetQueryPool(commandBuffer, P.pool, 0, MAX_QUERIES);
+}
+
+void GpuProfiler::beginRegion(VkCommandBuffer commandBuffer, const std::string &name) {
+	if (!supported) {
+		return;
+	}
+	QueryPool &P = pools[recording];
+	if (P.used + 2 > MAX_QUERIES) {
+		// out of queries: keep the stack balanced but do not time it
+		openRegions.push_back({-1, 0});
+		return;
+	}
+	int r = findRegion(name);
+	if (r < 0) {
+		r = regions.size();
+		regions.push_back(Region());
+		regions[r].name = name;
+		regions[r].samples.resize(HISTORY);
+	}
+	P.regionOfPair.push_back(r);
+	vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, P.pool, P.used);
+	openRegions.push_back({r, P.used});
+	P.used += 2;
+}
+
+void GpuProfiler::endRegion(VkCommandBuffer commandBuffer) {
+	if (!supported || openRegions.empty()) {
+		return;
+	}
+	auto open = openRegions.back();
+	openRegions.pop_back();
+	if (open.first >= 0) {
+		vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+							pools[recording].pool, open.second + 1);
+	}
+}
+
+void GpuProfiler::submitted(uint32_t index) {
+	if (supported) {
+		pools[index].submitted = true;
+	}
+}
+
+// Called after the wait for the image's previous submission, so the
+// results are normally all there; anything still unavailable is skipped
+// rather than waited for.
+void GpuProfiler::collect(uint32_t index) {
+	if (!supported || !pools[index].submitted || pools[index].used == 0) {
+		return;
+	}
+	QueryPool &P = pools[index];
+	P.submitted = false;
+	
+	// value and availability of each query
+	std::vector<uint64_t> data(P.used * 2);
+	VkResult result = vkGetQueryPoolResults(BP->device, P.pool, 0, P.used,
+						data.size() * sizeof(uint64_t), data.data(), 2 * sizeof(uint64_t),
+						VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+	if (result != VK_SUCCESS && result != VK_NOT_READY) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to read timestamp queries!");
+	}
+	
+	// a region recorded more than once in a frame counts with its total
+	std::vector<double> frameTimes(regions.size(), -1.0);
+	for (size_t k = 0; k < P.regionOfPair.size(); k++) {
+		const uint64_t *begin = &data[4 * k];
+		const uint64_t *end = &data[4 * k + 2];
+		if (begin[1] == 0 || end[1] == 0) {
+			continue;
+		}
+		uint64_t ticks = (end[0] - begin[0]) & timestampMask;
+		int r = P.regionOfPair[k];
+		frameTimes[r] = std::max(frameTimes[r], 0.0) + ticks * timestampPeriod * 1e-6;
+	}
+	
+	for (size_t r = 0; r < regions.size(); r++) {
+		if (frameTimes[r] < 0.0) {
+			continue;
+		}
+		Region &R = regions[r];
+		R.samples[R.count % HISTORY] = frameTimes[r];
+		R.count++;
+		R.last = frameTimes[r];
+		if (keepAllSamples) {
+			R.all.push_back(frameTimes[r]);
+		}
+		if (csv.is_open()) {
+			csv << frame << "," << R.name << "," << frameTimes[r] << "\n";
+		}
+	}
+	frame++;
+}
+
+void GpuProfiler::clearAllSamples() {
+	for (auto &R : regions) {
+		R.all.clear();
+	}
+}
+
+int GpuProfiler::findRegion(const std::string &name) const {
+	for (size_t r = 0; r < regions.size(); r++) {
+		if (regions[r].name == name) {
+			return r;
+		}
+	}
+	return -1;
+}
+
+double GpuProfiler::average(int region) const {
+	const Region &R = regions[region];
+	int n = std::min(R.count, HISTORY);
+	if (n == 0) return 0.0;
+	double sum = 0.0;
+	for (int i = 0; i < n; i++) {
+		sum += R.samples[i];
+	}
+	return sum / n;
+}
+
+// p in [0, 1], over the last HISTORY frames
+double GpuProfiler::percentile(int region, double p) const {
+	const Region &R = regions[region];
+	int n = std::min(R.count, HISTORY);
+	if (n == 0) return 0.0;
+	std::vector<double> sorted(R.samples.begin(), R.samples.begin() + n);
+	int k = std::min(n - 1, (int)(p * n));
+	std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+	return sorted[k];
+}
+
+void GpuProfiler::report() const {
+	for (size_t r = 0; r < regions.size(); r++) {
+		if (regions[r].count == 0) continue;
+		LOG_INFO("GPU %s: avg %g ms, p50 %g ms, p95 %g ms, p99 %g ms, max %g ms",
+				 regions[r].name.c_str(), average(r), percentile(r, 0.5),
+				 percentile(r, 0.95), percentile(r, 0.99), percentile(r, 1.0));
+	}
+}
+
+void FragmentCounter::init(BaseProject *bp, uint32_t commandBufferCount, bool preciseQueries) {
+	BP = bp;
+	precise = preciseQueries;
+	recorded.assign(commandBufferCount, false);
+	pending.assign(commandBufferCount, false);
+	
+	VkQueryPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	poolInfo.queryType = VK_QUERY_TYPE_OCCLUSION;
+	poolInfo.queryCount = commandBufferCount;
+	
+	VkResult result = vkCreateQueryPool(BP->device, &poolInfo, nullptr, &pool);
+	if (result != VK_SUCCESS) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to create occlusion query pool!");
+	}
+}
+
+void FragmentCounter::cleanup() {
+	vkDestroyQueryPool(BP->device, pool, nullptr);
+	pool = VK_NULL_HANDLE;
+}
+
+void FragmentCounter::beginCommandBuffer(VkCommandBuffer commandBuffer, uint32_t index) {
+	recorded[index] = false;
+	pending[index] = false;
+	vkCmdResetQueryPool(commandBuffer, pool, index, 1);
+}
+
+void FragmentCounter::begin(VkCommandBuffer commandBuffer, uint32_t index) {
+	recorded[index] = true;
+	vkCmdBeginQuery(commandBuffer, pool, index,
+					precise ? VK_QUERY_CONTROL_PRECISE_BIT : 0);
+}
+
+void FragmentCounter::end(VkCommandBuffer commandBuffer, uint32_t index) {
+	vkCmdEndQuery(commandBuffer, pool, index);
+}
+
+void FragmentCounter::submitted(uint32_t index) {
+	pending[index] = recorded[index];
+}
+
+void FragmentCounter::collect(uint32_t index, VkExtent2D extent) {
+	if (!pending[index]) {
+		return;
+	}
+	pending[index] = false;
+	
+	uint64_t data[2];
+	VkResult result = vkGetQueryPoolResults(BP->device, pool, index, 1, sizeof(data), data,
+						sizeof(data), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+	if (result != VK_SUCCESS && result != VK_NOT_READY) {
+	 	PrintVkError(result);
+		throw std::runtime_error("failed to read occlusion queries!");
+	}
+	if (data[1] == 0) {
+		return;
+	}
+	last = data[0];
+	fragments += data[0];
+	pixels += (uint64_t) extent.width * extent.height;
+}
+
+void FragmentCounter::report() {
+	if (pixels == 0) {
+		return;
+	}
+	LOG_INFO("Overdraw: %.2f shaded fragments per pixel%s", fragments / (double) pixels,
+			 precise ? "" : " (imprecise occlusion queries)");
+	fragments = 0;
+	pixels = 0;
 }
 
 glm::mat4 LookInDirMat(glm::vec3 Pos, glm::vec3 Angs) {
@@ -2029,104 +5324,6 @@ glm::mat4 LookInDirMat(glm::vec3 Pos, glm::vec3 Angs) {
 }
 
 
-// Define Infinite (Using INT_MAX caused overflow problems)
-#define INF 10000
-
-struct Point
-{
-    float x;
-    float y;
-};
-
-// Given three collinear points p, q, r, the function checks if
-// point q lies on line segment 'pr'
-bool onSegment(Point p, Point q, Point r)
-{
-    if (q.x <= std::max(p.x, r.x) && q.x >= std::min(p.x, r.x) &&
-            q.y <= std::max(p.y, r.y) && q.y >= std::min(p.y, r.y))
-        return true;
-    return false;
-}
-
-// To find orientation of ordered triplet (p, q, r).
-// The function returns following values
-// 0 --> p, q and r are collinear
-// 1 --> Clockwise
-// 2 --> Counterclockwise
-int orientation(Point p, Point q, Point r)
-{
-    int val = (q.y - p.y) * (r.x - q.x) -
-            (q.x - p.x) * (r.y - q.y);
-
-    if (val == 0) return 0; // collinear
-    return (val > 0)? 1: 2; // clock or counterclock wise
-}
-
-// The function that returns true if line segment 'p1q1'
-// and 'p2q2' intersect.
-bool doIntersect(Point p1, Point q1, Point p2, Point q2)
-{
-    // Find the four orientations needed for general and
-    // special cases
-    int o1 = orientation(p1, q1, p2);
-    int o2 = orientation(p1, q1, q2);
-    int o3 = orientation(p2, q2, p1);
-    int o4 = orientation(p2, q2, q1);
-
-    // General case
-    if (o1 != o2 && o3 != o4)
-        return true;
-
-    // Special Cases
-    // p1, q1 and p2 are collinear and p2 lies on segment p1q1
-    if (o1 == 0 && onSegment(p1, p2, q1)) return true;
-
-    // p1, q1 and p2 are collinear and q2 lies on segment p1q1
-    if (o2 == 0 && onSegment(p1, q2, q1)) return true;
-
-    // p2, q2 and p1 are collinear and p1 lies on segment p2q2
-    if (o3 == 0 && onSegment(p2, p1, q2)) return true;
-
-    // p2, q2 and q1 are collinear and q1 lies on segment p2q2
-    if (o4 == 0 && onSegment(p2, q1, q2)) return true;
-
-    return false; // Doesn't fall in any of the above cases
-}
-
-// Returns true if the point p lies inside the polygon[] with n vertices
-bool isInside(Point polygon[], int n, Point p)
-{
-    // There must be at least 3 vertices in polygon[]
-    if (n < 3) return false;
-
-    // Create a point for line segment from p to infinite
-    Point extreme = {INF, p.y};
-
-    // Count intersections of the above line with sides of polygon
-    int count = 0, i = 0;
-    do
-    {
-        int next = (i+1)%n;
-
-        // Check if the line segment from 'p' to 'extreme' intersects
-        // with the line segment from 'polygon[i]' to 'polygon[next]'
-        if (doIntersect(polygon[i], polygon[next], p, extreme))
-        {
-            // If the point 'p' is collinear with line segment 'i-next',
-            // then check if it lies on segment. If it lies, return true,
-            // otherwise false
-            if (orientation(polygon[i], p, polygon[next]) == 0)
-            return onSegment(polygon[i], p, polygon[next]);
-
-            count++;
-        }
-        i = next;
-    } while (i != 0);
-
-    // Return true if count is odd, false otherwise
-    return count&1; // Same as (count%2 == 1)
-}
-
 struct VerticesOfPlatform {
     glm::vec2 v1;
     glm::vec2 v2;
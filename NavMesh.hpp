@@ -0,0 +1,444 @@
+// Navigation mesh extracted from level geometry. The floor is every
+// triangle facing up within maxSlopeDegrees of the vertical whose
+// vertices lie between minHeight and maxHeight. Coincident vertices are
+// welded, triangles sharing an edge become neighbours and a flood fill
+// numbers the connected regions. The edges left without a neighbour are
+// the foot of the walls, which is what walkable() keeps a distance from.
+//
+// loadOrBuild() caches the result in a binary file keyed on the contents
+// of the OBJ file and on the settings, so only the first run builds it.
+
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "Logger.hpp"
+
+// the implementation half of tiny_obj_loader.h has no include guard:
+// do not pull it in twice when TINYOBJLOADER_IMPLEMENTATION is defined
+#ifndef TINY_OBJ_LOADER_H_
+#include "tiny_obj_loader.h"
+#endif
+
+struct NavMeshConfig {
+	float maxSlopeDegrees = 30.0f;
+	float minHeight = -1e30f;
+	float maxHeight = 1e30f;
+	float weldDistance = 1e-3f;		// vertices closer than this are merged
+	float cellSize = 2.0f;			// of the lookup grid on the xz plane
+};
+
+class NavMesh {
+public:
+	static const uint32_t VERSION = 1;
+
+	struct Triangle {
+		uint32_t v[3];
+		int32_t neighbour[3];	// across edge v[i] v[i+1], -1 on the boundary
+		uint32_t region;
+	};
+
+	std::vector<glm::vec3> vertices;
+	std::vector<Triangle> triangles;
+	uint32_t regionCount = 0;
+
+	// Every OBJ face, triangulated, as positions and indices
+	static void loadObj(const std::string &file, std::vector<glm::vec3> &positions,
+						std::vector<uint32_t> &indices) {
+		tinyobj::attrib_t attrib;
+		std::vector<tinyobj::shape_t> shapes;
+		std::vector<tinyobj::material_t> materials;
+		std::string warn, err;
+		if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, file.c_str())) {
+			throw std::runtime_error(warn + err);
+		}
+		positions.clear();
+		indices.clear();
+		for (size_t i = 0; i + 2 < attrib.vertices.size(); i += 3) {
+			positions.push_back({attrib.vertices[i], attrib.vertices[i + 1],
+								 attrib.vertices[i + 2]});
+		}
+		for (const auto &shape : shapes) {
+			for (const auto &index : shape.mesh.indices) {
+				indices.push_back((uint32_t) index.vertex_index);
+			}
+		}
+	}
+
+	void build(const std::vector<glm::vec3> &positions, const std::vector<uint32_t> &indices,
+			   const NavMeshConfig &config) {
+		vertices.clear();
+		triangles.clear();
+		float minNormalY = std::cos(glm::radians(config.maxSlopeDegrees));
+
+		// floor triangles, with welded vertices
+		std::map<std::array<int64_t, 3>, uint32_t> welded;
+		std::vector<uint32_t> remap(positions.size(), UINT32_MAX);
+		auto weld = [&](uint32_t i) {
+			if (remap[i] == UINT32_MAX) {
+				const glm::vec3 &p = positions[i];
+				std::array<int64_t, 3> key = {
+					(int64_t) std::llround(p.x / config.weldDistance),
+					(int64_t) std::llround(p.y / config.weldDistance),
+					(int64_t) std::llround(p.z / config.weldDistance)};
+				auto it = welded.find(key);
+				if (it == welded.end()) {
+					it = welded.insert({key, (uint32_t) vertices.size()}).first;
+					vertices.push_back(p);
+				}
+				remap[i] = it->second;
+			}
+			return remap[i];
+		};
+		for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+			const glm::vec3 &a = positions[indices[i]];
+			const glm::vec3 &b = positions[indices[i + 1]];
+			const glm::vec3 &c = positions[indices[i + 2]];
+			glm::vec3 normal = glm::cross(b - a, c - a);
+			float length = glm::length(normal);
+			if (length == 0.0f || normal.y < minNormalY * length) {
+				continue;
+			}
+			if (std::min({a.y, b.y, c.y}) < config.minHeight ||
+				std::max({a.y, b.y, c.y}) > config.maxHeight) {
+				continue;
+			}
+			Triangle T;
+			for (int k = 0; k < 3; k++) {
+				T.v[k] = weld(indices[i + k]);
+				T.neighbour[k] = -1;
+			}
+			if (T.v[0] != T.v[1] && T.v[1] != T.v[2] && T.v[2] != T.v[0]) {
+				triangles.push_back(T);
+			}
+		}
+
+		// adjacency: an edge shared by exactly two triangles links them
+		std::map<std::pair<uint32_t, uint32_t>, std::vector<uint32_t>> edges;
+		for (uint32_t t = 0; t < triangles.size(); t++) {
+			for (int k = 0; k < 3; k++) {
+				uint32_t a = triangles[t].v[k], b = triangles[t].v[(k + 1) % 3];
+				edges[{std::min(a, b), std::max(a, b)}].push_back(t * 3 + k);
+			}
+		}
+		for (auto &E : edges) {
+			if (E.second.size() == 2) {
+				uint32_t s0 = E.second[0], s1 = E.second[1];
+				triangles[s0 / 3].neighbour[s0 % 3] = (int32_t) (s1 / 3);
+				triangles[s1 / 3].neighbour[s1 % 3] = (int32_t) (s0 / 3);
+			}
+		}
+
+		// connected regions
+		regionCount = 0;
+		for (auto &T : triangles) {
+			T.region = UINT32_MAX;
+		}
+		std::vector<uint32_t> stack;
+		for (uint32_t t = 0; t < triangles.size(); t++) {
+			if (triangles[t].region != UINT32_MAX) {
+				continue;
+			}
+			triangles[t].region = regionCount;
+			stack.push_back(t);
+			while (!stack.empty()) {
+				const Triangle &T = triangles[stack.back()];
+				stack.pop_back();
+				for (int k = 0; k < 3; k++) {
+					int32_t n = T.neighbour[k];
+					if (n >= 0 && triangles[n].region == UINT32_MAX) {
+						triangles[n].region = regionCount;
+						stack.push_back((uint32_t) n);
+					}
+				}
+			}
+			regionCount++;
+		}
+
+		buildGrid(config.cellSize);
+	}
+
+	// Loads cacheFile if it was built from the same OBJ file with the same
+	// settings, otherwise builds the mesh and writes the cache. Returns
+	// true when the cache was used.
+	bool loadOrBuild(const std::string &objFile, const std::string &cacheFile,
+					 const NavMeshConfig &config) {
+		std::ifstream source(objFile, std::ios::binary);
+		if (!source) {
+			throw std::runtime_error("failed to open " + objFile + "!");
+		}
+		std::vector<char> bytes((std::istreambuf_iterator<char>(source)),
+								std::istreambuf_iterator<char>());
+		uint64_t key = hash(bytes.data(), bytes.size());
+		key = hash(&config, sizeof(config), key);
+
+		if (load(cacheFile, key, config.cellSize)) {
+			return true;
+		}
+		std::vector<glm::vec3> positions;
+		std::vector<uint32_t> indices;
+		loadObj(objFile, positions, indices);
+		build(positions, indices, config);
+		if (!save(cacheFile, key)) {
+			// built again next time, as without a cache
+			LOG_WARN("Cannot write navigation mesh cache %s", cacheFile.c_str());
+		}
+		return false;
+	}
+
+	// false if the file is missing, stale or not a navigation mesh
+	bool load(const std::string &file, uint64_t key, float gridCellSize) {
+		std::ifstream in(file, std::ios::binary);
+		char magic[4];
+		uint32_t version = 0, vertexCount = 0, triangleCount = 0, regions = 0;
+		uint64_t fileKey = 0;
+		in.read(magic, 4);
+		in.read((char *) &version, sizeof(version));
+		in.read((char *) &fileKey, sizeof(fileKey));
+		in.read((char *) &vertexCount, sizeof(vertexCount));
+		in.read((char *) &triangleCount, sizeof(triangleCount));
+		in.read((char *) &regions, sizeof(regions));
+		if (!in || memcmp(magic, "NAVM", 4) != 0 || version != VERSION || fileKey != key) {
+			return false;
+		}
+		std::vector<glm::vec3> loadedVertices(vertexCount);
+		std::vector<Triangle> loadedTriangles(triangleCount);
+		in.read((char *) loadedVertices.data(), vertexCount * sizeof(glm::vec3));
+		in.read((char *) loadedTriangles.data(), triangleCount * sizeof(Triangle));
+		if (!in) {
+			return false;
+		}
+		for (const Triangle &T : loadedTriangles) {
+			for (int k = 0; k < 3; k++) {
+				if (T.v[k] >= vertexCount || T.neighbour[k] >= (int32_t) triangleCount) {
+					return false;
+				}
+			}
+		}
+		vertices = std::move(loadedVertices);
+		triangles = std::move(loadedTriangles);
+		regionCount = regions;
+		buildGrid(gridCellSize);
+		return true;
+	}
+
+	// false if the file cannot be written
+	bool save(const std::string &file, uint64_t key) const {
+		std::ofstream out(file, std::ios::binary);
+		uint32_t version = VERSION;
+		uint32_t vertexCount = (uint32_t) vertices.size();
+		uint32_t triangleCount = (uint32_t) triangles.size();
+		out.write("NAVM", 4);
+		out.write((const char *) &version, sizeof(version));
+		out.write((const char *) &key, sizeof(key));
+		out.write((const char *) &vertexCount, sizeof(vertexCount));
+		out.write((const char *) &triangleCount, sizeof(triangleCount));
+		out.write((const char *) &regionCount, sizeof(regionCount));
+		out.write((const char *) vertices.data(), vertexCount * sizeof(glm::vec3));
+		out.write((const char *) triangles.data(), triangleCount * sizeof(Triangle));
+		return (bool) out;
+	}
+
+	// The triangle above or below (x, z) whose height there is closest to
+	// y and at most maxDistance from it, or -1
+	int locate(float x, float z, float y, float maxDistance = INFINITY) const {
+		int cell = cellOf(x, z);
+		if (cell < 0) {
+			return -1;
+		}
+		int best = -1;
+		float bestDistance = maxDistance;
+		for (uint32_t i = cellStart[cell]; i < cellStart[cell + 1]; i++) {
+			uint32_t t = cellTriangles[i];
+			float height;
+			if (project(t, x, z, height) && std::fabs(height - y) <= bestDistance) {
+				bestDistance = std::fabs(height - y);
+				best = (int) t;
+			}
+		}
+		return best;
+	}
+
+	float heightAt(int triangle, float x, float z) const {
+		float height = 0.0f;
+		project((uint32_t) triangle, x, z, height);
+		return height;
+	}
+
+	uint32_t regionOf(int triangle) const {
+		return triangles[triangle].region;
+	}
+
+	bool connected(int a, int b) const {
+		return a >= 0 && b >= 0 && triangles[a].region == triangles[b].region;
+	}
+
+	// Distance on the xz plane from (x, z) to the nearest boundary edge of
+	// the given region, capped at maxDistance
+	float boundaryDistance(float x, float z, uint32_t region, float maxDistance) const {
+		float best = maxDistance;
+		if (cols == 0) {
+			return best;
+		}
+		int x0 = std::max(0, (int) std::floor((x - maxDistance - gridMinX) / cellSize));
+		int z0 = std::max(0, (int) std::floor((z - maxDistance - gridMinZ) / cellSize));
+		int x1 = std::min(cols - 1, (int) std::floor((x + maxDistance - gridMinX) / cellSize));
+		int z1 = std::min(rows - 1, (int) std::floor((z + maxDistance - gridMinZ) / cellSize));
+		for (int cz = z0; cz <= z1; cz++) {
+			for (int cx = x0; cx <= x1; cx++) {
+				int cell = cz * cols + cx;
+				for (uint32_t i = edgeStart[cell]; i < edgeStart[cell + 1]; i++) {
+					uint32_t slot = cellBoundaryEdges[i];
+					const Triangle &T = triangles[slot / 3];
+					if (T.region != region) {
+						continue;
+					}
+					const glm::vec3 &a = vertices[T.v[slot % 3]];
+					const glm::vec3 &b = vertices[T.v[(slot % 3 + 1) % 3]];
+					best = std::min(best, segmentDistance(x, z, a, b));
+				}
+			}
+		}
+		return best;
+	}
+
+	// On the mesh within maxDistance of height y, and at least radius away
+	// from the edges of its region
+	bool walkable(float x, float z, float y, float maxDistance, float radius) const {
+		int t = locate(x, z, y, maxDistance);
+		if (t < 0) {
+			return false;
+		}
+		return radius <= 0.0f || boundaryDistance(x, z, triangles[t].region, radius) >= radius;
+	}
+
+	size_t boundaryEdgeCount() const {
+		size_t count = 0;
+		for (const Triangle &T : triangles) {
+			for (int k = 0; k < 3; k++) {
+				count += T.neighbour[k] < 0;
+			}
+		}
+		return count;
+	}
+
+	// FNV-1a, for the cache key
+	static uint64_t hash(const void *data, size_t size, uint64_t hash = 14695981039346656037ull) {
+		const unsigned char *bytes = (const unsigned char *) data;
+		for (size_t i = 0; i < size; i++) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+private:
+	// lookup grid on the xz plane: each cell lists the triangles and the
+	// boundary edges (as triangle * 3 + edge) whose bounds overlap it
+	float gridMinX = 0.0f, gridMinZ = 0.0f, cellSize = 1.0f;
+	int cols = 0, rows = 0;
+	std::vector<uint32_t> cellStart, cellTriangles;
+	std::vector<uint32_t> edgeStart, cellBoundaryEdges;
+
+	void buildGrid(float size) {
+		cols = rows = 0;
+		cellStart.assign(1, 0);
+		edgeStart.assign(1, 0);
+		cellTriangles.clear();
+		cellBoundaryEdges.clear();
+		if (triangles.empty()) {
+			return;
+		}
+		cellSize = size;
+		float minX = INFINITY, minZ = INFINITY, maxX = -INFINITY, maxZ = -INFINITY;
+		for (const glm::vec3 &v : vertices) {
+			minX = std::min(minX, v.x);
+			minZ = std::min(minZ, v.z);
+			maxX = std::max(maxX, v.x);
+			maxZ = std::max(maxZ, v.z);
+		}
+		gridMinX = minX;
+		gridMinZ = minZ;
+		cols = (int) std::floor((maxX - minX) / cellSize) + 1;
+		rows = (int) std::floor((maxZ - minZ) / cellSize) + 1;
+
+		std::vector<std::vector<uint32_t>> tris(cols * rows), edges(cols * rows);
+		auto addBox = [&](std::vector<std::vector<uint32_t>> &lists, uint32_t item,
+						  float x0, float z0, float x1, float z1) {
+			int cx0 = (int) ((x0 - gridMinX) / cellSize), cx1 = (int) ((x1 - gridMinX) / cellSize);
+			int cz0 = (int) ((z0 - gridMinZ) / cellSize), cz1 = (int) ((z1 - gridMinZ) / cellSize);
+			for (int cz = cz0; cz <= std::min(cz1, rows - 1); cz++) {
+				for (int cx = cx0; cx <= std::min(cx1, cols - 1); cx++) {
+					lists[cz * cols + cx].push_back(item);
+				}
+			}
+		};
+		for (uint32_t t = 0; t < triangles.size(); t++) {
+			const Triangle &T = triangles[t];
+			const glm::vec3 &a = vertices[T.v[0]], &b = vertices[T.v[1]], &c = vertices[T.v[2]];
+			addBox(tris, t, std::min({a.x, b.x, c.x}), std::min({a.z, b.z, c.z}),
+				   std::max({a.x, b.x, c.x}), std::max({a.z, b.z, c.z}));
+			for (int k = 0; k < 3; k++) {
+				if (T.neighbour[k] < 0) {
+					const glm::vec3 &p = vertices[T.v[k]], &q = vertices[T.v[(k + 1) % 3]];
+					addBox(edges, t * 3 + k, std::min(p.x, q.x), std::min(p.z, q.z),
+						   std::max(p.x, q.x), std::max(p.z, q.z));
+				}
+			}
+		}
+		for (int cell = 0; cell < cols * rows; cell++) {
+			cellTriangles.insert(cellTriangles.end(), tris[cell].begin(), tris[cell].end());
+			cellStart.push_back((uint32_t) cellTriangles.size());
+			cellBoundaryEdges.insert(cellBoundaryEdges.end(), edges[cell].begin(), edges[cell].end());
+			edgeStart.push_back((uint32_t) cellBoundaryEdges.size());
+		}
+	}
+
+	int cellOf(float x, float z) const {
+		if (cols == 0) {
+			return -1;
+		}
+		float fx = (x - gridMinX) / cellSize, fz = (z - gridMinZ) / cellSize;
+		if (!(fx >= 0.0f && fz >= 0.0f && fx < cols && fz < rows)) {
+			return -1;
+		}
+		return (int) fz * cols + (int) fx;
+	}
+
+	// height of the triangle at (x, z), if (x, z) is over it
+	bool project(uint32_t t, float x, float z, float &height) const {
+		const Triangle &T = triangles[t];
+		const glm::vec3 &a = vertices[T.v[0]], &b = vertices[T.v[1]], &c = vertices[T.v[2]];
+		float det = (b.z - c.z) * (a.x - c.x) + (c.x - b.x) * (a.z - c.z);
+		if (det == 0.0f) {
+			return false;
+		}
+		float u = ((b.z - c.z) * (x - c.x) + (c.x - b.x) * (z - c.z)) / det;
+		float v = ((c.z - a.z) * (x - c.x) + (a.x - c.x) * (z - c.z)) / det;
+		float w = 1.0f - u - v;
+		const float EPSILON = 1e-5f;
+		if (u < -EPSILON || v < -EPSILON || w < -EPSILON) {
+			return false;
+		}
+		height = u * a.y + v * b.y + w * c.y;
+		return true;
+	}
+
+	static float segmentDistance(float x, float z, const glm::vec3 &a, const glm::vec3 &b) {
+		glm::vec2 p(x, z), A(a.x, a.z), B(b.x, b.z);
+		glm::vec2 d = B - A;
+		float length2 = glm::dot(d, d);
+		float s = length2 > 0.0f ? glm::clamp(glm::dot(p - A, d) / length2, 0.0f, 1.0f) : 0.0f;
+		return glm::length(p - (A + s * d));
+	}
+};
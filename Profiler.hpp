@@ -0,0 +1,189 @@
+// Lightweight CPU profiling zones, exported as Chrome trace events
+// (chrome://tracing or ui.perfetto.dev).
+//
+// PROFILE_ZONE("name") times the enclosing scope. Until Profiler::start()
+// is called a zone costs a single relaxed load; building with
+// -DPROFILER_DISABLED removes the zones altogether. Every thread records
+// into its own ring buffer, so zones never take a lock.
+
+#pragma once
+
+#include <chrono>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+
+#include "json.hpp"
+
+struct ProfileEvent {
+	const char *name;		// must outlive the profiler: use literals
+	char detail[40];
+	uint64_t start;			// ns since Profiler::start()
+	uint64_t duration;		// ns
+};
+
+// Written only by its own thread; read by the exporter once recording
+// has stopped. When full, the oldest events are overwritten.
+struct ProfileThreadBuffer {
+	static const size_t CAPACITY = 1 << 16;
+
+	std::vector<ProfileEvent> events;
+	std::atomic<uint64_t> written{0};
+	uint32_t threadId;
+	std::string threadName;
+};
+
+class Profiler {
+public:
+	static Profiler &get() {
+		static Profiler instance;
+		return instance;
+	}
+
+	std::atomic<bool> enabled{false};
+
+	void start() {
+		epoch = std::chrono::steady_clock::now();
+		enabled.store(true, std::memory_order_release);
+		setThreadName("main");
+	}
+
+	void stop() {
+		enabled.store(false, std::memory_order_release);
+	}
+
+	uint64_t now() const {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - epoch).count();
+	}
+
+	// no-op while disabled, so that threads do not allocate a buffer
+	void setThreadName(const std::string &name) {
+		if (!enabled.load(std::memory_order_relaxed)) {
+			return;
+		}
+		threadBuffer()->threadName = name;
+	}
+
+	void record(const char *name, const char *detail, uint64_t start, uint64_t end) {
+		ProfileThreadBuffer *B = threadBuffer();
+		uint64_t n = B->written.load(std::memory_order_relaxed);
+		ProfileEvent &E = B->events[n % ProfileThreadBuffer::CAPACITY];
+		E.name = name;
+		E.detail[0] = '\0';
+		if (detail != nullptr) {
+			strncpy(E.detail, detail, sizeof(E.detail) - 1);
+			E.detail[sizeof(E.detail) - 1] = '\0';
+		}
+		E.start = start;
+		E.duration = end - start;
+		B->written.store(n + 1, std::memory_order_release);
+	}
+
+	// Stops recording and writes everything still in the ring buffers.
+	// Threads that were recording must have finished their zones.
+	void writeChromeTrace(const std::string &file) {
+		stop();
+
+		nlohmann::json events = nlohmann::json::array();
+		size_t dropped = 0;
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto &B : buffers) {
+			if (!B->threadName.empty()) {
+				events.push_back({
+					{"name", "thread_name"}, {"ph", "M"}, {"pid", 1},
+					{"tid", B->threadId}, {"args", {{"name", B->threadName}}}
+				});
+			}
+			uint64_t written = B->written.load(std::memory_order_acquire);
+			uint64_t first = 0;
+			if (written > ProfileThreadBuffer::CAPACITY) {
+				first = written - ProfileThreadBuffer::CAPACITY;
+				dropped += first;
+			}
+			for (uint64_t n = first; n < written; n++) {
+				const ProfileEvent &E = B->events[n % ProfileThreadBuffer::CAPACITY];
+				nlohmann::json event = {
+					{"name", E.name}, {"cat", "cpu"}, {"ph", "X"}, {"pid", 1},
+					{"tid", B->threadId},
+					{"ts", E.start / 1000.0}, {"dur", E.duration / 1000.0}
+				};
+				if (E.detail[0] != '\0') {
+					event["args"] = {{"detail", E.detail}};
+				}
+				events.push_back(event);
+			}
+		}
+
+		std::ofstream out(file);
+		if (!out) {
+			std::cout << "Profiler: cannot write " << file << "\n";
+			return;
+		}
+		out << nlohmann::json{{"traceEvents", events},
+							  {"displayTimeUnit", "ms"}}.dump() << "\n";
+		std::cout << "Profiler: wrote " << events.size() << " events to " << file;
+		if (dropped > 0) {
+			std::cout << " (" << dropped << " oldest dropped)";
+		}
+		std::cout << "\n";
+	}
+
+private:
+	std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+	std::mutex mutex;
+	std::vector<std::unique_ptr<ProfileThreadBuffer>> buffers;
+
+	// buffers are owned by the profiler, so they outlive their threads
+	ProfileThreadBuffer *threadBuffer() {
+		thread_local ProfileThreadBuffer *buffer = nullptr;
+		if (buffer == nullptr) {
+			std::lock_guard<std::mutex> lock(mutex);
+			buffers.push_back(std::make_unique<ProfileThreadBuffer>());
+			buffer = buffers.back().get();
+			buffer->events.resize(ProfileThreadBuffer::CAPACITY);
+			buffer->threadId = buffers.size();
+		}
+		return buffer;
+	}
+};
+
+struct ProfileZone {
+	const char *name;
+	const char *detail;
+	uint64_t start;
+	bool active;
+
+	ProfileZone(const char *name, const char *detail = nullptr) :
+			name(name), detail(detail) {
+		active = Profiler::get().enabled.load(std::memory_order_relaxed);
+		if (active) {
+			start = Profiler::get().now();
+		}
+	}
+
+	~ProfileZone() {
+		if (active) {
+			Profiler::get().record(name, detail, start, Profiler::get().now());
+		}
+	}
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+
+#ifndef PROFILER_DISABLED
+// detail is copied (truncated) into the event, e.g. the file being loaded
+#define PROFILE_ZONE(name) ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name)
+#define PROFILE_ZONE_DETAIL(name, detail) \
+	ProfileZone PROFILE_CONCAT(profileZone, __LINE__)(name, detail)
+#else
+#define PROFILE_ZONE(name) ((void)0)
+#define PROFILE_ZONE_DETAIL(name, detail) ((void)0)
+#endif
@@ -0,0 +1,437 @@
+// What a level is made of: the meshes and materials it loads and the
+// entities that draw them, read from a JSON file such as
+//
+//	{
+//		"meshes": {"block": "models/block.obj"},
+//		"materials": {"brick": {"texture": "textures/redBrick.png"},
+//					  "sign": {"color": [1, 0.8, 0.2], "lit": false, "specular": false}},
+//		"entities": [
+//			{"name": "platform", "mesh": "block", "material": "brick",
+//			 "position": [0, 0, 0], "rotation": [0, 90, 0], "scale": 0.5,
+//			 "track": "platform", "highlight": false, "region": "Objects"}
+//		],
+//		"lights": [
+//			{"position": [0, 2, 0], "color": [1, 0.6, 0.3], "radius": 10, "intensity": 1}
+//		]
+//	}
+//
+// rotation is in degrees around x, then y, then z; scale is a number or a
+// vector; the other entity fields are optional and left to the project.
+// Lights are point lights, and optional too. A material has a texture, a
+// color or both, which then multiplies the texture; unlit materials show
+// their color as is, and only those that ask for them get specular
+// highlights.
+// loadOrCompile() keeps a binary copy keyed on the JSON text, so that
+// large scenes are parsed only once.
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "json.hpp"
+
+#include "Logger.hpp"
+
+struct SceneEntity {
+	std::string name;
+	uint32_t mesh = 0;
+	uint32_t material = 0;
+	glm::vec3 position = glm::vec3(0.0f);
+	glm::vec3 rotation = glm::vec3(0.0f);	// degrees
+	glm::vec3 scale = glm::vec3(1.0f);
+	std::string track;		// animation moving the entity, empty for none
+	bool highlight = false;
+	std::string region;		// of the GPU profile, empty for none
+
+	// with offset added to the position, typically an animation
+	glm::mat4 transform(glm::vec3 offset = glm::vec3(0.0f)) const {
+		glm::mat4 M = glm::translate(glm::mat4(1.0f), position + offset);
+		M = glm::rotate(M, glm::radians(rotation.z), glm::vec3(0.0f, 0.0f, 1.0f));
+		M = glm::rotate(M, glm::radians(rotation.y), glm::vec3(0.0f, 1.0f, 0.0f));
+		M = glm::rotate(M, glm::radians(rotation.x), glm::vec3(1.0f, 0.0f, 0.0f));
+		return glm::scale(M, scale);
+	}
+};
+
+struct SceneMaterial {
+	glm::vec3 color = glm::vec3(1.0f);
+	bool lit = true;
+	bool specular = false;
+};
+
+struct SceneLight {
+	glm::vec3 position = glm::vec3(0.0f);
+	glm::vec3 color = glm::vec3(1.0f);
+	float radius = 10.0f;		// nothing beyond is lit
+	float intensity = 1.0f;
+};
+
+class Scene {
+public:
+	static const uint32_t VERSION = 3;
+
+	std::vector<std::string> meshNames;
+	std::vector<std::string> meshFiles;
+	std::vector<std::string> materialNames;
+	std::vector<std::string> textureFiles;		// empty for a color alone
+	std::vector<SceneMaterial> materials;
+	std::vector<SceneEntity> entities;
+	std::vector<SceneLight> lights;
+
+	// Loads cacheFile if it was compiled from the same JSON text,
+	// otherwise parses the JSON and writes the cache. Returns true when
+	// the cache was used.
+	bool loadOrCompile(const std::string &jsonFile, const std::string &cacheFile) {
+		std::string text = readFile(jsonFile);
+		uint64_t key = hash(text.data(), text.size());
+		if (load(cacheFile, key)) {
+			return true;
+		}
+		parse(text, jsonFile);
+		if (!save(cacheFile, key)) {
+			// compiled again next time, as without a cache
+			LOG_WARN("Cannot write compiled scene %s", cacheFile.c_str());
+		}
+		return false;
+	}
+
+	// file only names the scene in errors
+	void parse(const std::string &text, const std::string &file) {
+		Scene S;
+		try {
+			nlohmann::json J = nlohmann::json::parse(text);
+			std::map<std::string, uint32_t> meshIndex, materialIndex;
+			for (auto &M : J.at("meshes").items()) {
+				meshIndex[M.key()] = (uint32_t) S.meshNames.size();
+				S.meshNames.push_back(M.key());
+				S.meshFiles.push_back(M.value().get<std::string>());
+			}
+			for (auto &M : J.at("materials").items()) {
+				materialIndex[M.key()] = (uint32_t) S.materialNames.size();
+				S.materialNames.push_back(M.key());
+				SceneMaterial material;
+				material.color = vec3(M.value(), "color", material.color);
+				material.lit = M.value().value("lit", material.lit);
+				material.specular = M.value().value("specular", material.specular);
+				S.textureFiles.push_back(M.value().value("texture", ""));
+				if (S.textureFiles.back().empty() && !M.value().contains("color")) {
+					throw std::runtime_error("material " + M.key() + " has no texture nor color");
+				}
+				S.materials.push_back(material);
+			}
+			const nlohmann::json &entityArray = J.at("entities");
+			S.entities.reserve(entityArray.size());
+			for (const nlohmann::json &E : entityArray) {
+				SceneEntity entity;
+				entity.name = E.value("name", "");
+				std::string mesh = E.at("mesh").get<std::string>();
+				std::string material = E.at("material").get<std::string>();
+				if (!meshIndex.count(mesh)) {
+					throw std::runtime_error("unknown mesh " + mesh);
+				}
+				if (!materialIndex.count(material)) {
+					throw std::runtime_error("unknown material " + material);
+				}
+				entity.mesh = meshIndex[mesh];
+				entity.material = materialIndex[material];
+				entity.position = vec3(E, "position", glm::vec3(0.0f));
+				entity.rotation = vec3(E, "rotation", glm::vec3(0.0f));
+				entity.scale = vec3(E, "scale", glm::vec3(1.0f));
+				entity.track = E.value("track", "");
+				entity.highlight = E.value("highlight", false);
+				entity.region = E.value("region", "");
+				S.entities.push_back(std::move(entity));
+			}
+			for (const nlohmann::json &L : J.value("lights", nlohmann::json::array())) {
+				SceneLight light;
+				light.position = vec3(L, "position", light.position);
+				light.color = vec3(L, "color", light.color);
+				light.radius = L.value("radius", light.radius);
+				light.intensity = L.value("intensity", light.intensity);
+				S.lights.push_back(light);
+			}
+		} catch (const std::exception &e) {
+			throw std::runtime_error("failed to read scene " + file + ": " + e.what());
+		}
+		*this = std::move(S);
+	}
+
+	nlohmann::json toJson() const {
+		nlohmann::json J;
+		J["meshes"] = nlohmann::json::object();
+		for (size_t i = 0; i < meshNames.size(); i++) {
+			J["meshes"][meshNames[i]] = meshFiles[i];
+		}
+		J["materials"] = nlohmann::json::object();
+		for (size_t i = 0; i < materialNames.size(); i++) {
+			nlohmann::json material = nlohmann::json::object();
+			const SceneMaterial &M = materials[i];
+			if (!textureFiles[i].empty()) {
+				material["texture"] = textureFiles[i];
+			}
+			if (M.color != glm::vec3(1.0f) || textureFiles[i].empty()) {
+				material["color"] = {M.color.x, M.color.y, M.color.z};
+			}
+			if (!M.lit) {
+				material["lit"] = false;
+			}
+			if (M.specular) {
+				material["specular"] = true;
+			}
+			J["materials"][materialNames[i]] = std::move(material);
+		}
+		nlohmann::json entityArray = nlohmann::json::array();
+		for (const SceneEntity &E : entities) {
+			nlohmann::json entity = {
+				{"name", E.name},
+				{"mesh", meshNames[E.mesh]},
+				{"material", materialNames[E.material]},
+				{"position", {E.position.x, E.position.y, E.position.z}},
+			};
+			if (E.rotation != glm::vec3(0.0f)) {
+				entity["rotation"] = {E.rotation.x, E.rotation.y, E.rotation.z};
+			}
+			if (E.scale != glm::vec3(1.0f)) {
+				entity["scale"] = {E.scale.x, E.scale.y, E.scale.z};
+			}
+			if (!E.track.empty()) {
+				entity["track"] = E.track;
+			}
+			if (E.highlight) {
+				entity["highlight"] = true;
+			}
+			if (!E.region.empty()) {
+				entity["region"] = E.region;
+			}
+			entityArray.push_back(std::move(entity));
+		}
+		J["entities"] = std::move(entityArray);
+		if (!lights.empty()) {
+			nlohmann::json lightArray = nlohmann::json::array();
+			for (const SceneLight &L : lights) {
+				lightArray.push_back({
+					{"position", {L.position.x, L.position.y, L.position.z}},
+					{"color", {L.color.x, L.color.y, L.color.z}},
+					{"radius", L.radius},
+					{"intensity", L.intensity},
+				});
+			}
+			J["lights"] = std::move(lightArray);
+		}
+		return J;
+	}
+
+	void saveJson(const std::string &file) const {
+		std::ofstream out(file);
+		out << toJson().dump(1, '\t') << "\n";
+		if (!out) {
+			throw std::runtime_error("failed to write scene " + file + "!");
+		}
+	}
+
+	// false if the file is missing, stale or not a compiled scene
+	bool load(const std::string &file, uint64_t key) {
+		std::ifstream in(file, std::ios::binary);
+		char magic[4];
+		uint32_t version = 0;
+		uint64_t fileKey = 0;
+		in.read(magic, 4);
+		in.read((char *) &version, sizeof(version));
+		in.read((char *) &fileKey, sizeof(fileKey));
+		if (!in || memcmp(magic, "SCNE", 4) != 0 || version != VERSION || fileKey != key) {
+			return false;
+		}
+		Scene S;
+		readStrings(in, S.meshNames);
+		readStrings(in, S.meshFiles);
+		readStrings(in, S.materialNames);
+		readStrings(in, S.textureFiles);
+		if (!in || S.meshFiles.size() != S.meshNames.size()
+			|| S.textureFiles.size() != S.materialNames.size()) {
+			return false;
+		}
+		S.materials.resize(S.materialNames.size());
+		for (SceneMaterial &M : S.materials) {
+			M.color = readValue<glm::vec3>(in);
+			M.lit = readValue<uint8_t>(in) != 0;
+			M.specular = readValue<uint8_t>(in) != 0;
+		}
+		// every entity takes at least its fixed fields and three string
+		// lengths, which bounds the count by what is left of the file
+		uint32_t entityCount = readValue<uint32_t>(in);
+		const size_t minEntitySize = 2 * sizeof(uint32_t) + 3 * sizeof(glm::vec3) + sizeof(uint8_t)
+									 + 3 * sizeof(uint32_t);
+		if (!in || entityCount > remainingBytes(in) / minEntitySize) {
+			return false;
+		}
+		S.entities.resize(entityCount);
+		for (SceneEntity &E : S.entities) {
+			E.name = readString(in);
+			E.mesh = readValue<uint32_t>(in);
+			E.material = readValue<uint32_t>(in);
+			E.position = readValue<glm::vec3>(in);
+			E.rotation = readValue<glm::vec3>(in);
+			E.scale = readValue<glm::vec3>(in);
+			E.track = readString(in);
+			E.highlight = readValue<uint8_t>(in) != 0;
+			E.region = readString(in);
+			if (!in || E.mesh >= S.meshNames.size() || E.material >= S.materialNames.size()) {
+				return false;
+			}
+		}
+		uint32_t lightCount = readValue<uint32_t>(in);
+		if (!in || lightCount > (1u << 20)) {
+			return false;
+		}
+		S.lights.resize(lightCount);
+		for (SceneLight &L : S.lights) {
+			L = readValue<SceneLight>(in);
+		}
+		if (!in) {
+			return false;
+		}
+		*this = std::move(S);
+		return true;
+	}
+
+	// false if the file cannot be written
+	bool save(const std::string &file, uint64_t key) const {
+		std::ofstream out(file, std::ios::binary);
+		uint32_t version = VERSION;
+		out.write("SCNE", 4);
+		writeValue(out, version);
+		writeValue(out, key);
+		writeStrings(out, meshNames);
+		writeStrings(out, meshFiles);
+		writeStrings(out, materialNames);
+		writeStrings(out, textureFiles);
+		for (const SceneMaterial &M : materials) {
+			writeValue(out, M.color);
+			writeValue(out, (uint8_t) M.lit);
+			writeValue(out, (uint8_t) M.specular);
+		}
+		writeValue(out, (uint32_t) entities.size());
+		for (const SceneEntity &E : entities) {
+			writeString(out, E.name);
+			writeValue(out, E.mesh);
+			writeValue(out, E.material);
+			writeValue(out, E.position);
+			writeValue(out, E.rotation);
+			writeValue(out, E.scale);
+			writeString(out, E.track);
+			writeValue(out, (uint8_t) E.highlight);
+			writeString(out, E.region);
+		}
+		writeValue(out, (uint32_t) lights.size());
+		for (const SceneLight &L : lights) {
+			writeValue(out, L);
+		}
+		return (bool) out;
+	}
+
+	// index of the first entity with this name, or -1
+	int find(const std::string &name) const {
+		for (size_t i = 0; i < entities.size(); i++) {
+			if (entities[i].name == name) {
+				return (int) i;
+			}
+		}
+		return -1;
+	}
+
+	static std::string readFile(const std::string &file) {
+		std::ifstream in(file, std::ios::binary);
+		if (!in) {
+			throw std::runtime_error("failed to open " + file + "!");
+		}
+		return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	}
+
+	static uint64_t hash(const void *data, size_t size, uint64_t hash = 14695981039346656037ull) {
+		const unsigned char *bytes = (const unsigned char *) data;
+		for (size_t i = 0; i < size; i++) {
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+private:
+	// a number, or an array of three numbers
+	static glm::vec3 vec3(const nlohmann::json &E, const char *field, glm::vec3 fallback) {
+		auto it = E.find(field);
+		if (it == E.end()) {
+			return fallback;
+		}
+		if (it->is_number()) {
+			return glm::vec3(it->get<float>());
+		}
+		if (!it->is_array() || it->size() != 3) {
+			throw std::runtime_error(std::string(field) + " should be a number or 3 numbers");
+		}
+		return glm::vec3((*it)[0].get<float>(), (*it)[1].get<float>(), (*it)[2].get<float>());
+	}
+
+	template <class T>
+	static void writeValue(std::ofstream &out, const T &value) {
+		out.write((const char *) &value, sizeof(T));
+	}
+
+	template <class T>
+	static T readValue(std::ifstream &in) {
+		T value{};
+		in.read((char *) &value, sizeof(T));
+		return value;
+	}
+
+	static size_t remainingBytes(std::ifstream &in) {
+		std::streampos here = in.tellg();
+		in.seekg(0, std::ios::end);
+		std::streampos end = in.tellg();
+		in.seekg(here);
+		return end > here ? (size_t) (end - here) : 0;
+	}
+
+	static void writeString(std::ofstream &out, const std::string &s) {
+		writeValue(out, (uint32_t) s.size());
+		out.write(s.data(), s.size());
+	}
+
+	static std::string readString(std::ifstream &in) {
+		uint32_t size = readValue<uint32_t>(in);
+		if (!in || size > (1u << 20)) {
+			in.setstate(std::ios::failbit);
+			return std::string();
+		}
+		std::string s(size, '\0');
+		in.read(&s[0], size);
+		return s;
+	}
+
+	static void writeStrings(std::ofstream &out, const std::vector<std::string> &strings) {
+		writeValue(out, (uint32_t) strings.size());
+		for (const std::string &s : strings) {
+			writeString(out, s);
+		}
+	}
+
+	static void readStrings(std::ifstream &in, std::vector<std::string> &strings) {
+		uint32_t count = readValue<uint32_t>(in);
+		if (!in || count > (1u << 20)) {
+			in.setstate(std::ios::failbit);
+			return;
+		}
+		strings.resize(count);
+		for (std::string &s : strings) {
+			s = readString(in);
+		}
+	}
+};
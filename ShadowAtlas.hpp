@@ -0,0 +1,240 @@
+// Cached shadow maps of point lights. Every shadowed light owns a slot of
+// the atlas: six square tiles holding the depth seen from the light along
+// each axis, the faces of a cube map. A face is rendered again only when
+// its light moved, or when a moving caster entered its frustum, and no
+// more than FACES_PER_FRAME faces are rendered per frame, so lights that
+// stand still cost nothing once their faces are in the atlas.
+//
+// shaders/shadow.vert renders the faces and the lighting shaders sample
+// them through ShadowUniforms; the constants below must match theirs.
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "LightClusters.hpp"
+
+const uint32_t SHADOW_TILE_SIZE = 512;
+const uint32_t SHADOW_TILES_PER_ROW = 8;
+const uint32_t SHADOW_ATLAS_SIZE = SHADOW_TILE_SIZE * SHADOW_TILES_PER_ROW;
+const uint32_t SHADOW_SLOTS = SHADOW_TILES_PER_ROW * SHADOW_TILES_PER_ROW / 6;
+const uint32_t SHADOW_FACES = SHADOW_SLOTS * 6;
+const float SHADOW_NEAR = 0.05f;
+const float SHADOW_DISTANCE = 30.0f;	// of the lights shadowed, from the camera
+
+// std140, binding 0 of the shadow set
+struct ShadowUniforms {
+	alignas(16) glm::mat4 faceViewProj[SHADOW_FACES];	// face f of slot s at 6 * s + f
+	alignas(16) glm::vec4 slots[SHADOW_SLOTS];			// light position and radius, w = 0 until rendered
+	alignas(16) glm::ivec4 lightSlots[MAX_LIGHTS / 4];	// slot of light i at [i / 4][i % 4], or -1
+};
+
+struct ShadowFace {
+	uint32_t slot;
+	uint32_t face;			// +x, -x, +y, -y, +z, -z
+};
+
+class ShadowAtlas {
+public:
+	static constexpr uint32_t FACES_PER_FRAME = 12;
+
+	// wanted lists the lights to shadow, most important first; those past
+	// SHADOW_SLOTS are not. casters are the bounding spheres (center,
+	// radius) of what moved since the last update, covering both where it
+	// was and where it is. Picks the faces to render this frame.
+	void update(const std::vector<PointLight> &lights, const std::vector<uint32_t> &wanted,
+				const std::vector<glm::vec4> &casters) {
+		frame++;
+		for (Slot &S : slots) {
+			if (S.light >= (int) lights.size()) {
+				S = Slot();
+			}
+		}
+		// slots by priority: the lights that have one keep it, before the
+		// others take the free ones or those of lights no longer wanted
+		std::vector<int> order(std::min<size_t>(wanted.size(), SHADOW_SLOTS));
+		for (size_t w = 0; w < order.size(); w++) {
+			order[w] = findSlot(wanted[w]);
+			if (order[w] >= 0) {
+				slots[order[w]].lastUsed = frame;
+			}
+		}
+		for (size_t w = 0; w < order.size(); w++) {
+			if (order[w] < 0) {
+				order[w] = leastRecentlyUsed();
+				slots[order[w]] = Slot();
+				slots[order[w]].light = (int) wanted[w];
+				slots[order[w]].lastUsed = frame;
+			}
+		}
+
+		for (Slot &S : slots) {
+			if (!S.ready) {
+				continue;
+			}
+			for (const glm::vec4 &C : casters) {
+				glm::vec3 c = glm::vec3(C) - S.position;
+				if (glm::dot(c, c) < (C.w + S.radius) * (C.w + S.radius)) {
+					for (uint32_t face = 0; face < 6; face++) {
+						if (sphereInFace(c, C.w, face)) {
+							S.valid &= ~(1u << face);
+						}
+					}
+				}
+			}
+		}
+
+		// a light that moved has all its faces rendered in the same frame,
+		// or keeps the old ones: faces seen from two places would not match
+		rendered.clear();
+		uint32_t budget = FACES_PER_FRAME;
+		for (int slot : order) {
+			Slot &S = slots[slot];
+			const PointLight &L = lights[S.light];
+			glm::vec3 position = glm::vec3(L.positionRadius);
+			if (!S.ready || position != S.position || L.positionRadius.w != S.radius) {
+				if (budget >= 6) {
+					S.position = position;
+					S.radius = L.positionRadius.w;
+					S.ready = true;
+					S.valid = 0;
+				} else {
+					continue;
+				}
+			}
+			for (uint32_t face = 0; face < 6 && budget > 0; face++) {
+				if (!(S.valid & (1u << face))) {
+					rendered.push_back({(uint32_t) slot, face});
+					S.valid |= 1u << face;
+					budget--;
+				}
+			}
+		}
+		renderedFaces += rendered.size();
+	}
+
+	// the faces update() picked, to render before the frame reads the atlas
+	const std::vector<ShadowFace> &faces() const {
+		return rendered;
+	}
+
+	// where the faces of a slot were rendered from, and the radius
+	glm::vec4 slotSphere(uint32_t slot) const {
+		return glm::vec4(slots[slot].position, slots[slot].radius);
+	}
+
+	void fillUniforms(ShadowUniforms &U, size_t lightCount) const {
+		for (uint32_t slot = 0; slot < SHADOW_SLOTS; slot++) {
+			const Slot &S = slots[slot];
+			U.slots[slot] = glm::vec4(S.position, S.ready ? S.radius : 0.0f);
+			for (uint32_t face = 0; face < 6; face++) {
+				U.faceViewProj[6 * slot + face] = S.ready ?
+					faceViewProj(S.position, S.radius, face) : glm::mat4(1.0f);
+			}
+		}
+		for (size_t i = 0; i < MAX_LIGHTS; i++) {
+			U.lightSlots[i / 4][i % 4] = -1;
+		}
+		for (uint32_t slot = 0; slot < SHADOW_SLOTS; slot++) {
+			const Slot &S = slots[slot];
+			if (S.ready && S.light < (int) std::min<size_t>(lightCount, MAX_LIGHTS)) {
+				U.lightSlots[S.light / 4][S.light % 4] = (int) slot;
+			}
+		}
+	}
+
+	// top left corner of a face in the atlas, in texels
+	static glm::uvec2 tileOrigin(uint32_t slot, uint32_t face) {
+		uint32_t tile = 6 * slot + face;
+		return glm::uvec2(tile % SHADOW_TILES_PER_ROW, tile / SHADOW_TILES_PER_ROW) * SHADOW_TILE_SIZE;
+	}
+
+	// a 90 degree frustum along the axis of the face, out to the radius
+	static glm::mat4 faceViewProj(glm::vec3 position, float radius, uint32_t face) {
+		static const glm::vec3 directions[6] = {
+			{1, 0, 0}, {-1, 0, 0}, {0, 1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}};
+		static const glm::vec3 ups[6] = {
+			{0, -1, 0}, {0, -1, 0}, {0, 0, 1}, {0, 0, -1}, {0, -1, 0}, {0, -1, 0}};
+		glm::mat4 view = glm::lookAt(position, position + directions[face], ups[face]);
+		glm::mat4 proj = glm::perspective(glm::radians(90.0f), 1.0f, SHADOW_NEAR, radius);
+		return proj * view;
+	}
+
+	// whether a sphere, relative to the light, reaches into the frustum of
+	// a face: the four side planes are at 45 degrees from its axis
+	static bool sphereInFace(glm::vec3 center, float radius, uint32_t face) {
+		uint32_t axis = face / 2;
+		float along = face % 2 ? -center[axis] : center[axis];
+		float reach = radius * std::sqrt(2.0f);
+		for (uint32_t other = 0; other < 3; other++) {
+			if (other != axis && along + reach < std::abs(center[other])) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	size_t renderedFaces = 0;		// since the start
+
+private:
+	struct Slot {
+		int light = -1;
+		glm::vec3 position = glm::vec3(0.0f);	// the faces were rendered from
+		float radius = 0.0f;
+		uint32_t valid = 0;			// bit per face
+		bool ready = false;			// every face rendered once
+		uint64_t lastUsed = 0;
+	};
+
+	int findSlot(uint32_t light) const {
+		for (uint32_t slot = 0; slot < SHADOW_SLOTS; slot++) {
+			if (slots[slot].light == (int) light) {
+				return (int) slot;
+			}
+		}
+		return -1;
+	}
+
+	// a free slot, or that of the light left unwanted the longest
+	int leastRecentlyUsed() const {
+		int best = 0;
+		for (uint32_t slot = 0; slot < SHADOW_SLOTS; slot++) {
+			if (slots[slot].light < 0) {
+				return (int) slot;
+			}
+			if (slots[slot].lastUsed < slots[best].lastUsed) {
+				best = (int) slot;
+			}
+		}
+		return best;
+	}
+
+	Slot slots[SHADOW_SLOTS];
+	uint64_t frame = 0;
+	std::vector<ShadowFace> rendered;
+};
+
+// the torch (light 0) first, then the lights that reach closest to the camera
+inline std::vector<uint32_t> shadowedLights(const std::vector<PointLight> &lights, glm::vec3 eye) {
+	std::vector<std::pair<float, uint32_t>> nearby;
+	for (uint32_t i = 1; i < lights.size(); i++) {
+		float distance = glm::distance(eye, glm::vec3(lights[i].positionRadius))
+					   - lights[i].positionRadius.w;
+		if (distance < SHADOW_DISTANCE) {
+			nearby.push_back({distance, i});
+		}
+	}
+	std::sort(nearby.begin(), nearby.end());
+	std::vector<uint32_t> wanted = {0};
+	for (const auto &N : nearby) {
+		wanted.push_back(N.second);
+	}
+	return wanted;
+}
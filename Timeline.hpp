@@ -0,0 +1,207 @@
+// Keyframed animation of vec3 values (positions of moving objects). The
+// keyframes of every track are stored in shared contiguous arrays, and the
+// tracks in parallel arrays of their own. Timeline::update() evaluates
+// every playing track in one pass, whatever it animates, and reports the
+// keyframes crossed since the previous update as events.
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+enum Ease : uint8_t {
+	EASE_LINEAR,
+	EASE_IN_QUAD,
+	EASE_OUT_QUAD,
+	EASE_IN_OUT_QUAD,
+	EASE_IN_OUT_CUBIC,
+	EASE_STEP,			// holds the value of the key until the next one
+};
+
+// maps the fraction t of a segment in [0, 1] to the fraction of its value change
+inline float ease(Ease curve, float t) {
+	switch (curve) {
+	case EASE_IN_QUAD:
+		return t * t;
+	case EASE_OUT_QUAD:
+		return t * (2.0f - t);
+	case EASE_IN_OUT_QUAD:
+		return t < 0.5f ? 2.0f * t * t : 1.0f - 2.0f * (1.0f - t) * (1.0f - t);
+	case EASE_IN_OUT_CUBIC:
+		return t < 0.5f ? 4.0f * t * t * t : 1.0f - 4.0f * (1.0f - t) * (1.0f - t) * (1.0f - t);
+	case EASE_STEP:
+		return t < 1.0f ? 0.0f : 1.0f;
+	default:
+		return t;
+	}
+}
+
+struct Keyframe {
+	float time;				// seconds from the start of the track
+	glm::vec3 value;
+	Ease ease = EASE_LINEAR;	// of the segment towards the next key
+	int event = 0;			// reported when playback reaches the key, 0 for none
+};
+
+struct TimelineEvent {
+	uint32_t track;
+	int event;				// of a keyframe, or Timeline::FINISHED
+};
+
+class Timeline {
+public:
+	static constexpr int FINISHED = -1;
+
+	// keys must be sorted by time; the track rests on the first one
+	uint32_t addTrack(const std::vector<Keyframe> &keys) {
+		uint32_t track = (uint32_t) firstKey.size();
+		firstKey.push_back((uint32_t) keyTimes.size());
+		keyCount.push_back((uint32_t) std::max<size_t>(keys.size(), 1));
+		for (const Keyframe &K : keys) {
+			keyTimes.push_back(K.time - keys[0].time);
+			keyValues.push_back(K.value);
+			keyEases.push_back(K.ease);
+			keyEvents.push_back(K.event);
+		}
+		if (keys.empty()) {
+			keyTimes.push_back(0.0f);
+			keyValues.push_back(glm::vec3(0.0f));
+			keyEases.push_back(EASE_LINEAR);
+			keyEvents.push_back(0);
+		}
+		duration.push_back(keyTimes.back());
+		startTime.push_back(0.0f);
+		reversed.push_back(0);
+		atEnd.push_back(0);
+		nextKey.push_back(0);
+		values.push_back(keyValues[firstKey[track]]);
+		activeSlot.push_back(NOT_PLAYING);
+		return track;
+	}
+
+	// plays the track from its first key, or backwards from its last one
+	void play(uint32_t track, float time, bool reverse = false) {
+		startTime[track] = time;
+		reversed[track] = reverse;
+		nextKey[track] = reverse ? (int32_t) keyCount[track] - 2 : 1;
+		if (activeSlot[track] == NOT_PLAYING) {
+			activeSlot[track] = (uint32_t) active.size();
+			active.push_back(track);
+		}
+	}
+
+	// plays towards the end the track is not resting on, back and forth
+	void toggle(uint32_t track, float time) {
+		play(track, time, atEnd[track] != 0);
+	}
+
+	// freezes the track on its current value
+	void stop(uint32_t track) {
+		uint32_t slot = activeSlot[track];
+		if (slot == NOT_PLAYING) {
+			return;
+		}
+		active[slot] = active.back();
+		activeSlot[active[slot]] = slot;
+		active.pop_back();
+		activeSlot[track] = NOT_PLAYING;
+	}
+
+	bool playing(uint32_t track) const {
+		return activeSlot[track] != NOT_PLAYING;
+	}
+
+	const glm::vec3 &value(uint32_t track) const {
+		return values[track];
+	}
+
+	// evaluates every playing track at this time
+	void update(float time) {
+		fired.clear();
+		for (size_t slot = 0; slot < active.size();) {
+			uint32_t track = active[slot];
+			uint32_t first = firstKey[track];
+			int32_t count = (int32_t) keyCount[track];
+			float length = duration[track];
+			float elapsed = time - startTime[track];
+			bool done = elapsed >= length;
+			float local = std::min(std::max(elapsed, 0.0f), length);
+			int32_t next = nextKey[track];
+			int32_t lower;
+			if (reversed[track]) {
+				local = length - local;
+				while (next >= 0 && keyTimes[first + next] >= local) {
+					fire(track, keyEvents[first + next]);
+					next--;
+				}
+				lower = std::max(next, 0);
+			} else {
+				while (next < count && keyTimes[first + next] <= local) {
+					fire(track, keyEvents[first + next]);
+					next++;
+				}
+				lower = std::max(std::min(next - 1, count - 2), 0);
+			}
+			nextKey[track] = next;
+
+			uint32_t upper = first + std::min(lower + 1, count - 1);
+			float t0 = keyTimes[first + lower], t1 = keyTimes[upper];
+			float t = t1 > t0 ? std::min(std::max((local - t0) / (t1 - t0), 0.0f), 1.0f) : 1.0f;
+			values[track] = glm::mix(keyValues[first + lower], keyValues[upper],
+									 ease(keyEases[first + lower], t));
+
+			if (done) {
+				atEnd[track] = !reversed[track];
+				fired.push_back({track, FINISHED});
+				stop(track);		// moves the last playing track into this slot
+			} else {
+				slot++;
+			}
+		}
+	}
+
+	// what the last update() crossed, in track order of evaluation
+	const std::vector<TimelineEvent> &events() const {
+		return fired;
+	}
+
+	size_t trackCount() const {
+		return firstKey.size();
+	}
+
+	size_t playingCount() const {
+		return active.size();
+	}
+
+private:
+	static constexpr uint32_t NOT_PLAYING = UINT32_MAX;
+
+	void fire(uint32_t track, int event) {
+		if (event != 0) {
+			fired.push_back({track, event});
+		}
+	}
+
+	// keyframes of all tracks, those of a track are contiguous
+	std::vector<float> keyTimes;
+	std::vector<glm::vec3> keyValues;
+	std::vector<Ease> keyEases;
+	std::vector<int> keyEvents;
+
+	// tracks
+	std::vector<uint32_t> firstKey;
+	std::vector<uint32_t> keyCount;
+	std::vector<float> duration;
+	std::vector<float> startTime;
+	std::vector<uint8_t> reversed;
+	std::vector<uint8_t> atEnd;
+	std::vector<int32_t> nextKey;		// the next key playback will reach
+	std::vector<glm::vec3> values;
+	std::vector<uint32_t> activeSlot;	// in active, or NOT_PLAYING
+
+	std::vector<uint32_t> active;		// the playing tracks
+	std::vector<TimelineEvent> fired;
+};
@@ -0,0 +1,496 @@
+// Micro-benchmarks of the CPU-side modules, on the level data and on
+// generated fixtures, with no window nor Vulkan device. Run them from the
+// root of the repository, where models/ and scenes/ are:
+//
+//   g++ -std=c++17 -O2 -I. -Iheaders benchmarks/MicroBenchmarks.cpp -o micro-benchmarks -pthread
+//   ./micro-benchmarks <benchmark> [queries]
+
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// the one translation unit with the OBJ loader
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+#include "Logger.hpp"
+#include "Bvh.hpp"
+#include "Collision.hpp"
+#include "Level.hpp"
+#include "LightClusters.hpp"
+#include "Scene.hpp"
+#include "ShadowAtlas.hpp"
+#include "Timeline.hpp"
+
+template <class Query>
+static void measureQueries(const char *label, int queries, Query query)
+{
+	auto start = std::chrono::steady_clock::now();
+	query();
+	double ns = std::chrono::duration<double, std::nano>(
+					std::chrono::steady_clock::now() - start).count();
+	LOG_INFO("%-16s %8.1f ns/query", label, ns / queries);
+}
+
+// collision: random points around the first level through isInside(),
+// the grid, one batch and the brute-force test
+static void benchmarkCollision(int queries)
+{
+	PolygonGrid firstLevelArea(polygonFirstLevel, sizeof(polygonFirstLevel) / sizeof(polygonFirstLevel[0]));
+	// isInside() takes a mutable array
+	std::vector<Point> polygon = firstLevelArea.polygon();
+	std::vector<Point> points = randomPointsAround(polygon, queries, 1234);
+
+	std::vector<uint8_t> legacy(queries), grid(queries), batch(queries), exact(queries);
+	measureQueries("isInside", queries, [&]() {
+		for (int i = 0; i < queries; i++) {
+			legacy[i] = isInside(polygon.data(), (int) polygon.size(), points[i]);
+		}
+	});
+	measureQueries("grid", queries, [&]() {
+		for (int i = 0; i < queries; i++) {
+			grid[i] = firstLevelArea.contains(points[i]);
+		}
+	});
+	measureQueries("grid batch", queries, [&]() {
+		firstLevelArea.containsBatch(points.data(), points.size(), batch.data());
+	});
+	measureQueries("brute force", queries, [&]() {
+		for (int i = 0; i < queries; i++) {
+			exact[i] = firstLevelArea.containsBruteForce(points[i]);
+		}
+	});
+
+	int gridErrors = 0, legacyDifferences = 0;
+	for (int i = 0; i < queries; i++) {
+		gridErrors += (grid[i] != exact[i]) + (batch[i] != exact[i]);
+		legacyDifferences += (legacy[i] != exact[i]);
+	}
+	LOG_INFO("%d queries on a %d vertex polygon, %dx%d grid with %zu edges",
+			 queries, (int) polygon.size(), firstLevelArea.gridColumns(),
+			 firstLevelArea.gridRows(), firstLevelArea.storedEdges());
+	LOG_INFO("isInside() differs from the exact test on %d points", legacyDifferences);
+	if (gridErrors > 0) {
+		throw std::runtime_error("grid and brute-force collision disagree on " +
+								 std::to_string(gridErrors) + " points");
+	}
+}
+
+// The batch kernels at every SIMD level the CPU has, against isInside()
+// and doIntersect() per edge. Segments are movement steps up to 2 units long.
+static void benchmarkCollisionKernels(std::vector<Point> polygon, int queries)
+{
+	int n = (int) polygon.size();
+	PolygonEdgesSoA edges;
+	edges.build(polygon.data(), n);
+
+	std::vector<Point> points = randomPointsAround(polygon, queries, 4321);
+	std::mt19937 random(5678);
+	std::uniform_real_distribution<float> step(-2.0f, 2.0f);
+	std::vector<float> x0(queries), y0(queries), x1(queries), y1(queries);
+	for (int i = 0; i < queries; i++) {
+		x0[i] = points[i].x;
+		y0[i] = points[i].y;
+		x1[i] = x0[i] + step(random);
+		y1[i] = y0[i] + step(random);
+	}
+	LOG_INFO("%d queries on a %d vertex polygon, best SIMD level %s",
+			 queries, n, simdLevelName(bestSimdLevel()));
+
+	std::vector<uint8_t> legacyInside(queries), legacyHit(queries);
+	measureQueries("isInside", queries, [&]() {
+		for (int i = 0; i < queries; i++) {
+			legacyInside[i] = isInside(polygon.data(), n, points[i]);
+		}
+	});
+	measureQueries("doIntersect", queries, [&]() {
+		for (int i = 0; i < queries; i++) {
+			bool hit = false;
+			for (int e = 0; e < n && !hit; e++) {
+				hit = doIntersect(polygon[e], polygon[(e + 1) % n],
+								  {x0[i], y0[i]}, {x1[i], y1[i]});
+			}
+			legacyHit[i] = hit;
+		}
+	});
+
+	std::vector<uint8_t> inside[3], hit[3];
+	for (int level = SIMD_SCALAR; level <= bestSimdLevel(); level++) {
+		SimdLevel L = (SimdLevel) level;
+		std::string label = simdLevelName(L);
+		inside[level].resize(queries);
+		hit[level].resize(queries);
+		measureQueries((label + " inside").c_str(), queries, [&]() {
+			pointsInPolygon(edges, x0.data(), y0.data(), queries, inside[level].data(), L);
+		});
+		measureQueries((label + " segments").c_str(), queries, [&]() {
+			segmentsHitPolygon(edges, x0.data(), y0.data(), x1.data(), y1.data(),
+							   queries, hit[level].data(), L);
+		});
+	}
+
+	// the kernels do the same float operations at every level; the
+	// legacy functions truncate orientations to int
+	int levelDifferences = 0, legacyInsideDifferences = 0, legacyHitDifferences = 0;
+	for (int i = 0; i < queries; i++) {
+		for (int level = SIMD_SSE2; level <= bestSimdLevel(); level++) {
+			levelDifferences += (inside[level][i] != inside[SIMD_SCALAR][i]) +
+								(hit[level][i] != hit[SIMD_SCALAR][i]);
+		}
+		legacyInsideDifferences += (legacyInside[i] != inside[SIMD_SCALAR][i]);
+		legacyHitDifferences += (legacyHit[i] != hit[SIMD_SCALAR][i]);
+	}
+	LOG_INFO("isInside() differs on %d points, doIntersect() on %d segments",
+			 legacyInsideDifferences, legacyHitDifferences);
+	if (levelDifferences > 0) {
+		LOG_WARN("SIMD levels disagree on %d queries: was the scalar code built "
+				 "with fused multiply-add?", levelDifferences);
+	}
+}
+
+// collision-simd: the batch kernels on both levels
+static void benchmarkCollisionSimd(int queries)
+{
+	benchmarkCollisionKernels({std::begin(polygonFirstLevel), std::end(polygonFirstLevel)}, queries);
+	benchmarkCollisionKernels({std::begin(polygonSecondLevel), std::end(polygonSecondLevel)}, queries);
+}
+
+// navmesh: build time, query time and how often the extracted floor
+// agrees with the hand-authored level polygons
+static void benchmarkNavMesh(int queries)
+{
+	std::vector<glm::vec3> positions;
+	std::vector<uint32_t> indices;
+	NavMesh::loadObj("models/newcave.obj", positions, indices);
+	NavMesh navMesh;
+	auto start = std::chrono::steady_clock::now();
+	navMesh.build(positions, indices, caveNavMeshConfig());
+	LOG_INFO("navmesh built in %.2f ms: %zu of %zu triangles, %u regions",
+			 std::chrono::duration<double, std::milli>(
+				 std::chrono::steady_clock::now() - start).count(),
+			 navMesh.triangles.size(), indices.size() / 3, navMesh.regionCount);
+
+	const PolygonGrid areas[2] = {
+		{polygonFirstLevel, sizeof(polygonFirstLevel) / sizeof(polygonFirstLevel[0])},
+		{polygonSecondLevel, sizeof(polygonSecondLevel) / sizeof(polygonSecondLevel[0])}};
+	const float floors[2] = {1.0f - EYE_HEIGHT, 11.0f - EYE_HEIGHT};
+	for (int level = 0; level < 2; level++) {
+		std::vector<Point> points = randomPointsAround(areas[level].polygon(), queries, 99 + level);
+		std::vector<uint8_t> polygon(queries), mesh(queries);
+		measureQueries("polygon grid", queries, [&]() {
+			for (int i = 0; i < queries; i++) {
+				polygon[i] = areas[level].contains(points[i]);
+			}
+		});
+		measureQueries("navmesh", queries, [&]() {
+			for (int i = 0; i < queries; i++) {
+				mesh[i] = navMesh.walkable(points[i].x, points[i].y, floors[level],
+										   1.5f, NAVMESH_RADIUS);
+			}
+		});
+		int agree = 0;
+		for (int i = 0; i < queries; i++) {
+			agree += polygon[i] == mesh[i];
+		}
+		LOG_INFO("level %d: navmesh agrees with the polygon on %.2f%% of points",
+				 level + 1, 100.0 * agree / queries);
+	}
+}
+
+// bvh: build times on one and all threads, for the
+// cave and for 64 copies of it, then rays and sphere sweeps per second
+// from random points of the cave, checked against brute force
+static void benchmarkBvh(int queries)
+{
+	std::vector<glm::vec3> positions, tiledPositions;
+	std::vector<uint32_t> indices, tiledIndices;
+	NavMesh::loadObj("models/newcave.obj", positions, indices);
+	for (int copy = 0; copy < 64; copy++) {
+		glm::vec3 offset((copy % 8) * 120.0f, 0.0f, (copy / 8) * 120.0f);
+		for (uint32_t index : indices) {
+			tiledIndices.push_back(index + (uint32_t) tiledPositions.size());
+		}
+		for (const glm::vec3 &p : positions) {
+			tiledPositions.push_back(p + offset);
+		}
+	}
+	for (unsigned threads : {1u, 0u}) {
+		TriangleBvh bvh;
+		auto start = std::chrono::steady_clock::now();
+		bvh.build(tiledPositions, tiledIndices, threads);
+		LOG_INFO("%zu triangles on %s: built in %.2f ms, %zu nodes, depth %d",
+				 bvh.triangleCount(), threads == 1 ? "one thread" : "all threads",
+				 std::chrono::duration<double, std::milli>(
+					 std::chrono::steady_clock::now() - start).count(),
+				 bvh.nodeCount(), bvh.treeDepth());
+	}
+
+	TriangleBvh bvh;
+	bvh.build(positions, indices);
+	std::mt19937 random(2468);
+	std::uniform_real_distribution<float> x(-55.0f, 50.0f), y(-1.5f, 7.5f), z(-58.0f, 46.0f);
+	std::uniform_real_distribution<float> d(-1.0f, 1.0f);
+	std::vector<glm::vec3> origins(queries), directions(queries);
+	for (int i = 0; i < queries; i++) {
+		origins[i] = glm::vec3(x(random), y(random), z(random));
+		glm::vec3 direction;
+		do {
+			direction = glm::vec3(d(random), d(random), d(random));
+		} while (glm::length(direction) < 0.1f);
+		directions[i] = glm::normalize(direction);
+	}
+
+	auto perSecond = [&](const char *label, auto query) {
+		auto start = std::chrono::steady_clock::now();
+		int hits = query();
+		double seconds = std::chrono::duration<double>(
+							 std::chrono::steady_clock::now() - start).count();
+		LOG_INFO("%-12s %7.2f M/s, %d hits", label, queries / seconds * 1e-6, hits);
+	};
+	perSecond("raycast", [&]() {
+		int hits = 0;
+		for (int i = 0; i < queries; i++) {
+			RayHit hit;
+			hits += bvh.raycast(origins[i], directions[i], INFINITY, hit);
+		}
+		return hits;
+	});
+	perSecond("occluded", [&]() {
+		int hits = 0;
+		for (int i = 0; i < queries; i++) {
+			hits += bvh.occluded(origins[i], directions[i], 10.0f);
+		}
+		return hits;
+	});
+	perSecond("sweep sphere", [&]() {
+		int hits = 0;
+		for (int i = 0; i < queries; i++) {
+			SweepHit hit;
+			hits += bvh.sweepSphere(origins[i], CAPSULE_RADIUS, directions[i] * 2.0f, hit);
+		}
+		return hits;
+	});
+
+	int checked = std::min(queries, 10000), errors = 0;
+	for (int i = 0; i < checked; i++) {
+		RayHit a, b;
+		bool hitA = bvh.raycast(origins[i], directions[i], INFINITY, a);
+		bool hitB = bvh.raycastBruteForce(origins[i], directions[i], INFINITY, b);
+		errors += hitA != hitB || (hitA && std::fabs(a.t - b.t) > 1e-4f * std::max(1.0f, b.t));
+	}
+	if (errors > 0) {
+		throw std::runtime_error("BVH and brute-force raycasts disagree on " +
+								 std::to_string(errors) + " rays");
+	}
+}
+
+// timeline: one update of many playing tracks of
+// four keys with mixed easing, per track
+static void benchmarkTimeline(int queries)
+{
+	int tracks = std::min(queries, 1 << 16);
+	int updates = std::max(queries / tracks, 1);
+	std::mt19937 random(1357);
+	std::uniform_real_distribution<float> v(-10.0f, 10.0f), length(0.5f, 2.0f);
+	Timeline benchmark;
+	for (int i = 0; i < tracks; i++) {
+		std::vector<Keyframe> keys;
+		float time = 0.0f;
+		for (int k = 0; k < 4; k++) {
+			keys.push_back({time, glm::vec3(v(random), v(random), v(random)),
+							(Ease) (random() % (EASE_STEP + 1))});
+			time += length(random);
+		}
+		keys.back().event = 1;
+		benchmark.play(benchmark.addTrack(keys), 0.0f, i % 2 != 0);
+	}
+
+	// over the first second, before any track finishes
+	int events = 0;
+	measureQueries("timeline", updates * tracks, [&]() {
+		for (int i = 0; i < updates; i++) {
+			benchmark.update(i / (float) updates);
+			events += (int) benchmark.events().size();
+		}
+	});
+	LOG_INFO("%d tracks, %d updates, %d events", tracks, updates, events);
+}
+
+// scene: parsing a generated scene from JSON against writing and reading
+// its compiled form
+static void benchmarkScene(int queries)
+{
+	std::string file = generateScene("scenes/cave.json", std::min(queries, 1 << 16));
+	std::string text = Scene::readFile(file);
+	uint64_t key = Scene::hash(text.data(), text.size());
+	Scene S;
+	auto measure = [](const char *label, auto step) {
+		auto start = std::chrono::steady_clock::now();
+		step();
+		LOG_INFO("%-16s %8.2f ms", label, std::chrono::duration<double, std::milli>(
+					 std::chrono::steady_clock::now() - start).count());
+	};
+	measure("parse JSON", [&]() { S.parse(text, file); });
+	measure("save compiled", [&]() { S.save("scene_benchmark.bin", key); });
+	measure("load compiled", [&]() {
+		if (!S.load("scene_benchmark.bin", key)) {
+			throw std::runtime_error("failed to read back the compiled scene!");
+		}
+	});
+	std::remove("scene_benchmark.bin");
+	LOG_INFO("%zu entities, %zu bytes of JSON", S.entities.size(), text.size());
+}
+
+// clusters: binning lights scattered over the first level on the CPU, how
+// many a full cluster leaves out, and how many lights a fragment then loops
+// over compared with all of them
+static void benchmarkClusters(int queries)
+{
+	PolygonGrid firstLevelArea(polygonFirstLevel, sizeof(polygonFirstLevel) / sizeof(polygonFirstLevel[0]));
+	int count = std::min(queries, (int) MAX_LIGHTS);
+	std::mt19937 random(2468);
+	std::uniform_real_distribution<float> height(-1.5f, 3.0f), radius(2.0f, 8.0f);
+	std::vector<PointLight> lights;
+	for (const Point &p : randomPointsAround(firstLevelArea.polygon(), count, 2468)) {
+		lights.push_back({glm::vec4(p.x, height(random), p.y, radius(random)), glm::vec4(1.0f)});
+	}
+
+	const float nearPlane = 0.1f, farPlane = 150.0f;
+	glm::vec2 screen(1024.0f, 768.0f);
+	// the game's LookInDirMat() at a yaw of -90 degrees
+	glm::mat4 view = glm::rotate(glm::mat4(1.0f), glm::radians(90.0f), glm::vec3(0.0f, 1.0f, 0.0f)) *
+					 glm::translate(glm::mat4(1.0f), -glm::vec3(11.0f, 0.0f, -25.0f));
+	glm::mat4 proj = glm::perspective(glm::radians(45.0f), screen.x / screen.y, nearPlane, farPlane);
+	proj[1][1] *= -1;
+	glm::mat4 invProj = glm::inverse(proj);
+	std::vector<LightCluster> clusters;
+	size_t dropped = 0;
+	int repeats = std::max(queries / count, 1);
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < repeats; i++) {
+		dropped = binLights(lights, view, invProj, nearPlane, farPlane, clusters);
+	}
+	LOG_INFO("%-16s %8.2f ms", "bin lights", std::chrono::duration<double, std::milli>(
+				 std::chrono::steady_clock::now() - start).count() / repeats);
+
+	size_t binned = 0, full = 0;
+	for (const LightCluster &C : clusters) {
+		binned += C.count;
+		full += C.count == MAX_LIGHTS_PER_CLUSTER;
+	}
+
+	// fragments on random pixels and depths, and the lights that reach them
+	std::uniform_real_distribution<float> u(0.0f, 1.0f);
+	size_t looped = 0, lit = 0, missed = 0;
+	const int fragments = 100000;
+	for (int i = 0; i < fragments; i++) {
+		glm::vec2 fragCoord(u(random) * screen.x, u(random) * screen.y);
+		float depth = nearPlane * std::pow(farPlane / nearPlane, u(random));
+		glm::vec4 p = invProj * glm::vec4(fragCoord / screen * 2.0f - 1.0f, 1.0f, 1.0f);
+		glm::vec3 ray = glm::vec3(p) / p.w;
+		glm::vec3 world = glm::vec3(glm::inverse(view) * glm::vec4(ray * (depth / -ray.z), 1.0f));
+		const LightCluster &C = clusters[clusterOf(fragCoord, screen, depth, nearPlane, farPlane)];
+		looped += C.count;
+		for (size_t l = 0; l < lights.size(); l++) {
+			if (glm::distance(world, glm::vec3(lights[l].positionRadius)) < lights[l].positionRadius.w) {
+				lit++;
+				missed += std::find(C.lights, C.lights + C.count, (uint32_t) l) == C.lights + C.count;
+			}
+		}
+	}
+	LOG_INFO("%d lights, %.2f per cluster; a fragment loops over %.2f of them, %.2f reach it, "
+			 "%zu misses", count, binned / (double) CLUSTER_COUNT, looped / (double) fragments,
+			 lit / (double) fragments, missed);
+	LOG_INFO("%zu full clusters left out %zu lights", full, dropped);
+}
+
+// shadows: the faces the atlas renders per frame while the camera walks
+// across the first level among many lights and a platform goes up and
+// down, against rendering every face each frame
+static void benchmarkShadows(int queries)
+{
+	PolygonGrid firstLevelArea(polygonFirstLevel, sizeof(polygonFirstLevel) / sizeof(polygonFirstLevel[0]));
+	int count = std::min(queries, (int) MAX_LIGHTS - 1);
+	std::mt19937 random(1357);
+	std::uniform_real_distribution<float> height(-1.5f, 3.0f), radius(2.0f, 8.0f);
+	std::vector<PointLight> lights = {{glm::vec4(0.0f, 0.0f, 0.0f, 40.0f), glm::vec4(1.0f)}};
+	for (const Point &p : randomPointsAround(firstLevelArea.polygon(), count, 1357)) {
+		lights.push_back({glm::vec4(p.x, height(random), p.y, radius(random)), glm::vec4(1.0f)});
+	}
+
+	ShadowAtlas atlas;
+	const int frames = 1000;
+	size_t uncached = 0;
+	glm::vec4 platform(0.0f, -1.9f, 0.1f, 3.0f);
+	auto start = std::chrono::steady_clock::now();
+	for (int frame = 0; frame < frames; frame++) {
+		glm::vec3 eye(-20.0f + 40.0f * frame / frames, 0.0f, -10.0f);
+		lights[0].positionRadius = glm::vec4(eye + glm::vec3(0.0f, 0.5f, 0.0f), 40.0f);
+		std::vector<glm::vec4> moved;
+		if (frame % 200 < 100) {
+			glm::vec4 next = platform + glm::vec4(0.0f, frame % 200 < 50 ? 0.2f : -0.2f, 0.0f, 0.0f);
+			moved.push_back(glm::vec4((glm::vec3(platform) + glm::vec3(next)) * 0.5f, platform.w + 0.1f));
+			platform = next;
+		}
+		std::vector<uint32_t> wanted = shadowedLights(lights, eye);
+		atlas.update(lights, wanted, moved);
+		uncached += 6 * std::min<size_t>(wanted.size(), SHADOW_SLOTS);
+	}
+	double ms = std::chrono::duration<double, std::milli>(
+					std::chrono::steady_clock::now() - start).count();
+	LOG_INFO("%d lights, %.1f faces rendered per frame against %.1f uncached, %.3f ms per update",
+			 count, atlas.renderedFaces / (double) frames, uncached / (double) frames, ms / frames);
+}
+
+int main(int argc, char **argv)
+{
+	const std::map<std::string, void (*)(int)> benchmarks = {
+		{"bvh", benchmarkBvh},
+		{"clusters", benchmarkClusters},
+		{"collision", benchmarkCollision},
+		{"collision-simd", benchmarkCollisionSimd},
+		{"navmesh", benchmarkNavMesh},
+		{"scene", benchmarkScene},
+		{"shadows", benchmarkShadows},
+		{"timeline", benchmarkTimeline},
+	};
+	auto benchmark = argc > 1 ? benchmarks.find(argv[1]) : benchmarks.end();
+	if (benchmark == benchmarks.end()) {
+		std::cerr << "usage: " << argv[0] << " <benchmark> [queries], the benchmarks being:";
+		for (const auto &B : benchmarks) {
+			std::cerr << " " << B.first;
+		}
+		std::cerr << std::endl;
+		return EXIT_FAILURE;
+	}
+	int queries = argc > 2 ? std::max(1, std::atoi(argv[2])) : 1 << 20;
+
+	try
+	{
+		benchmark->second(queries);
+	}
+	catch (const std::exception &e)
+	{
+		Logger::get().flush();
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+	Logger::get().flush();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,173 @@
+#version 450
+
+// shader.frag with every point light of the fragment's cluster instead of
+// the torch alone; the lights are binned by clusters.comp.
+// glslc clustered.frag -o clustered_frag.spv
+
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 9
+#define CLUSTERS_Z 24
+#define MAX_LIGHTS_PER_CLUSTER 31
+
+// The features of the material, one variant of the shader per combination
+// in use (ShaderFeature in MyProject.cpp): the code of those that are off
+// is compiled out of the variant, rather than branched over per fragment.
+layout(constant_id = 0) const bool TEXTURE = true;
+layout(constant_id = 1) const bool LIGHTING = true;
+layout(constant_id = 2) const bool SPECULAR = false;
+layout(constant_id = 3) const bool HIGHLIGHT = true;
+
+layout(set = 1, binding = 1) uniform sampler2D texSampler;
+
+layout(set=0, binding = 0) uniform globalUniformBufferObject {
+    mat4 view;
+    mat4 proj;
+    float time;
+    vec3 eyePos;
+    vec3 cameraDir;
+    vec4 coneInOutDecayExp;
+} gubo;
+
+layout(set=1, binding = 0) uniform UniformBufferObject {
+    mat4 model;
+    int isFlowingColor;     // unused
+    vec3 highlightColor;
+    vec3 materialColor;
+} ubo;
+
+struct PointLight {
+    vec4 positionRadius;
+    vec4 colorIntensity;
+};
+
+struct LightCluster {
+    uint count;
+    uint lights[MAX_LIGHTS_PER_CLUSTER];
+};
+
+layout(set = 2, binding = 0) uniform ClusterUniforms {
+    mat4 view;
+    mat4 invProj;
+    vec4 screenNearFar;
+    uint lightCount;
+} cu;
+
+layout(std430, set = 2, binding = 1) readonly buffer Lights {
+    PointLight lights[];
+};
+
+layout(std430, set = 2, binding = 2) readonly buffer Clusters {
+    LightCluster clusters[];
+};
+
+#define SHADOW_TILES_PER_ROW 8
+#define SHADOW_TILE_SIZE 512.0f
+#define SHADOW_SLOTS 10
+#define SHADOW_FACES 60
+#define SHADOW_NEAR 0.05f
+#define MAX_LIGHTS 1024
+
+layout(set = 3, binding = 0) uniform ShadowUniforms {
+    mat4 faceViewProj[SHADOW_FACES];
+    vec4 slots[SHADOW_SLOTS];
+    ivec4 lightSlots[MAX_LIGHTS / 4];
+} su;
+
+layout(set = 3, binding = 1) uniform sampler2D shadowAtlas;
+
+layout(location = 1) in vec3 fragNorm;
+layout(location = 2) in vec2 fragTexCoord;
+layout(location=3) in vec3 fragPos;
+
+layout(location = 0) out vec4 outColor;
+
+// the torch falloff of shader.frag, faded to zero at the radius
+float attenuation(float d, float radius) {
+    float g = 12.0f;
+    float window = max(1.0f - pow(d / radius, 4.0f), 0.0f);
+    return g / max(d, 1e-3f) * window * window;
+}
+
+// 1 where the light reaches pos, 0 in its shadow, from the cube face of
+// the atlas that looks at pos; lights without a slot cast no shadow
+float shadow(uint light, vec3 pos) {
+    int slot = su.lightSlots[light / 4][light % 4];
+    if (slot < 0) {
+        return 1.0f;
+    }
+    vec4 S = su.slots[slot];
+    vec3 v = pos - S.xyz;
+    vec3 a = abs(v);
+    int face = a.x >= a.y && a.x >= a.z ? (v.x >= 0.0f ? 0 : 1) :
+               a.y >= a.z ? (v.y >= 0.0f ? 2 : 3) : (v.z >= 0.0f ? 4 : 5);
+    int tile = 6 * slot + face;
+    vec4 clip = su.faceViewProj[tile] * vec4(pos, 1.0f);
+    if (clip.z >= clip.w) {
+        return 1.0f;        // beyond the radius
+    }
+
+    // compared as distances along the axis of the face, clip.w for pos
+    float far = S.w;
+    float bias = 0.02f + 0.01f * clip.w;
+    vec2 origin = vec2(tile % SHADOW_TILES_PER_ROW, tile / SHADOW_TILES_PER_ROW) * SHADOW_TILE_SIZE;
+    vec2 texel = (clip.xy / clip.w * 0.5f + 0.5f) * SHADOW_TILE_SIZE;
+    float lit = 0.0f;
+    for (int i = 0; i < 4; i++) {
+        vec2 t = clamp(texel + vec2(i % 2, i / 2) - 0.5f, vec2(0.5f), vec2(SHADOW_TILE_SIZE - 0.5f));
+        float depth = texture(shadowAtlas, (origin + t) / (SHADOW_TILE_SIZE * SHADOW_TILES_PER_ROW)).r;
+        float distance = SHADOW_NEAR * far / (far - depth * (far - SHADOW_NEAR));
+        lit += distance + bias >= clip.w ? 0.25f : 0.0f;
+    }
+    return lit;
+}
+
+uint clusterIndex() {
+    float near = cu.screenNearFar.z, far = cu.screenNearFar.w;
+    float depth = -(cu.view * vec4(fragPos, 1.0)).z;
+    uvec2 tile = min(uvec2(gl_FragCoord.xy / cu.screenNearFar.xy * vec2(CLUSTERS_X, CLUSTERS_Y)),
+                     uvec2(CLUSTERS_X - 1, CLUSTERS_Y - 1));
+    float slice = log(max(depth, near) / near) / log(far / near);
+    uint z = min(uint(slice * CLUSTERS_Z), CLUSTERS_Z - 1);
+    return tile.x + CLUSTERS_X * (tile.y + CLUSTERS_Y * z);
+}
+
+void main() {
+    vec3 diffColor = ubo.materialColor;
+    if (TEXTURE) {
+        diffColor *= texture(texSampler, fragTexCoord).rgb;
+    }
+    const vec3  ambientColor = vec3(0.1f, 0.1f, 0.1f);
+    const vec3  specColor = vec3(1.0f, 1.0f, 1.0f);
+    const float specPower = 150.0f;
+
+    vec3 color = diffColor;
+    if (LIGHTING) {
+        vec3 N = normalize(fragNorm);
+        vec3 V = normalize(gubo.eyePos - fragPos);
+        vec3 ambient = ambientColor * diffColor;
+
+        vec3 lit = vec3(0.0f);
+        uint cluster = clusterIndex();
+        uint count = clusters[cluster].count;
+        for (uint i = 0; i < count; i++) {
+            uint index = clusters[cluster].lights[i];
+            PointLight L = lights[index];
+            vec3 toLight = L.positionRadius.xyz - fragPos;
+            float d = length(toLight);
+            vec3 lD = toLight / max(d, 1e-3f);
+            vec3 reflected = diffColor * max(dot(N, lD), 0.0f);
+            if (SPECULAR) {
+                reflected += specColor * pow(max(dot(-reflect(lD, N), V), 0.0f), specPower);
+            }
+            lit += L.colorIntensity.rgb * L.colorIntensity.a * attenuation(d, L.positionRadius.w)
+                 * reflected * shadow(index, fragPos);
+        }
+
+        color = 0.2f*ambient + 1.2*lit;
+    }
+    if (HIGHLIGHT) {
+        color += 0.5*ubo.highlightColor;
+    }
+
+    outColor = vec4(clamp(color, vec3(0.0f), vec3(1.0f)), 1.0f);
+}
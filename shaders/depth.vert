@@ -0,0 +1,30 @@
+#version 450
+
+// The depth of the level alone, for the depth pre-pass: reads the
+// position-only stream of the models. gl_Position must come out exactly
+// as in shader.vert, for the EQUAL test of the shading pass.
+// glslc depth.vert -o depth_vert.spv
+
+layout(set=0, binding = 0) uniform globalUniformBufferObject {
+	mat4 view;
+	mat4 proj;
+    float time;
+    vec3 eyePos;
+    vec3 cameraDir;
+    vec4 coneInOutDecayExp;
+} gubo;
+
+layout(set=1, binding = 0) uniform UniformBufferObject {
+    mat4 model;
+    int isFlowingColor;     // unused
+    vec3 highlightColor;
+    vec3 materialColor;
+} ubo;
+
+layout(location = 0) in vec3 pos;
+
+invariant gl_Position;
+
+void main() {
+	gl_Position = gubo.proj * gubo.view * ubo.model * vec4(pos, 1.0);
+}
@@ -0,0 +1,12 @@
+#version 450
+
+// Overdraw view: every fragment shaded adds the same small amount, with
+// additive blending, so the brighter a pixel the more times it was shaded;
+// red saturates after 8 fragments, green after 16 and blue after 32.
+// glslc overdraw.frag -o overdraw_frag.spv
+
+layout(location = 0) out vec4 outColor;
+
+void main() {
+	outColor = vec4(1.0 / 8.0, 1.0 / 16.0, 1.0 / 32.0, 0.0);
+}
@@ -1,5 +1,15 @@
 #version 450
 
+// glslc shader.frag -o frag.spv
+
+// The features of the material, one variant of the shader per combination
+// in use (ShaderFeature in MyProject.cpp): the code of those that are off
+// is compiled out of the variant, rather than branched over per fragment.
+layout(constant_id = 0) const bool TEXTURE = true;
+layout(constant_id = 1) const bool LIGHTING = true;
+layout(constant_id = 2) const bool SPECULAR = false;
+layout(constant_id = 3) const bool HIGHLIGHT = true;
+
 layout(set = 1, binding = 1) uniform sampler2D texSampler;
 
 layout(set=0, binding = 0) uniform globalUniformBufferObject {
@@ -13,17 +23,65 @@ layout(set=0, binding = 0) uniform globalUniformBufferObject {
 
 layout(set=1, binding = 0) uniform UniformBufferObject {
     mat4 model;
-    int isFlowingColor;
+    int isFlowingColor;     // unused
     vec3 highlightColor;
+    vec3 materialColor;
 } ubo;
 
-layout(location = 0) in vec3 fragViewDir;
+#define SHADOW_TILES_PER_ROW 8
+#define SHADOW_TILE_SIZE 512.0f
+#define SHADOW_SLOTS 10
+#define SHADOW_FACES 60
+#define SHADOW_NEAR 0.05f
+#define MAX_LIGHTS 1024
+
+layout(set = 2, binding = 0) uniform ShadowUniforms {
+    mat4 faceViewProj[SHADOW_FACES];
+    vec4 slots[SHADOW_SLOTS];
+    ivec4 lightSlots[MAX_LIGHTS / 4];
+} su;
+
+layout(set = 2, binding = 1) uniform sampler2D shadowAtlas;
+
 layout(location = 1) in vec3 fragNorm;
 layout(location = 2) in vec2 fragTexCoord;
 layout(location=3) in vec3 fragPos;
 
 layout(location = 0) out vec4 outColor;
 
+// 1 where the light reaches pos, 0 in its shadow, from the cube face of
+// the atlas that looks at pos; lights without a slot cast no shadow
+float shadow(uint light, vec3 pos) {
+    int slot = su.lightSlots[light / 4][light % 4];
+    if (slot < 0) {
+        return 1.0f;
+    }
+    vec4 S = su.slots[slot];
+    vec3 v = pos - S.xyz;
+    vec3 a = abs(v);
+    int face = a.x >= a.y && a.x >= a.z ? (v.x >= 0.0f ? 0 : 1) :
+               a.y >= a.z ? (v.y >= 0.0f ? 2 : 3) : (v.z >= 0.0f ? 4 : 5);
+    int tile = 6 * slot + face;
+    vec4 clip = su.faceViewProj[tile] * vec4(pos, 1.0f);
+    if (clip.z >= clip.w) {
+        return 1.0f;        // beyond the radius
+    }
+
+    // compared as distances along the axis of the face, clip.w for pos
+    float far = S.w;
+    float bias = 0.02f + 0.01f * clip.w;
+    vec2 origin = vec2(tile % SHADOW_TILES_PER_ROW, tile / SHADOW_TILES_PER_ROW) * SHADOW_TILE_SIZE;
+    vec2 texel = (clip.xy / clip.w * 0.5f + 0.5f) * SHADOW_TILE_SIZE;
+    float lit = 0.0f;
+    for (int i = 0; i < 4; i++) {
+        vec2 t = clamp(texel + vec2(i % 2, i / 2) - 0.5f, vec2(0.5f), vec2(SHADOW_TILE_SIZE - 0.5f));
+        float depth = texture(shadowAtlas, (origin + t) / (SHADOW_TILE_SIZE * SHADOW_TILES_PER_ROW)).r;
+        float distance = SHADOW_NEAR * far / (far - depth * (far - SHADOW_NEAR));
+        lit += distance + bias >= clip.w ? 0.25f : 0.0f;
+    }
+    return lit;
+}
+
 // we need to compute the direction from the light position (gubo.lightPosition) and the object position (pos)
 vec3 point_light_dir(vec3 pos, vec3 lightPos) {
     // Point light direction
@@ -41,27 +99,38 @@ vec3 point_light_color(vec3 pos, vec3 lightPos) {
 
 
 void main() {
-    
-    const vec3  diffColor = texture(texSampler, fragTexCoord).rgb;
+    vec3 diffColor = ubo.materialColor;
+    if (TEXTURE) {
+        diffColor *= texture(texSampler, fragTexCoord).rgb;
+    }
     const vec3  ambientColor = vec3(0.1f, 0.1f, 0.1f);
     const vec3  specColor = vec3(1.0f, 1.0f, 1.0f);
     const float specPower = 150.0f;
-    
-    vec3 N = normalize(fragNorm); // Normal vector
-    vec3 V = normalize(fragViewDir);  // View direction
-    
-    // ambient
-    vec3 ambient  = ambientColor * diffColor;
-    
-    //point light (torch of the character)
-    //vec3 p1_pos = vec3(4.20f, 12.70f, 0.37f);
-    vec3 p1_pos = gubo.eyePos + vec3(0.0f, 0.5f, 0.0f);
-    vec3 p1_lD = point_light_dir(fragPos, p1_pos);
-    vec3 p1_color = point_light_color(fragPos, p1_pos);
-    vec3 p1_specular = specColor * pow(max(dot(-reflect(p1_lD, N),V), 0.0f), specPower);
-    vec3 p1_diffuse = diffColor * max(dot(N,p1_lD), 0.0f);
-    vec3 p1_final = p1_color * (p1_diffuse); // using only diffuse right know
-
-    
-    outColor = vec4(clamp(0.2f*ambient + 1.2*p1_final + 0.5*ubo.highlightColor, vec3(0.0f), vec3(1.0f)), 1.0f);
+
+    vec3 color = diffColor;
+    if (LIGHTING) {
+        vec3 N = normalize(fragNorm); // Normal vector
+
+        // ambient
+        vec3 ambient  = ambientColor * diffColor;
+
+        //point light (torch of the character)
+        //vec3 p1_pos = vec3(4.20f, 12.70f, 0.37f);
+        vec3 p1_pos = gubo.eyePos + vec3(0.0f, 0.5f, 0.0f);
+        vec3 p1_lD = point_light_dir(fragPos, p1_pos);
+        vec3 p1_color = point_light_color(fragPos, p1_pos);
+        vec3 p1_reflected = diffColor * max(dot(N,p1_lD), 0.0f);
+        if (SPECULAR) {
+            vec3 V = normalize(gubo.eyePos - fragPos);  // View direction
+            p1_reflected += specColor * pow(max(dot(-reflect(p1_lD, N),V), 0.0f), specPower);
+        }
+        vec3 p1_final = p1_color * p1_reflected * shadow(0u, fragPos);
+
+        color = 0.2f*ambient + 1.2*p1_final;
+    }
+    if (HIGHLIGHT) {
+        color += 0.5*ubo.highlightColor;
+    }
+
+    outColor = vec4(clamp(color, vec3(0.0f), vec3(1.0f)), 1.0f);
 }
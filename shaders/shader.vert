@@ -1,5 +1,7 @@
 #version 450
 
+// glslc shader.vert -o vert.spv
+
 layout(set=0, binding = 0) uniform globalUniformBufferObject {
 	mat4 view;
 	mat4 proj;
@@ -11,22 +13,24 @@ layout(set=0, binding = 0) uniform globalUniformBufferObject {
 
 layout(set=1, binding = 0) uniform UniformBufferObject {
     mat4 model;
-    int isFlowingColor;
+    int isFlowingColor;     // unused
     vec3 highlightColor;
+    vec3 materialColor;
 } ubo;
 
 layout(location = 0) in vec3 pos;
 layout(location = 1) in vec3 norm;
 layout(location = 2) in vec2 texCoord;
 
-layout(location = 0) out vec3 fragViewDir;
 layout(location = 1) out vec3 fragNorm;
 layout(location = 2) out vec2 fragTexCoord;
 layout(location=3) out vec3 fragPos;
 
+// the depth pre-pass (depth.vert) computes it the same way
+invariant gl_Position;
+
 void main() {
 	gl_Position = gubo.proj * gubo.view * ubo.model * vec4(pos, 1.0);
-	fragViewDir  = (gubo.view[3]).xyz - (ubo.model * vec4(pos,  1.0)).xyz;
 	fragNorm     = (ubo.model * vec4(norm, 0.0)).xyz;
 	fragTexCoord = texCoord;
     fragPos = (ubo.model * vec4(pos, 1.0)).xyz;
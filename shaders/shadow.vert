@@ -0,0 +1,24 @@
+#version 450
+
+// The depth of the scene from a point light, into a face of the shadow
+// atlas: the instance index picks the face (see ShadowAtlas.hpp).
+// glslc shadow.vert -o shadow_vert.spv
+
+#define SHADOW_FACES 60
+
+layout(set = 0, binding = 0) uniform ShadowUniforms {
+    mat4 faceViewProj[SHADOW_FACES];
+} su;
+
+layout(set = 1, binding = 0) uniform UniformBufferObject {
+    mat4 model;
+    int isFlowingColor;     // unused
+    vec3 highlightColor;
+    vec3 materialColor;
+} ubo;
+
+layout(location = 0) in vec3 pos;
+
+void main() {
+    gl_Position = su.faceViewProj[gl_InstanceIndex] * ubo.model * vec4(pos, 1.0);
+}
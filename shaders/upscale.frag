@@ -0,0 +1,38 @@
+#version 450
+
+// The scene, drawn in the top left corner of the target, stretched over
+// the window: bilinear, then sharpened against the four neighbours, no
+// further than their range so that edges do not ring.
+// glslc upscale.frag -o upscale_frag.spv
+
+layout(set = 0, binding = 0) uniform sampler2D scene;
+
+layout(set = 0, binding = 1) uniform UpscaleUniforms {
+    vec4 uvScaleTexel;      // the part of the target drawn, and one texel
+    float sharpness;
+} uu;
+
+layout(location = 0) in vec2 fragUV;
+
+layout(location = 0) out vec4 outColor;
+
+vec3 fetch(vec2 uv) {
+    // not past the last texel drawn
+    vec2 halfTexel = 0.5 * uu.uvScaleTexel.zw;
+    return texture(scene, clamp(uv, halfTexel, uu.uvScaleTexel.xy - halfTexel)).rgb;
+}
+
+void main() {
+    vec2 uv = fragUV * uu.uvScaleTexel.xy;
+    vec2 texel = uu.uvScaleTexel.zw;
+    vec3 c = fetch(uv);
+    vec3 n = fetch(uv - vec2(0.0, texel.y));
+    vec3 s = fetch(uv + vec2(0.0, texel.y));
+    vec3 w = fetch(uv - vec2(texel.x, 0.0));
+    vec3 e = fetch(uv + vec2(texel.x, 0.0));
+
+    vec3 sharpened = c + uu.sharpness * (4.0 * c - n - s - w - e);
+    vec3 lo = min(c, min(min(n, s), min(w, e)));
+    vec3 hi = max(c, max(max(n, s), max(w, e)));
+    outColor = vec4(clamp(sharpened, lo, hi), 1.0);
+}
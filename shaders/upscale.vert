@@ -0,0 +1,12 @@
+#version 450
+
+// A triangle over the whole window, with no vertex buffer: the upscale of
+// dynamic resolution (see DynamicResolution.hpp).
+// glslc upscale.vert -o upscale_vert.spv
+
+layout(location = 0) out vec2 fragUV;
+
+void main() {
+    fragUV = vec2((gl_VertexIndex << 1) & 2, gl_VertexIndex & 2);
+    gl_Position = vec4(fragUV * 2.0 - 1.0, 0.0, 1.0);
+}
@@ -0,0 +1,254 @@
+// Bvh.hpp: ray hits on known triangles, raycast(), occluded() and
+// sweepSphere() against every triangle of the cave, a tree deeper than the
+// traversal's fixed stack, and the character controller against a wall.
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// the one translation unit with the OBJ loader
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+#include "Check.hpp"
+#include "Bvh.hpp"
+#include "Level.hpp"
+
+struct Mesh {
+	std::vector<glm::vec3> positions;
+	std::vector<uint32_t> indices;
+
+	void triangle(glm::vec3 a, glm::vec3 b, glm::vec3 c) {
+		uint32_t base = (uint32_t) positions.size();
+		positions.insert(positions.end(), {a, b, c});
+		indices.insert(indices.end(), {base, base + 1, base + 2});
+	}
+};
+
+// Random origins over the cave's bounds and random unit directions
+static void randomRays(int count, unsigned seed, std::vector<glm::vec3> &origins,
+					   std::vector<glm::vec3> &directions)
+{
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<float> x(-55.0f, 50.0f), y(-1.5f, 7.5f), z(-58.0f, 46.0f);
+	std::uniform_real_distribution<float> d(-1.0f, 1.0f);
+	for (int i = 0; i < count; i++) {
+		origins.push_back(glm::vec3(x(random), y(random), z(random)));
+		glm::vec3 direction;
+		do {
+			direction = glm::vec3(d(random), d(random), d(random));
+		} while (glm::length(direction) < 0.1f);
+		directions.push_back(glm::normalize(direction));
+	}
+}
+
+// BVH against brute force: the same rays hit, at the same distance
+static int rayDisagreements(const TriangleBvh &bvh, const std::vector<glm::vec3> &origins,
+							const std::vector<glm::vec3> &directions, float maxT)
+{
+	int wrong = 0;
+	for (size_t i = 0; i < origins.size(); i++) {
+		RayHit a, b;
+		bool hitA = bvh.raycast(origins[i], directions[i], maxT, a);
+		bool hitB = bvh.raycastBruteForce(origins[i], directions[i], maxT, b);
+		wrong += hitA != hitB || (hitA && std::fabs(a.t - b.t) > 1e-4f * std::max(1.0f, b.t));
+		wrong += bvh.occluded(origins[i], directions[i], maxT) != hitB;
+	}
+	return wrong;
+}
+
+static void testTriangle()
+{
+	Mesh M;
+	M.triangle({0.0f, 0.0f, 0.0f}, {4.0f, 0.0f, 0.0f}, {0.0f, 0.0f, 4.0f});
+	TriangleBvh bvh;
+	bvh.build(M.positions, M.indices);
+	CHECK(!bvh.empty());
+	CHECK(bvh.triangleCount() == 1);
+
+	// from above and from below: double sided, the normal facing the origin
+	RayHit hit;
+	CHECK(bvh.raycast({1.0f, 3.0f, 1.0f}, {0.0f, -1.0f, 0.0f}, INFINITY, hit));
+	CHECK_NEAR(hit.t, 3.0f, 1e-6);
+	CHECK(hit.triangle == 0);
+	CHECK_NEAR(hit.normal.y, 1.0f, 1e-6);
+	CHECK(bvh.raycast({1.0f, -2.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, INFINITY, hit));
+	CHECK_NEAR(hit.t, 2.0f, 1e-6);
+	CHECK_NEAR(hit.normal.y, -1.0f, 1e-6);
+	// beyond maxT, beside the hypotenuse, pointing away and parallel
+	CHECK(!bvh.raycast({1.0f, 3.0f, 1.0f}, {0.0f, -1.0f, 0.0f}, 2.5f, hit));
+	CHECK(!bvh.occluded({1.0f, 3.0f, 1.0f}, {0.0f, -1.0f, 0.0f}, 2.5f));
+	CHECK(!bvh.raycast({2.5f, 3.0f, 2.5f}, {0.0f, -1.0f, 0.0f}, INFINITY, hit));
+	CHECK(!bvh.raycast({1.0f, 3.0f, 1.0f}, {0.0f, 1.0f, 0.0f}, INFINITY, hit));
+	CHECK(!bvh.raycast({-1.0f, 0.0f, 1.0f}, {1.0f, 0.0f, 0.0f}, INFINITY, hit));
+
+	float height;
+	CHECK(bvh.groundHeight({1.0f, 1.5f, 1.0f}, 2.0f, height));
+	CHECK_NEAR(height, 0.0f, 1e-6);
+	CHECK(!bvh.groundHeight({1.0f, 1.5f, 1.0f}, 1.0f, height));
+
+	TriangleBvh none;
+	none.build({}, {});
+	SweepHit sweep;
+	CHECK(none.empty());
+	CHECK(!none.raycast({0.0f, 1.0f, 0.0f}, {0.0f, -1.0f, 0.0f}, INFINITY, hit));
+	CHECK(!none.sweepSphere({0.0f, 1.0f, 0.0f}, 0.5f, {0.0f, -2.0f, 0.0f}, sweep));
+}
+
+static void testSweep()
+{
+	Mesh M;
+	M.triangle({-4.0f, 0.0f, -4.0f}, {4.0f, 0.0f, -4.0f}, {0.0f, 0.0f, 4.0f});
+	TriangleBvh bvh;
+	bvh.build(M.positions, M.indices);
+	SweepHit hit;
+
+	// onto the face: contact when the centre is a radius above it
+	CHECK(bvh.sweepSphere({0.0f, 2.0f, 0.0f}, 0.5f, {0.0f, -2.0f, 0.0f}, hit));
+	CHECK_NEAR(hit.t, 0.75f, 1e-5);
+	CHECK_NEAR(hit.normal.y, 1.0f, 1e-5);
+	CHECK_NEAR(hit.point.y, 0.0f, 1e-5);
+	// ending with the centre above the face's bounds, so culling has to
+	// grow the swept box by the radius
+	CHECK(bvh.sweepSphere({0.0f, 1.0f, 0.0f}, 0.5f, {0.0f, -0.6f, 0.0f}, hit));
+	CHECK_NEAR(hit.t, 0.5f / 0.6f, 1e-5);
+	// onto the vertex at (0, 0, 4) from beyond the triangle, where the
+	// plane is reached outside it: |(0, 3 - 4t, 2 - 2t)| = 0.5 at t = 0.75
+	CHECK(bvh.sweepSphere({0.0f, 3.0f, 6.0f}, 0.5f, {0.0f, -4.0f, -2.0f}, hit));
+	CHECK_NEAR(hit.t, 0.75f, 1e-5);
+	CHECK_NEAR(hit.point.y, 0.0f, 1e-5);
+	CHECK_NEAR(hit.point.z, 4.0f, 1e-5);
+	// too short, moving away, and resting on it while sliding along: only
+	// what the sphere moves towards counts
+	CHECK(!bvh.sweepSphere({0.0f, 2.0f, 0.0f}, 0.5f, {0.0f, -1.0f, 0.0f}, hit));
+	CHECK(!bvh.sweepSphere({0.0f, 2.0f, 0.0f}, 0.5f, {0.0f, 1.0f, 0.0f}, hit));
+	CHECK(!bvh.sweepSphere({0.0f, 0.5f, 0.0f}, 0.5f, {1.0f, 0.0f, 0.0f}, hit));
+}
+
+// The cave: rays and sweeps against every triangle, with the tree built
+// on one thread and on all of them
+static void testCave()
+{
+	Mesh M;
+	NavMesh::loadObj("models/newcave.obj", M.positions, M.indices);
+	std::vector<glm::vec3> origins, directions;
+	randomRays(5000, 2468, origins, directions);
+	for (unsigned threads : {1u, 0u}) {
+		TriangleBvh bvh;
+		bvh.build(M.positions, M.indices, threads);
+		CHECK(bvh.triangleCount() == M.indices.size() / 3);
+		CHECK(rayDisagreements(bvh, origins, directions, INFINITY) == 0);
+		CHECK(rayDisagreements(bvh, origins, directions, 10.0f) == 0);
+	}
+
+	// a sweep against each triangle alone is the brute force
+	TriangleBvh bvh;
+	bvh.build(M.positions, M.indices);
+	std::vector<TriangleBvh> single(M.indices.size() / 3);
+	for (size_t t = 0; t < single.size(); t++) {
+		Mesh T;
+		T.triangle(M.positions[M.indices[3 * t]], M.positions[M.indices[3 * t + 1]],
+				   M.positions[M.indices[3 * t + 2]]);
+		single[t].build(T.positions, T.indices, 1);
+	}
+	int wrong = 0, hits = 0;
+	for (size_t i = 0; i < 1000; i++) {
+		SweepHit hit, exact;
+		bool found = bvh.sweepSphere(origins[i], CAPSULE_RADIUS, directions[i] * 2.0f, hit);
+		bool exactFound = false;
+		exact.t = 1.0f;
+		for (const TriangleBvh &T : single) {
+			SweepHit one;
+			if (T.sweepSphere(origins[i], CAPSULE_RADIUS, directions[i] * 2.0f, one) && one.t < exact.t) {
+				exact = one;
+				exactFound = true;
+			}
+		}
+		wrong += found != exactFound || (found && std::fabs(hit.t - exact.t) > 1e-5f);
+		hits += found;
+	}
+	CHECK(wrong == 0);
+	CHECK(hits > 0);
+}
+
+// Triangles at exponentially shrinking distances from the origin along
+// each axis in turn: the surface area heuristic peels them off a few at a
+// time, which makes a tree deeper than STACK_SIZE for the traversals
+static void testDeepTree()
+{
+	Mesh M;
+	uint32_t closest = 0;
+	for (int axis = 0; axis < 3; axis++) {
+		glm::vec3 u(0.0f), v(0.0f);
+		u[(axis + 1) % 3] = 1.0f;
+		v[(axis + 2) % 3] = 1.0f;
+		for (float distance = 1e18f; distance > 1e-30f; distance *= 0.25f) {
+			glm::vec3 corner(0.0f);
+			corner[axis] = distance;
+			if (axis == 0) {
+				closest = (uint32_t) M.indices.size() / 3;
+			}
+			M.triangle(corner, corner + u, corner + v);
+		}
+	}
+	TriangleBvh bvh;
+	bvh.build(M.positions, M.indices, 1);
+	CHECK(bvh.treeDepth() >= TriangleBvh::STACK_SIZE);
+
+	std::vector<glm::vec3> origins, directions;
+	std::mt19937 random(13);
+	std::uniform_real_distribution<float> u(-0.5f, 0.5f);
+	for (int i = 0; i < 5000; i++) {
+		origins.push_back({u(random), u(random), u(random)});
+		glm::vec3 direction;
+		do {
+			direction = glm::vec3(u(random), u(random), u(random));
+		} while (glm::length(direction) < 0.05f);
+		directions.push_back(glm::normalize(direction));
+	}
+	CHECK(rayDisagreements(bvh, origins, directions, INFINITY) == 0);
+	RayHit hit;
+	CHECK(bvh.raycast({-0.5f, 0.25f, 0.25f}, {1.0f, 0.0f, 0.0f}, INFINITY, hit));
+	CHECK(hit.triangle == closest);
+	SweepHit sweep;
+	CHECK(bvh.sweepSphere({-0.5f, 0.25f, 0.25f}, 0.1f, {1.0f, 0.0f, 0.0f}, sweep));
+	CHECK_NEAR(sweep.t, 0.4f, 1e-5);
+}
+
+// Walking into a wall at 45 degrees slides along it and stays a radius away
+static void testMoveAndSlide()
+{
+	Mesh M;
+	M.triangle({0.0f, -10.0f, -10.0f}, {0.0f, 10.0f, -10.0f}, {0.0f, -10.0f, 10.0f});
+	M.triangle({0.0f, 10.0f, -10.0f}, {0.0f, 10.0f, 10.0f}, {0.0f, -10.0f, 10.0f});
+	TriangleBvh bvh;
+	bvh.build(M.positions, M.indices);
+	glm::vec3 a(0.0f, -0.5f, 0.0f), b(0.0f, 0.5f, 0.0f);
+	glm::vec3 end = bvh.moveAndSlide({-1.0f, 0.0f, 0.0f}, a, b, 0.25f, {2.0f, 0.0f, 2.0f});
+	CHECK(end.x < -0.25f + 1e-3f && end.x > -0.25f - 2e-3f);
+	CHECK(end.z > 1.0f);
+	CHECK_NEAR(end.y, 0.0f, 1e-5);
+	// nothing in the way
+	glm::vec3 free = bvh.moveAndSlide({-1.0f, 0.0f, 0.0f}, a, b, 0.25f, {-2.0f, 0.0f, 2.0f});
+	CHECK_NEAR(free.x, -3.0f, 1e-5);
+	CHECK_NEAR(free.z, 2.0f, 1e-5);
+}
+
+int main()
+{
+	try
+	{
+		testTriangle();
+		testSweep();
+		testCave();
+		testDeepTree();
+		testMoveAndSlide();
+	}
+	catch (const std::exception &e)
+	{
+		CHECK(!"exception thrown");
+		std::fprintf(stderr, "%s\n", e.what());
+	}
+	return checkResults("BvhTests");
+}
@@ -0,0 +1,54 @@
+// The checks of the unit tests. Every tests/*Tests.cpp is an executable of
+// its own, with no window nor Vulkan device, run from the root of the
+// repository (some read models/ and scenes/):
+//
+//   g++ -std=c++17 -O1 -I. -Iheaders tests/CollisionTests.cpp -o collision-tests -pthread
+//   ./collision-tests
+//
+// A failed CHECK prints where it is and the test goes on with the next
+// one; main returns checkResults(), non-zero if any failed.
+
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "Logger.hpp"
+
+inline int &checkCount() {
+	static int count = 0;
+	return count;
+}
+
+inline int &checkFailures() {
+	static int failures = 0;
+	return failures;
+}
+
+#define CHECK(condition) \
+	do { \
+		checkCount()++; \
+		if (!(condition)) { \
+			checkFailures()++; \
+			std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+		} \
+	} while (0)
+
+#define CHECK_NEAR(a, b, tolerance) \
+	do { \
+		checkCount()++; \
+		double checkA = (a), checkB = (b); \
+		if (!(std::fabs(checkA - checkB) <= (tolerance))) { \
+			checkFailures()++; \
+			std::fprintf(stderr, "%s:%d: CHECK_NEAR(%s, %s) failed: %g and %g\n", \
+						 __FILE__, __LINE__, #a, #b, checkA, checkB); \
+		} \
+	} while (0)
+
+inline int checkResults(const char *tests) {
+	// what the code under test logged, before the verdict
+	Logger::get().flush();
+	std::printf("%s: %d checks, %d failed\n", tests, checkCount(), checkFailures());
+	return checkFailures() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
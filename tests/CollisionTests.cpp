@@ -0,0 +1,232 @@
+// Collision.hpp: the exact orientation, PolygonGrid against the
+// brute-force test, the tutorial's segment test, and the batch kernels at
+// every SIMD level against the scalar ones.
+
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "Check.hpp"
+#include "Collision.hpp"
+#include "Level.hpp"
+
+static void testOrientation()
+{
+	CHECK(orient2d({0.0f, 0.0f}, {1.0f, 0.0f}, {0.0f, 1.0f}) == 1);
+	CHECK(orient2d({0.0f, 0.0f}, {0.0f, 1.0f}, {1.0f, 0.0f}) == -1);
+	CHECK(orient2d({0.0f, 0.0f}, {1.0f, 1.0f}, {2.0f, 2.0f}) == 0);
+	// collinear far from the origin, and off the line by one ulp
+	CHECK(orient2d({1000.25f, 1000.25f}, {2000.5f, 2000.5f}, {3000.75f, 3000.75f}) == 0);
+	CHECK(orient2d({0.5f, 0.5f}, {12.0f, 12.0f}, {24.0f, std::nextafter(24.0f, 25.0f)}) == 1);
+	CHECK(orient2d({0.5f, 0.5f}, {12.0f, 12.0f}, {24.0f, std::nextafter(24.0f, 23.0f)}) == -1);
+}
+
+static void testSquare()
+{
+	Point square[] = {{0.0f, 0.0f}, {10.0f, 0.0f}, {10.0f, 10.0f}, {0.0f, 10.0f}};
+	PolygonGrid grid(square, 4);
+	CHECK(!grid.empty());
+	CHECK(grid.contains({5.0f, 5.0f}));
+	CHECK(grid.contains({0.001f, 9.999f}));
+	CHECK(!grid.contains({-0.001f, 5.0f}));
+	CHECK(!grid.contains({5.0f, 10.001f}));
+	CHECK(!grid.contains({50.0f, 50.0f}));
+	// the boundary counts as inside, vertices included
+	CHECK(grid.contains({10.0f, 5.0f}));
+	CHECK(grid.contains({5.0f, 0.0f}));
+	CHECK(grid.contains({0.0f, 0.0f}));
+	CHECK(grid.contains({10.0f, 10.0f}));
+}
+
+// a U open upwards: the notch is outside though within the bounding box
+static void testConcave()
+{
+	Point u[] = {{0.0f, 0.0f}, {9.0f, 0.0f}, {9.0f, 9.0f}, {6.0f, 9.0f},
+				 {6.0f, 3.0f}, {3.0f, 3.0f}, {3.0f, 9.0f}, {0.0f, 9.0f}};
+	PolygonGrid grid(u, 8);
+	CHECK(grid.contains({1.5f, 8.0f}));
+	CHECK(grid.contains({7.5f, 8.0f}));
+	CHECK(grid.contains({4.5f, 1.5f}));
+	CHECK(!grid.contains({4.5f, 6.0f}));
+	CHECK(grid.contains({4.5f, 3.0f}));
+	CHECK(grid.contains({3.0f, 6.0f}));
+	CHECK(!grid.contains({4.5f, 9.0f}));
+}
+
+static void testDegenerate()
+{
+	Point segment[] = {{0.0f, 0.0f}, {1.0f, 1.0f}};
+	PolygonGrid grid(segment, 2);
+	CHECK(grid.empty());
+	CHECK(!grid.contains({0.5f, 0.5f}));
+	CHECK(!grid.containsBruteForce({0.5f, 0.5f}));
+}
+
+// An L whose edges lie on cell boundaries at some resolutions: the points
+// on every cell boundary and between them, against the known answer
+static void testCellBoundaries()
+{
+	Point l[] = {{0.0f, 0.0f}, {8.0f, 0.0f}, {8.0f, 4.0f}, {4.0f, 4.0f}, {4.0f, 8.0f}, {0.0f, 8.0f}};
+	auto expected = [](Point p) {
+		return (p.x >= 0.0f && p.x <= 8.0f && p.y >= 0.0f && p.y <= 4.0f) ||
+			   (p.x >= 0.0f && p.x <= 4.0f && p.y >= 0.0f && p.y <= 8.0f);
+	};
+	for (float cellsPerEdge : {0.1f, 1.0f, 4.0f, 16.0f}) {
+		PolygonGrid grid(l, 6, cellsPerEdge);
+		float cellWidth = 8.0f / grid.gridColumns(), cellHeight = 8.0f / grid.gridRows();
+		std::vector<float> xs, ys;
+		for (int i = -1; i <= grid.gridColumns() + 1; i++) {
+			xs.insert(xs.end(), {i * cellWidth, i * cellWidth + cellWidth * 0.5f,
+								 std::nextafter(i * cellWidth, -1.0f), std::nextafter(i * cellWidth, 9.0f)});
+		}
+		for (int i = -1; i <= grid.gridRows() + 1; i++) {
+			ys.insert(ys.end(), {i * cellHeight, i * cellHeight + cellHeight * 0.5f,
+								 std::nextafter(i * cellHeight, -1.0f), std::nextafter(i * cellHeight, 9.0f)});
+		}
+		xs.insert(xs.end(), {4.0f, std::nextafter(4.0f, 0.0f), std::nextafter(4.0f, 8.0f)});
+		ys.insert(ys.end(), {4.0f, std::nextafter(4.0f, 0.0f), std::nextafter(4.0f, 8.0f)});
+		int wrong = 0;
+		for (float x : xs) {
+			for (float y : ys) {
+				wrong += grid.contains({x, y}) != expected({x, y});
+				wrong += grid.containsBruteForce({x, y}) != expected({x, y});
+			}
+		}
+		CHECK(wrong == 0);
+	}
+}
+
+// the level polygons on random points, their vertices and the batch
+static void testLevels()
+{
+	const std::vector<Point> levels[] = {
+		{std::begin(polygonFirstLevel), std::end(polygonFirstLevel)},
+		{std::begin(polygonSecondLevel), std::end(polygonSecondLevel)},
+		{std::begin(doorVertices), std::end(doorVertices)}};
+	for (const std::vector<Point> &polygon : levels) {
+		PolygonGrid grid(polygon.data(), polygon.size());
+		std::vector<Point> points = randomPointsAround(polygon, 100000, 42);
+		std::vector<uint8_t> batch(points.size());
+		grid.containsBatch(points.data(), points.size(), batch.data());
+		int disagree = 0, batchDisagree = 0, inside = 0;
+		for (size_t i = 0; i < points.size(); i++) {
+			bool exact = grid.containsBruteForce(points[i]);
+			disagree += grid.contains(points[i]) != exact;
+			batchDisagree += (batch[i] != 0) != exact;
+			inside += exact;
+		}
+		CHECK(disagree == 0);
+		CHECK(batchDisagree == 0);
+		CHECK(inside > 0 && inside < (int) points.size());
+		int verticesOutside = 0;
+		for (const Point &p : polygon) {
+			verticesOutside += !grid.contains(p);
+		}
+		CHECK(verticesOutside == 0);
+	}
+}
+
+static void testSegments()
+{
+	// crossing, apart, touching at an end, collinear overlapping and apart
+	CHECK(doIntersect({0.0f, 0.0f}, {10.0f, 10.0f}, {0.0f, 10.0f}, {10.0f, 0.0f}));
+	CHECK(!doIntersect({0.0f, 0.0f}, {10.0f, 0.0f}, {0.0f, 1.0f}, {10.0f, 1.0f}));
+	CHECK(doIntersect({0.0f, 0.0f}, {10.0f, 0.0f}, {10.0f, 0.0f}, {10.0f, 5.0f}));
+	CHECK(doIntersect({0.0f, 0.0f}, {10.0f, 0.0f}, {5.0f, 0.0f}, {15.0f, 0.0f}));
+	CHECK(!doIntersect({0.0f, 0.0f}, {10.0f, 0.0f}, {11.0f, 0.0f}, {15.0f, 0.0f}));
+}
+
+// Every level the CPU has must give exactly the scalar answers. The kernels
+// go through the edges a register at a time, so the polygons are the levels
+// and random star-shaped ones with every edge count up to a few registers,
+// which covers each tail length; the batches are random points and steps,
+// of several lengths, at offsets that misalign the arrays
+static void testSimdLevels()
+{
+	std::vector<std::vector<Point>> polygons = {
+		{std::begin(polygonFirstLevel), std::end(polygonFirstLevel)},
+		{std::begin(polygonSecondLevel), std::end(polygonSecondLevel)},
+		{std::begin(doorVertices), std::end(doorVertices)}};
+	std::mt19937 random(91);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	for (size_t count = 3; count <= 3 * PolygonEdgesSoA::WIDTH + 1; count++) {
+		std::vector<float> angles;
+		for (size_t i = 0; i < count; i++) {
+			angles.push_back(unit(random) * 6.2831853f);
+		}
+		std::sort(angles.begin(), angles.end());
+		std::vector<Point> star;
+		for (float angle : angles) {
+			float radius = 2.0f + 8.0f * unit(random);
+			star.push_back({radius * std::cos(angle), radius * std::sin(angle)});
+		}
+		polygons.push_back(star);
+	}
+	std::uniform_real_distribution<float> step(-2.0f, 2.0f);
+	std::vector<size_t> lengths = {0, 1, 2, 3, 7, 8, 9, 4099};
+	for (const std::vector<Point> &polygon : polygons) {
+		PolygonEdgesSoA edges;
+		edges.build(polygon.data(), polygon.size());
+		std::vector<Point> points = randomPointsAround(polygon, 8192, 17);
+		std::vector<float> x0, y0, x1, y1;
+		for (const Point &p : points) {
+			x0.push_back(p.x);
+			y0.push_back(p.y);
+			x1.push_back(p.x + step(random));
+			y1.push_back(p.y + step(random));
+		}
+		// segments ending on the vertices and points on them
+		for (size_t i = 0; i < polygon.size(); i++) {
+			x0[i] = x1[i + polygon.size()] = polygon[i].x;
+			y0[i] = y1[i + polygon.size()] = polygon[i].y;
+		}
+		int inside = 0, hit = 0;
+		int insideDifferences[3] = {}, hitDifferences[3] = {};
+		for (size_t n : lengths) {
+			for (size_t offset : {(size_t) 0, (size_t) 1, (size_t) 3}) {
+				std::vector<uint8_t> scalarInside(n + 1, 2), scalarHit(n + 1, 2);
+				pointsInPolygon(edges, &x0[offset], &y0[offset], n, scalarInside.data(), SIMD_SCALAR);
+				segmentsHitPolygon(edges, &x0[offset], &y0[offset], &x1[offset], &y1[offset],
+								   n, scalarHit.data(), SIMD_SCALAR);
+				// nothing written past the end
+				CHECK(scalarInside[n] == 2 && scalarHit[n] == 2);
+				for (size_t i = 0; i < n; i++) {
+					inside += scalarInside[i] != 0;
+					hit += scalarHit[i] != 0;
+				}
+				for (int level = SIMD_SSE2; level <= bestSimdLevel(); level++) {
+					std::vector<uint8_t> levelInside(n + 1, 2), levelHit(n + 1, 2);
+					pointsInPolygon(edges, &x0[offset], &y0[offset], n, levelInside.data(), (SimdLevel) level);
+					segmentsHitPolygon(edges, &x0[offset], &y0[offset], &x1[offset], &y1[offset],
+									   n, levelHit.data(), (SimdLevel) level);
+					insideDifferences[level] += levelInside != scalarInside;
+					hitDifferences[level] += levelHit != scalarHit;
+				}
+			}
+		}
+		for (int level = SIMD_SSE2; level <= bestSimdLevel(); level++) {
+			CHECK(insideDifferences[level] == 0);
+			CHECK(hitDifferences[level] == 0);
+		}
+		// both answers occur
+		CHECK(inside > 0 && hit > 0);
+	}
+	if (bestSimdLevel() < SIMD_AVX2) {
+		std::printf("best SIMD level %s: the levels above it are not tested\n",
+					simdLevelName(bestSimdLevel()));
+	}
+}
+
+int main()
+{
+	testOrientation();
+	testSquare();
+	testConcave();
+	testDegenerate();
+	testCellBoundaries();
+	testLevels();
+	testSegments();
+	testSimdLevels();
+	return checkResults("CollisionTests");
+}
@@ -0,0 +1,244 @@
+// NavMesh.hpp: which triangles become floor, that neighbour links are
+// valid steps and that regions are what they reach, locate() and
+// walkable(), the binary cache, and the floor of the cave.
+
+#include <cstdio>
+#include <set>
+#include <vector>
+
+// the one translation unit with the OBJ loader
+#define TINYOBJLOADER_IMPLEMENTATION
+#include "tiny_obj_loader.h"
+
+#include "Check.hpp"
+#include "NavMesh.hpp"
+#include "Level.hpp"
+
+// Quads with vertices of their own, so that shared edges must be welded
+struct Geometry {
+	std::vector<glm::vec3> positions;
+	std::vector<uint32_t> indices;
+
+	void quad(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 d) {
+		uint32_t base = (uint32_t) positions.size();
+		positions.insert(positions.end(), {a, b, c, d});
+		// with the corners at (x0, z0), (x1, z0), (x1, z1), (x0, z1) these
+		// two face up
+		indices.insert(indices.end(), {base, base + 2, base + 1, base, base + 3, base + 2});
+	}
+
+	// horizontal at height y, or rising from y0 at x0 to y1 at x1
+	void floor(float x0, float z0, float x1, float z1, float y0, float y1) {
+		quad({x0, y0, z0}, {x1, y1, z0}, {x1, y1, z1}, {x0, y0, z1});
+	}
+};
+
+// Every link leads to a triangle sharing the two vertices of the edge and
+// linking back, and a region is exactly what the links reach
+static void checkLinks(const NavMesh &mesh)
+{
+	int broken = 0, asymmetric = 0;
+	for (uint32_t t = 0; t < mesh.triangles.size(); t++) {
+		const NavMesh::Triangle &T = mesh.triangles[t];
+		for (int k = 0; k < 3; k++) {
+			int32_t n = T.neighbour[k];
+			if (n < 0) {
+				continue;
+			}
+			const NavMesh::Triangle &N = mesh.triangles[n];
+			std::set<uint32_t> shared = {N.v[0], N.v[1], N.v[2]};
+			broken += !shared.count(T.v[k]) || !shared.count(T.v[(k + 1) % 3]) ||
+					  N.region != T.region;
+			asymmetric += N.neighbour[0] != (int32_t) t && N.neighbour[1] != (int32_t) t &&
+						  N.neighbour[2] != (int32_t) t;
+		}
+	}
+	CHECK(broken == 0);
+	CHECK(asymmetric == 0);
+
+	int wrongRegions = 0;
+	for (uint32_t start = 0; start < mesh.triangles.size(); start++) {
+		std::vector<bool> reached(mesh.triangles.size(), false);
+		std::vector<uint32_t> stack = {start};
+		reached[start] = true;
+		while (!stack.empty()) {
+			const NavMesh::Triangle &T = mesh.triangles[stack.back()];
+			stack.pop_back();
+			for (int32_t n : T.neighbour) {
+				if (n >= 0 && !reached[n]) {
+					reached[n] = true;
+					stack.push_back((uint32_t) n);
+				}
+			}
+		}
+		for (uint32_t t = 0; t < mesh.triangles.size(); t++) {
+			wrongRegions += reached[t] != mesh.connected((int) start, (int) t);
+		}
+	}
+	CHECK(wrongRegions == 0);
+}
+
+// Two floors joined by a ramp, an island, a wall, a slope too steep, a
+// storey above the first floor and a roof above maxHeight
+static Geometry testGeometry()
+{
+	Geometry G;
+	G.floor(0.0f, 0.0f, 4.0f, 4.0f, 0.0f, 0.0f);
+	G.floor(4.0f, 0.0f, 8.0f, 4.0f, 0.0f, 1.0f);
+	G.floor(8.0f, 0.0f, 12.0f, 4.0f, 1.0f, 1.0f);
+	G.floor(20.0f, 0.0f, 24.0f, 4.0f, 0.0f, 0.0f);
+	G.quad({12.0f, 1.0f, 0.0f}, {12.0f, 4.0f, 0.0f}, {12.0f, 4.0f, 4.0f}, {12.0f, 1.0f, 4.0f});
+	G.floor(12.0f, 0.0f, 14.0f, 4.0f, 1.0f, 5.0f);
+	G.floor(0.0f, 0.0f, 4.0f, 4.0f, 5.0f, 5.0f);
+	G.floor(0.0f, 0.0f, 4.0f, 4.0f, 20.0f, 20.0f);
+	return G;
+}
+
+static NavMeshConfig testConfig()
+{
+	NavMeshConfig config;
+	config.maxSlopeDegrees = 30.0f;
+	config.maxHeight = 10.0f;
+	config.cellSize = 1.5f;
+	return config;
+}
+
+static void testBuild()
+{
+	Geometry G = testGeometry();
+	NavMesh mesh;
+	mesh.build(G.positions, G.indices, testConfig());
+	// the two floors, the ramp, the island and the storey
+	CHECK(mesh.triangles.size() == 10);
+	CHECK(mesh.regionCount == 3);
+	checkLinks(mesh);
+
+	int first = mesh.locate(2.0f, 2.0f, 0.0f, 1.0f);
+	int ramp = mesh.locate(6.0f, 2.0f, 0.5f, 1.0f);
+	int second = mesh.locate(10.0f, 2.0f, 1.0f, 1.0f);
+	int island = mesh.locate(22.0f, 2.0f, 0.0f, 1.0f);
+	int storey = mesh.locate(2.0f, 2.0f, 4.0f, 2.0f);
+	CHECK(first >= 0 && ramp >= 0 && second >= 0 && island >= 0 && storey >= 0);
+	if (first < 0 || ramp < 0 || second < 0 || island < 0 || storey < 0) {
+		return;
+	}
+	CHECK(mesh.connected(first, second));
+	CHECK(mesh.connected(first, ramp));
+	CHECK(!mesh.connected(first, island));
+	CHECK(!mesh.connected(first, storey));
+	CHECK(!mesh.connected(first, -1));
+	CHECK(storey != first);
+	CHECK_NEAR(mesh.heightAt(storey, 2.0f, 2.0f), 5.0f, 1e-5);
+	CHECK_NEAR(mesh.heightAt(ramp, 6.0f, 2.0f), 0.5f, 1e-5);
+	int rampSide = mesh.locate(7.0f, 1.0f, 0.0f, 1.0f);
+	CHECK(mesh.connected(ramp, rampSide));
+	CHECK_NEAR(mesh.heightAt(rampSide, 7.0f, 1.0f), 0.75f, 1e-5);
+
+	// too far from any floor, beside the mesh, over the wall and the steep slope
+	CHECK(mesh.locate(2.0f, 2.0f, 2.5f, 1.0f) < 0);
+	CHECK(mesh.locate(-1.0f, 2.0f, 0.0f) < 0);
+	CHECK(mesh.locate(16.0f, 2.0f, 0.0f) < 0);
+	CHECK(mesh.locate(13.0f, 2.0f, 3.0f, 1.0f) < 0);
+	// the roof is above maxHeight
+	CHECK(mesh.locate(2.0f, 2.0f, 20.0f, 1.0f) < 0);
+}
+
+static void testWalkable()
+{
+	Geometry G = testGeometry();
+	NavMesh mesh;
+	mesh.build(G.positions, G.indices, testConfig());
+	CHECK(mesh.walkable(2.0f, 2.0f, 0.0f, 1.0f, 0.25f));
+	// the joint with the ramp is not a boundary
+	CHECK(mesh.walkable(4.0f, 2.0f, 0.0f, 1.0f, 0.25f));
+	CHECK(mesh.walkable(11.5f, 2.0f, 1.0f, 1.0f, 0.25f));
+	// near the outer edges, the foot of the wall, and on the storey's
+	CHECK(!mesh.walkable(0.1f, 2.0f, 0.0f, 1.0f, 0.25f));
+	CHECK(mesh.walkable(0.1f, 2.0f, 0.0f, 1.0f, 0.0f));
+	CHECK(!mesh.walkable(11.9f, 2.0f, 1.0f, 1.0f, 0.25f));
+	CHECK(!mesh.walkable(6.0f, 3.9f, 0.5f, 1.0f, 0.25f));
+	CHECK(!mesh.walkable(3.9f, 2.0f, 5.0f, 1.0f, 0.25f));
+	CHECK_NEAR(mesh.boundaryDistance(2.0f, 1.0f, mesh.regionOf(mesh.locate(2.0f, 1.0f, 0.0f)), 10.0f),
+			   1.0f, 1e-5);
+}
+
+static void testCache()
+{
+	Geometry G = testGeometry();
+	NavMesh mesh;
+	mesh.build(G.positions, G.indices, testConfig());
+	const char *file = "navmesh_tests.bin";
+	CHECK(mesh.save(file, 1234));
+
+	NavMesh loaded;
+	CHECK(!loaded.load(file, 4321, testConfig().cellSize));
+	CHECK(loaded.triangles.empty());
+	CHECK(loaded.load(file, 1234, testConfig().cellSize));
+	CHECK(loaded.vertices == mesh.vertices);
+	CHECK(loaded.triangles.size() == mesh.triangles.size());
+	CHECK(loaded.regionCount == mesh.regionCount);
+	int differences = 0;
+	for (size_t t = 0; t < mesh.triangles.size() && t < loaded.triangles.size(); t++) {
+		differences += std::memcmp(&mesh.triangles[t], &loaded.triangles[t], sizeof(NavMesh::Triangle)) != 0;
+	}
+	CHECK(differences == 0);
+	CHECK(loaded.locate(10.0f, 2.0f, 1.0f, 1.0f) == mesh.locate(10.0f, 2.0f, 1.0f, 1.0f));
+	CHECK(loaded.walkable(2.0f, 2.0f, 0.0f, 1.0f, 0.25f));
+
+	// cut short, and missing
+	std::vector<char> bytes;
+	{
+		std::ifstream in(file, std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	{
+		std::ofstream out(file, std::ios::binary);
+		out.write(bytes.data(), bytes.size() - 10);
+	}
+	CHECK(!NavMesh().load(file, 1234, 1.0f));
+	std::remove(file);
+	CHECK(!NavMesh().load(file, 1234, 1.0f));
+}
+
+// The floor of newcave.obj: its links, and agreement with the first level's
+// polygon (98% on the micro-benchmark's points), built and from the cache
+static void testCave()
+{
+	const char *file = "navmesh_tests_cave.bin";
+	std::remove(file);
+	NavMesh built, cached;
+	CHECK(!built.loadOrBuild("models/newcave.obj", file, caveNavMeshConfig()));
+	CHECK(cached.loadOrBuild("models/newcave.obj", file, caveNavMeshConfig()));
+	std::remove(file);
+	CHECK(built.regionCount > 0);
+	CHECK(cached.triangles.size() == built.triangles.size());
+	checkLinks(built);
+
+	PolygonGrid area(polygonFirstLevel, sizeof(polygonFirstLevel) / sizeof(polygonFirstLevel[0]));
+	std::vector<Point> points = randomPointsAround(area.polygon(), 20000, 7);
+	int agree = 0, cachedAgree = 0;
+	for (const Point &p : points) {
+		bool walkable = built.walkable(p.x, p.y, 1.0f - EYE_HEIGHT, 1.5f, NAVMESH_RADIUS);
+		agree += walkable == area.contains(p);
+		cachedAgree += walkable == cached.walkable(p.x, p.y, 1.0f - EYE_HEIGHT, 1.5f, NAVMESH_RADIUS);
+	}
+	CHECK(agree > 0.95 * points.size());
+	CHECK(cachedAgree == (int) points.size());
+}
+
+int main()
+{
+	try
+	{
+		testBuild();
+		testWalkable();
+		testCache();
+		testCave();
+	}
+	catch (const std::exception &e)
+	{
+		CHECK(!"exception thrown");
+		std::fprintf(stderr, "%s\n", e.what());
+	}
+	return checkResults("NavMeshTests");
+}
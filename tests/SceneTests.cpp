@@ -0,0 +1,273 @@
+// Scene.hpp: the cave scene through JSON and through its compiled form,
+// what parse() reports about broken scenes, stale and damaged compiled
+// files, and the generated scenes of --generate-scene.
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "Check.hpp"
+#include "Scene.hpp"
+#include "Level.hpp"
+
+// Equal up to the order of meshes and materials, which JSON objects do not
+// keep: entities are compared by the names of what they use
+static bool sameScene(const Scene &a, const Scene &b)
+{
+	if (a.meshNames.size() != b.meshNames.size() || a.materialNames.size() != b.materialNames.size() ||
+		a.entities.size() != b.entities.size() || a.lights.size() != b.lights.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.meshNames.size(); i++) {
+		auto it = std::find(b.meshNames.begin(), b.meshNames.end(), a.meshNames[i]);
+		if (it == b.meshNames.end() || b.meshFiles[it - b.meshNames.begin()] != a.meshFiles[i]) {
+			return false;
+		}
+	}
+	for (size_t i = 0; i < a.materialNames.size(); i++) {
+		auto it = std::find(b.materialNames.begin(), b.materialNames.end(), a.materialNames[i]);
+		if (it == b.materialNames.end()) {
+			return false;
+		}
+		size_t j = it - b.materialNames.begin();
+		const SceneMaterial &A = a.materials[i], &B = b.materials[j];
+		if (b.textureFiles[j] != a.textureFiles[i] || A.color != B.color || A.lit != B.lit ||
+			A.specular != B.specular) {
+			return false;
+		}
+	}
+	for (size_t i = 0; i < a.entities.size(); i++) {
+		const SceneEntity &A = a.entities[i], &B = b.entities[i];
+		if (A.name != B.name || a.meshNames[A.mesh] != b.meshNames[B.mesh] ||
+			a.materialNames[A.material] != b.materialNames[B.material] ||
+			A.position != B.position || A.rotation != B.rotation || A.scale != B.scale ||
+			A.track != B.track || A.highlight != B.highlight || A.region != B.region) {
+			return false;
+		}
+	}
+	for (size_t i = 0; i < a.lights.size(); i++) {
+		const SceneLight &A = a.lights[i], &B = b.lights[i];
+		if (A.position != B.position || A.color != B.color || A.radius != B.radius ||
+			A.intensity != B.intensity) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// the message parse() throws, empty if it does not
+static std::string parseError(const std::string &text)
+{
+	Scene S;
+	try {
+		S.parse(text, "broken.json");
+	} catch (const std::exception &e) {
+		return e.what();
+	}
+	return std::string();
+}
+
+static bool reports(const std::string &text, const std::string &cause)
+{
+	std::string error = parseError(text);
+	bool found = error.find("failed to read scene broken.json") == 0 &&
+				 error.find(cause) != std::string::npos;
+	if (!found) {
+		std::fprintf(stderr, "expected \"%s\", got \"%s\"\n", cause.c_str(), error.c_str());
+	}
+	return found;
+}
+
+static void testCave()
+{
+	Scene S;
+	S.parse(Scene::readFile("scenes/cave.json"), "scenes/cave.json");
+	CHECK(S.meshNames.size() == 4 && S.materialNames.size() == 3);
+	CHECK(S.entities.size() == 6 && S.lights.size() == 3);
+	int lock = S.find("colorLock");
+	CHECK(lock >= 0);
+	if (lock >= 0) {
+		const SceneEntity &E = S.entities[lock];
+		CHECK(S.meshNames[E.mesh] == "block" && S.materialNames[E.material] == "rock");
+		CHECK(E.scale == glm::vec3(0.5f));
+		CHECK(E.position == glm::vec3(-26.0f, -1.8f, 33.0f));
+		CHECK(E.highlight && E.track.empty() && E.region == "Objects");
+	}
+	CHECK(S.find("nothing") == -1);
+	// optional fields take their defaults
+	const SceneEntity &cave = S.entities[S.find("cave")];
+	CHECK(cave.position == glm::vec3(0.0f) && cave.scale == glm::vec3(1.0f) && !cave.highlight);
+	CHECK(S.lights[1].intensity == 1.0f && S.lights[0].radius == 12.0f);
+	size_t hint = std::find(S.materialNames.begin(), S.materialNames.end(), "hint") - S.materialNames.begin();
+	CHECK(hint < S.materials.size() && !S.materials[hint].lit && !S.materials[hint].specular);
+
+	// JSON text, a JSON file, and the compiled form give the same scene
+	Scene fromText;
+	fromText.parse(S.toJson().dump(), "round trip");
+	CHECK(sameScene(S, fromText));
+	S.saveJson("scene_tests.json");
+	Scene fromFile;
+	fromFile.parse(Scene::readFile("scene_tests.json"), "scene_tests.json");
+	CHECK(sameScene(S, fromFile));
+	std::remove("scene_tests.json");
+
+	CHECK(S.save("scene_tests.bin", 42));
+	Scene compiled;
+	CHECK(!compiled.load("scene_tests.bin", 43));
+	CHECK(compiled.entities.empty());
+	CHECK(compiled.load("scene_tests.bin", 42));
+	CHECK(sameScene(S, compiled));
+	CHECK(compiled.meshNames == S.meshNames && compiled.materialNames == S.materialNames);
+	std::remove("scene_tests.bin");
+}
+
+// A color alone, unlit and specular materials, vector scales and rotations
+static void testFields()
+{
+	const char *text = R"({
+		"meshes": {"m": "models/m.obj"},
+		"materials": {"plain": {"color": [0.5, 0.25, 1], "specular": true},
+					  "both": {"texture": "t.png", "color": [1, 0, 0], "lit": false}},
+		"entities": [{"name": "e", "mesh": "m", "material": "plain", "position": [1, 2, 3],
+					  "rotation": [0, 90, 0], "scale": [1, 2, 3], "track": "door", "region": "R"},
+					 {"mesh": "m", "material": "both"}]
+	})";
+	Scene S;
+	S.parse(text, "fields.json");
+	// materials come in the order of their names
+	CHECK((S.materialNames == std::vector<std::string>{"both", "plain"}));
+	CHECK(S.materials[1].color == glm::vec3(0.5f, 0.25f, 1.0f) && S.materials[1].specular);
+	CHECK(S.textureFiles[1].empty() && S.textureFiles[0] == "t.png");
+	CHECK(!S.materials[0].lit && S.materials[0].color == glm::vec3(1.0f, 0.0f, 0.0f));
+	CHECK(S.entities[0].scale == glm::vec3(1.0f, 2.0f, 3.0f));
+	CHECK(S.entities[0].rotation == glm::vec3(0.0f, 90.0f, 0.0f));
+	CHECK(S.entities[1].name.empty() && S.lights.empty());
+	glm::vec4 moved = S.entities[0].transform(glm::vec3(0.0f, 1.0f, 0.0f)) * glm::vec4(1.0f, 0.0f, 0.0f, 1.0f);
+	// x scaled by 1 turns to -z around y, then the translation and offset
+	CHECK_NEAR(moved.x, 1.0f, 1e-5);
+	CHECK_NEAR(moved.y, 3.0f, 1e-5);
+	CHECK_NEAR(moved.z, 2.0f, 1e-5);
+
+	Scene again;
+	again.parse(S.toJson().dump(), "fields again");
+	CHECK(sameScene(S, again));
+}
+
+static void testErrors()
+{
+	const std::string meshes = R"("meshes": {"m": "m.obj"})";
+	const std::string materials = R"("materials": {"c": {"color": 1}})";
+	const std::string entity = R"({"mesh": "m", "material": "c"})";
+	CHECK(reports("{\"meshes\": ", "parse error"));
+	CHECK(reports("{" + materials + ", \"entities\": []}", "meshes"));
+	CHECK(reports("{" + meshes + ", \"entities\": []}", "materials"));
+	CHECK(reports("{" + meshes + ", " + materials + "}", "entities"));
+	CHECK(reports("{" + meshes + ", " + materials + R"(, "entities": [{"mesh": "x", "material": "c"}]})",
+				  "unknown mesh x"));
+	CHECK(reports("{" + meshes + ", " + materials + R"(, "entities": [{"mesh": "m", "material": "y"}]})",
+				  "unknown material y"));
+	CHECK(reports("{" + meshes + ", " + materials + R"(, "entities": [{"material": "c"}]})", "mesh"));
+	CHECK(reports("{" + meshes + R"(, "materials": {"bare": {"lit": false}}, "entities": []})",
+				  "material bare has no texture nor color"));
+	CHECK(reports("{" + meshes + ", " + materials + R"(, "entities": [{"mesh": "m", "material": "c", "position": [1, 2]}]})",
+				  "position should be a number or 3 numbers"));
+	CHECK(reports("{" + meshes + ", " + materials + R"(, "entities": [{"mesh": "m", "material": "c", "scale": "big"}]})",
+				  "scale should be a number or 3 numbers"));
+	CHECK(reports("{" + meshes + ", " + materials + R"(, "entities": [], "lights": [{"radius": "far"}]})",
+				  "type"));
+	CHECK(parseError("{" + meshes + ", " + materials + ", \"entities\": [" + entity + "]}").empty());
+
+	// a scene that fails to parse is left as it was
+	Scene S;
+	S.parse("{" + meshes + ", " + materials + ", \"entities\": [" + entity + "]}", "good.json");
+	try {
+		S.parse("{" + meshes + ", " + materials + R"(, "entities": [{"mesh": "x", "material": "c"}]})", "bad.json");
+	} catch (const std::exception &) {
+	}
+	CHECK(S.entities.size() == 1 && S.meshNames.size() == 1);
+
+	bool threw = false;
+	try {
+		Scene::readFile("scenes/missing.json");
+	} catch (const std::exception &e) {
+		threw = std::string(e.what()).find("scenes/missing.json") != std::string::npos;
+	}
+	CHECK(threw);
+}
+
+// Cut anywhere, or with counts that promise more than the file holds, a
+// compiled scene is refused rather than read past its end
+static void testDamagedCache()
+{
+	Scene S;
+	S.parse(Scene::readFile("scenes/cave.json"), "scenes/cave.json");
+	CHECK(S.save("scene_tests.bin", 7));
+	std::vector<char> bytes;
+	{
+		std::ifstream in("scene_tests.bin", std::ios::binary);
+		bytes.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+	int loaded = 0;
+	for (size_t length = 0; length < bytes.size(); length += 7) {
+		std::ofstream("scene_tests.bin", std::ios::binary).write(bytes.data(), length);
+		Scene damaged;
+		loaded += damaged.load("scene_tests.bin", 7);
+	}
+	CHECK(loaded == 0);
+	// the mesh name count, right after the header, made huge
+	std::vector<char> huge = bytes;
+	huge[16] = huge[17] = huge[18] = (char) 0xff;
+	std::ofstream("scene_tests.bin", std::ios::binary).write(huge.data(), huge.size());
+	CHECK(!Scene().load("scene_tests.bin", 7));
+	std::ofstream("scene_tests.bin", std::ios::binary).write(bytes.data(), bytes.size());
+	CHECK(Scene().load("scene_tests.bin", 7));
+	std::remove("scene_tests.bin");
+
+	// loadOrCompile() compiles once, then reads the compiled form
+	Scene first, second;
+	std::remove("scene_tests_cave.bin");
+	CHECK(!first.loadOrCompile("scenes/cave.json", "scene_tests_cave.bin"));
+	CHECK(second.loadOrCompile("scenes/cave.json", "scene_tests_cave.bin"));
+	CHECK(sameScene(first, second) && sameScene(first, S));
+	std::remove("scene_tests_cave.bin");
+}
+
+// the blocks land inside the first level, and the file reads back whole
+static void testGenerated()
+{
+	std::string file = generateScene("scenes/cave.json", 500);
+	Scene cave, generated;
+	cave.parse(Scene::readFile("scenes/cave.json"), "scenes/cave.json");
+	generated.parse(Scene::readFile(file), file);
+	std::remove(file.c_str());
+	CHECK(generated.entities.size() == cave.entities.size() + 500);
+	CHECK(generated.lights.size() == cave.lights.size() + 125);
+	PolygonGrid area(polygonFirstLevel, sizeof(polygonFirstLevel) / sizeof(polygonFirstLevel[0]));
+	int outside = 0;
+	for (size_t i = cave.entities.size(); i < generated.entities.size(); i++) {
+		const SceneEntity &E = generated.entities[i];
+		outside += !area.contains({E.position.x, E.position.z}) ||
+				   generated.meshNames[E.mesh] != "block";
+	}
+	CHECK(outside == 0);
+}
+
+int main()
+{
+	try
+	{
+		testCave();
+		testFields();
+		testErrors();
+		testDamagedCache();
+		testGenerated();
+	}
+	catch (const std::exception &e)
+	{
+		CHECK(!"exception thrown");
+		std::fprintf(stderr, "%s\n", e.what());
+	}
+	return checkResults("SceneTests");
+}
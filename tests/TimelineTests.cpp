@@ -0,0 +1,204 @@
+// Timeline.hpp: the easing curves at their ends, values on and between
+// keys, before the start and past the end, backwards, the events crossed
+// by an update, and tracks finishing in the middle of an update.
+
+#include <vector>
+
+#include "Check.hpp"
+#include "Timeline.hpp"
+
+static bool same(glm::vec3 a, glm::vec3 b, float tolerance = 1e-5f) {
+	return glm::all(glm::lessThanEqual(glm::abs(a - b), glm::vec3(tolerance)));
+}
+
+static int eventCount(const Timeline &T, int event) {
+	int count = 0;
+	for (const TimelineEvent &E : T.events()) {
+		count += E.event == event;
+	}
+	return count;
+}
+
+static void testEase()
+{
+	for (int curve = EASE_LINEAR; curve <= EASE_STEP; curve++) {
+		CHECK(ease((Ease) curve, 0.0f) == 0.0f);
+		CHECK(ease((Ease) curve, 1.0f) == 1.0f);
+	}
+	CHECK_NEAR(ease(EASE_LINEAR, 0.25f), 0.25f, 1e-6);
+	CHECK_NEAR(ease(EASE_IN_QUAD, 0.5f), 0.25f, 1e-6);
+	CHECK_NEAR(ease(EASE_OUT_QUAD, 0.5f), 0.75f, 1e-6);
+	CHECK_NEAR(ease(EASE_IN_OUT_QUAD, 0.5f), 0.5f, 1e-6);
+	CHECK_NEAR(ease(EASE_IN_OUT_QUAD, 0.25f), 0.125f, 1e-6);
+	CHECK_NEAR(ease(EASE_IN_OUT_CUBIC, 0.5f), 0.5f, 1e-6);
+	CHECK_NEAR(ease(EASE_IN_OUT_CUBIC, 0.75f), 0.9375f, 1e-6);
+	CHECK(ease(EASE_STEP, 0.999f) == 0.0f);
+}
+
+// keys at 5, 6 and 8 seconds of the track's own time: it starts at the first
+static Timeline threeKeys(uint32_t &track)
+{
+	Timeline T;
+	track = T.addTrack({{5.0f, glm::vec3(0.0f), EASE_LINEAR, 1},
+						{6.0f, glm::vec3(10.0f, 0.0f, 0.0f), EASE_IN_QUAD, 2},
+						{8.0f, glm::vec3(10.0f, 20.0f, 0.0f), EASE_LINEAR, 3}});
+	return T;
+}
+
+static void testForward()
+{
+	uint32_t track;
+	Timeline T = threeKeys(track);
+	CHECK(same(T.value(track), glm::vec3(0.0f)));
+	CHECK(!T.playing(track));
+
+	T.play(track, 100.0f);
+	// before the start the track rests on its first key
+	T.update(99.0f);
+	CHECK(same(T.value(track), glm::vec3(0.0f)));
+	CHECK(T.events().empty());
+	T.update(100.0f);
+	CHECK(same(T.value(track), glm::vec3(0.0f)));
+	T.update(100.5f);
+	CHECK(same(T.value(track), glm::vec3(5.0f, 0.0f, 0.0f)));
+	// exactly on the middle key, then eased in on the segment after it
+	T.update(101.0f);
+	CHECK(same(T.value(track), glm::vec3(10.0f, 0.0f, 0.0f)));
+	CHECK(T.events().size() == 1 && eventCount(T, 2) == 1);
+	T.update(102.0f);
+	CHECK(same(T.value(track), glm::vec3(10.0f, 5.0f, 0.0f)));
+	CHECK(T.events().empty());
+	CHECK(T.playing(track));
+	// exactly on the last key: there, finished, and resting
+	T.update(103.0f);
+	CHECK(same(T.value(track), glm::vec3(10.0f, 20.0f, 0.0f)));
+	CHECK(eventCount(T, 3) == 1 && eventCount(T, Timeline::FINISHED) == 1);
+	CHECK(T.events().back().event == Timeline::FINISHED);
+	CHECK(!T.playing(track));
+	T.update(200.0f);
+	CHECK(T.events().empty());
+	CHECK(same(T.value(track), glm::vec3(10.0f, 20.0f, 0.0f)));
+}
+
+static void testBackward()
+{
+	uint32_t track;
+	Timeline T = threeKeys(track);
+	// toggle() goes forwards from the start, then backwards from the end
+	T.toggle(track, 0.0f);
+	T.update(10.0f);
+	CHECK(!T.playing(track));
+	T.toggle(track, 20.0f);
+	T.update(20.0f);
+	CHECK(same(T.value(track), glm::vec3(10.0f, 20.0f, 0.0f)));
+	CHECK(T.events().empty());
+	// the same eased curve, run backwards
+	T.update(21.0f);
+	CHECK(same(T.value(track), glm::vec3(10.0f, 5.0f, 0.0f)));
+	T.update(22.0f);
+	CHECK(same(T.value(track), glm::vec3(10.0f, 0.0f, 0.0f)));
+	CHECK(T.events().size() == 1 && eventCount(T, 2) == 1);
+	T.update(22.5f);
+	CHECK(same(T.value(track), glm::vec3(5.0f, 0.0f, 0.0f)));
+	// past the end in one step: the first key fires, then it finishes there
+	T.update(30.0f);
+	CHECK(same(T.value(track), glm::vec3(0.0f)));
+	CHECK(eventCount(T, 1) == 1 && eventCount(T, Timeline::FINISHED) == 1);
+	CHECK(!T.playing(track));
+	T.toggle(track, 40.0f);
+	T.update(40.5f);
+	CHECK(same(T.value(track), glm::vec3(5.0f, 0.0f, 0.0f)));
+}
+
+// one update over every key fires each once, in order
+static void testSkippedKeys()
+{
+	uint32_t track;
+	Timeline T = threeKeys(track);
+	T.play(track, 0.0f);
+	T.update(50.0f);
+	std::vector<int> events;
+	for (const TimelineEvent &E : T.events()) {
+		CHECK(E.track == track);
+		events.push_back(E.event);
+	}
+	CHECK((events == std::vector<int>{2, 3, Timeline::FINISHED}));
+	CHECK(same(T.value(track), glm::vec3(10.0f, 20.0f, 0.0f)));
+}
+
+// steps hold until the next key; a lone key and no key at all finish at once
+static void testDegenerate()
+{
+	Timeline T;
+	uint32_t step = T.addTrack({{0.0f, glm::vec3(1.0f), EASE_STEP}, {2.0f, glm::vec3(3.0f)}});
+	uint32_t lone = T.addTrack({{4.0f, glm::vec3(7.0f)}});
+	uint32_t none = T.addTrack({});
+	CHECK(T.trackCount() == 3);
+	T.play(step, 0.0f);
+	T.play(lone, 0.0f);
+	T.play(none, 0.0f);
+	CHECK(T.playingCount() == 3);
+	T.update(1.99f);
+	CHECK(same(T.value(step), glm::vec3(1.0f)));
+	CHECK(same(T.value(lone), glm::vec3(7.0f)));
+	CHECK(same(T.value(none), glm::vec3(0.0f)));
+	CHECK(eventCount(T, Timeline::FINISHED) == 2);
+	CHECK(T.playingCount() == 1 && T.playing(step));
+	T.update(2.0f);
+	CHECK(same(T.value(step), glm::vec3(3.0f)));
+	CHECK(T.playingCount() == 0);
+}
+
+// tracks that finish in the same update are swapped out of the playing
+// list while it is walked: every one must still be evaluated
+static void testManyTracks()
+{
+	Timeline T;
+	std::vector<uint32_t> tracks;
+	for (int i = 0; i < 100; i++) {
+		float length = 1.0f + (i % 7);
+		tracks.push_back(T.addTrack({{0.0f, glm::vec3(0.0f)}, {length, glm::vec3((float) i)}}));
+		T.play(tracks.back(), 0.0f);
+	}
+	int finished = 0;
+	for (int step = 1; step <= 8; step++) {
+		T.update((float) step);
+		finished += eventCount(T, Timeline::FINISHED);
+	}
+	CHECK(finished == 100);
+	CHECK(T.playingCount() == 0);
+	int wrong = 0;
+	for (int i = 0; i < 100; i++) {
+		wrong += !same(T.value(tracks[i]), glm::vec3((float) i));
+	}
+	CHECK(wrong == 0);
+}
+
+// stop() freezes a track where it is, and play() restarts it
+static void testStop()
+{
+	uint32_t track;
+	Timeline T = threeKeys(track);
+	T.play(track, 0.0f);
+	T.update(0.5f);
+	T.stop(track);
+	T.update(5.0f);
+	CHECK(!T.playing(track));
+	CHECK(same(T.value(track), glm::vec3(5.0f, 0.0f, 0.0f)));
+	T.stop(track);
+	T.play(track, 10.0f);
+	T.update(10.0f);
+	CHECK(same(T.value(track), glm::vec3(0.0f)));
+}
+
+int main()
+{
+	testEase();
+	testForward();
+	testBackward();
+	testSkippedKeys();
+	testDegenerate();
+	testManyTracks();
+	testStop();
+	return checkResults("TimelineTests");
+}